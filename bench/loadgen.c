@@ -0,0 +1,737 @@
+// httppo-loadgen drives an HTTP server with keep-alive or fresh connections, optionally pipelined,
+// and reports throughput and latency percentiles as one JSON object per scenario.
+//
+//   httppo-loadgen -S build/httppo     start httppo on loopback and run the standard scenarios
+//   httppo-loadgen -a 127.0.0.1:6969   run a single scenario against a running server
+//
+// Closed-loop runs keep every connection busy and measure from the moment a request is sent.
+// Open-loop runs (-R) send at a constant rate on a fixed schedule instead, and measure from when
+// a request was due, so a stalled server is charged for the requests it kept from being sent
+
+// for memmem
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/metrics.h"
+
+#define LOADGEN_MAX_PIPELINE 64
+#define LOADGEN_MAX_FILES 16
+#define LOADGEN_BUF_SIZE (64 * 1024)
+// requests that are due but have no free connection yet, per thread
+#define LOADGEN_BACKLOG_CAP (1 << 16)
+
+typedef struct {
+    size_t size;
+    unsigned weight;
+} LoadgenFile;
+
+typedef struct {
+    const char* name;
+    bool keep_alive;
+    size_t pipeline;
+    /// requests per second over all threads, 0 for a closed loop
+    double rate;
+} LoadgenScenario;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    size_t threads;
+    size_t conns;
+    double duration;
+    double warmup;
+    LoadgenFile files[LOADGEN_MAX_FILES];
+    size_t file_count;
+    unsigned total_weight;
+} LoadgenOptions;
+
+typedef struct {
+    int fd;
+    char buf[LOADGEN_BUF_SIZE];
+    size_t len;
+    /// the status line and headers of the current response have been read
+    bool in_body;
+    size_t body_left;
+    bool close_after;
+    /// when each outstanding request was sent, or was due in an open loop
+    uint64_t started[LOADGEN_MAX_PIPELINE];
+    size_t head;
+    size_t outstanding;
+} LoadgenConn;
+
+typedef struct {
+    LoadgenOptions const* options;
+    LoadgenScenario const* scenario;
+    pthread_t handle;
+    uint64_t rng;
+    int epoll_fd;
+    LoadgenConn* conns;
+    size_t conn_count;
+
+    uint64_t backlog[LOADGEN_BACKLOG_CAP];
+    size_t backlog_head;
+    size_t backlog_len;
+
+    uint64_t measure_from;
+    uint64_t measure_until;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t histogram[METRICS_BUCKETS];
+} LoadgenThread;
+
+static char* loadgen_requests[LOADGEN_MAX_FILES][2];
+static size_t loadgen_request_lens[LOADGEN_MAX_FILES][2];
+
+static void loadgen_die(const char* what) {
+    fprintf(stderr, "ERROR: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static uint64_t loadgen_rand(LoadgenThread* thread) {
+    // xorshift64
+    thread->rng ^= thread->rng << 13;
+    thread->rng ^= thread->rng >> 7;
+    thread->rng ^= thread->rng << 17;
+    return thread->rng;
+}
+
+static size_t loadgen_pick_file(LoadgenThread* thread) {
+    LoadgenOptions const* options = thread->options;
+    unsigned pick = loadgen_rand(thread) % options->total_weight;
+    for (size_t i = 0; i < options->file_count; i++) {
+        if (pick < options->files[i].weight) {
+            return i;
+        }
+        pick -= options->files[i].weight;
+    }
+    return 0;
+}
+
+static void loadgen_record(LoadgenThread* thread, uint64_t started, uint64_t now) {
+    if (started < thread->measure_from || now > thread->measure_until) {
+        return;
+    }
+
+    thread->requests++;
+    thread->histogram[metrics_bucket(now - started)]++;
+}
+
+static bool loadgen_connect(LoadgenThread* thread, LoadgenConn* conn) {
+    // NOTE: connecting blocks, which is next to free on loopback and keeps the state machine small
+    conn->fd = socket(thread->options->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1 || connect(conn->fd, (struct sockaddr const*)&thread->options->addr,
+                                  thread->options->addr_len) == -1) {
+        if (conn->fd != -1) {
+            close(conn->fd);
+        }
+        conn->fd = -1;
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        loadgen_die("could not watch a connection");
+    }
+
+    conn->len = 0;
+    conn->in_body = false;
+    conn->body_left = 0;
+    conn->close_after = false;
+    conn->head = 0;
+    conn->outstanding = 0;
+    return true;
+}
+
+static void loadgen_disconnect(LoadgenConn* conn) {
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+/// Sends a request that started at `started`, the connection is opened first if it is closed
+static bool loadgen_send(LoadgenThread* thread, LoadgenConn* conn, uint64_t started) {
+    if (conn->fd == -1 && !loadgen_connect(thread, conn)) {
+        thread->errors++;
+        return false;
+    }
+
+    size_t file = loadgen_pick_file(thread);
+    bool keep_alive = thread->scenario->keep_alive;
+    const char* request = loadgen_requests[file][keep_alive];
+    size_t len = loadgen_request_lens[file][keep_alive];
+
+    // NOTE: requests are tiny next to the socket buffer, a short send means the server is stuck
+    if (send(conn->fd, request, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        thread->errors++;
+        loadgen_disconnect(conn);
+        return false;
+    }
+
+    conn->started[(conn->head + conn->outstanding) % LOADGEN_MAX_PIPELINE] = started;
+    conn->outstanding++;
+    return true;
+}
+
+/// Parses the status line and headers at `off`, returns their length or 0 if they are not
+/// complete yet
+static size_t loadgen_parse_head(LoadgenThread* thread, LoadgenConn* conn, size_t off) {
+    char* head = conn->buf + off;
+    char* end = memmem(head, conn->len - off, "\r\n\r\n", 4);
+    if (!end) {
+        return 0;
+    }
+
+    size_t head_len = end - head + 4;
+    if (head_len < 12 || memcmp(head + 9, "200", 3) != 0) {
+        thread->errors++;
+    }
+
+    conn->body_left = 0;
+    conn->close_after = !thread->scenario->keep_alive;
+    for (char* line = memchr(head, '\n', head_len); line && line < end;
+         line = memchr(line, '\n', end - line)) {
+        line++;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            conn->body_left = strtoull(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Connection: close", 17) == 0) {
+            conn->close_after = true;
+        }
+    }
+
+    conn->in_body = true;
+    return head_len;
+}
+
+static void loadgen_complete(LoadgenThread* thread, LoadgenConn* conn, uint64_t now) {
+    conn->in_body = false;
+    if (conn->outstanding == 0) {
+        // a response nobody asked for
+        thread->errors++;
+        return;
+    }
+
+    loadgen_record(thread, conn->started[conn->head], now);
+    conn->head = (conn->head + 1) % LOADGEN_MAX_PIPELINE;
+    conn->outstanding--;
+
+    if (conn->close_after) {
+        // whatever else was in flight on the connection is lost with it
+        thread->errors += conn->outstanding;
+        conn->outstanding = 0;
+        loadgen_disconnect(conn);
+    }
+}
+
+static void loadgen_fail(LoadgenThread* thread, LoadgenConn* conn) {
+    thread->errors += conn->outstanding;
+    conn->outstanding = 0;
+    loadgen_disconnect(conn);
+}
+
+/// Consumes every complete response in the buffer and keeps the start of an incomplete head
+static void loadgen_consume(LoadgenThread* thread, LoadgenConn* conn, uint64_t now) {
+    size_t off = 0;
+    while (conn->fd != -1) {
+        if (!conn->in_body) {
+            size_t head_len = loadgen_parse_head(thread, conn, off);
+            if (!head_len) {
+                break;
+            }
+            off += head_len;
+        }
+
+        // bodies are dropped as they arrive
+        size_t take = conn->len - off < conn->body_left ? conn->len - off : conn->body_left;
+        conn->body_left -= take;
+        off += take;
+        if (now >= thread->measure_from) {
+            thread->bytes += take;
+        }
+
+        if (conn->body_left) {
+            break;
+        }
+        loadgen_complete(thread, conn, now);
+    }
+
+    if (conn->fd == -1) {
+        return;
+    }
+
+    memmove(conn->buf, conn->buf + off, conn->len - off);
+    conn->len -= off;
+    if (conn->len == sizeof(conn->buf)) {
+        // a head that does not fit the buffer
+        loadgen_fail(thread, conn);
+    }
+}
+
+static void loadgen_read(LoadgenThread* thread, LoadgenConn* conn) {
+    while (conn->fd != -1) {
+        ssize_t nread = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, 0);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (nread <= 0) {
+            loadgen_fail(thread, conn);
+            return;
+        }
+
+        conn->len += nread;
+        loadgen_consume(thread, conn, metrics_now());
+    }
+}
+
+/// Hands due requests to connections with room in their pipeline
+static void loadgen_dispatch(LoadgenThread* thread, uint64_t now) {
+    LoadgenScenario const* scenario = thread->scenario;
+    for (size_t i = 0; i < thread->conn_count; i++) {
+        LoadgenConn* conn = &thread->conns[i];
+        size_t depth = scenario->keep_alive ? scenario->pipeline : 1;
+
+        while (conn->outstanding < depth) {
+            uint64_t started = now;
+            if (scenario->rate > 0) {
+                if (thread->backlog_len == 0) {
+                    return;
+                }
+                started = thread->backlog[thread->backlog_head];
+                thread->backlog_head = (thread->backlog_head + 1) % LOADGEN_BACKLOG_CAP;
+                thread->backlog_len--;
+            }
+
+            if (!loadgen_send(thread, conn, started)) {
+                break;
+            }
+        }
+    }
+}
+
+static void* loadgen_run(void* arg) {
+    LoadgenThread* thread = arg;
+    LoadgenScenario const* scenario = thread->scenario;
+
+    thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (thread->epoll_fd == -1) {
+        loadgen_die("could not create an epoll instance");
+    }
+    for (size_t i = 0; i < thread->conn_count; i++) {
+        thread->conns[i].fd = -1;
+    }
+
+    uint64_t start = metrics_now();
+    thread->measure_from = start + thread->options->warmup * 1e9;
+    thread->measure_until = thread->measure_from + thread->options->duration * 1e9;
+
+    double interval = scenario->rate > 0 ? 1e9 * thread->options->threads / scenario->rate : 0;
+    // threads are offset so that their schedules interleave instead of firing together
+    double next_due = start + interval * (thread->rng % 1000) / 1000.0;
+
+    struct epoll_event events[64];
+    while (true) {
+        uint64_t now = metrics_now();
+        if (now >= thread->measure_until) {
+            break;
+        }
+
+        if (scenario->rate > 0) {
+            for (; next_due <= now; next_due += interval) {
+                if (thread->backlog_len == LOADGEN_BACKLOG_CAP) {
+                    thread->errors++;
+                    continue;
+                }
+                size_t slot = (thread->backlog_head + thread->backlog_len) % LOADGEN_BACKLOG_CAP;
+                thread->backlog[slot] = next_due;
+                thread->backlog_len++;
+            }
+        }
+        loadgen_dispatch(thread, now);
+
+        // NOTE: sleeping until the next request is due rather than spinning, a spinning load
+        // generator takes the CPU away from the server it measures
+        uint64_t timeout = 1000 * 1000;
+        if (scenario->rate > 0 && next_due - now < timeout) {
+            timeout = next_due > now ? next_due - now : 0;
+        }
+
+        struct timespec wait = {.tv_nsec = timeout};
+        int count = epoll_pwait2(thread->epoll_fd, events, 64, &wait, NULL);
+        for (int i = 0; i < count; i++) {
+            loadgen_read(thread, events[i].data.ptr);
+        }
+    }
+
+    // NOTE: requests still in flight or never sent took at least until the end, leaving them
+    // out would hide exactly the stalls an open loop is meant to show
+    for (size_t i = 0; i < thread->conn_count; i++) {
+        LoadgenConn* conn = &thread->conns[i];
+        for (size_t j = 0; conn->fd != -1 && j < conn->outstanding; j++) {
+            uint64_t started = conn->started[(conn->head + j) % LOADGEN_MAX_PIPELINE];
+            loadgen_record(thread, started, thread->measure_until);
+        }
+        loadgen_disconnect(conn);
+    }
+    for (size_t i = 0; i < thread->backlog_len; i++) {
+        uint64_t started = thread->backlog[(thread->backlog_head + i) % LOADGEN_BACKLOG_CAP];
+        loadgen_record(thread, started, thread->measure_until);
+    }
+    close(thread->epoll_fd);
+    return NULL;
+}
+
+typedef struct {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t histogram[METRICS_BUCKETS];
+} LoadgenResult;
+
+static double loadgen_percentile(LoadgenResult const* result, double quantile) {
+    uint64_t rank = quantile * result->requests;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        seen += result->histogram[i];
+        if (seen > rank) {
+            return metrics_bucket_upper(i) / 1e3;
+        }
+    }
+    return 0;
+}
+
+static LoadgenResult loadgen_scenario(LoadgenOptions const* options,
+                                      LoadgenScenario const* scenario) {
+    LoadgenThread* threads = calloc(options->threads, sizeof(LoadgenThread));
+    LoadgenConn* conns = calloc(options->conns, sizeof(LoadgenConn));
+    if (!threads || !conns) {
+        loadgen_die("could not allocate the load generator state");
+    }
+
+    size_t next_conn = 0;
+    for (size_t i = 0; i < options->threads; i++) {
+        LoadgenThread* thread = &threads[i];
+        thread->options = options;
+        thread->scenario = scenario;
+        thread->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        thread->conns = conns + next_conn;
+        thread->conn_count =
+            options->conns / options->threads + (i < options->conns % options->threads);
+        next_conn += thread->conn_count;
+
+        if (pthread_create(&thread->handle, NULL, loadgen_run, thread) != 0) {
+            loadgen_die("could not start a load generator thread");
+        }
+    }
+
+    LoadgenResult result = {0};
+    for (size_t i = 0; i < options->threads; i++) {
+        pthread_join(threads[i].handle, NULL);
+        result.requests += threads[i].requests;
+        result.errors += threads[i].errors;
+        result.bytes += threads[i].bytes;
+        for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+            result.histogram[b] += threads[i].histogram[b];
+        }
+    }
+
+    free(threads);
+    free(conns);
+    return result;
+}
+
+static void loadgen_report(LoadgenOptions const* options, LoadgenScenario const* scenario,
+                           LoadgenResult const* result) {
+    printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"keep_alive\":%s,\"pipeline\":%zu,"
+           "\"target_rps\":%.0f,\"threads\":%zu,\"connections\":%zu,\"duration_s\":%.1f,"
+           "\"requests\":%lu,\"errors\":%lu,\"rps\":%.1f,\"mib_per_s\":%.2f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+           scenario->name, scenario->rate > 0 ? "open" : "closed",
+           scenario->keep_alive ? "true" : "false", scenario->pipeline, scenario->rate,
+           options->threads, options->conns, options->duration, result->requests, result->errors,
+           result->requests / options->duration,
+           result->bytes / options->duration / (1024.0 * 1024.0),
+           loadgen_percentile(result, 0.5), loadgen_percentile(result, 0.99),
+           loadgen_percentile(result, 0.999));
+    fflush(stdout);
+}
+
+static void loadgen_prepare_requests(LoadgenOptions const* options) {
+    for (size_t i = 0; i < options->file_count; i++) {
+        for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+            char request[256];
+            int len = snprintf(request, sizeof(request),
+                               "GET /%zu.bin HTTP/1.1\r\nHost: loadgen\r\n%s\r\n",
+                               options->files[i].size, keep_alive ? "" : "Connection: close\r\n");
+            loadgen_requests[i][keep_alive] = strdup(request);
+            loadgen_request_lens[i][keep_alive] = len;
+        }
+    }
+}
+
+/// Parses a mix like "1024:80,65536:15,1048576:5", sizes in bytes with their weights
+static void loadgen_parse_mix(LoadgenOptions* options, const char* mix) {
+    options->file_count = 0;
+    options->total_weight = 0;
+
+    while (*mix) {
+        char* end;
+        size_t size = strtoull(mix, &end, 10);
+        unsigned weight = 1;
+        if (*end == ':') {
+            weight = strtoul(end + 1, &end, 10);
+        }
+
+        if (end == mix || (*end && *end != ',') || !weight ||
+            options->file_count == LOADGEN_MAX_FILES) {
+            fprintf(stderr, "ERROR: invalid file size mix\n");
+            exit(1);
+        }
+
+        options->files[options->file_count++] = (LoadgenFile){size, weight};
+        options->total_weight += weight;
+        mix = *end ? end + 1 : end;
+    }
+}
+
+static void loadgen_parse_addr(LoadgenOptions* options, const char* addr) {
+    char host[256];
+    const char* colon = strrchr(addr, ':');
+    if (!colon || (size_t)(colon - addr) >= sizeof(host)) {
+        fprintf(stderr, "ERROR: the address has to be host:port\n");
+        exit(1);
+    }
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo* info;
+    int status = getaddrinfo(host, colon + 1, &hints, &info);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: %s: %s\n", addr, gai_strerror(status));
+        exit(1);
+    }
+    memcpy(&options->addr, info->ai_addr, info->ai_addrlen);
+    options->addr_len = info->ai_addrlen;
+    freeaddrinfo(info);
+}
+
+/// Writes a file of every size in the mix into a fresh directory
+static char* loadgen_make_docroot(LoadgenOptions const* options) {
+    static char dir[] = "/tmp/httppo-bench-XXXXXX";
+    if (!mkdtemp(dir)) {
+        loadgen_die("could not create the docroot");
+    }
+
+    for (size_t i = 0; i < options->file_count; i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%zu.bin", dir, options->files[i].size);
+        FILE* f = fopen(path, "wb");
+        if (!f) {
+            loadgen_die("could not create a docroot file");
+        }
+        // NOTE: the .bin extension keeps the server from compressing the bodies
+        for (size_t off = 0; off < options->files[i].size; off++) {
+            fputc('a' + off % 26, f);
+        }
+        fclose(f);
+    }
+
+    return dir;
+}
+
+static void loadgen_remove_docroot(LoadgenOptions const* options, const char* dir) {
+    for (size_t i = 0; i < options->file_count; i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%zu.bin", dir, options->files[i].size);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+static int loadgen_free_port(void) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    if (sock == -1 || bind(sock, (struct sockaddr*)&addr, len) == -1 ||
+        getsockname(sock, (struct sockaddr*)&addr, &len) == -1) {
+        loadgen_die("could not find a free port");
+    }
+    close(sock);
+    return ntohs(addr.sin_port);
+}
+
+static pid_t loadgen_spawn(LoadgenOptions* options, const char* server, const char* root) {
+    char port[8];
+    snprintf(port, sizeof(port), "%d", loadgen_free_port());
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        loadgen_die("could not fork the server");
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(server, server, "-p", port, "-r", root, "-c", "65536", "-q", "65536", (char*)NULL);
+        loadgen_die("could not start the server");
+    }
+
+    char addr[32];
+    snprintf(addr, sizeof(addr), "127.0.0.1:%s", port);
+    loadgen_parse_addr(options, addr);
+
+    // wait until it listens
+    for (int i = 0; i < 500; i++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        bool up = connect(sock, (struct sockaddr*)&options->addr, options->addr_len) == 0;
+        close(sock);
+        if (up) {
+            return pid;
+        }
+        usleep(10 * 1000);
+    }
+
+    kill(pid, SIGKILL);
+    fprintf(stderr, "ERROR: the server did not start listening\n");
+    exit(1);
+}
+
+static void loadgen_usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -S <httppo>     start the server on loopback and run the standard scenarios\n"
+            "  -a <host:port>  the server to load, 127.0.0.1:6969 by default\n"
+            "  -t <threads>    load generator threads, 4 by default\n"
+            "  -c <conns>      connections over all threads, 64 by default\n"
+            "  -d <seconds>    how long each scenario is measured, 5 by default\n"
+            "  -w <seconds>    warm-up before measuring, 1 by default\n"
+            "  -m <mix>        file sizes and weights, 1024:80,65536:15,1048576:5 by default\n"
+            "  -k <0|1>        keep connections alive, 1 by default\n"
+            "  -p <depth>      requests pipelined per connection, 1 by default\n"
+            "  -R <rps>        send at a constant rate instead of in a closed loop\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    LoadgenOptions options = {
+        .threads = 4,
+        .conns = 64,
+        .duration = 5,
+        .warmup = 1,
+    };
+    loadgen_parse_mix(&options, "1024:80,65536:15,1048576:5");
+    LoadgenScenario single = {.name = "custom", .keep_alive = true, .pipeline = 1};
+    const char* server = NULL;
+    const char* addr = "127.0.0.1:6969";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "S:a:t:c:d:w:m:k:p:R:")) != -1) {
+        switch (opt) {
+            case 'S':
+                server = optarg;
+                break;
+            case 'a':
+                addr = optarg;
+                break;
+            case 't':
+                options.threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                options.conns = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                options.duration = strtod(optarg, NULL);
+                break;
+            case 'w':
+                options.warmup = strtod(optarg, NULL);
+                break;
+            case 'm':
+                loadgen_parse_mix(&options, optarg);
+                break;
+            case 'k':
+                single.keep_alive = atoi(optarg) != 0;
+                break;
+            case 'p':
+                single.pipeline = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                single.rate = strtod(optarg, NULL);
+                break;
+            default:
+                loadgen_usage(argv[0]);
+        }
+    }
+
+    if (!options.threads || options.conns < options.threads || options.duration <= 0 ||
+        !single.pipeline || single.pipeline > LOADGEN_MAX_PIPELINE) {
+        loadgen_usage(argv[0]);
+    }
+    loadgen_prepare_requests(&options);
+
+    if (!server) {
+        loadgen_parse_addr(&options, addr);
+        LoadgenResult result = loadgen_scenario(&options, &single);
+        loadgen_report(&options, &single, &result);
+        return 0;
+    }
+
+    char* root = loadgen_make_docroot(&options);
+    pid_t pid = loadgen_spawn(&options, server, root);
+
+    LoadgenScenario scenarios[] = {
+        {.name = "keep-alive", .keep_alive = true, .pipeline = 1},
+        {.name = "pipelined", .keep_alive = true, .pipeline = 8},
+        {.name = "connection-per-request", .keep_alive = false, .pipeline = 1},
+        {.name = "open-loop-50", .keep_alive = true, .pipeline = 1},
+        {.name = "open-loop-90", .keep_alive = true, .pipeline = 1},
+    };
+
+    // NOTE: the open loops run at a share of what the closed keep-alive loop managed, so they
+    // show the latency of a server that keeps up rather than the one of a saturated server
+    double peak = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (strcmp(scenarios[i].name, "open-loop-50") == 0) {
+            scenarios[i].rate = peak * 0.5;
+        } else if (strcmp(scenarios[i].name, "open-loop-90") == 0) {
+            scenarios[i].rate = peak * 0.9;
+        }
+
+        LoadgenResult result = loadgen_scenario(&options, &scenarios[i]);
+        loadgen_report(&options, &scenarios[i], &result);
+        if (i == 0) {
+            peak = result.requests / options.duration;
+        }
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    loadgen_remove_docroot(&options, root);
+    return 0;
+}
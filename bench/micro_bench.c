@@ -0,0 +1,158 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BASE_IMPLEMENTATION
+#include "../src/base.h"
+
+#define ARENA_H_IMPLEMENTATION
+#include "../src/arena.h"
+#include "../src/http_date.h"
+#include "../src/protocol.h"
+
+#define BENCH_ITERATIONS 1000000
+
+// NOTE: the encoder as it was before the status line table, kept here as the baseline. It pushes
+// strings a byte at a time, formats every line with two vsnprintf calls and zeroes the buffer on
+// every clear. The Date header is formatted with strftime for every response
+static void legacy_push_cstr(string_builder* sb, const char* str) {
+    while (*str) {
+        sb_push(sb, *str++);
+    }
+}
+
+static void legacy_sprintf(string_builder* sb, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    ssize_t count = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    while ((ssize_t)(sb->cap - sb->len) <= count) {
+        DA_GROW(sb);
+    }
+
+    va_start(args, fmt);
+    vsnprintf(sb->items + sb->len, count + 1, fmt, args);
+    va_end(args);
+    sb->len += count;
+}
+
+static void legacy_clear(string_builder* sb) {
+    memset(sb->items, 0, sb->len);
+    sb->len = 0;
+}
+
+static const char* legacy_status_str(HttpStatusCode status_code) {
+    switch (status_code) {
+        case STATUS_OK:
+            return "OK";
+        case STATUS_NOT_FOUND:
+            return "Not found";
+        case STATUS_BAD_REQUEST:
+            return "Bad request";
+        case STATUS_SERVICE_UNAVAILABLE:
+            return "Service Unavailable";
+        default:
+            return NULL;
+    }
+}
+
+static void legacy_encode_sb(HttpResponse const* res, string_builder* sb) {
+    legacy_sprintf(sb, "%s %d %s\r\n", res->http_version, res->status_code,
+                   legacy_status_str(res->status_code));
+
+    char date[64];
+    struct tm tm;
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&now, &tm));
+    legacy_sprintf(sb, "Date: %s\r\n", date);
+    legacy_sprintf(sb, "Content-Length: %zu\r\n", res->body.size);
+    if (!res->keep_alive) {
+        legacy_push_cstr(sb, "Connection: close\r\n");
+    }
+
+    for (size_t i = 0; i < res->headers.len; i++) {
+        legacy_sprintf(sb, "%s: %s\r\n", res->headers.items[i].key, res->headers.items[i].value);
+    }
+
+    legacy_push_cstr(sb, "\r\n");
+    if (res->body.ptr) {
+        legacy_push_cstr(sb, res->body.ptr);
+    }
+}
+
+typedef void (*EncodeProc)(HttpResponse const* res, string_builder* sb);
+typedef void (*ClearProc)(string_builder* sb);
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double bench_encoder(HttpResponse const* res, EncodeProc encode, ClearProc clear) {
+    string_builder sb = sb_new(4096);
+    volatile size_t sink = 0;
+
+    uint64_t start = now_nsec();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        clear(&sb);
+        encode(res, &sb);
+        sink += sb.len;
+    }
+    uint64_t elapsed = now_nsec() - start;
+
+    sb_destroy(&sb);
+    return (double)elapsed / BENCH_ITERATIONS;
+}
+
+static bool encoders_agree(HttpResponse const* res) {
+    string_builder legacy = sb_new(4096);
+    string_builder fast = sb_new(4096);
+    legacy_encode_sb(res, &legacy);
+    http_res_encode_sb(res, &fast);
+
+    bool agree = legacy.len == fast.len && memcmp(legacy.items, fast.items, fast.len) == 0;
+    sb_destroy(&legacy);
+    sb_destroy(&fast);
+    return agree;
+}
+
+static void bench_response(const char* name, HttpResponse const* res) {
+    // NOTE: the shared clock may lag behind time() for a moment when a second starts
+    if (!encoders_agree(res) && (usleep(10000), !encoders_agree(res))) {
+        fprintf(stderr, "%s: the encoders disagree\n", name);
+        exit(1);
+    }
+
+    double legacy_ns = bench_encoder(res, legacy_encode_sb, legacy_clear);
+    double fast_ns = bench_encoder(res, http_res_encode_sb, sb_clear);
+    printf("%-24s legacy %8.1f ns/op  fast %8.1f ns/op  speedup %5.2fx\n", name, legacy_ns,
+           fast_ns, legacy_ns / fast_ns);
+}
+
+int main(void) {
+    Arena arena = {0};
+    http_date_start();
+
+    static char page[1024 + 1];
+    memset(page, 'x', sizeof(page) - 1);
+
+    HttpResponse not_found = http_res_new(STATUS_NOT_FOUND, sv_make("Not found", 9));
+    bench_response("404 short body", &not_found);
+
+    HttpResponse close = http_res_new(STATUS_BAD_REQUEST, sv_make("Bad request", 11));
+    close.keep_alive = false;
+    bench_response("400 connection close", &close);
+
+    HttpResponse ok = http_res_new(STATUS_OK, sv_make(page, sizeof(page) - 1));
+    http_headers_add(&ok.headers, &arena, "Content-Type", "text/html; charset=utf-8");
+    http_headers_add(&ok.headers, &arena, "Cache-Control", "max-age=3600");
+    http_headers_add(&ok.headers, &arena, "Server", "httppo");
+    bench_response("200 1KiB body, 3 headers", &ok);
+
+    arena_destroy(&arena);
+    return 0;
+}
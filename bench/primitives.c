@@ -0,0 +1,374 @@
+// Benchmarks the hot primitives of the server one at a time, so that a regression shows up next to
+// the primitive that caused it rather than as a few percent less throughput.
+//
+// Every benchmark reports ns/op, heap allocations/op and, where perf_event_open is allowed, CPU
+// cycles and instructions/op. Allocations are counted by wrapping malloc, calloc and realloc at
+// link time, so they cover exactly the code linked into this binary
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BASE_IMPLEMENTATION
+#include "../src/base.h"
+
+#define ARENA_H_IMPLEMENTATION
+#include "../src/arena.h"
+#include "../src/hash.h"
+#include "../src/http_date.h"
+#include "../src/protocol.h"
+
+// NOTE: the job queues are private to the thread pool, the bench is built with it instead of
+// against it to get at them
+#include "../src/thread_pool.c"
+
+#define BENCH_ITERATIONS 1000000
+
+static size_t bench_allocs = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+// the group leader counts cycles, -1 if perf events are not available
+static int perf_fd = -1;
+
+static int bench_perf_open(uint64_t config, int group) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = config,
+        .disabled = group == -1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+        .read_format = PERF_FORMAT_GROUP,
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void bench_perf_init(void) {
+    perf_fd = bench_perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (perf_fd == -1) {
+        return;
+    }
+
+    if (bench_perf_open(PERF_COUNT_HW_INSTRUCTIONS, perf_fd) == -1) {
+        close(perf_fd);
+        perf_fd = -1;
+    }
+}
+
+typedef struct {
+    uint64_t nr;
+    uint64_t values[2];
+} BenchPerfCounts;
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef void (*BenchProc)(void* ctx, size_t iterations);
+
+static void bench_run(const char* name, BenchProc proc, void* ctx, size_t iterations) {
+    proc(ctx, iterations / 10);
+
+    if (perf_fd != -1) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    size_t allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+    uint64_t start = now_nsec();
+
+    proc(ctx, iterations);
+
+    uint64_t elapsed = now_nsec() - start;
+    allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - allocs;
+    BenchPerfCounts counts = {0};
+    if (perf_fd != -1) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        if (read(perf_fd, &counts, sizeof(counts)) != sizeof(counts)) {
+            counts.nr = 0;
+        }
+    }
+
+    printf("%-40s %9.1f ns/op %7.2f allocs/op", name, (double)elapsed / iterations,
+           (double)allocs / iterations);
+    if (counts.nr == 2) {
+        printf(" %9.1f cycles/op %9.1f instructions/op", (double)counts.values[0] / iterations,
+               (double)counts.values[1] / iterations);
+    }
+    printf("\n");
+}
+
+// a request as small as they come, one like curl sends, one like a browser sends and one with a
+// body
+static const char* const parse_corpora[][2] = {
+    {"parse minimal", "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"},
+    {"parse curl",
+     "GET /index.html HTTP/1.1\r\nHost: localhost:6969\r\nUser-Agent: curl/8.5.0\r\n"
+     "Accept: */*\r\n\r\n"},
+    {"parse browser",
+     "GET /static/css/app.css?v=3 HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Connection: keep-alive\r\n"
+     "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+     "sec-ch-ua-mobile: ?0\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+     "Chrome/124.0.0.0 Safari/537.36\r\n"
+     "sec-ch-ua-platform: \"Linux\"\r\n"
+     "Accept: text/css,*/*;q=0.1\r\n"
+     "Sec-Fetch-Site: same-origin\r\n"
+     "Sec-Fetch-Mode: no-cors\r\n"
+     "Sec-Fetch-Dest: style\r\n"
+     "Referer: https://www.example.com/\r\n"
+     "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n"
+     "Cookie: session=4f1c2a9b7d3e8f60a1b2c3d4e5f60718; theme=dark; "
+     "_ga=GA1.1.1234567890.1700000000; _ga_ABCDEF=GS1.1.1700000000.1.1.1700000100.0.0.0\r\n"
+     "If-None-Match: \"5e1f2a3b4c5d6e7f-1a2b\"\r\n"
+     "\r\n"},
+    {"parse post with body",
+     "POST /api/items HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\n"
+     "Content-Length: 64\r\n\r\n"
+     "{\"name\":\"widget\",\"count\":12,\"tags\":[\"a\",\"b\",\"c\"],\"ok\":true}  "},
+};
+
+static void bench_parse(void* ctx, size_t iterations) {
+    string_view request = sv_make(ctx, strlen(ctx));
+    static Arena arena = {0};
+    volatile HttpRequest* sink;
+
+    for (size_t i = 0; i < iterations; i++) {
+        sink = http_req_parse(request, &arena);
+        arena_free(&arena);
+    }
+}
+
+static void bench_encode(void* ctx, size_t iterations) {
+    HttpResponse const* res = ctx;
+    static string_builder sb = {0};
+    if (!sb.items) {
+        sb = sb_new(4096);
+    }
+
+    for (size_t i = 0; i < iterations; i++) {
+        sb_clear(&sb);
+        http_res_encode_sb(res, &sb);
+    }
+}
+
+static void bench_find_head_end(void* ctx, size_t iterations) {
+    string_view request = sv_make(ctx, strlen(ctx));
+    volatile ssize_t sink;
+
+    for (size_t i = 0; i < iterations; i++) {
+        sink = sv_find_sub_cstr(request, "\r\n\r\n");
+    }
+}
+
+static void bench_arena(void* ctx, size_t iterations) {
+    // the allocations a request with a handful of headers makes
+    static const size_t sizes[] = {16, 48, 200, 24, 512, 64, 32, 1024};
+    static Arena arena = {0};
+    volatile void* sink;
+
+    for (size_t i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            sink = arena_alloc(&arena, sizes[j]);
+        }
+        arena_free(&arena);
+    }
+}
+
+#define HT_BENCH_KEYS 4096
+
+typedef struct {
+    char* keys[HT_BENCH_KEYS];
+    size_t count;
+    hash_table ht;
+} HtBench;
+
+static void ht_bench_fill(HtBench* bench, size_t count, size_t cap) {
+    bench->count = count;
+    bench->ht = ht_make(hash_djb2, hash_str_eq, cap);
+    for (size_t i = 0; i < count; i++) {
+        ht_add(&bench->ht, bench->keys[i], bench->keys[i]);
+    }
+}
+
+static void bench_ht_find(void* ctx, size_t iterations) {
+    HtBench* bench = ctx;
+    volatile void* sink;
+
+    for (size_t i = 0; i < iterations; i++) {
+        sink = ht_find(&bench->ht, bench->keys[i % bench->count]);
+    }
+}
+
+static void bench_ht_find_miss(void* ctx, size_t iterations) {
+    HtBench* bench = ctx;
+    volatile void* sink;
+
+    // the keys past `count` were never added
+    for (size_t i = 0; i < iterations; i++) {
+        sink = ht_find(&bench->ht, bench->keys[HT_BENCH_KEYS - 1 - i % bench->count]);
+    }
+}
+
+static void bench_ht_add(void* ctx, size_t iterations) {
+    HtBench* bench = ctx;
+
+    // NOTE: builds tables from their initial capacity, so the growth is part of the cost
+    for (size_t done = 0; done < iterations;) {
+        hash_table ht = ht_make(hash_djb2, hash_str_eq, 16);
+        for (size_t i = 0; i < bench->count && done < iterations; i++, done++) {
+            ht_add(&ht, bench->keys[i], bench->keys[i]);
+        }
+        ht_destroy(&ht);
+    }
+}
+
+#define QUEUE_BENCH_CAP 1024
+
+typedef struct {
+    WorkerThreadRequestQueue queue;
+    size_t producers;
+    size_t per_producer;
+} QueueBench;
+
+static void bench_queue_uncontended(void* ctx, size_t iterations) {
+    QueueBench* bench = ctx;
+    WorkerData data;
+    volatile WorkerData* sink;
+
+    for (size_t i = 0; i < iterations; i++) {
+        wtrq_enqueue(&bench->queue, &data);
+        sink = wtrq_dequeue(&bench->queue);
+    }
+}
+
+static void* queue_bench_producer(void* arg) {
+    QueueBench* bench = arg;
+    WorkerData data;
+
+    for (size_t i = 0; i < bench->per_producer; i++) {
+        while (!wtrq_enqueue(&bench->queue, &data)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/// Producers enqueue from threads of their own while the calling thread drains the queue, like
+/// the accept loop and a worker do
+static void bench_queue_contended(void* ctx, size_t iterations) {
+    QueueBench* bench = ctx;
+    bench->per_producer = iterations / bench->producers;
+
+    pthread_t threads[16];
+    for (size_t i = 0; i < bench->producers; i++) {
+        pthread_create(&threads[i], NULL, queue_bench_producer, bench);
+    }
+
+    for (size_t done = 0; done < bench->per_producer * bench->producers;) {
+        if (atomic_load(&bench->queue.size) == 0) {
+            sched_yield();
+            continue;
+        }
+        wtrq_dequeue(&bench->queue);
+        done++;
+    }
+
+    for (size_t i = 0; i < bench->producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+int main(void) {
+    bench_perf_init();
+    if (perf_fd == -1) {
+        printf("perf events are not available, cycles and instructions are left out\n");
+    }
+    http_date_start();
+
+    for (size_t i = 0; i < sizeof(parse_corpora) / sizeof(parse_corpora[0]); i++) {
+        bench_run(parse_corpora[i][0], bench_parse, (void*)parse_corpora[i][1], BENCH_ITERATIONS);
+    }
+
+    Arena arena = {0};
+    static char page[1024 + 1];
+    memset(page, 'x', sizeof(page) - 1);
+
+    HttpResponse not_found = http_res_new(STATUS_NOT_FOUND, sv_make(NULL, 0));
+    bench_run("encode 404", bench_encode, &not_found, BENCH_ITERATIONS);
+
+    HttpResponse ok = http_res_new(STATUS_OK, sv_make(page, sizeof(page) - 1));
+    http_headers_add(&ok.headers, &arena, "Content-Type", "text/html; charset=utf-8");
+    http_headers_add(&ok.headers, &arena, "Last-Modified", "Sun, 18 Oct 2026 12:00:00 GMT");
+    http_headers_add(&ok.headers, &arena, "ETag", "\"5e1f2a3b4c5d6e7f-401\"");
+    bench_run("encode 200 1KiB body, 3 headers", bench_encode, &ok, BENCH_ITERATIONS);
+
+    bench_run("sv_find_sub_cstr head end (browser)", bench_find_head_end,
+              (void*)parse_corpora[2][1], BENCH_ITERATIONS);
+
+    bench_run("arena_alloc x8 + arena_free", bench_arena, NULL, BENCH_ITERATIONS);
+
+    static HtBench ht_bench;
+    for (size_t i = 0; i < HT_BENCH_KEYS; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "static/assets/file-%zu.css", i);
+        ht_bench.keys[i] = (char*)sv_dup(sv_make(key, strlen(key)));
+    }
+
+    // NOTE: the table grows once it is 70% full, so the loads stay below that
+    static const size_t loads[] = {25, 50, 69};
+    for (size_t i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+        ht_bench_fill(&ht_bench, 1024 * loads[i] / 100, 1024);
+        char name[64];
+        snprintf(name, sizeof(name), "ht_find hit, %zu%% load", loads[i]);
+        bench_run(name, bench_ht_find, &ht_bench, BENCH_ITERATIONS);
+        snprintf(name, sizeof(name), "ht_find miss, %zu%% load", loads[i]);
+        bench_run(name, bench_ht_find_miss, &ht_bench, BENCH_ITERATIONS);
+        ht_destroy(&ht_bench.ht);
+    }
+    ht_bench.count = 1024;
+    bench_run("ht_add growing from 16 buckets", bench_ht_add, &ht_bench, BENCH_ITERATIONS);
+
+    static QueueBench queue_bench;
+    wtrq_init(&queue_bench.queue, QUEUE_BENCH_CAP, NULL);
+    bench_run("wtrq_enqueue + wtrq_dequeue", bench_queue_uncontended, &queue_bench,
+              BENCH_ITERATIONS);
+
+    static const size_t producers[] = {1, 2, 4};
+    for (size_t i = 0; i < sizeof(producers) / sizeof(producers[0]); i++) {
+        queue_bench.producers = producers[i];
+        char name[64];
+        snprintf(name, sizeof(name), "wtrq contended, %zu producers", producers[i]);
+        bench_run(name, bench_queue_contended, &queue_bench, BENCH_ITERATIONS);
+    }
+
+    arena_destroy(&arena);
+    return 0;
+}
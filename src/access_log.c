@@ -0,0 +1,243 @@
+#include "access_log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "util.h"
+
+// how long the logger sleeps when there was nothing to write
+#define ACCESS_LOG_IDLE_NSEC (10 * 1000 * 1000)
+// vectors handed to a single writev, Linux takes up to 1024
+#define ACCESS_LOG_IOVS 1024
+
+/// A single producer, single consumer ring. The worker only moves `tail` and the logger only
+/// moves `head`, each on a cache line of its own
+typedef struct AccessLogRing {
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) atomic_size_t head;
+    struct AccessLogRing* next;
+    AccessLogRecord records[ACCESS_LOG_RING_CAP];
+} AccessLogRing;
+
+static int log_fd = -1;
+static bool log_text = false;
+
+static thread_local AccessLogRing* current_ring = NULL;
+
+static _Atomic(AccessLogRing*) rings = NULL;
+
+static AccessLogRing* access_log_ring_new(void) {
+    AccessLogRing* ring = aligned_alloc(64, sizeof(AccessLogRing));
+    if (!ring) {
+        die("could not allocate an access log ring");
+    }
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+
+    // NOTE: rings are only ever pushed, the logger can walk the list without a lock
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring, memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+
+    current_ring = ring;
+    return ring;
+}
+
+bool access_log_enabled(void) {
+    return log_fd != -1;
+}
+
+void access_log_request(uint32_t addr, const char* method, const char* path, uint16_t status,
+                        uint64_t bytes, uint64_t start_ns) {
+    if (log_fd == -1) {
+        return;
+    }
+
+    AccessLogRing* ring = current_ring ? current_ring : access_log_ring_new();
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == ACCESS_LOG_RING_CAP) {
+        metrics_count(METRIC_ACCESS_LOG_DROPPED, 1);
+        return;
+    }
+
+    AccessLogRecord* record = &ring->records[tail & (ACCESS_LOG_RING_CAP - 1)];
+    // the wall clock time the request was parsed at, back from now by how long it took
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t duration_ns = metrics_now() - start_ns;
+    record->time_ns = (uint64_t)now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec - duration_ns;
+    record->bytes = bytes;
+    record->duration_us = duration_ns / 1000;
+    record->addr = addr;
+    record->status = status;
+
+    memset(record->method, 0, sizeof(record->method));
+    if (method) {
+        strncpy(record->method, method, sizeof(record->method));
+    }
+
+    // NOTE: the slot is reused, what an earlier path left behind must not reach the binary log
+    size_t path_len = path ? strlen(path) : 0;
+    size_t kept = path_len < ACCESS_LOG_PATH_CAP ? path_len : ACCESS_LOG_PATH_CAP;
+    record->path_len = path_len > UINT16_MAX ? UINT16_MAX : path_len;
+    memcpy(record->path, path ? path : "", kept);
+    memset(record->path + kept, 0, ACCESS_LOG_PATH_CAP - kept);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void access_log_format(AccessLogRecord const* record, string_builder* sb) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &record->addr, addr, sizeof(addr));
+
+    time_t seconds = record->time_ns / (1000 * 1000 * 1000);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char date[32];
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+
+    size_t method_len = strnlen(record->method, sizeof(record->method));
+    size_t path_len = record->path_len < ACCESS_LOG_PATH_CAP ? record->path_len
+                                                             : ACCESS_LOG_PATH_CAP;
+
+    sb_sprintf(sb, "%s - - [%s] ", addr, date);
+    if (method_len) {
+        sb_sprintf(sb, "\"%.*s %.*s%s\"", (int)method_len, record->method, (int)path_len,
+                   record->path, record->path_len > ACCESS_LOG_PATH_CAP ? "..." : "");
+    } else {
+        sb_push_cstr(sb, "\"-\"");
+    }
+    sb_sprintf(sb, " %u %" PRIu64 " %" PRIu32 "us\n", record->status, record->bytes,
+               record->duration_us);
+}
+
+static void access_log_write(struct iovec* iov, int count) {
+    while (count) {
+        ssize_t written = writev(log_fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // NOTE: a full disk must not take the server down, the batch is lost
+            return;
+        }
+
+        while (count && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/// The records of a ring that are ready, as up to two spans because the ring wraps around
+static int access_log_spans(AccessLogRing* ring, size_t head, size_t tail, struct iovec* iov) {
+    size_t start = head & (ACCESS_LOG_RING_CAP - 1);
+    size_t count = tail - head;
+    size_t first = count < ACCESS_LOG_RING_CAP - start ? count : ACCESS_LOG_RING_CAP - start;
+
+    iov[0] = (struct iovec){&ring->records[start], first * sizeof(AccessLogRecord)};
+    if (first == count) {
+        return 1;
+    }
+
+    iov[1] = (struct iovec){ring->records, (count - first) * sizeof(AccessLogRecord)};
+    return 2;
+}
+
+/// Writes whatever the rings hold, returns the number of records written
+static size_t access_log_drain(string_builder* text) {
+    struct iovec iov[ACCESS_LOG_IOVS];
+    size_t written = 0;
+
+    AccessLogRing* ring = atomic_load_explicit(&rings, memory_order_acquire);
+    while (ring) {
+        // the records of a batch are written straight out of the rings, so their slots are only
+        // given back once the batch is written
+        AccessLogRing* first = ring;
+        size_t tails[ACCESS_LOG_IOVS / 2];
+        int iov_count = 0;
+        size_t ring_count = 0;
+        sb_clear(text);
+
+        // NOTE: a ring takes at most two vectors and the text one more
+        for (; ring && ring_count < ACCESS_LOG_IOVS / 2 - 1; ring = ring->next, ring_count++) {
+            size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            tails[ring_count] = tail;
+            written += tail - head;
+
+            if (!log_text) {
+                iov_count += head != tail ? access_log_spans(ring, head, tail, iov + iov_count) : 0;
+                continue;
+            }
+
+            for (size_t i = head; i != tail; i++) {
+                access_log_format(&ring->records[i & (ACCESS_LOG_RING_CAP - 1)], text);
+            }
+        }
+
+        if (log_text && text->len) {
+            iov[iov_count++] = (struct iovec){text->items, text->len};
+        }
+        access_log_write(iov, iov_count);
+
+        for (size_t i = 0; i < ring_count; i++, first = first->next) {
+            atomic_store_explicit(&first->head, tails[i], memory_order_release);
+        }
+    }
+
+    return written;
+}
+
+static void* access_log_run(void* arg) {
+    string_builder text = sb_new(64 * 1024);
+
+    while (true) {
+        if (access_log_drain(&text) == 0) {
+            nanosleep(&(struct timespec){.tv_nsec = ACCESS_LOG_IDLE_NSEC}, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+void access_log_start(const char* path, bool text) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        die("could not open the access log");
+    }
+    log_text = text;
+
+    // a binary log starts with its header, appending to an existing one only adds records
+    off_t size = lseek(log_fd, 0, SEEK_END);
+    if (!text && size == 0) {
+        AccessLogHeader header = {.record_size = sizeof(AccessLogRecord)};
+        memcpy(header.magic, ACCESS_LOG_MAGIC, ACCESS_LOG_MAGIC_LEN);
+        if (write(log_fd, &header, sizeof(header)) != sizeof(header)) {
+            die("could not write the access log header");
+        }
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, access_log_run, NULL) != 0) {
+        die("could not start the access log thread");
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "base.h"
+
+// Workers never write the access log themselves. Each one appends fixed-size records to a ring of
+// its own and a logger thread hands batches of them to the kernel with writev. A full ring drops
+// the record and counts it, logging must never hold up a response
+
+#define ACCESS_LOG_MAGIC "HTTPPOL\x01"
+#define ACCESS_LOG_MAGIC_LEN 8
+// records per worker ring, a power of two
+#define ACCESS_LOG_RING_CAP 4096
+#define ACCESS_LOG_PATH_CAP 92
+
+/// Starts a binary log, before its records
+typedef struct {
+    char magic[ACCESS_LOG_MAGIC_LEN];
+    uint32_t record_size;
+    uint32_t reserved;
+} AccessLogHeader;
+
+/// One request, written to a binary log as is
+typedef struct {
+    /// CLOCK_REALTIME in nanoseconds, when the request was parsed
+    uint64_t time_ns;
+    /// the size of the response body
+    uint64_t bytes;
+    /// from parsing the request to encoding its response
+    uint32_t duration_us;
+    /// the IPv4 address of the client in network byte order
+    uint32_t addr;
+    uint16_t status;
+    /// the length of the whole path, only the first `ACCESS_LOG_PATH_CAP` bytes are kept
+    uint16_t path_len;
+    /// not NUL terminated when it takes up all of it
+    char method[8];
+    char path[ACCESS_LOG_PATH_CAP];
+} AccessLogRecord;
+
+_Static_assert(sizeof(AccessLogRecord) == 128, "access log records take two cache lines");
+
+/// Opens the log for appending and starts the logger thread. Records are formatted as text lines
+/// instead of being written as is when `text` is set
+void access_log_start(const char* path, bool text);
+bool access_log_enabled(void);
+/// Queues a record on the ring of the calling thread. `method` and `path` may be NULL for
+/// requests that could not be parsed, `start_ns` is the CLOCK_MONOTONIC time the request was
+/// parsed at
+void access_log_request(uint32_t addr, const char* method, const char* path, uint16_t status,
+                        uint64_t bytes, uint64_t start_ns);
+/// Appends the record as a single line in the common log format, followed by the duration
+void access_log_format(AccessLogRecord const* record, string_builder* sb);
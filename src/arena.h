@@ -1,22 +1,43 @@
 #ifndef ARENA_H_
 #define ARENA_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+/// back the regions with huge pages when the system has them
+#define ARENA_HUGE_PAGES (1 << 0)
+
+/// A region of memory, the header lives at the start of its own mapping
 typedef struct ArenaRegion {
     struct ArenaRegion* next;
-    void* data;
     size_t size;
     size_t off;
 } ArenaRegion;
 
+typedef struct {
+    /// bytes handed out since the last reset
+    size_t used;
+    /// the most bytes ever handed out between two resets
+    size_t high_water;
+    /// bytes currently mapped for the regions
+    size_t mapped;
+    size_t regions;
+    size_t resets;
+} ArenaStats;
+
+/// A bump allocator. Every new region is at least twice as big as the previous one, so after a
+/// warmup a single region serves everything and a reset is O(1). A zeroed Arena is ready to use
 typedef struct {
     ArenaRegion* head;
-    ArenaRegion* region_pool;
+    int flags;
+    ArenaStats stats;
 } Arena;
 
 void* arena_alloc(Arena*, size_t);
+/// Resets the arena, keeping only its largest region
 void arena_free(Arena*);
+/// Unmaps every region of the arena
+void arena_destroy(Arena*);
 
 #ifdef ARENA_H_IMPLEMENTATION
 
@@ -25,82 +46,151 @@ void arena_free(Arena*);
 #include <sys/mman.h>
 #include <unistd.h>
 
-#define ARENA_ALLOC_PAGE(sz) (mmap(NULL, (sz), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0))
-#define ARENA_ALLOC_SMOL(sz) (sbrk((sz)))
+#define ARENA_MAP(sz, extra_flags) \
+    (mmap(NULL, (sz), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | (extra_flags), -1, 0))
+#define ARENA_UNMAP(ptr, sz) (munmap((ptr), (sz)))
 
 #else
 
 #error "Only UNIX-like systems are supported"
 
-#endif // unix check
+#endif  // unix check
 
 #define ARENA_PAGE_SIZE 4096
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_MIN_REGION_SIZE (64 * 1024)
+// regions stop doubling at this size, bigger allocations still get a region of their own
+#define ARENA_MAX_REGION_SIZE (64 * 1024 * 1024)
+#define ARENA_ALIGN 16
 
 static inline uintptr_t arena_align_ptr(uintptr_t size, uintptr_t align) {
     return size + ((align - (size & (align - 1))) & (align - 1));
 }
 
-ArenaRegion* arena_alloc_region(Arena* arena, size_t size) {
-    size = arena_align_ptr(size, ARENA_PAGE_SIZE);
-
-    ArenaRegion* head = arena->region_pool;
-
-    while (head) {
-        if (head->size - head->off <= sizeof(ArenaRegion)) {
-            ArenaRegion* region = (void*)((uint8_t*)head->data + head->off);
-            region->data = ARENA_ALLOC_PAGE(size);
-            region->size = size;
-            region->off = 0;
-            region->next = NULL;
-            return region;
+static inline size_t arena_header_size(void) {
+    return arena_align_ptr(sizeof(ArenaRegion), ARENA_ALIGN);
+}
+
+static void* arena_map(Arena* arena, size_t* size) {
+    void* data = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+    if (arena->flags & ARENA_HUGE_PAGES) {
+        *size = arena_align_ptr(*size, ARENA_HUGE_PAGE_SIZE);
+        data = ARENA_MAP(*size, MAP_HUGETLB);
+    }
+#endif
+
+    if (data == MAP_FAILED) {
+        *size = arena_align_ptr(*size, ARENA_PAGE_SIZE);
+        data = ARENA_MAP(*size, 0);
+        if (data == MAP_FAILED) {
+            return NULL;
         }
 
-        head = head->next;
+#if defined(MADV_HUGEPAGE)
+        // no reserved huge pages, let transparent huge pages back the region instead
+        if (arena->flags & ARENA_HUGE_PAGES) {
+            madvise(data, *size, MADV_HUGEPAGE);
+        }
+#endif
     }
 
-    head = ARENA_ALLOC_SMOL(sizeof(ArenaRegion));
-    head->next = arena->region_pool;
-    arena->region_pool = head;
+    return data;
+}
 
-    head->data = ARENA_ALLOC_PAGE(size);
-    head->size = size;
-    head->off = 0;
-    head->next = NULL;
-    return head;
+ArenaRegion* arena_alloc_region(Arena* arena, size_t size) {
+    size_t region_size = arena->head ? arena->head->size * 2 : ARENA_MIN_REGION_SIZE;
+    if (region_size > ARENA_MAX_REGION_SIZE) {
+        region_size = ARENA_MAX_REGION_SIZE;
+    }
+
+    size += arena_header_size();
+    if (region_size < size) {
+        region_size = size;
+    }
+
+    ArenaRegion* region = (ArenaRegion*)arena_map(arena, &region_size);
+    if (!region) {
+        return NULL;
+    }
+
+    region->size = region_size;
+    region->off = arena_header_size();
+    region->next = arena->head;
+    arena->head = region;
+
+    arena->stats.mapped += region_size;
+    arena->stats.regions++;
+    return region;
 }
 
 void* arena_alloc(Arena* arena, size_t sz) {
-    ArenaRegion* head = arena->head;
+    sz = arena_align_ptr(sz, ARENA_ALIGN);
 
-    sz = arena_align_ptr(sz, sizeof(void*));
-
-    while (head) {
-        if (head->size - head->off <= sz) {
-            void* ptr = (void*)((uint8_t*)head->data + head->off);
-            head->off += sz;
-            return ptr;
+    ArenaRegion* head = arena->head;
+    if (!head || head->size - head->off < sz) {
+        head = arena_alloc_region(arena, sz);
+        if (!head) {
+            return NULL;
         }
-
-        head = head->next;
     }
 
-    head = arena_alloc_region(arena, arena_align_ptr(sz, ARENA_PAGE_SIZE));
-    head->next = arena->head;
-    arena->head = head;
-
-    void* ptr = (void*)((uint8_t*)head->data + head->off);
+    void* ptr = (void*)((uint8_t*)head + head->off);
     head->off += sz;
+
+    arena->stats.used += sz;
+    if (arena->stats.used > arena->stats.high_water) {
+        arena->stats.high_water = arena->stats.used;
+    }
+
     return ptr;
 }
 
 void arena_free(Arena* arena) {
-    ArenaRegion* head = arena->head;
-    while (head) {
-        head->off = 0;
-        head = head->next;
+    ArenaRegion* keep = arena->head;
+    if (!keep) {
+        return;
     }
+
+    // NOTE: regions double in size, so the head is the largest one unless an oversized allocation
+    // came before it. The list is a single region once the arena has warmed up, which makes the
+    // reset O(1)
+    for (ArenaRegion* region = keep->next; region; region = region->next) {
+        if (region->size > keep->size) {
+            keep = region;
+        }
+    }
+
+    ArenaRegion* region = arena->head;
+    while (region) {
+        ArenaRegion* next = region->next;
+        if (region != keep) {
+            arena->stats.mapped -= region->size;
+            arena->stats.regions--;
+            ARENA_UNMAP(region, region->size);
+        }
+        region = next;
+    }
+
+    keep->next = NULL;
+    keep->off = arena_header_size();
+    arena->head = keep;
+    arena->stats.used = 0;
+    arena->stats.resets++;
+}
+
+void arena_destroy(Arena* arena) {
+    arena_free(arena);
+    if (arena->head) {
+        ARENA_UNMAP(arena->head, arena->head->size);
+        arena->head = NULL;
+    }
+
+    arena->stats.mapped = 0;
+    arena->stats.regions = 0;
 }
 
-#endif // ARENA_H_IMPLEMENTATION
+#endif  // ARENA_H_IMPLEMENTATION
 
-#endif // ARENA_H_
+#endif  // ARENA_H_
@@ -63,12 +63,13 @@
         free((arr)->items); \
     } while (0)
 
-#define DA_REMOVE(arr, idx)                                                                \
-    do {                                                                                   \
-        if ((idx) < (arr)->len) {                                                          \
-            memmove((arr)->items + idx, (arr)->items + idx + 1, (arr)->len - ((idx) + 1)); \
-            (arr)->len--;                                                                  \
-        }                                                                                  \
+#define DA_REMOVE(arr, idx)                                                      \
+    do {                                                                         \
+        if ((idx) < (arr)->len) {                                                \
+            memmove((arr)->items + (idx), (arr)->items + (idx) + 1,              \
+                    ((arr)->len - ((idx) + 1)) * sizeof((arr)->items[0]));       \
+            (arr)->len--;                                                        \
+        }                                                                        \
     } while (0)
 
 // HASH TABLE
@@ -150,6 +151,9 @@ typedef struct {
 BASEDEF string_builder sb_new(size_t cap);
 BASEDEF void sb_destroy(string_builder* sb);
 BASEDEF void sb_push_cstr(string_builder* sb, const char* str);
+BASEDEF void sb_push_n(string_builder* sb, const char* str, size_t n);
+/// Makes room for at least `n` more bytes, so that they can be written without further checks
+BASEDEF void sb_reserve(string_builder* sb, size_t n);
 BASEDEF void sb_sprintf(string_builder* sb, const char* fmt, ...)
     __attribute__((format(printf, 2, 3)));
 BASEDEF char* sb_to_cstr(string_builder* sb);
@@ -307,10 +311,26 @@ BASEDEF void sb_push(string_builder* sb, char c) {
     DA_ADD(sb, c);
 }
 
-BASEDEF void sb_push_cstr(string_builder* sb, const char* str) {
-    while (*str) {
-        sb_push(sb, *str++);
+BASEDEF void sb_reserve(string_builder* sb, size_t n) {
+    if (sb->cap - sb->len >= n) {
+        return;
     }
+
+    size_t cap = sb->cap ? sb->cap : 1;
+    while (cap - sb->len < n) {
+        cap *= 2;
+    }
+    DA_RESIZE(sb, cap);
+}
+
+BASEDEF void sb_push_n(string_builder* sb, const char* str, size_t n) {
+    sb_reserve(sb, n);
+    memcpy(sb->items + sb->len, str, n);
+    sb->len += n;
+}
+
+BASEDEF void sb_push_cstr(string_builder* sb, const char* str) {
+    sb_push_n(sb, str, strlen(str));
 }
 
 BASEDEF char* sb_to_cstr(string_builder* sb) {
@@ -328,9 +348,8 @@ BASEDEF void sb_sprintf(string_builder* sb, const char* fmt, ...) {
     ssize_t count = vsnprintf(NULL, 0, fmt, args);
     va_end(args);
 
-    while ((ssize_t)(sb->cap - sb->len) < count) {
-        DA_GROW(sb);
-    }
+    // NOTE: reserve room for the null terminator vsnprintf writes
+    sb_reserve(sb, count + 1);
 
     va_start(args, fmt);
     vsnprintf(sb->items + sb->len, count + 1, fmt,
@@ -341,14 +360,14 @@ BASEDEF void sb_sprintf(string_builder* sb, const char* fmt, ...) {
 }
 
 BASEDEF void sb_clear(string_builder* sb) {
-    memset(sb->items, 0, sb->len * sizeof(sb->items[0]));
+    // NOTE: the contents are overwritten by the next push, there is no need to zero them
     sb->len = 0;
 }
 
 // HASH TABLE
 
 BASEDEF int ht_load(const hash_table* ht) {
-    return (ht->len / ht->cap) * 100;
+    return (int)(ht->len * 100 / ht->cap);
 }
 
 BASEDEF hash_table ht_make(ht_hash_func hash_func, ht_eq_func eq_func, size_t cap) {
@@ -368,33 +387,61 @@ static inline uint64_t __ht_idx_for(const hash_table* ht, const void* key) {
     return hash % ht->cap;
 }
 
-BASEDEF void ht_add(hash_table* ht, void* key, void* value) {
-    if (ht_load(ht) >= 70) {
-        ht->cap *= 2;
-        ht->buckets = (ht_bucket**)realloc(ht->buckets, ht->cap);
-    }
-
-    size_t idx = __ht_idx_for(ht, key);
+static inline void __ht_insert_pair(hash_table* ht, ht_kv_pair pair) {
+    size_t idx = __ht_idx_for(ht, pair.key);
     ht_bucket* bucket = ht->buckets[idx];
-    ht_kv_pair pair = {.key = key, .value = value};
 
     if (!bucket) {
         bucket = (ht_bucket*)BASE_ALLOC(sizeof(ht_bucket));
         DA_INIT(bucket, 0, 2);
-        DA_ADD(bucket, pair);
         ht->buckets[idx] = bucket;
-        ht->len++;
-        return;
     }
 
-    for (size_t i = 0; i < bucket->len; i++) {
+    DA_ADD(bucket, pair);
+}
+
+/// Doubles the number of buckets and moves every pair to its new bucket
+static void __ht_grow(hash_table* ht) {
+    ht_bucket** old_buckets = ht->buckets;
+    size_t old_cap = ht->cap;
+
+    ht->cap *= 2;
+    ht->buckets = (ht_bucket**)calloc(ht->cap, sizeof(ht_bucket*));
+
+    for (size_t i = 0; i < old_cap; i++) {
+        ht_bucket* bucket = old_buckets[i];
+        if (!bucket) {
+            continue;
+        }
+
+        for (size_t j = 0; j < bucket->len; j++) {
+            __ht_insert_pair(ht, bucket->items[j]);
+        }
+        DA_FREE(bucket);
+        free(bucket);
+    }
+
+    free(old_buckets);
+}
+
+BASEDEF void ht_add(hash_table* ht, void* key, void* value) {
+    size_t idx = __ht_idx_for(ht, key);
+    ht_bucket* bucket = ht->buckets[idx];
+
+    for (size_t i = 0; bucket && i < bucket->len; i++) {
         if (ht->equality_function(key, bucket->items[i].key)) {
             bucket->items[i].value = value;
             return;
         }
     }
 
-    DA_ADD(bucket, pair);
+    // NOTE: `len` counts the pairs, not the buckets in use
+    ht->len++;
+    if (ht_load(ht) >= 70) {
+        __ht_grow(ht);
+    }
+
+    __ht_insert_pair(ht, (ht_kv_pair){.key = key, .value = value});
 }
 
 BASEDEF void* ht_find(hash_table* ht, const void* key) {
@@ -418,9 +465,10 @@ BASEDEF void* ht_delete(hash_table* ht, const void* key) {
 
     for (size_t i = 0; i < bucket->len; i++) {
         if (ht->equality_function(bucket->items[i].key, key)) {
+            void* value = bucket->items[i].value;
             DA_REMOVE(bucket, i);
             ht->len--;
-            return bucket->items[i].value;
+            return value;
         }
     }
 
@@ -503,6 +551,7 @@ BASEDEF int base_read_whole_file_buf(const char* filepath, char* buf, size_t buf
 
     size_t fsize = ftell(f);
     if (fsize > buf_size - 1) {
+        fclose(f);
         return 1;
     }
 
@@ -511,6 +560,7 @@ BASEDEF int base_read_whole_file_buf(const char* filepath, char* buf, size_t buf
     fread(buf, fsize, 1, f);
     buf[fsize] = '\0';
 
+    fclose(f);
     return 0;
 }
 
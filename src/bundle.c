@@ -0,0 +1,135 @@
+#include "bundle.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdalign.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+static bool httppo_bundle_span_valid(HttppoBundle const* bundle, HttppoBundleSpan span) {
+    return span.offset <= bundle->size && span.size <= bundle->size - span.offset;
+}
+
+static bool httppo_bundle_validate(HttppoBundle* bundle) {
+    if (bundle->size < sizeof(HttppoBundleHeader)) {
+        return false;
+    }
+
+    HttppoBundleHeader const* header = (HttppoBundleHeader const*)bundle->data;
+    if (memcmp(header->magic, HTTPPO_BUNDLE_MAGIC, HTTPPO_BUNDLE_MAGIC_LEN) != 0 ||
+        header->version != HTTPPO_BUNDLE_VERSION) {
+        return false;
+    }
+
+    if (!httppo_bundle_span_valid(bundle, header->index) ||
+        header->index.offset % alignof(HttppoBundleEntry) != 0 ||
+        header->index.size != (uint64_t)header->count * sizeof(HttppoBundleEntry)) {
+        return false;
+    }
+
+    bundle->entries = (HttppoBundleEntry const*)(bundle->data + header->index.offset);
+    bundle->count = header->count;
+
+    // NOTE: checked once here so that serving never has to look at a span twice
+    for (size_t i = 0; i < bundle->count; i++) {
+        HttppoBundleEntry const* entry = &bundle->entries[i];
+        // the path has to be followed by its NUL
+        uint64_t path_end = entry->path.offset + entry->path.size;
+        if (!httppo_bundle_span_valid(bundle, entry->path) || path_end >= bundle->size ||
+            bundle->data[path_end] != '\0') {
+            return false;
+        }
+
+        for (size_t r = 0; r < HTTPPO_BUNDLE_REPRESENTATIONS; r++) {
+            if (!httppo_bundle_span_valid(bundle, entry->body[r]) ||
+                !httppo_bundle_span_valid(bundle, entry->headers[r])) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool httppo_bundle_open(HttppoBundle* bundle, const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) == -1) {
+        close(fd);
+        return false;
+    }
+
+    void* data = s.st_size ? mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED) {
+        close(fd);
+        errno = s.st_size ? errno : EINVAL;
+        return false;
+    }
+
+    *bundle = (HttppoBundle){
+        .fd = fd,
+        .data = data,
+        .size = s.st_size,
+    };
+
+    if (!httppo_bundle_validate(bundle)) {
+        munmap(data, s.st_size);
+        close(fd);
+        *bundle = (HttppoBundle){.fd = -1};
+        errno = EINVAL;
+        return false;
+    }
+
+    // the index is touched by every request, the bodies are mostly sent with sendfile
+    HttppoBundleHeader const* header = (HttppoBundleHeader const*)bundle->data;
+    size_t index_start = header->index.offset & ~(uint64_t)(HTTPPO_BUNDLE_ALIGN - 1);
+    madvise((char*)data + index_start, bundle->size - index_start, MADV_WILLNEED);
+
+    return true;
+}
+
+HttppoBundleEntry const* httppo_bundle_find(HttppoBundle const* bundle, const char* name) {
+    size_t lo = 0;
+    size_t hi = bundle->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        HttppoBundleEntry const* entry = &bundle->entries[mid];
+
+        int cmp = strcmp(name, httppo_bundle_at(bundle, entry->path));
+        if (cmp == 0) {
+            return entry;
+        }
+
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+size_t httppo_bundle_pick(HttppoBundleEntry const* entry, const char* accept_encoding) {
+    if (!accept_encoding) {
+        return HTTPPO_BUNDLE_IDENTITY;
+    }
+
+    for (CompressEncoding e = 0; e < COMPRESS_ENCODING_COUNT; e++) {
+        if (entry->body[1 + e].size &&
+            http_accepts_encoding(accept_encoding, compress_encoding_name(e))) {
+            return 1 + e;
+        }
+    }
+
+    return HTTPPO_BUNDLE_IDENTITY;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compress.h"
+
+// A bundle is a whole static site packed into one file by `httppo-bundle`. It is laid out as
+//
+//   header | bodies, each at a page-aligned offset | strings | sorted entry index
+//
+// All offsets are absolute and every integer is in the byte order of the machine that built it,
+// bundles are meant to be built for the host that serves them
+
+#define HTTPPO_BUNDLE_MAGIC "HTTPPOB\x01"
+#define HTTPPO_BUNDLE_MAGIC_LEN 8
+#define HTTPPO_BUNDLE_VERSION 1
+#define HTTPPO_BUNDLE_ALIGN 4096
+
+/// The identity representation, `representation - 1` is the CompressEncoding of the others
+#define HTTPPO_BUNDLE_IDENTITY 0
+#define HTTPPO_BUNDLE_REPRESENTATIONS (1 + COMPRESS_ENCODING_COUNT)
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} HttppoBundleSpan;
+
+typedef struct {
+    char magic[HTTPPO_BUNDLE_MAGIC_LEN];
+    uint32_t version;
+    uint32_t count;
+    /// the HttppoBundleEntry array, sorted by path
+    HttppoBundleSpan index;
+} HttppoBundleHeader;
+
+typedef struct {
+    /// relative to the docroot like the names of the file cache, NUL-terminated
+    HttppoBundleSpan path;
+    /// the body of every representation, empty if the bundler did not build it
+    HttppoBundleSpan body[HTTPPO_BUNDLE_REPRESENTATIONS];
+    /// the header lines of every representation, from Content-Type to ETag, each ending in CRLF
+    HttppoBundleSpan headers[HTTPPO_BUNDLE_REPRESENTATIONS];
+} HttppoBundleEntry;
+
+/// A bundle mapped into memory. It is immutable, so lookups need neither locks nor syscalls and
+/// its bodies stay valid for as long as the server runs
+typedef struct {
+    int fd;
+    const char* data;
+    size_t size;
+    HttppoBundleEntry const* entries;
+    size_t count;
+} HttppoBundle;
+
+/// Maps the bundle and checks that every span of it lies inside the file. Returns false with
+/// errno set if it can't be opened and with EINVAL if it is not a valid bundle
+bool httppo_bundle_open(HttppoBundle* bundle, const char* path);
+/// Binary searches the index for a normalized request path
+HttppoBundleEntry const* httppo_bundle_find(HttppoBundle const* bundle, const char* name);
+/// The most preferred representation the client accepts
+size_t httppo_bundle_pick(HttppoBundleEntry const* entry, const char* accept_encoding);
+
+static inline const char* httppo_bundle_at(HttppoBundle const* bundle, HttppoBundleSpan span) {
+    return bundle->data + span.offset;
+}
@@ -0,0 +1,165 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "metrics.h"
+#include "util.h"
+
+// how often the buffers are written out
+#define CAPTURE_FLUSH_NSEC (100 * 1000 * 1000)
+// records are dropped while a thread has this much waiting to be written
+#define CAPTURE_BUFFER_CAP (16 * 1024 * 1024)
+
+/// The records of one thread. Its lock is only ever contended by the writer, once per flush
+typedef struct CaptureBuffer {
+    pthread_mutex_t mutex;
+    string_builder data;
+    struct CaptureBuffer* next;
+} CaptureBuffer;
+
+static int capture_fd = -1;
+static unsigned capture_every = 1;
+static uint64_t capture_epoch;
+static atomic_uint capture_next_conn;
+
+static thread_local CaptureBuffer* current_buffer = NULL;
+
+static CaptureBuffer* capture_buffers = NULL;
+static pthread_mutex_t capture_buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static CaptureBuffer* capture_buffer(void) {
+    if (current_buffer) {
+        return current_buffer;
+    }
+
+    CaptureBuffer* buffer = malloc(sizeof(CaptureBuffer));
+    if (!buffer) {
+        die("could not allocate a capture buffer");
+    }
+    pthread_mutex_init(&buffer->mutex, NULL);
+    buffer->data = sb_new(64 * 1024);
+
+    pthread_mutex_lock(&capture_buffers_mutex);
+    buffer->next = capture_buffers;
+    capture_buffers = buffer;
+    pthread_mutex_unlock(&capture_buffers_mutex);
+
+    current_buffer = buffer;
+    return buffer;
+}
+
+uint32_t capture_sample(void) {
+    if (capture_fd == -1) {
+        return 0;
+    }
+
+    unsigned n = atomic_fetch_add_explicit(&capture_next_conn, 1, memory_order_relaxed);
+    if (n % capture_every != 0) {
+        return 0;
+    }
+
+    // NOTE: 0 means not sampled, so the numbers start at 1
+    return n / capture_every + 1;
+}
+
+static void capture_record(uint32_t conn, const char* data, uint32_t len) {
+    CaptureRecord record = {
+        .time_ns = metrics_now() - capture_epoch,
+        .conn = conn,
+        .len = len,
+    };
+    size_t size = len == CAPTURE_CLOSE ? 0 : len;
+
+    CaptureBuffer* buffer = capture_buffer();
+    pthread_mutex_lock(&buffer->mutex);
+    if (buffer->data.len + sizeof(record) + size > CAPTURE_BUFFER_CAP) {
+        pthread_mutex_unlock(&buffer->mutex);
+        metrics_count(METRIC_CAPTURE_DROPPED, 1);
+        return;
+    }
+
+    sb_push_n(&buffer->data, (const char*)&record, sizeof(record));
+    if (size) {
+        sb_push_n(&buffer->data, data, size);
+    }
+    pthread_mutex_unlock(&buffer->mutex);
+}
+
+void capture_data(uint32_t conn, const char* data, size_t len) {
+    if (conn && len) {
+        capture_record(conn, data, len);
+    }
+}
+
+void capture_close(uint32_t conn) {
+    if (conn) {
+        capture_record(conn, NULL, CAPTURE_CLOSE);
+    }
+}
+
+static void capture_write(const char* data, size_t len) {
+    while (len) {
+        ssize_t written = write(capture_fd, data, len);
+        if (written <= 0) {
+            // NOTE: a full disk must not take the server down, the rest of the batch is lost
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+static void* capture_run(void* arg) {
+    string_builder spare = sb_new(64 * 1024);
+
+    while (true) {
+        nanosleep(&(struct timespec){.tv_nsec = CAPTURE_FLUSH_NSEC}, NULL);
+
+        pthread_mutex_lock(&capture_buffers_mutex);
+        CaptureBuffer* buffers = capture_buffers;
+        pthread_mutex_unlock(&capture_buffers_mutex);
+
+        // the filled buffer is swapped for an empty one, so the worker never waits for the disk
+        for (CaptureBuffer* buffer = buffers; buffer; buffer = buffer->next) {
+            pthread_mutex_lock(&buffer->mutex);
+            string_builder full = buffer->data;
+            buffer->data = spare;
+            pthread_mutex_unlock(&buffer->mutex);
+
+            capture_write(full.items, full.len);
+            sb_clear(&full);
+            spare = full;
+        }
+    }
+
+    return NULL;
+}
+
+void capture_start(const char* path, unsigned sample) {
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture_fd == -1) {
+        die("could not open the capture file");
+    }
+    capture_every = sample ? sample : 1;
+    capture_epoch = metrics_now();
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    CaptureHeader header = {.started_at = (uint64_t)now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec};
+    memcpy(header.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    capture_write((const char*)&header, sizeof(header));
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, capture_run, NULL) != 0) {
+        die("could not start the capture thread");
+    }
+    pthread_detach(thread);
+}
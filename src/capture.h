@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A capture holds the raw bytes a sample of connections sent, chunk by chunk as they arrived,
+// so that `httppo-replay` can play real traffic back with its paths, header sizes, pipelining and
+// keep-alive patterns intact. Connections are sampled as a whole, a sampled one is recorded from
+// its first byte to its close
+
+#define CAPTURE_MAGIC "HTTPPOC\x01"
+#define CAPTURE_MAGIC_LEN 8
+// the length of the record that marks the close of a connection
+#define CAPTURE_CLOSE UINT32_MAX
+
+/// Starts a capture, before its records
+typedef struct {
+    char magic[CAPTURE_MAGIC_LEN];
+    /// CLOCK_REALTIME in nanoseconds when the capture started
+    uint64_t started_at;
+} CaptureHeader;
+
+/// Followed by `len` bytes of the request stream, unless it marks a close
+typedef struct {
+    /// nanoseconds since the capture started
+    uint64_t time_ns;
+    /// numbers the sampled connections, never 0
+    uint32_t conn;
+    uint32_t len;
+} CaptureRecord;
+
+/// Creates the capture, replacing an existing one, and starts the thread that writes it. One in
+/// `sample` connections is recorded
+void capture_start(const char* path, unsigned sample);
+/// Decides whether a new connection is recorded, returns its number or 0 if it is not
+uint32_t capture_sample(void);
+/// Records bytes a sampled connection sent
+void capture_data(uint32_t conn, const char* data, size_t len);
+void capture_close(uint32_t conn);
@@ -0,0 +1,142 @@
+#include "compress.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#ifdef HTTPPO_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define COMPRESS_GZIP_LEVEL 9
+// NOTE: the best brotli quality takes seconds per megabyte, bigger files get a cheaper one so that
+// their variant shows up in reasonable time
+#define COMPRESS_BROTLI_BEST_MAX_SIZE (1024 * 1024)
+#define COMPRESS_BROTLI_LARGE_QUALITY 6
+
+const char* compress_encoding_name(CompressEncoding encoding) {
+    switch (encoding) {
+        case COMPRESS_BROTLI:
+            return "br";
+        case COMPRESS_GZIP:
+            return "gzip";
+        default:
+            return NULL;
+    }
+}
+
+const char* compress_encoding_suffix(CompressEncoding encoding) {
+    switch (encoding) {
+        case COMPRESS_BROTLI:
+            return ".br";
+        case COMPRESS_GZIP:
+            return ".gz";
+        default:
+            return NULL;
+    }
+}
+
+bool compress_available(CompressEncoding encoding) {
+    switch (encoding) {
+        case COMPRESS_GZIP:
+            return true;
+        case COMPRESS_BROTLI:
+#ifdef HTTPPO_HAVE_BROTLI
+            return true;
+#else
+            return false;
+#endif
+        default:
+            return false;
+    }
+}
+
+static bool compress_gzip(const char* in, size_t in_len, char** out, size_t* out_len) {
+    z_stream stream = {0};
+    // 16 on top of the window bits asks for the gzip wrapper instead of the zlib one
+    if (deflateInit2(&stream, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) !=
+        Z_OK) {
+        return false;
+    }
+
+    size_t cap = deflateBound(&stream, in_len);
+    char* buf = malloc(cap);
+    if (!buf) {
+        deflateEnd(&stream);
+        return false;
+    }
+
+    // NOTE: avail_in is 32 bits wide, feed bigger inputs in chunks
+    stream.next_out = (Bytef*)buf;
+    stream.avail_out = cap;
+    size_t off = 0;
+    int status;
+    do {
+        size_t chunk = in_len - off > UINT32_MAX ? UINT32_MAX : in_len - off;
+        stream.next_in = (Bytef*)(in + off);
+        stream.avail_in = chunk;
+        off += chunk;
+        status = deflate(&stream, off == in_len ? Z_FINISH : Z_NO_FLUSH);
+    } while (status == Z_OK);
+
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END) {
+        free(buf);
+        return false;
+    }
+
+    *out = buf;
+    *out_len = stream.total_out;
+    return true;
+}
+
+#ifdef HTTPPO_HAVE_BROTLI
+static bool compress_brotli(const char* in, size_t in_len, char** out, size_t* out_len) {
+    size_t cap = BrotliEncoderMaxCompressedSize(in_len);
+    if (cap == 0) {
+        return false;
+    }
+
+    char* buf = malloc(cap);
+    if (!buf) {
+        return false;
+    }
+
+    int quality = in_len <= COMPRESS_BROTLI_BEST_MAX_SIZE ? BROTLI_MAX_QUALITY
+                                                          : COMPRESS_BROTLI_LARGE_QUALITY;
+    size_t size = cap;
+    if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, in_len,
+                               (const uint8_t*)in, &size, (uint8_t*)buf)) {
+        free(buf);
+        return false;
+    }
+
+    *out = buf;
+    *out_len = size;
+    return true;
+}
+#endif
+
+bool compress_buffer(CompressEncoding encoding, const char* in, size_t in_len, char** out,
+                     size_t* out_len) {
+    bool ok = false;
+    switch (encoding) {
+        case COMPRESS_GZIP:
+            ok = compress_gzip(in, in_len, out, out_len);
+            break;
+#ifdef HTTPPO_HAVE_BROTLI
+        case COMPRESS_BROTLI:
+            ok = compress_brotli(in, in_len, out, out_len);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    if (ok && *out_len >= in_len) {
+        free(*out);
+        ok = false;
+    }
+
+    return ok;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Content codings the file cache keeps variants for, in the order they are preferred
+typedef enum {
+    COMPRESS_BROTLI,
+    COMPRESS_GZIP,
+    COMPRESS_ENCODING_COUNT,
+} CompressEncoding;
+
+/// The name of the coding in Accept-Encoding and Content-Encoding
+const char* compress_encoding_name(CompressEncoding encoding);
+/// The suffix of precompressed siblings, ".br" for "index.html.br"
+const char* compress_encoding_suffix(CompressEncoding encoding);
+/// Whether the server was built with an encoder for the coding
+bool compress_available(CompressEncoding encoding);
+/// Compresses `in` into a malloc'd buffer. Fails if the coding is not available or the result
+/// would not be smaller than the input
+bool compress_buffer(CompressEncoding encoding, const char* in, size_t in_len, char** out,
+                     size_t* out_len);
@@ -20,6 +20,36 @@
 static SapOption opts[] = {
     {"threads", 't', "specify the number of threads to use", SAP_INT, 0, NULL, 0},
     {"port", 'p', "specify the port number", SAP_INT, 0, NULL, 0},
+    {"max-conns", 'c', "specify the maximum number of concurrent connections", SAP_INT, 0, NULL, 0},
+    {"queue-cap", 'q', "specify the capacity of each worker's queue", SAP_INT, 0, NULL, 0},
+    {"huge-pages", 'H', "back the request arenas with huge pages", SAP_BOOL, 0, NULL, 0},
+    {"root", 'r', "specify the directory to serve files from", SAP_STRING, 0, NULL, 0},
+    {"preload", 'P', "load the root directory into the file cache before listening", SAP_BOOL, 0,
+     NULL, 0},
+    {"preload-max", 'M', "specify the size of the biggest file to preload", SAP_INT, 0, NULL, 0},
+    {"bundle", 'b', "serve the files packed into a bundle before the root", SAP_STRING, 0, NULL, 0},
+    {"snapshot", 'S', "keep the hot set of the file cache in a file and prefetch it on startup",
+     SAP_STRING, 0, NULL, 0},
+    {"metrics-port", 'm', "serve /metrics on this port of the loopback interface", SAP_INT, 0, NULL,
+     0},
+    {"access-log", 'l', "log every request to this file, in binary unless --access-log-text is set",
+     SAP_STRING, 0, NULL, 0},
+    {"access-log-text", 'L', "write the access log as text lines", SAP_BOOL, 0, NULL, 0},
+    {"capture", 'C', "record the raw requests of sampled connections to this file", SAP_STRING, 0,
+     NULL, 0},
+    {"capture-sample", 'R', "record one in this many connections, 100 by default", SAP_INT, 0, NULL,
+     0},
+    {"trace-sample", 'T', "trace one in this many requests, dumped on /trace of the metrics port",
+     SAP_INT, 0, NULL, 0},
+    {"tls-cert", 'E', "serve TLS with this PEM certificate chain, --tls-key is needed as well",
+     SAP_STRING, 0, NULL, 0},
+    {"tls-key", 'K', "the PEM private key of the TLS certificate", SAP_STRING, 0, NULL, 0},
+    {"ktls", 'k', "hand the TLS encryption of responses to the kernel where it is supported",
+     SAP_BOOL, 0, NULL, 0},
+    {"upstreams", 'u', "proxy requests that match no file to these comma separated host:port",
+     SAP_STRING, 0, NULL, 0},
+    {"microcache", 'X', "cache proxied GET responses for a short while and coalesce their misses",
+     SAP_BOOL, 0, NULL, 0},
     {"help", 'h', "print the help message", SAP_BOOL, 0, NULL, 0},
 };
 
@@ -63,5 +93,79 @@ HttppoConfig httppo_config_parse(int argc, char** argv) {
         DIE("the port number '%d' is not valid", config.port);
     }
 
+    SapOption* copt = sap_get_short(&parser, 'c');
+    config.max_conns = copt->parsed ? (intptr_t)copt->value : HTTPPO_DEFAULT_MAX_CONNS;
+    if (config.max_conns <= 0) {
+        DIE("the connection limit '%d' is not valid", config.max_conns);
+    }
+
+    SapOption* qopt = sap_get_short(&parser, 'q');
+    config.queue_cap = qopt->parsed ? (intptr_t)qopt->value : HTTPPO_DEFAULT_QUEUE_CAP;
+    if (config.queue_cap <= 0) {
+        DIE("the queue capacity '%d' is not valid", config.queue_cap);
+    }
+
+    config.huge_pages = sap_get_short(&parser, 'H')->value != NULL;
+
+    SapOption* ropt = sap_get_short(&parser, 'r');
+    config.root = ropt->parsed ? (const char*)ropt->value : HTTPPO_DEFAULT_ROOT;
+
+    config.preload = sap_get_short(&parser, 'P')->value != NULL;
+
+    SapOption* mopt = sap_get_short(&parser, 'M');
+    config.preload_max = mopt->parsed ? (intptr_t)mopt->value : HTTPPO_DEFAULT_PRELOAD_MAX;
+    if (config.preload_max < 0) {
+        DIE("the preload size limit '%d' is not valid", config.preload_max);
+    }
+
+    SapOption* bopt = sap_get_short(&parser, 'b');
+    config.bundle = bopt->parsed ? (const char*)bopt->value : NULL;
+
+    SapOption* sopt = sap_get_short(&parser, 'S');
+    config.snapshot = sopt->parsed ? (const char*)sopt->value : NULL;
+
+    SapOption* mpopt = sap_get_short(&parser, 'm');
+    config.metrics_port = mpopt->parsed ? (intptr_t)mpopt->value : 0;
+    if (config.metrics_port < 0 || config.metrics_port > MAX_PORT_NUMBER) {
+        DIE("the metrics port '%d' is not valid", config.metrics_port);
+    }
+
+    SapOption* lopt = sap_get_short(&parser, 'l');
+    config.access_log = lopt->parsed ? (const char*)lopt->value : NULL;
+    config.access_log_text = sap_get_short(&parser, 'L')->value != NULL;
+
+    SapOption* capture_opt = sap_get_short(&parser, 'C');
+    config.capture = capture_opt->parsed ? (const char*)capture_opt->value : NULL;
+
+    SapOption* sample_opt = sap_get_short(&parser, 'R');
+    config.capture_sample =
+        sample_opt->parsed ? (intptr_t)sample_opt->value : HTTPPO_DEFAULT_CAPTURE_SAMPLE;
+    if (config.capture_sample <= 0) {
+        DIE("the capture sample '%d' is not valid", config.capture_sample);
+    }
+
+    SapOption* trace_opt = sap_get_short(&parser, 'T');
+    config.trace_sample = trace_opt->parsed ? (intptr_t)trace_opt->value : 0;
+    if (config.trace_sample < 0) {
+        DIE("the trace sample '%d' is not valid", config.trace_sample);
+    }
+
+    SapOption* cert_opt = sap_get_short(&parser, 'E');
+    SapOption* key_opt = sap_get_short(&parser, 'K');
+    config.tls_cert = cert_opt->parsed ? (const char*)cert_opt->value : NULL;
+    config.tls_key = key_opt->parsed ? (const char*)key_opt->value : NULL;
+    if (!config.tls_cert != !config.tls_key) {
+        DIE("TLS needs both a certificate and a key, only the %s was given",
+            config.tls_cert ? "certificate" : "key");
+    }
+    config.ktls = sap_get_short(&parser, 'k')->value != NULL;
+
+    SapOption* upstreams_opt = sap_get_short(&parser, 'u');
+    config.upstreams = upstreams_opt->parsed ? (const char*)upstreams_opt->value : NULL;
+    config.microcache = sap_get_short(&parser, 'X')->value != NULL;
+    if (config.microcache && !config.upstreams) {
+        DIE("the micro-cache only holds proxied responses, %s needs --upstreams", "--microcache");
+    }
+
     return config;
 }
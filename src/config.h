@@ -1,11 +1,56 @@
 #pragma once
 
+#include <stdbool.h>
+
 #define HTTPPO_DEFAULT_PORT "6969"
 #define HTTPPO_DEFAULT_PORTI 6969
+#define HTTPPO_DEFAULT_MAX_CONNS 4096
+#define HTTPPO_DEFAULT_QUEUE_CAP 256
+#define HTTPPO_DEFAULT_ROOT "."
+#define HTTPPO_DEFAULT_PRELOAD_MAX (1024 * 1024)
+#define HTTPPO_DEFAULT_CAPTURE_SAMPLE 100
 
 typedef struct {
     int threads;
     int port;
+    /// maximum number of connections being served at the same time
+    int max_conns;
+    /// capacity of each worker's job queue
+    int queue_cap;
+    /// back the request arenas with huge pages
+    bool huge_pages;
+    /// the directory files are served from
+    const char* root;
+    /// load the docroot into the file cache before listening
+    bool preload;
+    /// files bigger than this are left out of the preload
+    int preload_max;
+    /// a bundle made by `httppo-bundle` to serve before looking at the root, NULL for none
+    const char* bundle;
+    /// where the hot set of the file cache is kept across restarts, NULL for nowhere
+    const char* snapshot;
+    /// the loopback port `/metrics` is served on, 0 to not serve it
+    int metrics_port;
+    /// where every request is logged, NULL to not log them
+    const char* access_log;
+    /// log text lines instead of binary records
+    bool access_log_text;
+    /// where the requests of sampled connections are recorded, NULL to not record them
+    const char* capture;
+    /// one in this many connections is recorded
+    int capture_sample;
+    /// one in this many requests is traced, 0 to not trace any
+    int trace_sample;
+    /// the certificate chain and key the port is served with over TLS, NULL to serve plain HTTP
+    const char* tls_cert;
+    const char* tls_key;
+    /// let the kernel encrypt what is sent over TLS where it can
+    bool ktls;
+    /// comma separated `host:port` upstreams that requests matching no file are proxied to, NULL
+    /// to answer them with 404
+    const char* upstreams;
+    /// cache proxied responses briefly and send concurrent misses of a path upstream once
+    bool microcache;
 } HttppoConfig;
 
 HttppoConfig httppo_config_parse(int argc, char** argv);
@@ -0,0 +1,1064 @@
+#include "connection.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "arena.h"
+#include "capture.h"
+#include "h2.h"
+#include "metrics.h"
+#include "microcache.h"
+#include "proxy.h"
+#include "tls.h"
+#include "trace.h"
+#include "util.h"
+
+// responses with bodies larger than this are sent from the bulk lane
+#define HTTPPO_BULK_THRESHOLD (64 * 1024)
+// how much of a bulk response is sent before yielding to other jobs
+#define HTTPPO_BULK_SLICE (256 * 1024)
+
+// NOTE: the header timeout is not refreshed by incoming bytes, a client has to send the whole
+// header block in time
+#define HTTPPO_HANDSHAKE_TIMEOUT_MS (10 * 1000)
+#define HTTPPO_HEADER_TIMEOUT_MS (10 * 1000)
+#define HTTPPO_BODY_TIMEOUT_MS (30 * 1000)
+#define HTTPPO_IDLE_TIMEOUT_MS (5 * 1000)
+#define HTTPPO_SEND_TIMEOUT_MS (30 * 1000)
+
+typedef enum {
+    CONN_FLUSH_DONE,
+    CONN_FLUSH_BLOCKED,
+    CONN_FLUSH_YIELD,
+    CONN_FLUSH_ERROR,
+} ConnFlushStatus;
+
+atomic_int conn_active_count;
+
+static ConnRequestHandler request_handler = NULL;
+static int request_arena_flags = 0;
+
+// every request is allocated from here and dropped at once after its response is encoded
+static thread_local Arena arena;
+// responses are encoded here and only copied to the connection if they can't be sent right away
+static thread_local string_builder scratch;
+
+static SlabPool conn_pool;
+static SlabPool buffer_pool;
+
+static void conn_io(IoHandler* io, uint32_t events);
+static void conn_timeout(Timer* timer);
+static void conn_process(Connection* conn);
+static void conn_read(Connection* conn);
+static void conn_handshake(Connection* conn);
+static void conn_handle_h2(void* ctx, uint32_t stream, HttpRequest* req);
+static void conn_data_h2(void* ctx, uint32_t stream, const char* data, size_t len, bool end);
+
+void conn_init(ConnRequestHandler handler, int arena_flags) {
+    request_handler = handler;
+    request_arena_flags = arena_flags;
+
+    slab_pool_init(&conn_pool, "connections", sizeof(Connection));
+    slab_pool_init(&buffer_pool, "io_buffers", HTTPPO_IO_BUF_SIZE);
+}
+
+SlabStats conn_slab_stats(void) {
+    return slab_pool_stats(&conn_pool);
+}
+
+SlabStats conn_buffer_slab_stats(void) {
+    return slab_pool_stats(&buffer_pool);
+}
+
+static void conn_release_out(Connection* conn) {
+    if (conn->out) {
+        if (conn->out_len <= HTTPPO_IO_BUF_SIZE) {
+            slab_free(conn->out);
+        } else {
+            free(conn->out);
+        }
+    }
+
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_off = 0;
+}
+
+static void conn_release_body(Connection* conn) {
+    if (conn->body_release) {
+        conn->body_release(conn->body_owner);
+    }
+
+    conn->body = NULL;
+    conn->body_len = 0;
+    conn->body_off = 0;
+    conn->body_file = -1;
+    conn->body_release = NULL;
+    conn->body_owner = NULL;
+}
+
+static void conn_close(Connection* conn) {
+    threadpool_timer_cancel(&conn->timer);
+    if (conn->proxy) {
+        proxy_abort(conn->proxy);
+    }
+    if (conn->h2_proxies) {
+        proxy_abort_streams(conn);
+    }
+    if (conn->h2_waiters) {
+        microcache_abandon(conn);
+    }
+    if (conn->tls) {
+        tls_free(conn->tls);
+    }
+
+    // NOTE: closing the socket also removes it from the worker's epoll set
+    if (close(conn->sock) == -1) {
+        fprintf(stderr, "ERROR: could not close socket %d: %s\n", conn->sock, strerror(errno));
+        exit(1);
+    }
+
+    conn_release_out(conn);
+    conn_release_body(conn);
+    if (conn->h2) {
+        h2_session_free(conn->h2);
+    }
+    capture_close(conn->capture_id);
+    slab_free(conn);
+
+    atomic_fetch_sub(&conn_active_count, 1);
+}
+
+/// Switches the connection into a reading state, arming the matching timeout on a transition
+static void conn_expect(Connection* conn, ConnState state) {
+    if (conn->state == state) {
+        return;
+    }
+
+    conn->state = state;
+    switch (state) {
+        case CONN_HANDSHAKE:
+            threadpool_timer_arm(&conn->timer, HTTPPO_HANDSHAKE_TIMEOUT_MS);
+            break;
+        case CONN_READING_HEADERS:
+            threadpool_timer_arm(&conn->timer, HTTPPO_HEADER_TIMEOUT_MS);
+            break;
+        case CONN_READING_BODY:
+            threadpool_timer_arm(&conn->timer, HTTPPO_BODY_TIMEOUT_MS);
+            break;
+        case CONN_IDLE:
+            threadpool_timer_arm(&conn->timer, HTTPPO_IDLE_TIMEOUT_MS);
+            break;
+        case CONN_WRITING:
+            threadpool_timer_arm(&conn->timer, HTTPPO_SEND_TIMEOUT_MS);
+            break;
+    }
+}
+
+void* conn_open(void* socket) {
+    int sock = (int)(uintptr_t)socket;
+
+    int flags = fcntl(sock, F_GETFL);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        die("could not make a client socket non-blocking");
+    }
+
+    if (!arena.head) {
+        arena.flags = request_arena_flags;
+        scratch = sb_new(HTTPPO_IO_BUF_SIZE);
+    }
+
+    Connection* conn = slab_alloc(&conn_pool);
+    if (!conn) {
+        die("could not allocate a connection");
+    }
+
+    conn->io.proc = conn_io;
+    timer_init(&conn->timer, conn_timeout);
+    conn->sock = sock;
+    conn->state = CONN_IDLE;
+    conn->keep_alive = true;
+    conn->scheduled = false;
+    // NOTE: the accept loop stamped the job, so the first byte latency includes the queueing
+    conn->accepted_at = threadpool_job_enqueued_at();
+    if (conn->accepted_at == 0) {
+        conn->accepted_at = metrics_now();
+    }
+    conn->respond_at = 0;
+    conn->status = 0;
+    conn->response_bytes = 0;
+    conn->peer_addr = 0;
+    // the upstreams are told who the client is as well
+    if (access_log_enabled() || proxy_enabled()) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        if (getpeername(sock, (struct sockaddr*)&addr, &addr_len) == 0 &&
+            addr.sin_family == AF_INET) {
+            conn->peer_addr = addr.sin_addr.s_addr;
+        }
+    }
+    conn->capture_id = capture_sample();
+    trace_open(&conn->trace, conn->accepted_at);
+    TRACE_PROBE(dequeue, sock);
+    conn->tls = NULL;
+    conn->h2 = NULL;
+    conn->h2_stream = 0;
+    conn->proxy = NULL;
+    conn->h2_proxies = NULL;
+    conn->parked = false;
+    conn->parked_at = 0;
+    conn->h2_waiters = NULL;
+    conn->expect_continue = false;
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_off = 0;
+    conn->body = NULL;
+    conn->body_len = 0;
+    conn->body_off = 0;
+    conn->body_file = -1;
+    conn->body_file_off = 0;
+    conn->body_release = NULL;
+    conn->body_owner = NULL;
+    conn->in_len = 0;
+
+    metrics_count(METRIC_CONNECTIONS, 1);
+    if (tls_enabled()) {
+        conn->tls = tls_new(sock);
+        conn_expect(conn, CONN_HANDSHAKE);
+        threadpool_watch(sock, EPOLLIN, &conn->io);
+        // the ClientHello has most likely arrived already as well
+        conn_handshake(conn);
+        return NULL;
+    }
+
+    conn_expect(conn, CONN_READING_HEADERS);
+    threadpool_watch(sock, EPOLLIN, &conn->io);
+
+    // the request has most likely arrived already, don't wait for a poll to read it
+    conn_read(conn);
+    return NULL;
+}
+
+static void conn_handshake(Connection* conn) {
+    switch (tls_handshake(conn->tls)) {
+        case TLS_DONE:
+            conn_expect(conn, CONN_READING_HEADERS);
+            threadpool_watch(conn->sock, EPOLLIN, &conn->io);
+            conn_read(conn);
+            return;
+        case TLS_WANT_READ:
+            threadpool_watch(conn->sock, EPOLLIN, &conn->io);
+            return;
+        case TLS_WANT_WRITE:
+            threadpool_watch(conn->sock, EPOLLOUT, &conn->io);
+            return;
+        case TLS_ERROR:
+            conn_close(conn);
+            return;
+    }
+}
+
+static ssize_t conn_recv(Connection* conn, char* buf, size_t len) {
+    if (conn->tls) {
+        return tls_recv(conn->tls, buf, len);
+    }
+    return recv(conn->sock, buf, len, 0);
+}
+
+static bool conn_send(Connection* conn, const char* data, size_t size, size_t* off,
+                      ConnFlushStatus* status) {
+    while (*off < size) {
+        ssize_t nsent = conn->tls ? tls_send(conn->tls, data + *off, size - *off)
+                                  : send(conn->sock, data + *off, size - *off, MSG_NOSIGNAL);
+        if (nsent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            *status = errno == EAGAIN || errno == EWOULDBLOCK ? CONN_FLUSH_BLOCKED
+                                                              : CONN_FLUSH_ERROR;
+            return false;
+        }
+
+        metrics_count(METRIC_BYTES_OUT, nsent);
+        *off += nsent;
+    }
+
+    return true;
+}
+
+/// Sends the body from its descriptor up to `end` without copying it through user space
+static bool conn_sendfile(Connection* conn, size_t end, ConnFlushStatus* status) {
+    while (conn->body_off < end) {
+        off_t off = conn->body_file_off + conn->body_off;
+        size_t len = end - conn->body_off;
+        ssize_t nsent = conn->tls ? tls_sendfile(conn->tls, conn->body_file, off, len)
+                                  : sendfile(conn->sock, conn->body_file, &off, len);
+        if (nsent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            *status = errno == EAGAIN || errno == EWOULDBLOCK ? CONN_FLUSH_BLOCKED
+                                                              : CONN_FLUSH_ERROR;
+            return false;
+        }
+
+        // the file got shorter than the Content-Length that was already sent
+        if (nsent == 0) {
+            *status = CONN_FLUSH_ERROR;
+            return false;
+        }
+
+        metrics_count(METRIC_BYTES_OUT, nsent);
+        conn->body_off += nsent;
+    }
+
+    return true;
+}
+
+static ConnFlushStatus conn_flush(Connection* conn) {
+    ConnFlushStatus status = CONN_FLUSH_DONE;
+
+    if (conn->out) {
+        if (!conn_send(conn, conn->out, conn->out_len, &conn->out_off, &status)) {
+            return status;
+        }
+        conn_release_out(conn);
+    }
+
+    if (conn->body) {
+        size_t end = conn->body_off + HTTPPO_BULK_SLICE;
+        if (end > conn->body_len) {
+            end = conn->body_len;
+        }
+
+        bool sent = conn->body_file != -1
+                        ? conn_sendfile(conn, end, &status)
+                        : conn_send(conn, conn->body, end, &conn->body_off, &status);
+        if (!sent) {
+            return status;
+        }
+
+        if (conn->body_off < conn->body_len) {
+            return CONN_FLUSH_YIELD;
+        }
+    }
+
+    conn_release_body(conn);
+    return CONN_FLUSH_DONE;
+}
+
+static void* conn_continue(void* arg);
+
+/// Takes the connection out of the event loop until its next bulk slice runs, returns false if
+/// the bulk lane is full
+static bool conn_yield(Connection* conn) {
+    conn->state = CONN_WRITING;
+    threadpool_timer_cancel(&conn->timer);
+    threadpool_unwatch(conn->sock);
+    if (!threadpool_schedule_local(WORKER_LANE_BULK, conn_continue, conn)) {
+        return false;
+    }
+
+    conn->scheduled = true;
+    return true;
+}
+
+/// Sends the frames of the session, yielding to the bulk lane after every slice of them
+static bool conn_write_h2(Connection* conn) {
+    size_t budget = HTTPPO_BULK_SLICE;
+    while (true) {
+        size_t len;
+        const char* data = h2_session_output(conn->h2, &len);
+        if (!len) {
+            break;
+        }
+        if (!budget) {
+            if (conn_yield(conn)) {
+                return false;
+            }
+            budget = HTTPPO_BULK_SLICE;
+        }
+
+        size_t off = 0;
+        ConnFlushStatus status = CONN_FLUSH_DONE;
+        bool sent = conn_send(conn, data, len, &off, &status);
+        h2_session_sent(conn->h2, off);
+        if (conn->accepted_at && off) {
+            metrics_record_since(METRIC_FIRST_BYTE, conn->accepted_at);
+            conn->accepted_at = 0;
+        }
+
+        if (!sent) {
+            if (status == CONN_FLUSH_ERROR) {
+                conn_close(conn);
+                return false;
+            }
+
+            // NOTE: nothing is read until the client takes what is queued, which bounds the
+            // responses piling up for it
+            proxy_resume_streams(conn);
+            conn->state = CONN_WRITING;
+            threadpool_timer_arm(&conn->timer, HTTPPO_SEND_TIMEOUT_MS);
+            threadpool_watch(conn->sock, EPOLLOUT, &conn->io);
+            return false;
+        }
+        budget = off < budget ? budget - off : 0;
+    }
+
+    // the upstreams of the streams whose bodies got sent go on
+    proxy_resume_streams(conn);
+    if (h2_session_done(conn->h2)) {
+        conn_close(conn);
+        return false;
+    }
+
+    // streams that are left wait for the client to open its flow control window
+    conn->state = CONN_WRITING;
+    conn_expect(conn, h2_session_idle(conn->h2) ? CONN_IDLE : CONN_READING_BODY);
+    threadpool_watch(conn->sock, EPOLLIN, &conn->io);
+    return true;
+}
+
+/// Flushes the pending response and returns true if the connection can go on reading requests
+static bool conn_write(Connection* conn) {
+    if (conn->h2) {
+        return conn_write_h2(conn);
+    }
+
+    // a relayed response goes on with the next bytes from the upstream
+    if (conn->proxy) {
+        switch (conn_flush(conn)) {
+            case CONN_FLUSH_DONE:
+                threadpool_timer_cancel(&conn->timer);
+                threadpool_unwatch(conn->sock);
+                proxy_resume(conn->proxy);
+                return false;
+            case CONN_FLUSH_ERROR:
+                conn_close(conn);
+                return false;
+            default:
+                conn->state = CONN_WRITING;
+                threadpool_timer_arm(&conn->timer, HTTPPO_SEND_TIMEOUT_MS);
+                threadpool_watch(conn->sock, EPOLLOUT, &conn->io);
+                return false;
+        }
+    }
+
+    while (true) {
+        switch (conn_flush(conn)) {
+            case CONN_FLUSH_DONE:
+                if (conn->respond_at) {
+                    metrics_record_since(METRIC_SEND, conn->respond_at);
+                    conn->respond_at = 0;
+                }
+                // the socket did not take a single byte when the response was encoded
+                if (conn->accepted_at) {
+                    metrics_record_since(METRIC_FIRST_BYTE, conn->accepted_at);
+                    conn->accepted_at = 0;
+                }
+                TRACE_PROBE(sent, conn->sock);
+                trace_finish(&conn->trace, conn->status);
+
+                if (!conn->keep_alive) {
+                    conn_close(conn);
+                    return false;
+                }
+
+                // NOTE: leaving the writing state makes sure the next request gets a fresh timeout
+                conn->state = CONN_WRITING;
+                conn_expect(conn, conn->in_len ? CONN_READING_HEADERS : CONN_IDLE);
+                threadpool_watch(conn->sock, EPOLLIN, &conn->io);
+                return true;
+
+            case CONN_FLUSH_BLOCKED:
+                // the send timeout is restarted whenever the client makes progress
+                conn->state = CONN_WRITING;
+                threadpool_timer_arm(&conn->timer, HTTPPO_SEND_TIMEOUT_MS);
+                threadpool_watch(conn->sock, EPOLLOUT, &conn->io);
+                return false;
+
+            case CONN_FLUSH_YIELD:
+                if (conn_yield(conn)) {
+                    return false;
+                }
+
+                // if the bulk lane is full there is nothing to yield to, so keep sending
+                continue;
+
+            case CONN_FLUSH_ERROR:
+                conn_close(conn);
+                return false;
+        }
+    }
+}
+
+static void* conn_continue(void* arg) {
+    Connection* conn = (Connection*)arg;
+    conn->scheduled = false;
+
+    if (conn_write(conn)) {
+        conn_process(conn);
+    }
+    return NULL;
+}
+
+static void conn_fail(Connection* conn, HttpStatusCode status_code) {
+    if (status_code == STATUS_BAD_REQUEST) {
+        metrics_count(METRIC_BAD_REQUESTS, 1);
+    }
+
+    uint64_t start = metrics_now();
+    HttpResponse res = http_res_new(status_code, sv_make(NULL, 0));
+    res.keep_alive = false;
+    conn_respond(conn, &res);
+    access_log_request(conn->peer_addr, NULL, NULL, status_code, 0, start);
+    conn_write(conn);
+}
+
+/// Hands received bytes to the session, returns false if it ran into a connection error
+static bool conn_feed_h2(Connection* conn, const char* data, size_t len) {
+    bool ok = true;
+    while (ok && len) {
+        size_t cap;
+        char* input = h2_session_input(conn->h2, &cap);
+        size_t n = len < cap ? len : cap;
+        memcpy(input, data, n);
+        ok = h2_session_recv(conn->h2, n, &arena, conn_handle_h2, conn_data_h2, conn);
+        data += n;
+        len -= n;
+    }
+
+    // header blocks that were not requests were decoded into the arena as well
+    arena_free(&arena);
+    return ok;
+}
+
+static void* conn_resume(void* arg) {
+    Connection* conn = (Connection*)arg;
+    conn->scheduled = false;
+
+    // the timeout of the state was cancelled, leaving the state arms it again
+    ConnState state = conn->state;
+    conn->state = CONN_WRITING;
+    conn_expect(conn, state);
+    threadpool_watch(conn->sock, EPOLLIN, &conn->io);
+    conn_read(conn);
+    return NULL;
+}
+
+/// Waits for more of the request. Bytes that TLS decrypted already never wake the connection up,
+/// so they are read by a job of their own
+static void conn_await(Connection* conn, ConnState state) {
+    conn_expect(conn, state);
+    if (!conn->tls || !tls_pending(conn->tls)) {
+        return;
+    }
+
+    threadpool_timer_cancel(&conn->timer);
+    threadpool_unwatch(conn->sock);
+    if (threadpool_schedule_local(WORKER_LANE_INTERACTIVE, conn_resume, conn)) {
+        conn->scheduled = true;
+        return;
+    }
+
+    // NOTE: with the lane full the bytes are read right away, at the cost of a deeper stack
+    conn_resume(conn);
+}
+
+/// Hands the body bytes that arrived to the upstream and leaves the connection alone until it
+/// asks for more
+static void conn_upload(Connection* conn) {
+    if (conn->in_len) {
+        ssize_t len = proxy_upload(conn->proxy, conn->in, conn->in_len);
+        if (len == -1) {
+            proxy_abort(conn->proxy);
+            conn->proxy = NULL;
+            conn_fail(conn, STATUS_BAD_REQUEST);
+            return;
+        }
+        conn->in_len -= len;
+        memmove(conn->in, conn->in + len, conn->in_len);
+    }
+
+    conn->state = CONN_WRITING;
+    threadpool_timer_cancel(&conn->timer);
+    threadpool_unwatch(conn->sock);
+}
+
+/// Handles every complete request in the input buffer
+static void conn_process(Connection* conn) {
+    // the session reads on its own, its buffer is not this one
+    if (conn->h2) {
+        return;
+    }
+
+    // only the body of a streamed request is read while its upstream exchange is going on
+    if (conn->proxy) {
+        if (!conn->in_len) {
+            conn_await(conn, CONN_READING_BODY);
+            return;
+        }
+        conn_upload(conn);
+        return;
+    }
+
+    while (true) {
+        // NOTE: a client with prior knowledge of HTTP/2 starts with the connection preface
+        size_t preface_len = conn->in_len < H2_PREFACE_LEN ? conn->in_len : H2_PREFACE_LEN;
+        if (preface_len && memcmp(conn->in, H2_PREFACE, preface_len) == 0) {
+            if (preface_len < H2_PREFACE_LEN) {
+                conn_expect(conn, CONN_READING_HEADERS);
+                return;
+            }
+
+            conn->h2 = h2_session_new(NULL);
+            conn_feed_h2(conn, conn->in, conn->in_len);
+            conn->in_len = 0;
+            conn_write(conn);
+            return;
+        }
+
+        string_view input = sv_make(conn->in, conn->in_len);
+        ssize_t head_end = sv_find_sub_cstr(input, "\r\n\r\n");
+        if (head_end == -1) {
+            if (conn->in_len == sizeof(conn->in)) {
+                conn_fail(conn, STATUS_BAD_REQUEST);
+                return;
+            }
+
+            conn_await(conn, conn->in_len ? CONN_READING_HEADERS : CONN_IDLE);
+            return;
+        }
+
+        size_t head_len = head_end + 4;
+        string_view head = sv_slice(input, 0, head_end);
+        ssize_t body_len = http_req_content_length(head);
+        if (body_len < 0) {
+            conn_fail(conn, STATUS_BAD_REQUEST);
+            return;
+        }
+
+        // bodies that don't fit the buffer and chunked ones are read as they are passed on
+        bool streamed = http_req_chunked(head) || head_len + body_len > sizeof(conn->in);
+        if (streamed) {
+            body_len = 0;
+        } else if (conn->in_len < head_len + body_len) {
+            conn_await(conn, CONN_READING_BODY);
+            return;
+        }
+
+        size_t req_len = head_len + body_len;
+        TRACE_PROBE(parse__start, conn->sock);
+        trace_begin(&conn->trace);
+        uint64_t parse_start = metrics_now();
+        HttpRequest* req = http_req_parse(sv_slice(input, 0, req_len), &arena);
+        metrics_record_since(METRIC_PARSE, parse_start);
+        // a request that waited on the micro-cache is parsed again, it is still the same one
+        if (!conn->parked) {
+            metrics_count(METRIC_REQUESTS, 1);
+            conn->parked_at = 0;
+        }
+        conn->parked = false;
+        if (!req) {
+            arena_free(&arena);
+            conn_fail(conn, STATUS_BAD_REQUEST);
+            return;
+        }
+        req->body_streamed = streamed;
+        TRACE_PROBE(parse__end, req->headers.path);
+        trace_parsed(&conn->trace, req->headers.path);
+
+        // the request that asks for h2c is answered as the first stream of the session, unless
+        // its body is still to come over HTTP/1.1
+        const char* h2_settings = conn->tls || streamed ? NULL : h2_upgrade_settings(req);
+        if (h2_settings) {
+            conn->h2 = h2_session_new(h2_settings);
+            conn->h2_stream = 1;
+        }
+
+        // NOTE: a streamed body that does not go to an upstream is never read, the connection
+        // is closed after the response instead
+        bool keep_alive = http_req_keep_alive(req);
+        conn->keep_alive = keep_alive && !streamed;
+        trace_enter(&conn->trace);
+        request_handler(conn, req);
+        trace_leave();
+        if (conn->proxy) {
+            conn->keep_alive = keep_alive;
+            const char* expect = streamed ? http_req_header(req, "Expect") : NULL;
+            conn->expect_continue =
+                expect && http_header_has(sv_make(expect, strlen(expect)), "100-continue");
+        }
+
+        // NOTE: a parked request stays in the buffer and is handled again by `conn_unpark`, the
+        // client is not read from in the meantime
+        if (conn->parked) {
+            arena_free(&arena);
+            conn->state = CONN_WRITING;
+            threadpool_timer_cancel(&conn->timer);
+            threadpool_unwatch(conn->sock);
+            return;
+        }
+
+        if (conn->h2) {
+            trace_finish(&conn->trace, conn->status);
+        }
+        // the proxy logs the request once its response is relayed
+        if (!conn->proxy && !(conn->h2 && h2_deferred(conn->h2, conn->h2_stream))) {
+            access_log_request(conn->peer_addr, req->headers.method, req->headers.path,
+                               conn->status, conn->response_bytes, parse_start);
+        }
+        arena_free(&arena);
+        metrics_gauge_set(METRIC_ARENA_MAPPED_BYTES, arena.stats.mapped);
+        metrics_gauge_set(METRIC_ARENA_HIGH_WATER_BYTES, arena.stats.high_water);
+
+        conn->in_len -= req_len;
+        memmove(conn->in, conn->in + req_len, conn->in_len);
+
+        // NOTE: pipelined requests wait in the buffer until the relayed response is done, the
+        // client is not read from in the meantime. What came of a streamed body goes along with
+        // the head
+        if (conn->proxy) {
+            if (streamed) {
+                conn_upload(conn);
+                return;
+            }
+            conn->state = CONN_WRITING;
+            threadpool_timer_cancel(&conn->timer);
+            threadpool_unwatch(conn->sock);
+            return;
+        }
+
+        // the client's preface may have come right behind the request
+        if (conn->h2) {
+            conn_feed_h2(conn, conn->in, conn->in_len);
+            conn->in_len = 0;
+            conn_write(conn);
+            return;
+        }
+
+        if (!conn_write(conn)) {
+            return;
+        }
+    }
+}
+
+/// Handles a request of an HTTP/2 stream, a scaled down `conn_process` for a request that is
+/// already parsed
+static void conn_handle_h2(void* ctx, uint32_t stream, HttpRequest* req) {
+    Connection* conn = ctx;
+    uint64_t start = metrics_now();
+    metrics_count(METRIC_REQUESTS, 1);
+    trace_begin(&conn->trace);
+    TRACE_PROBE(parse__end, req->headers.path);
+    trace_parsed(&conn->trace, req->headers.path);
+
+    conn->h2_stream = stream;
+    trace_enter(&conn->trace);
+    request_handler(conn, req);
+    trace_leave();
+    // NOTE: streams share the connection, so a request is traced until its response is queued
+    trace_finish(&conn->trace, conn->status);
+    // the proxy logs a deferred stream once its response is complete
+    if (!h2_deferred(conn->h2, stream)) {
+        access_log_request(conn->peer_addr, req->headers.method, req->headers.path, conn->status,
+                           conn->response_bytes, start);
+    }
+    arena_free(&arena);
+    metrics_gauge_set(METRIC_ARENA_MAPPED_BYTES, arena.stats.mapped);
+    metrics_gauge_set(METRIC_ARENA_HIGH_WATER_BYTES, arena.stats.high_water);
+}
+
+static void conn_data_h2(void* ctx, uint32_t stream, const char* data, size_t len, bool end) {
+    proxy_stream_data(ctx, stream, data, len, end);
+}
+
+static void conn_read_h2(Connection* conn) {
+    while (true) {
+        size_t cap;
+        char* input = h2_session_input(conn->h2, &cap);
+        ssize_t nread = conn_recv(conn, input, cap);
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+
+            conn_close(conn);
+            return;
+        }
+
+        if (nread == 0) {
+            conn_close(conn);
+            return;
+        }
+
+        capture_data(conn->capture_id, input, nread);
+        bool ok = h2_session_recv(conn->h2, nread, &arena, conn_handle_h2, conn_data_h2, conn);
+        arena_free(&arena);
+        if (!ok) {
+            break;
+        }
+    }
+
+    conn_write(conn);
+}
+
+static void conn_read(Connection* conn) {
+    if (conn->h2) {
+        conn_read_h2(conn);
+        return;
+    }
+
+    while (conn->in_len < sizeof(conn->in)) {
+        ssize_t nread = conn_recv(conn, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+
+            conn_close(conn);
+            return;
+        }
+
+        if (nread == 0) {
+            conn_close(conn);
+            return;
+        }
+
+        capture_data(conn->capture_id, conn->in + conn->in_len, nread);
+        conn->in_len += nread;
+    }
+
+    conn_process(conn);
+}
+
+static void conn_io(IoHandler* io, uint32_t events) {
+    Connection* conn = container_of(io, Connection, io);
+
+    if (events & EPOLLERR) {
+        conn_close(conn);
+        return;
+    }
+
+    if (conn->state == CONN_HANDSHAKE) {
+        conn_handshake(conn);
+        return;
+    }
+
+    if (conn->state == CONN_WRITING && conn->h2) {
+        conn_write(conn);
+        return;
+    }
+
+    if (conn->state == CONN_WRITING) {
+        // a writable bulk transfer waits for its turn in the bulk lane like any other slice
+        if (conn->body && conn_yield(conn)) {
+            return;
+        }
+
+        if (conn_write(conn)) {
+            conn_process(conn);
+        }
+        return;
+    }
+
+    conn_read(conn);
+}
+
+static void conn_timeout(Timer* timer) {
+    Connection* conn = container_of(timer, Connection, timer);
+    assert(!conn->scheduled);
+    conn_close(conn);
+}
+
+/// Sends what the socket takes right away and keeps the rest in `out`, returns false if there is
+/// a rest
+static bool conn_send_now(Connection* conn, const char* data, size_t len) {
+    size_t off = 0;
+    ConnFlushStatus status;
+    bool sent = conn_send(conn, data, len, &off, &status);
+    if (conn->accepted_at && off) {
+        metrics_record(METRIC_FIRST_BYTE, metrics_now() - conn->accepted_at);
+        conn->accepted_at = 0;
+    }
+
+    if (sent) {
+        return true;
+    }
+
+    // NOTE: send errors are not handled here, the next flush runs into them again
+    size_t rest = len - off;
+    conn->out = rest <= HTTPPO_IO_BUF_SIZE ? slab_alloc(&buffer_pool) : malloc(rest);
+    if (!conn->out) {
+        die("could not allocate an output buffer");
+    }
+
+    memcpy(conn->out, data + off, rest);
+    conn->out_len = rest;
+    conn->out_off = 0;
+    return false;
+}
+
+void conn_respond(Connection* conn, HttpResponse const* res) {
+    conn_respond_body(conn, res, &(ConnBody){.fd = -1});
+}
+
+void conn_respond_body(Connection* conn, HttpResponse const* res, ConnBody const* body) {
+    assert(!conn->out && !conn->body && "the previous response has not been sent yet");
+
+    HttpResponse response = *res;
+    response.keep_alive = res->keep_alive && conn->keep_alive;
+    conn->keep_alive = response.keep_alive;
+
+    sb_clear(&scratch);
+    TRACE_POINT(&conn->trace, TRACE_RESPOND, respond, res->status_code);
+    conn->respond_at = metrics_now();
+    conn->status = res->status_code;
+    conn->response_bytes = res->body.size;
+
+    // the session frames the response, a small body is copied as it would not outlive the arena
+    if (conn->h2) {
+        h2_respond(conn->h2, conn->h2_stream, res, res->body.size <= HTTPPO_BULK_THRESHOLD,
+                   body->release, body->owner);
+        return;
+    }
+
+    // large bodies are sent from the bulk lane, so that they can't hold up small responses
+    if (res->body.size > HTTPPO_BULK_THRESHOLD) {
+        http_res_encode_head_sb(&response, &scratch);
+        conn->body = res->body.ptr;
+        conn->body_len = res->body.size;
+        conn->body_off = 0;
+        // NOTE: sendfile only works over TLS when the kernel does the encryption
+        conn->body_file = conn->tls && !tls_ktls_send(conn->tls) ? -1 : body->fd;
+        conn->body_file_off = body->offset;
+        conn->body_release = body->release;
+        conn->body_owner = body->owner;
+    } else {
+        http_res_encode_sb(&response, &scratch);
+        if (body->release) {
+            body->release(body->owner);
+        }
+    }
+
+    conn_send_now(conn, scratch.items, scratch.len);
+}
+
+void conn_respond_stream(Connection* conn, uint32_t stream, HttpResponse const* res,
+                         ConnBody const* body) {
+    conn->h2_stream = stream;
+    conn_respond_body(conn, res, body);
+    conn_send_later(conn);
+}
+
+void conn_send_later(Connection* conn) {
+    // a connection that is sending already or has a job queued gets to the new frames by itself
+    if (conn->scheduled || conn->state == CONN_WRITING) {
+        return;
+    }
+
+    // NOTE: sending right away could close the connection under the caller
+    conn->state = CONN_WRITING;
+    threadpool_timer_arm(&conn->timer, HTTPPO_SEND_TIMEOUT_MS);
+    threadpool_watch(conn->sock, EPOLLOUT, &conn->io);
+}
+
+bool conn_relay(Connection* conn, uint16_t status, const char* data, size_t len) {
+    assert(!conn->out && "the relayed bytes before were not sent yet");
+
+    if (!conn->respond_at) {
+        TRACE_POINT(&conn->trace, TRACE_RESPOND, respond, status);
+        conn->respond_at = metrics_now();
+    }
+
+    if (conn_send_now(conn, data, len)) {
+        return true;
+    }
+
+    conn->state = CONN_WRITING;
+    threadpool_timer_arm(&conn->timer, HTTPPO_SEND_TIMEOUT_MS);
+    threadpool_watch(conn->sock, EPOLLOUT, &conn->io);
+    return false;
+}
+
+void conn_read_body(Connection* conn) {
+    // NOTE: the client is only told to go on once the upstream took the head
+    if (conn->expect_continue) {
+        static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        conn->expect_continue = false;
+        if (!conn_send_now(conn, interim, sizeof(interim) - 1)) {
+            // `proxy_resume` calls back once it is sent
+            conn->state = CONN_WRITING;
+            threadpool_timer_arm(&conn->timer, HTTPPO_SEND_TIMEOUT_MS);
+            threadpool_watch(conn->sock, EPOLLOUT, &conn->io);
+            return;
+        }
+    }
+
+    conn->state = CONN_WRITING;
+    conn_expect(conn, CONN_READING_BODY);
+    threadpool_watch(conn->sock, EPOLLIN, &conn->io);
+
+    // bytes TLS decrypted already never wake the connection up. With the lane full they wait
+    // for the next ones
+    if (conn->tls && tls_pending(conn->tls) &&
+        threadpool_schedule_local(WORKER_LANE_INTERACTIVE, conn_resume, conn)) {
+        threadpool_timer_cancel(&conn->timer);
+        threadpool_unwatch(conn->sock);
+        conn->scheduled = true;
+    }
+}
+
+void conn_relay_end(Connection* conn, uint16_t status, uint64_t bytes, bool keep_alive) {
+    conn->proxy = NULL;
+    conn->status = status;
+    conn->response_bytes = bytes;
+    conn->keep_alive &= keep_alive;
+
+    if (conn_write(conn)) {
+        conn_process(conn);
+    }
+}
+
+void conn_unpark(Connection* conn) {
+    conn_process(conn);
+}
+
+void conn_unpark_stream(Connection* conn, uint32_t stream, HttpRequest* req, uint64_t parked_at) {
+    if (!h2_deferred(conn->h2, stream)) {
+        return;
+    }
+
+    req->arena = &arena;
+    conn->h2_stream = stream;
+    conn->parked_at = parked_at;
+    request_handler(conn, req);
+    conn->parked_at = 0;
+    // NOTE: a stream that waits again or went upstream is logged once it is answered
+    if (h2_responded(conn->h2, stream)) {
+        access_log_request(conn->peer_addr, req->headers.method, req->headers.path, conn->status,
+                           conn->response_bytes, parked_at);
+    }
+    arena_free(&arena);
+    conn_send_later(conn);
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "base.h"
+#include "h2.h"
+#include "protocol.h"
+#include "slab.h"
+#include "thread_pool.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "trace.h"
+
+#define HTTPPO_CONN_BUF_SIZE 8192
+// size of the slab buffers that hold the part of a response the socket did not take right away
+#define HTTPPO_IO_BUF_SIZE (16 * 1024)
+
+struct ProxyConn;
+
+typedef enum {
+    CONN_HANDSHAKE,
+    CONN_READING_HEADERS,
+    CONN_READING_BODY,
+    CONN_WRITING,
+    CONN_IDLE,
+} ConnState;
+
+/// A client connection owned by the worker thread that accepted it
+typedef struct {
+    IoHandler io;
+    /// the timeout of the current state
+    Timer timer;
+    int sock;
+    ConnState state;
+    /// close the connection once the current response is sent
+    bool keep_alive;
+    /// a bulk continuation job is queued for the connection
+    bool scheduled;
+    /// when the connection was accepted, 0 once its first response is under way
+    uint64_t accepted_at;
+    /// when the current response was encoded
+    uint64_t respond_at;
+    /// the status and body size of the last response, for the access log
+    uint16_t status;
+    uint64_t response_bytes;
+    /// the IPv4 address of the client in network byte order, only looked up for the access log
+    uint32_t peer_addr;
+    /// the number of the connection in the capture, 0 if it is not recorded
+    uint32_t capture_id;
+    TraceRequest trace;
+    /// NULL for plain HTTP
+    struct ssl_st* tls;
+    /// set once the connection speaks HTTP/2, which takes over the buffers below
+    H2Session* h2;
+    /// the stream whose request is being handled
+    uint32_t h2_stream;
+    /// the upstream exchange whose response is being relayed, NULL otherwise
+    struct ProxyConn* proxy;
+    /// the upstream exchanges of HTTP/2 streams, linked through their `next`
+    struct ProxyConn* h2_proxies;
+    /// the request waits for a response the micro-cache is being filled with, see `conn_unpark`
+    bool parked;
+    /// when the request was first parked, 0 unless it waited on a fill before
+    uint64_t parked_at;
+    /// the HTTP/2 streams waiting on micro-cache fills, see `conn_unpark_stream`
+    struct MicrocacheWaiter* h2_waiters;
+    /// the client waits for a 100 Continue before it sends the body streamed to the upstream
+    bool expect_continue;
+
+    /// the unsent part of the encoded status line, headers and small body. It comes from the I/O
+    /// buffer slab unless it is bigger than `HTTPPO_IO_BUF_SIZE`
+    char* out;
+    size_t out_len;
+    size_t out_off;
+    /// large bodies are sent straight from the file cache
+    const char* body;
+    size_t body_len;
+    size_t body_off;
+    /// or with sendfile from this descriptor, where the body starts at `body_file_off`. -1 if the
+    /// body is sent from memory
+    int body_file;
+    off_t body_file_off;
+    /// called once the body is sent or the connection is closed, NULL if the body outlives both
+    void (*body_release)(void* owner);
+    void* body_owner;
+
+    size_t in_len;
+    char in[HTTPPO_CONN_BUF_SIZE];
+} Connection;
+
+/// Where the body of a response comes from when it has to outlive the request
+typedef struct {
+    /// the body is sent with sendfile from this descriptor, which holds the same bytes at
+    /// `offset`, when it is large. -1 to always send it from memory
+    int fd;
+    off_t offset;
+    /// called once the body is not needed any more, right away if it was copied out
+    void (*release)(void* owner);
+    void* owner;
+} ConnBody;
+
+/// Handles a parsed request, it has to answer with `conn_respond`
+typedef void (*ConnRequestHandler)(Connection* conn, HttpRequest const* req);
+
+/// the number of open client connections, incremented by the accept loop
+extern atomic_int conn_active_count;
+
+/// Sets the request handler and the flags of the per-thread request arenas
+void conn_init(ConnRequestHandler handler, int arena_flags);
+/// Worker job that takes over an accepted socket
+void* conn_open(void* socket);
+/// Encodes the response and sends as much of it as the socket takes right away
+void conn_respond(Connection* conn, HttpResponse const* res);
+/// Like `conn_respond`, for bodies that are not static. A large body is sent straight from its
+/// source, which is released once it is done with
+void conn_respond_body(Connection* conn, HttpResponse const* res, ConnBody const* body);
+/// Queues the response of a deferred HTTP/2 stream from outside the connection's handlers, it is
+/// sent from the event loop
+void conn_respond_stream(Connection* conn, uint32_t stream, HttpResponse const* res,
+                         ConnBody const* body);
+/// Sends what the HTTP/2 session queued from outside the connection's handlers, from the event
+/// loop
+void conn_send_later(Connection* conn);
+/// Sends bytes of a response that is passed through as it arrives, `status` is the one its head
+/// carries. Returns false if the client did not take all of them, the rest is sent from the event
+/// loop and `proxy_resume` is called after it
+bool conn_relay(Connection* conn, uint16_t status, const char* data, size_t len);
+/// Goes on reading the body of a request that is streamed to the upstream, `proxy_upload` gets
+/// it. Only called while neither is watched
+void conn_read_body(Connection* conn);
+/// Ends the relayed response and goes on with the requests that came in behind it
+void conn_relay_end(Connection* conn, uint16_t status, uint64_t bytes, bool keep_alive);
+/// Handles the request a handler parked by setting `parked` again, along with the ones behind it
+void conn_unpark(Connection* conn);
+/// Handles the request of a deferred HTTP/2 stream again, `parked_at` is when it was first parked.
+/// A stream the client reset meanwhile is left alone
+void conn_unpark_stream(Connection* conn, uint32_t stream, HttpRequest* req, uint64_t parked_at);
+
+SlabStats conn_slab_stats(void);
+SlabStats conn_buffer_slab_stats(void);
@@ -1,106 +1,1172 @@
 #include "files.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "base.h"
 #include "hash.h"
+#include "metrics.h"
+#include "mime.h"
+#include "protocol.h"
+#include "trace.h"
 #include "util.h"
 
-#define HTTPPO_FILES_REVALIDATION_TIME (2500 * 1000)
+// smaller files barely shrink and the variant would not pay for its headers
+#define HTTPPO_COMPRESS_MIN_SIZE 256
+#define HTTPPO_COMPRESS_MAX_SIZE (64 * 1024 * 1024)
+// files loaded while the queue is full are served uncompressed until they are reloaded
+#define HTTPPO_COMPRESS_QUEUE_CAP 64
+
+// the negative cache holds at most this many paths, new misses evict the oldest ones
+#define HTTPPO_MISSING_CAP 1024
+// NOTE: short enough that a file created where inotify can't see it is found quickly anyway
+#define HTTPPO_MISSING_TTL_NSEC (2 * 1000 * 1000 * 1000ull)
+// how often the hot set is written out and how much of it
+#define HTTPPO_SNAPSHOT_INTERVAL_SEC 30
+#define HTTPPO_SNAPSHOT_MAX_FILES 4096
+#define HTTPPO_SNAPSHOT_MAGIC "httppo-snapshot 1\n"
+// directories watched for files appearing, changing or going away
+#define HTTPPO_MAX_WATCHES 256
+#define HTTPPO_WATCH_EVENTS                                                             \
+    (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | \
+     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct HttppoCompressJob {
+    struct HttppoCompressJob* next;
+    /// the job holds a reference, blobs never change so the contents are compressed in place
+    HttppoBlob* blob;
+} HttppoCompressJob;
 
 static size_t get_time_nsec(void) {
     struct timespec t;
-    if (clock_gettime(CLOCK_REALTIME, &t) == -1) {
+    if (clock_gettime(CLOCK_MONOTONIC, &t) == -1) {
         die("clock_gettime");
     }
 
-    return t.tv_nsec;
+    return (size_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/// Takes over the mtime of a freshly read file and derives the headers that depend on it
+static void httppo_file_set_mtime(HttppoFile* file, struct stat const* stat) {
+    file->last_modified = stat->st_mtim;
+    http_date_format(stat->st_mtim.tv_sec, file->last_modified_str);
+}
+
+static bool httppo_file_modified(HttppoFile const* file, struct stat const* stat) {
+    return stat->st_mtim.tv_sec != file->last_modified.tv_sec ||
+           stat->st_mtim.tv_nsec != file->last_modified.tv_nsec;
 }
 
-static HttppoFile* httppo_file_read(const char* name) {
-    base_file file = base_read_whole_file(name);
-    if (!file.contents) {
+/// Opens a file beneath the docroot, neither `..` nor symlinks can lead out of it
+static int httppo_files_open(HttppoFiles const* files, const char* name) {
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+
+    int fd = syscall(SYS_openat2, files->root_fd, name, &how, sizeof(how));
+    if (fd == -1 && errno == ENOSYS) {
+        // NOTE: kernels before 5.6, the name is normalized already so only a symlink could lead
+        // out of the docroot here
+        fd = openat(files->root_fd, name, O_RDONLY | O_CLOEXEC);
+    }
+
+    return fd;
+}
+
+/// Reads `size` bytes from the start of the file, null terminated for good measure
+static char* httppo_read_fd(int fd, size_t size) {
+    char* buf = malloc(size + 1);
+    if (!buf) {
+        return NULL;
+    }
+
+    size_t off = 0;
+    while (off < size) {
+        ssize_t n = pread(fd, buf + off, size - off, off);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            free(buf);
+            return NULL;
+        }
+        off += n;
+    }
+
+    buf[size] = '\0';
+    return buf;
+}
+
+static uint64_t httppo_blob_hash(void const* key) {
+    return ((HttppoBlob const*)key)->hash;
+}
+
+static bool httppo_blob_eq(void const* lhs, void const* rhs) {
+    HttppoBlob const* a = lhs;
+    HttppoBlob const* b = rhs;
+    return a->hash == b->hash && a->size == b->size &&
+           memcmp(a->contents, b->contents, a->size) == 0;
+}
+
+static void httppo_blob_free(HttppoBlob* blob) {
+    for (CompressEncoding encoding = 0; encoding < COMPRESS_ENCODING_COUNT; encoding++) {
+        HttppoFileVariant* variant = atomic_load(&blob->variants[encoding]);
+        if (variant) {
+            free(variant->contents);
+            free(variant);
+        }
+    }
+
+    free(blob->contents);
+    free(blob);
+}
+
+HttppoBlob* httppo_blob_ref(HttppoBlob* blob) {
+    atomic_fetch_add_explicit(&blob->refs, 1, memory_order_relaxed);
+    return blob;
+}
+
+void httppo_files_release(HttppoFiles* files, HttppoBlob* blob) {
+    if (atomic_fetch_sub_explicit(&blob->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    // NOTE: an intern may have found the blob without references and replaced it already
+    pthread_mutex_lock(&files->blobs_mutex);
+    if (ht_find(&files->blobs, blob) == blob) {
+        ht_delete(&files->blobs, blob);
+    }
+    pthread_mutex_unlock(&files->blobs_mutex);
+
+    metrics_count(METRIC_CACHE_EVICTIONS, 1);
+    httppo_blob_free(blob);
+}
+
+HttppoBlob* httppo_blob_intern(HttppoFiles* files, char* contents, size_t size) {
+    HttppoBlob key = {.hash = hash_bytes(contents, size), .contents = contents, .size = size};
+
+    pthread_mutex_lock(&files->blobs_mutex);
+    HttppoBlob* blob = ht_find(&files->blobs, &key);
+    if (blob) {
+        // a blob whose last reference is being dropped can't be revived, it gets replaced instead
+        size_t refs = atomic_load_explicit(&blob->refs, memory_order_relaxed);
+        while (refs && !atomic_compare_exchange_weak_explicit(&blob->refs, &refs, refs + 1,
+                                                              memory_order_acquire,
+                                                              memory_order_relaxed)) {
+        }
+
+        if (refs) {
+            pthread_mutex_unlock(&files->blobs_mutex);
+            free(contents);
+            return blob;
+        }
+        ht_delete(&files->blobs, blob);
+    }
+
+    blob = malloc(sizeof(HttppoBlob));
+    blob->hash = key.hash;
+    atomic_init(&blob->refs, 1);
+    blob->contents = contents;
+    blob->size = size;
+    for (CompressEncoding encoding = 0; encoding < COMPRESS_ENCODING_COUNT; encoding++) {
+        atomic_init(&blob->variants[encoding], NULL);
+    }
+    snprintf(blob->etag, sizeof(blob->etag), "\"%016" PRIx64 "-%zx\"", blob->hash, size);
+
+    ht_add(&files->blobs, blob, blob);
+    pthread_mutex_unlock(&files->blobs_mutex);
+    return blob;
+}
+
+/// Publishes a variant unless the blob has one for the coding already, the first one wins
+static void httppo_blob_set_variant(HttppoBlob* blob, CompressEncoding encoding,
+                                    HttppoFileVariant* variant) {
+    HttppoFileVariant* expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&blob->variants[encoding], &expected, variant,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        free(variant->contents);
+        free(variant);
+    }
+}
+
+/// Loads the precompressed siblings that are at least as new as the file itself
+static void httppo_file_load_siblings(HttppoFiles* files, HttppoFile* file) {
+    if (!file->compressible) {
+        return;
+    }
+
+    size_t name_len = strlen(file->name);
+    for (CompressEncoding encoding = 0; encoding < COMPRESS_ENCODING_COUNT; encoding++) {
+        // contents shared with another path may have the variant already
+        if (atomic_load(&file->blob->variants[encoding])) {
+            continue;
+        }
+
+        const char* suffix = compress_encoding_suffix(encoding);
+        size_t suffix_len = strlen(suffix);
+
+        char* path = malloc(name_len + suffix_len + 1);
+        memcpy(path, file->name, name_len);
+        memcpy(path + name_len, suffix, suffix_len + 1);
+
+        int fd = httppo_files_open(files, path);
+        free(path);
+        if (fd == -1) {
+            continue;
+        }
+
+        struct stat s;
+        char* contents = NULL;
+        if (fstat(fd, &s) == 0 && S_ISREG(s.st_mode) &&
+            s.st_mtim.tv_sec >= file->last_modified.tv_sec) {
+            contents = httppo_read_fd(fd, s.st_size);
+        }
+        close(fd);
+
+        if (contents) {
+            HttppoFileVariant* variant = malloc(sizeof(HttppoFileVariant));
+            variant->contents = contents;
+            variant->size = s.st_size;
+            httppo_blob_set_variant(file->blob, encoding, variant);
+        }
+    }
+}
+
+/// Hands the contents to the compressor thread if they are missing a variant they should have
+static void httppo_files_submit_compression(HttppoFiles* files, HttppoFile const* file) {
+    HttppoBlob* blob = file->blob;
+    if (!file->compressible || blob->size < HTTPPO_COMPRESS_MIN_SIZE ||
+        blob->size > HTTPPO_COMPRESS_MAX_SIZE) {
+        return;
+    }
+
+    bool missing = false;
+    for (CompressEncoding encoding = 0; encoding < COMPRESS_ENCODING_COUNT; encoding++) {
+        if (compress_available(encoding) && !atomic_load(&blob->variants[encoding])) {
+            missing = true;
+        }
+    }
+    if (!missing) {
+        return;
+    }
+
+    pthread_mutex_lock(&files->compress_mutex);
+    while (files->compress_pending >= HTTPPO_COMPRESS_QUEUE_CAP) {
+        if (!files->compress_wait) {
+            pthread_mutex_unlock(&files->compress_mutex);
+            return;
+        }
+        pthread_cond_wait(&files->compress_done, &files->compress_mutex);
+    }
+
+    HttppoCompressJob* job = malloc(sizeof(HttppoCompressJob));
+    job->next = NULL;
+    job->blob = httppo_blob_ref(blob);
+
+    if (files->compress_tail) {
+        files->compress_tail->next = job;
+    } else {
+        files->compress_head = job;
+    }
+    files->compress_tail = job;
+    files->compress_pending++;
+
+    pthread_cond_signal(&files->compress_cond);
+    pthread_mutex_unlock(&files->compress_mutex);
+}
+
+static void httppo_files_run_compression(HttppoCompressJob* job) {
+    HttppoBlob* blob = job->blob;
+    for (CompressEncoding encoding = 0; encoding < COMPRESS_ENCODING_COUNT; encoding++) {
+        // NOTE: several paths with the same contents may have queued the blob
+        if (!compress_available(encoding) || atomic_load(&blob->variants[encoding])) {
+            continue;
+        }
+
+        char* out;
+        size_t out_len;
+        if (!compress_buffer(encoding, blob->contents, blob->size, &out, &out_len)) {
+            continue;
+        }
+
+        HttppoFileVariant* variant = malloc(sizeof(HttppoFileVariant));
+        variant->contents = out;
+        variant->size = out_len;
+        httppo_blob_set_variant(blob, encoding, variant);
+    }
+}
+
+static void* httppo_files_compressor(void* arg) {
+    HttppoFiles* files = arg;
+
+    while (true) {
+        pthread_mutex_lock(&files->compress_mutex);
+        while (!files->compress_head) {
+            pthread_cond_wait(&files->compress_cond, &files->compress_mutex);
+        }
+
+        HttppoCompressJob* job = files->compress_head;
+        files->compress_head = job->next;
+        if (!files->compress_head) {
+            files->compress_tail = NULL;
+        }
+        pthread_mutex_unlock(&files->compress_mutex);
+
+        httppo_files_run_compression(job);
+        httppo_files_release(files, job->blob);
+
+        pthread_mutex_lock(&files->compress_mutex);
+        files->compress_pending--;
+        pthread_cond_broadcast(&files->compress_done);
+        pthread_mutex_unlock(&files->compress_mutex);
+
+        free(job);
+    }
+
+    return NULL;
+}
+
+void httppo_files_start_compressor(HttppoFiles* files) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, httppo_files_compressor, files) != 0) {
+        die("could not start the compressor thread");
+    }
+    pthread_detach(thread);
+}
+
+/// Opens and reads a file, NULL if it is missing or not a regular file. It does not need the
+/// cache lock
+static HttppoFile* httppo_file_read(HttppoFiles* files, const char* name) {
+    int fd = httppo_files_open(files, name);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    // NOTE: directories open just fine, but they have no size to read
+    struct stat s;
+    char* contents = NULL;
+    if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || !(contents = httppo_read_fd(fd, s.st_size))) {
+        close(fd);
         return NULL;
     }
 
     HttppoFile* hfile = malloc(sizeof(HttppoFile));
     hfile->last_read = get_time_nsec();
-    hfile->name = name;
-    hfile->contents = file.contents;
-    hfile->size = file.stat.st_size;
-    hfile->last_modified = file.stat.st_mtim.tv_nsec;
+    // NOTE: the name comes from the request's arena, the cache entry outlives it
+    hfile->name = sv_dup(sv_make(name, strlen(name)));
+    hfile->fd = fd;
+    hfile->stale = false;
+    hfile->hits = 0;
+    hfile->blob = httppo_blob_intern(files, contents, s.st_size);
+
+    MimeType mime = mime_lookup(name);
+    hfile->content_type = mime.type;
+    hfile->compressible = mime.compressible;
+
+    httppo_file_set_mtime(hfile, &s);
+    httppo_file_load_siblings(files, hfile);
+    httppo_files_submit_compression(files, hfile);
+    hfile->watched = false;
 
     return hfile;
 }
 
-static int httppo_file_update(HttppoFile* file, struct stat const* stat) {
-    memset(file->contents, 0, file->size);
-    file->contents = realloc(file->contents, stat->st_size);
-    file->size = stat->st_size;
-
-    if (base_read_whole_file_buf(file->name, file->contents, file->size) != 0) {
+/// Rereads the contents from the open file
+static int httppo_file_update(HttppoFiles* files, HttppoFile* file, struct stat const* stat) {
+    char* contents = httppo_read_fd(file->fd, stat->st_size);
+    if (!contents) {
         return 1;
     }
 
-    file->last_modified = stat->st_mtim.tv_nsec;
+    // NOTE: responses still being sent hold references of their own to the old contents
+    HttppoBlob* old = file->blob;
+    file->blob = httppo_blob_intern(files, contents, stat->st_size);
+    httppo_files_release(files, old);
+
+    httppo_file_set_mtime(file, stat);
     file->last_read = get_time_nsec();
+    httppo_file_load_siblings(files, file);
+    httppo_files_submit_compression(files, file);
+    return 0;
+}
+
+/// Makes sure the cached file matches the one on disk. Without a watch on its directory that
+/// takes a stat of the name, otherwise only files the watcher marked stale are looked at again
+static int httppo_file_refresh(HttppoFiles* files, HttppoFile* file) {
+    if (file->watched && !file->stale) {
+        return 0;
+    }
+
+    struct stat s;
+    if (fstatat(files->root_fd, file->name, &s, 0) != 0 || !S_ISREG(s.st_mode)) {
+        return 1;
+    }
+
+    struct stat open_stat;
+    if (fstat(file->fd, &open_stat) != 0 || open_stat.st_ino != s.st_ino ||
+        open_stat.st_dev != s.st_dev) {
+        // the file was replaced, read the new one
+        int fd = httppo_files_open(files, file->name);
+        if (fd == -1) {
+            return 1;
+        }
+        close(file->fd);
+        file->fd = fd;
+        if (fstat(fd, &s) != 0) {
+            return 1;
+        }
+        file->last_modified = (struct timespec){0};
+    }
+
+    file->stale = false;
+    if (httppo_file_modified(file, &s)) {
+        return httppo_file_update(files, file, &s);
+    }
+
     return 0;
 }
 
-HttppoFile* httppo_files_get(HttppoFiles* files, const char* name) {
+/// Frees a negative entry, the caller removes it from the table
+static void httppo_missing_clear(HttppoMissingFile* missing) {
+    free(missing->name);
+    missing->name = NULL;
+}
+
+static void httppo_missing_remove(HttppoFiles* files, const char* name) {
+    HttppoMissingFile* missing = ht_delete(&files->missing, name);
+    if (missing) {
+        httppo_missing_clear(missing);
+    }
+}
+
+/// Copies the directory of a name relative to the docroot into `dir`, returns false if it does
+/// not fit
+static bool httppo_files_dir(const char* name, char dir[PATH_MAX]) {
+    const char* slash = strrchr(name, '/');
+    size_t dir_len = slash ? (size_t)(slash - name) : 0;
+    if (dir_len >= PATH_MAX) {
+        return false;
+    }
+    memcpy(dir, name, dir_len);
+    dir[dir_len] = '\0';
+    return true;
+}
+
+/// Whether the directory of a name is watched already, the cache lock is held
+static bool httppo_files_watched(HttppoFiles* files, const char* name) {
+    char dir[PATH_MAX];
+    return files->inotify_fd != -1 && httppo_files_dir(name, dir) &&
+           ht_find(&files->watched_names, dir) != NULL;
+}
+
+/// Watches the directory of a name relative to the docroot and marks its cached file as watched.
+/// It takes the cache lock itself, the caller must not hold it
+// NOTE: adding a watch is a syscall that walks the path, which the other workers should not
+// wait for. Racing callers get the same watch descriptor back
+static void httppo_files_watch(HttppoFiles* files, const char* name) {
+    char dir[PATH_MAX];
+    if (files->inotify_fd == -1 || !httppo_files_dir(name, dir)) {
+        return;
+    }
+
+    string_builder path = sb_new(strlen(files->root) + strlen(dir) + 2);
+    sb_push_cstr(&path, files->root);
+    if (*dir) {
+        sb_push(&path, '/');
+        sb_push_cstr(&path, dir);
+    }
+    int wd = inotify_add_watch(files->inotify_fd, sb_to_cstr(&path), HTTPPO_WATCH_EVENTS);
+    sb_destroy(&path);
+
+    // NOTE: a directory that does not exist yet can't be watched, its negative entries live out
+    // their TTL
+    if (wd < 0) {
+        return;
+    }
+    if ((size_t)wd >= files->watched_cap) {
+        inotify_rm_watch(files->inotify_fd, wd);
+        return;
+    }
+
     pthread_mutex_lock(&files->mutex);
+    if (!files->watched_dirs[wd]) {
+        files->watched_dirs[wd] = (char*)sv_dup(sv_make(dir, strlen(dir)));
+    }
+    ht_delete(&files->watched_names, dir);
+    ht_add(&files->watched_names, files->watched_dirs[wd], files->watched_dirs[wd]);
+    // NOTE: the file was read before the watch was there, a change in between would never be
+    // reported. The next lookup checks it once more
     HttppoFile* file = ht_find(&files->table, name);
+    if (file) {
+        file->watched = true;
+        file->stale = true;
+    }
+    pthread_mutex_unlock(&files->mutex);
+}
+
+/// Forgets that the directory of a watch is watched under its name, the watch itself stays
+static void httppo_files_forget_dir(HttppoFiles* files, int wd) {
+    char* dir = files->watched_dirs[wd];
+    if (dir && ht_find(&files->watched_names, dir) == dir) {
+        ht_delete(&files->watched_names, dir);
+    }
+}
+
+/// Whether the name is in the negative cache, expired entries are dropped on the way
+static bool httppo_missing_find(HttppoFiles* files, const char* name, size_t now) {
+    HttppoMissingFile* missing = ht_find(&files->missing, name);
+    if (!missing) {
+        return false;
+    }
+
+    if (now >= missing->expires_at) {
+        httppo_missing_remove(files, name);
+        return false;
+    }
+
+    return true;
+}
+
+static void httppo_missing_add(HttppoFiles* files, const char* name, size_t now) {
+    if (files->missing_len == HTTPPO_MISSING_CAP) {
+        HttppoMissingFile* oldest = &files->missing_ring[files->missing_head];
+        if (oldest->name) {
+            httppo_missing_remove(files, oldest->name);
+        }
+        files->missing_head = (files->missing_head + 1) % HTTPPO_MISSING_CAP;
+        files->missing_len--;
+    }
+
+    size_t slot = (files->missing_head + files->missing_len) % HTTPPO_MISSING_CAP;
+    files->missing_len++;
+
+    HttppoMissingFile* missing = &files->missing_ring[slot];
+    missing->name = (char*)sv_dup(sv_make(name, strlen(name)));
+    missing->expires_at = now + HTTPPO_MISSING_TTL_NSEC;
+    ht_add(&files->missing, missing->name, missing);
+}
+
+/// Marks every cached file stale, for when the watcher lost track of events
+static void httppo_files_mark_all_stale(HttppoFiles* files) {
+    HT_ITER(files->table, {
+        HttppoFile* file = (HttppoFile*)kv.value;
+        file->stale = true;
+    });
+}
+
+static void* httppo_files_watcher(void* arg) {
+    HttppoFiles* files = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(files->inotify_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&files->mutex);
+        for (char* ptr = buf; ptr < buf + len;) {
+            struct inotify_event const* event = (struct inotify_event const*)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                httppo_files_mark_all_stale(files);
+                continue;
+            }
+
+            if (event->wd < 0 || (size_t)event->wd >= files->watched_cap) {
+                continue;
+            }
+
+            // NOTE: a directory is only reported deleted once nothing holds it any more, which
+            // an open file in it does. Emptying it is what gives its removal away, so the next
+            // lookup in it makes sure the name still leads to the watched directory
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF)) {
+                httppo_files_forget_dir(files, event->wd);
+            }
+            // the files cached from a directory that moved are not where they were looked up
+            if (event->mask & IN_MOVE_SELF && files->watched_dirs[event->wd]) {
+                httppo_files_forget_dir(files, event->wd);
+                inotify_rm_watch(files->inotify_fd, event->wd);
+                httppo_files_mark_all_stale(files);
+            }
+            if (event->mask & IN_IGNORED) {
+                httppo_files_forget_dir(files, event->wd);
+                free(files->watched_dirs[event->wd]);
+                files->watched_dirs[event->wd] = NULL;
+            }
+
+            if (!event->len) {
+                continue;
+            }
+
+            const char* dir = files->watched_dirs[event->wd];
+            if (!dir) {
+                continue;
+            }
+
+            string_builder path = sb_new(strlen(dir) + event->len + 2);
+            if (*dir) {
+                sb_push_cstr(&path, dir);
+                sb_push(&path, '/');
+            }
+            sb_push_cstr(&path, event->name);
+            const char* name = sb_to_cstr(&path);
+
+            httppo_missing_remove(files, name);
+            HttppoFile* file = ht_find(&files->table, name);
+            if (file) {
+                file->stale = true;
+            }
+            sb_destroy(&path);
+        }
+        pthread_mutex_unlock(&files->mutex);
+    }
+
+    return NULL;
+}
+
+void httppo_files_start_watcher(HttppoFiles* files) {
+    files->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (files->inotify_fd == -1) {
+        fprintf(stderr,
+                "WARNING: inotify is not available, cached files are checked on every request\n");
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, httppo_files_watcher, files) != 0) {
+        die("could not start the file watcher thread");
+    }
+    pthread_detach(thread);
+}
+
+bool httppo_files_get(HttppoFiles* files, const char* name, HttppoFileRef* ref) {
+    TRACE_MARK(TRACE_FILES_LOCK, files__lock, name);
+    pthread_mutex_lock(&files->mutex);
+    TRACE_MARK(TRACE_FILES_LOCKED, files__locked, name);
+    HttppoFile* file = ht_find(&files->table, name);
+    bool watch = false;
 
     if (!file) {
-        file = httppo_file_read(name);
+        size_t now = get_time_nsec();
+        if (httppo_missing_find(files, name, now)) {
+            metrics_count(METRIC_CACHE_NEGATIVE_HITS, 1);
+            goto end;
+        }
+
+        metrics_count(METRIC_CACHE_MISSES, 1);
+        TRACE_MARK(TRACE_DISK_READ_START, disk__read__start, name);
+        file = httppo_file_read(files, name);
+        TRACE_MARK(TRACE_DISK_READ_END, disk__read__end, name);
+        watch = !httppo_files_watched(files, name);
         if (!file) {
+            httppo_missing_add(files, name, now);
             goto end;
         }
+
+        // the entry has to stay around for its compressed variants to be of any use
+        file->watched = !watch;
+        ht_add(&files->table, (void*)file->name, file);
+    } else {
+        metrics_count(METRIC_CACHE_HITS, 1);
     }
 
-    struct stat s;
-    if (stat(file->name, &s) != 0) {
+    // NOTE: the entry stays in the table when its file went away, a response may still be sent
+    // from it
+    if (httppo_file_refresh(files, file) != 0) {
+        file = NULL;
         goto end;
     }
 
-    if ((size_t)s.st_mtim.tv_nsec != file->last_modified) {
-        if (httppo_file_update(file, &s) != 0) {
-            goto end;
-        }
-    }
+    file->hits++;
+    ref->blob = httppo_blob_ref(file->blob);
+    ref->content_type = file->content_type;
+    ref->compressible = file->compressible;
+    memcpy(ref->last_modified, file->last_modified_str, sizeof(ref->last_modified));
 
 end:
     pthread_mutex_unlock(&files->mutex);
-    return file;
+    if (watch) {
+        httppo_files_watch(files, name);
+    }
+    return file != NULL;
 }
 
-HttppoFiles httppo_files_new(size_t cap) {
+HttppoFiles httppo_files_new(size_t cap, const char* root) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        die("could not open the document root");
+    }
+
     HttppoFiles files = {
         .table = ht_make(hash_djb2, hash_str_eq, cap),
+        .root = root,
+        .root_fd = root_fd,
+        .missing = ht_make(hash_djb2, hash_str_eq, HTTPPO_MISSING_CAP),
+        .missing_ring = calloc(HTTPPO_MISSING_CAP, sizeof(HttppoMissingFile)),
+        .inotify_fd = -1,
+        .watched_dirs = calloc(HTTPPO_MAX_WATCHES, sizeof(char*)),
+        .watched_cap = HTTPPO_MAX_WATCHES,
+        .watched_names = ht_make(hash_djb2, hash_str_eq, HTTPPO_MAX_WATCHES),
+        .blobs = ht_make(httppo_blob_hash, httppo_blob_eq, cap),
     };
     pthread_mutex_init(&files.mutex, NULL);
+    pthread_mutex_init(&files.blobs_mutex, NULL);
+    pthread_mutex_init(&files.compress_mutex, NULL);
+    pthread_cond_init(&files.compress_cond, NULL);
+    pthread_cond_init(&files.compress_done, NULL);
     return files;
 }
 
-static void httppo_file_delete(HttppoFile* file) {
-    free(file->contents);
+HttppoFileVariant const* httppo_blob_pick_variant(HttppoBlob* blob, const char* accept_encoding,
+                                                  CompressEncoding* encoding) {
+    if (!accept_encoding) {
+        return NULL;
+    }
+
+    for (CompressEncoding e = 0; e < COMPRESS_ENCODING_COUNT; e++) {
+        HttppoFileVariant* variant = atomic_load_explicit(&blob->variants[e], memory_order_acquire);
+        if (variant && http_accepts_encoding(accept_encoding, compress_encoding_name(e))) {
+            *encoding = e;
+            return variant;
+        }
+    }
+
+    return NULL;
 }
 
-void httppo_files_revalidate(HttppoFiles* files) {
+HttppoFilesStats httppo_files_stats(HttppoFiles* files) {
+    HttppoFilesStats stats = {0};
+
     pthread_mutex_lock(&files->mutex);
+    stats.files = files->table.len;
+    stats.missing = files->missing.len;
+    pthread_mutex_unlock(&files->mutex);
 
-    size_t now = get_time_nsec();
+    pthread_mutex_lock(&files->blobs_mutex);
+    stats.blobs = files->blobs.len;
+    pthread_mutex_unlock(&files->blobs_mutex);
 
-    HT_ITER(files->table, {
-        HttppoFile* file = (HttppoFile*)kv.value;
-        if (now - file->last_read > HTTPPO_FILES_REVALIDATION_TIME) {
-            ht_delete(&files->table, file->name);
-            httppo_file_delete(file);
+    pthread_mutex_lock(&files->compress_mutex);
+    stats.compress_pending = files->compress_pending;
+    pthread_mutex_unlock(&files->compress_mutex);
+
+    return stats;
+}
+
+typedef struct {
+    HttppoFiles* files;
+    ThreadPool* pool;
+    size_t max_size;
+
+    atomic_size_t files_loaded;
+    atomic_size_t bytes;
+    atomic_size_t directories;
+
+    /// directory jobs that have not finished yet
+    size_t pending;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} HttppoPreload;
+
+typedef struct {
+    HttppoPreload* preload;
+    /// relative to the docroot, empty for the docroot itself
+    char* dir;
+} HttppoPreloadJob;
+
+static void* httppo_preload_dir(void* arg);
+
+static void httppo_preload_schedule(HttppoPreload* preload, char* dir) {
+    HttppoPreloadJob* job = malloc(sizeof(HttppoPreloadJob));
+    job->preload = preload;
+    job->dir = dir;
+
+    pthread_mutex_lock(&preload->mutex);
+    preload->pending++;
+    pthread_mutex_unlock(&preload->mutex);
+
+    // NOTE: the queues are bounded, a full one gets the directory scanned right away instead
+    if (!threadpool_schedule_bulk(preload->pool, httppo_preload_dir, job)) {
+        httppo_preload_dir(job);
+    }
+}
+
+/// Whether the name is a precompressed sibling of another file, those are loaded along with it
+static bool httppo_preload_is_sibling(HttppoFiles const* files, const char* name) {
+    size_t name_len = strlen(name);
+    for (CompressEncoding encoding = 0; encoding < COMPRESS_ENCODING_COUNT; encoding++) {
+        const char* suffix = compress_encoding_suffix(encoding);
+        size_t suffix_len = strlen(suffix);
+        if (name_len <= suffix_len || strcmp(name + name_len - suffix_len, suffix) != 0) {
+            continue;
+        }
+
+        char* base = (char*)sv_dup(sv_make(name, name_len - suffix_len));
+        struct stat s;
+        bool exists = fstatat(files->root_fd, base, &s, 0) == 0 && S_ISREG(s.st_mode);
+        free(base);
+        if (exists) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void httppo_preload_file(HttppoPreload* preload, const char* name) {
+    HttppoFiles* files = preload->files;
+    if (httppo_preload_is_sibling(files, name)) {
+        return;
+    }
+
+    // NOTE: the file is read without holding the cache lock, that is what makes the warmup
+    // parallel. Every name is visited by exactly one job, so nobody else loads it meanwhile
+    HttppoFile* file = httppo_file_read(files, name);
+    if (!file) {
+        return;
+    }
+
+    pthread_mutex_lock(&files->mutex);
+    file->watched = httppo_files_watched(files, file->name);
+    bool watch = !file->watched;
+    ht_add(&files->table, (void*)file->name, file);
+    pthread_mutex_unlock(&files->mutex);
+    if (watch) {
+        httppo_files_watch(files, name);
+    }
+
+    atomic_fetch_add(&preload->files_loaded, 1);
+    atomic_fetch_add(&preload->bytes, file->blob->size);
+}
+
+static void* httppo_preload_dir(void* arg) {
+    HttppoPreloadJob* job = arg;
+    HttppoPreload* preload = job->preload;
+    HttppoFiles* files = preload->files;
+
+    int fd = openat(files->root_fd, *job->dir ? job->dir : ".",
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir && fd != -1) {
+        close(fd);
+    }
+
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        // NOTE: symlinks are skipped, they are resolved beneath the docroot on their first request
+        struct stat s;
+        if (fstatat(dirfd(dir), entry->d_name, &s, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+
+        string_builder name = sb_new(strlen(job->dir) + strlen(entry->d_name) + 2);
+        if (*job->dir) {
+            sb_push_cstr(&name, job->dir);
+            sb_push(&name, '/');
+        }
+        sb_push_cstr(&name, entry->d_name);
+        sb_to_cstr(&name);
+
+        if (S_ISDIR(s.st_mode)) {
+            httppo_preload_schedule(preload, name.items);
+            continue;
+        }
+
+        if (S_ISREG(s.st_mode) && (size_t)s.st_size <= preload->max_size) {
+            httppo_preload_file(preload, name.items);
+        }
+        sb_destroy(&name);
+    }
+
+    if (dir) {
+        closedir(dir);
+        atomic_fetch_add(&preload->directories, 1);
+    }
+    free(job->dir);
+    free(job);
+
+    pthread_mutex_lock(&preload->mutex);
+    if (--preload->pending == 0) {
+        pthread_cond_signal(&preload->done);
+    }
+    pthread_mutex_unlock(&preload->mutex);
+
+    return NULL;
+}
+
+HttppoPreloadStats httppo_files_preload(HttppoFiles* files, ThreadPool* pool, size_t max_size) {
+    HttppoPreload preload = {
+        .files = files,
+        .pool = pool,
+        .max_size = max_size,
+    };
+    pthread_mutex_init(&preload.mutex, NULL);
+    pthread_cond_init(&preload.done, NULL);
+
+    pthread_mutex_lock(&files->compress_mutex);
+    files->compress_wait = true;
+    pthread_mutex_unlock(&files->compress_mutex);
+
+    httppo_preload_schedule(&preload, (char*)sv_dup(sv_make("", 0)));
+
+    pthread_mutex_lock(&preload.mutex);
+    while (preload.pending != 0) {
+        pthread_cond_wait(&preload.done, &preload.mutex);
+    }
+    pthread_mutex_unlock(&preload.mutex);
+
+    // the variants are part of the warmup as well
+    pthread_mutex_lock(&files->compress_mutex);
+    while (files->compress_pending != 0) {
+        pthread_cond_wait(&files->compress_done, &files->compress_mutex);
+    }
+    files->compress_wait = false;
+    pthread_mutex_unlock(&files->compress_mutex);
+
+    HttppoPreloadStats stats = {
+        .files = atomic_load(&preload.files_loaded),
+        .bytes = atomic_load(&preload.bytes),
+        .directories = atomic_load(&preload.directories),
+    };
+
+    // identical files share their blob, so the memory actually used is the sum over the blobs
+    pthread_mutex_lock(&files->blobs_mutex);
+    HT_ITER(files->blobs, {
+        HttppoBlob* blob = (HttppoBlob*)kv.value;
+        stats.unique_bytes += blob->size;
+        for (CompressEncoding encoding = 0; encoding < COMPRESS_ENCODING_COUNT; encoding++) {
+            HttppoFileVariant* variant = atomic_load(&blob->variants[encoding]);
+            stats.variant_bytes += variant ? variant->size : 0;
         }
     });
+    pthread_mutex_unlock(&files->blobs_mutex);
+
+    pthread_mutex_destroy(&preload.mutex);
+    pthread_cond_destroy(&preload.done);
+    return stats;
+}
+
+/// An entry of the hot set
+typedef struct {
+    char* name;
+    size_t hits;
+    size_t size;
+    struct timespec mtime;
+} HttppoSnapshotEntry;
+
+typedef struct {
+    HttppoSnapshotEntry* items;
+    size_t len;
+    size_t cap;
+} HttppoSnapshot;
+
+typedef struct {
+    HttppoFiles* files;
+    const char* path;
+} HttppoSnapshotter;
+
+static int httppo_snapshot_compare(const void* a, const void* b) {
+    size_t hits_a = ((HttppoSnapshotEntry const*)a)->hits;
+    size_t hits_b = ((HttppoSnapshotEntry const*)b)->hits;
+    return hits_a < hits_b ? 1 : hits_a > hits_b ? -1 : 0;
+}
+
+static void httppo_snapshot_free(HttppoSnapshot* snapshot) {
+    for (size_t i = 0; i < snapshot->len; i++) {
+        free(snapshot->items[i].name);
+    }
+    DA_FREE(snapshot);
+}
+
+/// Reads a snapshot, the entries come out most requested first
+static bool httppo_snapshot_read(const char* path, HttppoSnapshot* snapshot) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+
+    DA_INIT(snapshot, 0, 64);
+
+    char line[PATH_MAX + 128];
+    bool valid = fgets(line, sizeof(line), f) && strcmp(line, HTTPPO_SNAPSHOT_MAGIC) == 0;
+    while (valid && fgets(line, sizeof(line), f)) {
+        HttppoSnapshotEntry entry;
+        long sec, nsec;
+        int name_off;
+        if (sscanf(line, "%zu %zu %ld.%ld %n", &entry.hits, &entry.size, &sec, &nsec,
+                   &name_off) != 4) {
+            continue;
+        }
+
+        size_t name_len = strcspn(line + name_off, "\n");
+        if (name_len == 0) {
+            continue;
+        }
+
+        entry.name = (char*)sv_dup(sv_make(line + name_off, name_len));
+        entry.mtime = (struct timespec){.tv_sec = sec, .tv_nsec = nsec};
+        DA_ADD(snapshot, entry);
+    }
+
+    fclose(f);
+    if (!valid) {
+        httppo_snapshot_free(snapshot);
+        errno = EINVAL;
+        return false;
+    }
+
+    qsort(snapshot->items, snapshot->len, sizeof(HttppoSnapshotEntry), httppo_snapshot_compare);
+    return true;
+}
 
+static void httppo_snapshot_add(HttppoSnapshot* snapshot, HttppoFile const* file) {
+    // names are written one per line
+    if (!file->hits || strchr(file->name, '\n')) {
+        return;
+    }
+
+    HttppoSnapshotEntry entry = {
+        .name = (char*)sv_dup(sv_make(file->name, strlen(file->name))),
+        .hits = file->hits,
+        .size = file->blob->size,
+        .mtime = file->last_modified,
+    };
+    DA_ADD(snapshot, entry);
+}
+
+/// Writes the most requested files next to the snapshot and renames it over the old one, so that
+/// a crash never leaves a torn snapshot behind
+static void httppo_snapshot_write(HttppoFiles* files, const char* path) {
+    HttppoSnapshot snapshot;
+    DA_INIT(&snapshot, 0, 64);
+
+    // NOTE: only the counters are copied under the lock, sorting and writing happen after it
+    pthread_mutex_lock(&files->mutex);
+    HT_ITER(files->table, { httppo_snapshot_add(&snapshot, (HttppoFile*)kv.value); });
     pthread_mutex_unlock(&files->mutex);
+
+    qsort(snapshot.items, snapshot.len, sizeof(HttppoSnapshotEntry), httppo_snapshot_compare);
+
+    string_builder tmp_path = sb_new(strlen(path) + 5);
+    sb_push_cstr(&tmp_path, path);
+    sb_push_cstr(&tmp_path, ".tmp");
+
+    FILE* f = fopen(sb_to_cstr(&tmp_path), "w");
+    if (f) {
+        fputs(HTTPPO_SNAPSHOT_MAGIC, f);
+        for (size_t i = 0; i < snapshot.len && i < HTTPPO_SNAPSHOT_MAX_FILES; i++) {
+            HttppoSnapshotEntry const* entry = &snapshot.items[i];
+            fprintf(f, "%zu %zu %ld.%09ld %s\n", entry->hits, entry->size,
+                    (long)entry->mtime.tv_sec, (long)entry->mtime.tv_nsec, entry->name);
+        }
+
+        if (fclose(f) != 0 || rename(tmp_path.items, path) != 0) {
+            fprintf(stderr, "WARNING: could not write the cache snapshot %s: %s\n", path,
+                    strerror(errno));
+        }
+    } else {
+        fprintf(stderr, "WARNING: could not write the cache snapshot %s: %s\n", path,
+                strerror(errno));
+    }
+
+    sb_destroy(&tmp_path);
+    httppo_snapshot_free(&snapshot);
+}
+
+/// Loads the recorded hot set one file at a time, most requested first. It runs while the server
+/// is already listening, requests for files it has not reached yet are simply cold reads
+static void httppo_snapshot_prefetch(HttppoFiles* files, const char* path) {
+    HttppoSnapshot snapshot;
+    if (!httppo_snapshot_read(path, &snapshot)) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "WARNING: ignoring the cache snapshot %s\n", path);
+        }
+        return;
+    }
+
+    uint64_t start = get_time_nsec();
+    size_t loaded = 0;
+    size_t changed = 0;
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < snapshot.len; i++) {
+        HttppoSnapshotEntry const* entry = &snapshot.items[i];
+        // a file rewritten since the snapshot is not known to be hot any more
+        struct stat s;
+        if (fstatat(files->root_fd, entry->name, &s, 0) != 0 || !S_ISREG(s.st_mode) ||
+            (size_t)s.st_size != entry->size || s.st_mtim.tv_sec != entry->mtime.tv_sec ||
+            s.st_mtim.tv_nsec != entry->mtime.tv_nsec) {
+            changed++;
+            continue;
+        }
+
+        HttppoFileRef ref;
+        if (!httppo_files_get(files, entry->name, &ref)) {
+            continue;
+        }
+        bytes += ref.blob->size;
+        httppo_files_release(files, ref.blob);
+
+        // NOTE: half of the old count is carried over, so that the next snapshot still knows
+        // what was hot before the restart while stale popularity fades out over a few restarts.
+        // The prefetch itself is not a request
+        pthread_mutex_lock(&files->mutex);
+        HttppoFile* file = ht_find(&files->table, entry->name);
+        if (file) {
+            file->hits = file->hits - 1 + entry->hits / 2;
+        }
+        pthread_mutex_unlock(&files->mutex);
+
+        loaded++;
+    }
+
+    printf("prefetched %zu of %zu files from the cache snapshot in %.1f ms: %.2f MiB, %zu "
+           "changed\n",
+           loaded, snapshot.len, (get_time_nsec() - start) / 1e6, bytes / (1024.0 * 1024.0),
+           changed);
+    fflush(stdout);
+    httppo_snapshot_free(&snapshot);
+}
+
+static void* httppo_files_snapshotter(void* arg) {
+    HttppoSnapshotter* snapshotter = arg;
+
+    httppo_snapshot_prefetch(snapshotter->files, snapshotter->path);
+    while (true) {
+        sleep(HTTPPO_SNAPSHOT_INTERVAL_SEC);
+        httppo_snapshot_write(snapshotter->files, snapshotter->path);
+    }
+
+    return NULL;
+}
+
+void httppo_files_start_snapshots(HttppoFiles* files, const char* path) {
+    HttppoSnapshotter* snapshotter = malloc(sizeof(HttppoSnapshotter));
+    snapshotter->files = files;
+    snapshotter->path = path;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, httppo_files_snapshotter, snapshotter) != 0) {
+        die("could not start the cache snapshot thread");
+    }
+    pthread_detach(thread);
 }
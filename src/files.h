@@ -1,24 +1,171 @@
 #pragma once
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <time.h>
 #include "base.h"
+#include "compress.h"
+#include "http_date.h"
+#include "thread_pool.h"
 
+// "\"<hash>-<size>\"" in hex, with room for a coding suffix
+#define HTTPPO_ETAG_CAP 64
+
+/// A compressed copy of a file's contents
 typedef struct {
-    const char* name;
     char* contents;
     size_t size;
+} HttppoFileVariant;
 
-    size_t last_modified;
+/// Contents shared by every cached path with the same bytes. It is immutable apart from its
+/// variants, which are only ever filled in once, and is freed with its last reference
+typedef struct {
+    /// `hash_bytes` of the contents
+    uint64_t hash;
+    atomic_size_t refs;
+    char* contents;
+    size_t size;
+    /// picked up from precompressed siblings or filled in by the compressor thread later
+    _Atomic(HttppoFileVariant*) variants[COMPRESS_ENCODING_COUNT];
+    /// the entity tag of the uncompressed contents, derived from the hash, quotes included
+    char etag[HTTPPO_ETAG_CAP];
+} HttppoBlob;
+
+typedef struct {
+    /// normalized and relative to the docroot
+    const char* name;
+    /// kept open, so that checking the file again needs no path walk
+    int fd;
+    /// the watcher saw the file change or go away
+    bool stale;
+    /// the directory of the file is watched, otherwise its name is checked on every request
+    bool watched;
+    /// the current contents, swapped for a new blob on every reload. The file holds a reference
+    HttppoBlob* blob;
+    /// resolved from the extension when the file is first read
+    const char* content_type;
+    bool compressible;
+
+    /// the mtime of the file when it was read
+    struct timespec last_modified;
+    /// `last_modified` formatted for the Last-Modified header
+    char last_modified_str[HTTP_DATE_LEN + 1];
     size_t last_read;
+    /// requests served from the entry, only touched under the cache lock
+    size_t hits;
 } HttppoFile;
 
+/// What a response needs of a cached file, copied out under the cache lock so that a reload can't
+/// change it while the response is built
+typedef struct {
+    /// a reference of the caller's own, handed back with `httppo_files_release`
+    HttppoBlob* blob;
+    const char* content_type;
+    bool compressible;
+    char last_modified[HTTP_DATE_LEN + 1];
+} HttppoFileRef;
+
+struct HttppoCompressJob;
+
+/// A path that was recently found missing
+typedef struct {
+    /// NULL once the entry expired or the file appeared
+    char* name;
+    uint64_t expires_at;
+} HttppoMissingFile;
+
 /// A type representing a concurrent in-memory file cache
 typedef struct {
+    /// maps normalized names to their files
     hash_table table;
     pthread_mutex_t mutex;
+
+    const char* root;
+    /// every file is opened relative to this descriptor, never outside of it
+    int root_fd;
+
+    /// the negative cache, maps the names of missing files to their slot in `missing_ring`
+    hash_table missing;
+    /// slots in the order they were filled, the oldest one is evicted when the ring is full
+    HttppoMissingFile* missing_ring;
+    size_t missing_head;
+    size_t missing_len;
+
+    /// inotify instance watching the directories of cached and missing files, -1 when there is
+    /// none
+    int inotify_fd;
+    /// the directory of every inotify watch, indexed by the watch descriptor
+    char** watched_dirs;
+    size_t watched_cap;
+    /// maps the watched directories to their entry in `watched_dirs`, so that each is only
+    /// watched once
+    hash_table watched_names;
+
+    /// files waiting for the compressor thread
+    struct HttppoCompressJob* compress_head;
+    struct HttppoCompressJob* compress_tail;
+    size_t compress_pending;
+    /// maps contents to the blob holding them, keyed by the blob itself
+    hash_table blobs;
+    /// only guards `blobs`, taken after `mutex` when both are needed
+    pthread_mutex_t blobs_mutex;
+
+    /// a full queue makes submitters wait instead of dropping the file, used while preloading
+    bool compress_wait;
+    pthread_mutex_t compress_mutex;
+    pthread_cond_t compress_cond;
+    /// signalled whenever the compressor finishes a file
+    pthread_cond_t compress_done;
 } HttppoFiles;
 
-HttppoFiles httppo_files_new(size_t cap);
-HttppoFile* httppo_files_get(HttppoFiles* files, const char* filename);
-void httppo_files_revalidate(HttppoFiles* files);
+/// Opens the document root, every name the cache is asked for is relative to it
+HttppoFiles httppo_files_new(size_t cap, const char* root);
+/// Starts the thread that builds the compressed variants of loaded files
+void httppo_files_start_compressor(HttppoFiles* files);
+/// Starts the thread that marks cached files stale and drops negative entries as soon as their
+/// files appear
+void httppo_files_start_watcher(HttppoFiles* files);
+/// Looks up a file by its normalized name, see `http_path_normalize`. Returns false if there is no
+/// such file, otherwise `ref` holds a reference to its contents
+bool httppo_files_get(HttppoFiles* files, const char* filename, HttppoFileRef* ref);
+/// Takes another reference to a blob the caller already holds one of
+HttppoBlob* httppo_blob_ref(HttppoBlob* blob);
+/// Drops a reference to a blob, the last one frees it
+void httppo_files_release(HttppoFiles* files, HttppoBlob* blob);
+/// Returns a reference to the blob holding the malloc'd contents, taking them over. Identical
+/// contents end up in the same blob, however many paths or responses they come from
+HttppoBlob* httppo_blob_intern(HttppoFiles* files, char* contents, size_t size);
+
+typedef struct {
+    /// paths in the cache
+    size_t files;
+    /// distinct contents, shared by the paths that hold the same bytes
+    size_t blobs;
+    /// paths in the negative cache
+    size_t missing;
+    /// files waiting for the compressor
+    size_t compress_pending;
+} HttppoFilesStats;
+
+HttppoFilesStats httppo_files_stats(HttppoFiles* files);
+
+typedef struct {
+    size_t files;
+    size_t bytes;
+    /// the size of the distinct contents, identical files are only kept once
+    size_t unique_bytes;
+    /// the size of all compressed variants
+    size_t variant_bytes;
+    size_t directories;
+} HttppoPreloadStats;
+
+/// Walks the docroot with jobs on the thread pool and loads every regular file up to `max_size`
+/// bytes, then waits until the compressor has built their variants
+HttppoPreloadStats httppo_files_preload(HttppoFiles* files, ThreadPool* pool, size_t max_size);
+/// Starts the thread that prefetches the hot set recorded at `path` in the order of its
+/// popularity, then rewrites the snapshot of the most requested files every few seconds
+void httppo_files_start_snapshots(HttppoFiles* files, const char* path);
+/// Picks the best variant the Accept-Encoding header allows, NULL means the identity coding
+HttppoFileVariant const* httppo_blob_pick_variant(HttppoBlob* blob, const char* accept_encoding,
+                                                  CompressEncoding* encoding);
@@ -0,0 +1,1012 @@
+#include "h2.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_date.h"
+#include "util.h"
+
+// frames of DATA are framed in batches of about this much, so that a window that just opened
+// does not turn into one huge buffer
+#define H2_OUTPUT_BATCH (64 * 1024)
+// the largest window either end may have
+#define H2_MAX_WINDOW 0x7fffffff
+
+#define H2_UPGRADE_RESPONSE \
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+typedef enum {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+} H2FrameType;
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+typedef enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+} H2Setting;
+
+typedef enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+} H2Error;
+
+static uint32_t h2_u32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void h2_put_u32(char* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void h2_frame_header(string_builder* sb, size_t len, H2FrameType type, uint8_t flags,
+                            uint32_t stream) {
+    char header[H2_FRAME_HEADER_SIZE] = {len >> 16, len >> 8, len, type, flags};
+    h2_put_u32(header + 5, stream);
+    sb_push_n(sb, header, sizeof(header));
+}
+
+static void h2_frame_u32(H2Session* session, H2FrameType type, uint32_t stream, uint32_t value) {
+    char payload[4];
+    h2_put_u32(payload, value);
+    h2_frame_header(&session->out, sizeof(payload), type, 0, stream);
+    sb_push_n(&session->out, payload, sizeof(payload));
+}
+
+/// Queues a GOAWAY, after which nothing else is read. Returns false for the callers to pass on
+static bool h2_fail(H2Session* session, H2Error error) {
+    char payload[8];
+    h2_put_u32(payload, session->last_stream_id);
+    h2_put_u32(payload + 4, error);
+    h2_frame_header(&session->out, sizeof(payload), H2_GOAWAY, 0, 0);
+    sb_push_n(&session->out, payload, sizeof(payload));
+
+    session->closing = true;
+    return false;
+}
+
+static H2Stream* h2_stream_find(H2Session* session, uint32_t id) {
+    if (!id) {
+        return NULL;
+    }
+
+    // NOTE: a linear scan, the table is small and a stream is looked up once per frame at most
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        if (session->streams[i].id == id) {
+            return &session->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static H2Stream* h2_stream_open(H2Session* session, uint32_t id) {
+    if (session->stream_count == H2_MAX_STREAMS) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        H2Stream* stream = &session->streams[i];
+        if (stream->id) {
+            continue;
+        }
+
+        *stream = (H2Stream){
+            .id = id,
+            .send_window = session->peer_initial_window,
+        };
+        session->stream_count++;
+        return stream;
+    }
+    return NULL;
+}
+
+static void h2_stream_close(H2Session* session, H2Stream* stream) {
+    if (stream->body_release) {
+        stream->body_release(stream->body_owner);
+    }
+    free(stream->body_copy);
+    sb_destroy(&stream->feed);
+
+    stream->id = 0;
+    stream->body = NULL;
+    stream->body_copy = NULL;
+    stream->body_release = NULL;
+    session->stream_count--;
+}
+
+/// Gives `n` bytes of DATA back to the client's window of the stream, in batches
+static void h2_stream_ack(H2Session* session, H2Stream* stream, size_t n) {
+    stream->recv_unacked += n;
+    if (!stream->remote_closed && stream->recv_unacked >= H2_DEFAULT_WINDOW / 2) {
+        h2_frame_u32(session, H2_WINDOW_UPDATE, stream->id, stream->recv_unacked);
+        stream->recv_unacked = 0;
+    }
+}
+
+/// Closes a stream whose response is sent. A client still sending its request is told to stop
+static void h2_stream_done(H2Session* session, H2Stream* stream) {
+    if (!stream->remote_closed) {
+        h2_frame_u32(session, H2_RST_STREAM, stream->id, H2_NO_ERROR);
+    }
+    h2_stream_close(session, stream);
+}
+
+static bool h2_apply_settings(H2Session* session, const uint8_t* payload, size_t len) {
+    for (size_t off = 0; off + 6 <= len; off += 6) {
+        uint16_t id = payload[off] << 8 | payload[off + 1];
+        uint32_t value = h2_u32(payload + off + 2);
+
+        switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_encoder_set_max_size(&session->encoder, value);
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return h2_fail(session, H2_PROTOCOL_ERROR);
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW) {
+                    return h2_fail(session, H2_FLOW_CONTROL_ERROR);
+                }
+
+                // the change applies to the windows of the open streams as well
+                int64_t delta = (int64_t)value - session->peer_initial_window;
+                for (size_t i = 0; i < H2_MAX_STREAMS; i++) {
+                    if (!session->streams[i].id) {
+                        continue;
+                    }
+                    session->streams[i].send_window += delta;
+                    if (session->streams[i].send_window > H2_MAX_WINDOW) {
+                        return h2_fail(session, H2_FLOW_CONTROL_ERROR);
+                    }
+                }
+                session->peer_initial_window = value;
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+                    return h2_fail(session, H2_PROTOCOL_ERROR);
+                }
+                session->peer_max_frame = value;
+                break;
+            default:
+                // NOTE: unknown settings have to be ignored
+                break;
+        }
+    }
+
+    return true;
+}
+
+static int h2_base64url_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '-') {
+        return 62;
+    }
+    if (c == '_') {
+        return 63;
+    }
+    return -1;
+}
+
+/// Decodes the unpadded base64url of HTTP2-Settings, returns the decoded length or -1
+static ssize_t h2_base64url_decode(const char* str, uint8_t* out, size_t cap) {
+    uint32_t acc = 0;
+    size_t bits = 0;
+    size_t len = 0;
+    for (; *str && *str != '='; str++) {
+        int value = h2_base64url_value(*str);
+        if (value == -1) {
+            return -1;
+        }
+
+        acc = acc << 6 | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (len == cap) {
+                return -1;
+            }
+            out[len++] = acc >> bits;
+        }
+    }
+    return len;
+}
+
+const char* h2_upgrade_settings(HttpRequest const* req) {
+    const char* upgrade = http_req_header(req, "Upgrade");
+    const char* settings = http_req_header(req, "HTTP2-Settings");
+    if (!upgrade || !settings) {
+        return NULL;
+    }
+
+    // the Upgrade header lists protocols, h2c may be any of them
+    return http_header_has(sv_make(upgrade, strlen(upgrade)), "h2c") ? settings : NULL;
+}
+
+H2Session* h2_session_new(const char* upgrade_settings) {
+    H2Session* session = malloc(sizeof(H2Session));
+    if (!session) {
+        die("could not allocate an HTTP/2 session");
+    }
+
+    hpack_decoder_init(&session->decoder);
+    hpack_encoder_init(&session->encoder);
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        session->streams[i] = (H2Stream){0};
+    }
+    session->stream_count = 0;
+    session->next_stream = 0;
+    session->last_stream_id = 0;
+    session->send_window = H2_DEFAULT_WINDOW;
+    session->recv_unacked = 0;
+    session->peer_initial_window = H2_DEFAULT_WINDOW;
+    session->peer_max_frame = H2_MAX_FRAME_SIZE;
+    session->preface_received = false;
+    session->closing = false;
+    session->draining = false;
+    session->continuation_stream = 0;
+    session->continuation_end_stream = false;
+    session->header_block = sb_new(4096);
+    session->out = sb_new(H2_OUTPUT_BATCH);
+    session->out_off = 0;
+    session->name = sb_new(64);
+    session->in_len = 0;
+
+    if (upgrade_settings) {
+        uint8_t settings[H2_MAX_FRAME_SIZE];
+        ssize_t len = h2_base64url_decode(upgrade_settings, settings, sizeof(settings));
+        if (len < 0 || len % 6 != 0 || !h2_apply_settings(session, settings, len)) {
+            h2_session_free(session);
+            return NULL;
+        }
+
+        sb_push_cstr(&session->out, H2_UPGRADE_RESPONSE);
+        // the request that asked for the upgrade becomes stream 1, which the client can't send on
+        H2Stream* stream = h2_stream_open(session, 1);
+        stream->remote_closed = true;
+        session->last_stream_id = 1;
+    }
+
+    // NOTE: the server preface is a SETTINGS frame, everything but the stream limit is left at
+    // its default
+    char setting[6] = {0, H2_SETTINGS_MAX_CONCURRENT_STREAMS};
+    h2_put_u32(setting + 2, H2_MAX_STREAMS);
+    h2_frame_header(&session->out, sizeof(setting), H2_SETTINGS, 0, 0);
+    sb_push_n(&session->out, setting, sizeof(setting));
+
+    return session;
+}
+
+void h2_session_free(H2Session* session) {
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        if (session->streams[i].id) {
+            h2_stream_close(session, &session->streams[i]);
+        }
+    }
+
+    hpack_table_free(&session->decoder.table);
+    hpack_table_free(&session->encoder.table);
+    sb_destroy(&session->header_block);
+    sb_destroy(&session->out);
+    sb_destroy(&session->name);
+    free(session);
+}
+
+/// Builds the request out of the decoded fields, NULL if it is malformed
+static HttpRequest* h2_request(HttpHeaders const* fields, Arena* arena) {
+    HttpRequest* req = arena_alloc(arena, sizeof(HttpRequest));
+    *req = (HttpRequest){
+        .headers = {.http_version = "HTTP/2"},
+        .body = "",
+        .arena = arena,
+    };
+
+    const char* scheme = NULL;
+    const char* authority = NULL;
+    bool regular_seen = false;
+    for (size_t i = 0; i < fields->len; i++) {
+        HttpHeader const* field = &fields->items[i];
+
+        // pseudo-headers come first and only once each
+        if (field->key[0] == ':') {
+            const char** slot = NULL;
+            if (strcmp(field->key, ":method") == 0) {
+                slot = &req->headers.method;
+            } else if (strcmp(field->key, ":path") == 0) {
+                slot = &req->headers.path;
+            } else if (strcmp(field->key, ":scheme") == 0) {
+                slot = &scheme;
+            } else if (strcmp(field->key, ":authority") == 0) {
+                slot = &authority;
+            }
+
+            if (regular_seen || !slot || *slot) {
+                return NULL;
+            }
+            *slot = field->value;
+            continue;
+        }
+        regular_seen = true;
+
+        for (const char* c = field->key; *c; c++) {
+            if (*c >= 'A' && *c <= 'Z') {
+                return NULL;
+            }
+        }
+
+        // NOTE: HTTP/2 has no connection-specific headers, TE may only ask for trailers
+        if (strcmp(field->key, "connection") == 0 || strcmp(field->key, "keep-alive") == 0 ||
+            strcmp(field->key, "proxy-connection") == 0 ||
+            strcmp(field->key, "transfer-encoding") == 0 || strcmp(field->key, "upgrade") == 0 ||
+            (strcmp(field->key, "te") == 0 && strcmp(field->value, "trailers") != 0)) {
+            return NULL;
+        }
+        http_headers_add(&req->headers.headers, arena, field->key, field->value);
+    }
+
+    if (!req->headers.method || !req->headers.path || !scheme || !*req->headers.path) {
+        return NULL;
+    }
+
+    // handlers look for a Host, which HTTP/2 carries as :authority
+    if (authority && !http_headers_find(&req->headers.headers, "host")) {
+        http_headers_add(&req->headers.headers, arena, "host", authority);
+    }
+    return req;
+}
+
+static bool h2_headers_complete(H2Session* session, uint32_t id, bool end_stream, Arena* arena,
+                                H2RequestProc proc, H2DataProc data, void* ctx) {
+    // NOTE: every block is decoded, even the ones of refused streams, to keep the table in step
+    HttpHeaders fields = {0};
+    bool decoded = hpack_decode(&session->decoder, (const uint8_t*)session->header_block.items,
+                                session->header_block.len, arena, &fields);
+    sb_clear(&session->header_block);
+    if (!decoded) {
+        return h2_fail(session, H2_COMPRESSION_ERROR);
+    }
+
+    // trailers, or a block of a stream that is done with
+    if (id <= session->last_stream_id) {
+        H2Stream* stream = h2_stream_find(session, id);
+        if (stream && end_stream) {
+            stream->remote_closed = true;
+            // NOTE: the trailers themselves are not passed on
+            if (stream->deferred) {
+                data(ctx, id, NULL, 0, true);
+            }
+        }
+        return true;
+    }
+
+    session->last_stream_id = id;
+    H2Stream* stream = h2_stream_open(session, id);
+    if (!stream) {
+        h2_frame_u32(session, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+        return true;
+    }
+    stream->remote_closed = end_stream;
+
+    HttpRequest* req = h2_request(&fields, arena);
+    if (!req) {
+        h2_frame_u32(session, H2_RST_STREAM, id, H2_PROTOCOL_ERROR);
+        h2_stream_close(session, stream);
+        return true;
+    }
+
+    // NOTE: the request is handled once its headers are in, a body is not waited for. Only a
+    // deferred stream gets it
+    req->body_streamed = !end_stream;
+    proc(ctx, id, req);
+
+    // the response may be sent and its stream gone already
+    stream = h2_stream_find(session, id);
+    if (stream && !stream->responded && !stream->deferred) {
+        h2_frame_u32(session, H2_RST_STREAM, id, H2_INTERNAL_ERROR);
+        h2_stream_close(session, stream);
+    }
+    return true;
+}
+
+/// Strips the padding of a DATA or HEADERS frame, returns false if it is longer than the frame
+static bool h2_unpad(uint8_t flags, const uint8_t** payload, size_t* len) {
+    if (!(flags & H2_FLAG_PADDED)) {
+        return true;
+    }
+
+    if (*len < 1 || (*payload)[0] >= *len) {
+        return false;
+    }
+    *len -= 1 + (*payload)[0];
+    (*payload)++;
+    return true;
+}
+
+static bool h2_headers(H2Session* session, uint8_t flags, uint32_t id, const uint8_t* payload,
+                       size_t len, Arena* arena, H2RequestProc proc, H2DataProc data,
+                       void* ctx) {
+    if (!id || id % 2 == 0 || !h2_unpad(flags, &payload, &len)) {
+        return h2_fail(session, H2_PROTOCOL_ERROR);
+    }
+
+    if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) {
+            return h2_fail(session, H2_FRAME_SIZE_ERROR);
+        }
+        payload += 5;
+        len -= 5;
+    }
+
+    sb_push_n(&session->header_block, (const char*)payload, len);
+    bool end_stream = flags & H2_FLAG_END_STREAM;
+    if (!(flags & H2_FLAG_END_HEADERS)) {
+        session->continuation_stream = id;
+        session->continuation_end_stream = end_stream;
+        return true;
+    }
+
+    return h2_headers_complete(session, id, end_stream, arena, proc, data, ctx);
+}
+
+static bool h2_continuation(H2Session* session, uint8_t flags, uint32_t id,
+                            const uint8_t* payload, size_t len, Arena* arena, H2RequestProc proc,
+                            H2DataProc data, void* ctx) {
+    if (!session->continuation_stream) {
+        return h2_fail(session, H2_PROTOCOL_ERROR);
+    }
+    if (session->header_block.len + len > H2_MAX_HEADER_BLOCK) {
+        return h2_fail(session, H2_ENHANCE_YOUR_CALM);
+    }
+
+    sb_push_n(&session->header_block, (const char*)payload, len);
+    if (!(flags & H2_FLAG_END_HEADERS)) {
+        return true;
+    }
+
+    session->continuation_stream = 0;
+    return h2_headers_complete(session, id, session->continuation_end_stream, arena, proc, data,
+                               ctx);
+}
+
+/// Request bodies only go to deferred streams, which give them back to the flow control window
+/// once they are used. Any other is taken off the windows and given back right away
+static bool h2_data(H2Session* session, uint8_t flags, uint32_t id, const uint8_t* payload,
+                    size_t len, H2DataProc data, void* ctx) {
+    if (!id || id > session->last_stream_id) {
+        return h2_fail(session, H2_PROTOCOL_ERROR);
+    }
+
+    size_t frame_len = len;
+    if (!h2_unpad(flags, &payload, &len)) {
+        return h2_fail(session, H2_PROTOCOL_ERROR);
+    }
+
+    session->recv_unacked += frame_len;
+    if (session->recv_unacked >= H2_DEFAULT_WINDOW / 2) {
+        h2_frame_u32(session, H2_WINDOW_UPDATE, 0, session->recv_unacked);
+        session->recv_unacked = 0;
+    }
+
+    H2Stream* stream = h2_stream_find(session, id);
+    if (!stream) {
+        return true;
+    }
+
+    bool end = flags & H2_FLAG_END_STREAM;
+    if (end) {
+        stream->remote_closed = true;
+    }
+    if (!stream->deferred) {
+        h2_stream_ack(session, stream, frame_len);
+        return true;
+    }
+
+    // the padding is never used. NOTE: the stream may be answered and gone after `data`
+    h2_stream_ack(session, stream, frame_len - len);
+    data(ctx, id, (const char*)payload, len, end);
+    return true;
+}
+
+static bool h2_window_update(H2Session* session, uint32_t id, const uint8_t* payload, size_t len) {
+    if (len != 4) {
+        return h2_fail(session, H2_FRAME_SIZE_ERROR);
+    }
+
+    uint32_t increment = h2_u32(payload) & H2_MAX_WINDOW;
+    if (!id) {
+        if (!increment) {
+            return h2_fail(session, H2_PROTOCOL_ERROR);
+        }
+        session->send_window += increment;
+        if (session->send_window > H2_MAX_WINDOW) {
+            return h2_fail(session, H2_FLOW_CONTROL_ERROR);
+        }
+        return true;
+    }
+
+    H2Stream* stream = h2_stream_find(session, id);
+    if (!stream) {
+        return true;
+    }
+
+    stream->send_window += increment;
+    if (!increment || stream->send_window > H2_MAX_WINDOW) {
+        h2_frame_u32(session, H2_RST_STREAM, id,
+                     increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+        h2_stream_close(session, stream);
+    }
+    return true;
+}
+
+static bool h2_frame(H2Session* session, H2FrameType type, uint8_t flags, uint32_t id,
+                     const uint8_t* payload, size_t len, Arena* arena, H2RequestProc proc,
+                     H2DataProc data, void* ctx) {
+    // a header block can't be interrupted by any other frame
+    if (session->continuation_stream &&
+        (type != H2_CONTINUATION || id != session->continuation_stream)) {
+        return h2_fail(session, H2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+        case H2_DATA:
+            return h2_data(session, flags, id, payload, len, data, ctx);
+
+        case H2_HEADERS:
+            return h2_headers(session, flags, id, payload, len, arena, proc, data, ctx);
+
+        case H2_CONTINUATION:
+            return h2_continuation(session, flags, id, payload, len, arena, proc, data, ctx);
+
+        case H2_PRIORITY:
+            // NOTE: priorities are not followed, every stream gets the same turn
+            if (!id) {
+                return h2_fail(session, H2_PROTOCOL_ERROR);
+            }
+            return len == 5 || h2_fail(session, H2_FRAME_SIZE_ERROR);
+
+        case H2_RST_STREAM: {
+            if (!id || id > session->last_stream_id) {
+                return h2_fail(session, H2_PROTOCOL_ERROR);
+            }
+            if (len != 4) {
+                return h2_fail(session, H2_FRAME_SIZE_ERROR);
+            }
+
+            H2Stream* stream = h2_stream_find(session, id);
+            if (stream) {
+                h2_stream_close(session, stream);
+            }
+            return true;
+        }
+
+        case H2_SETTINGS:
+            if (id) {
+                return h2_fail(session, H2_PROTOCOL_ERROR);
+            }
+            if (flags & H2_FLAG_ACK) {
+                return len == 0 || h2_fail(session, H2_FRAME_SIZE_ERROR);
+            }
+            if (len % 6 != 0) {
+                return h2_fail(session, H2_FRAME_SIZE_ERROR);
+            }
+            if (!h2_apply_settings(session, payload, len)) {
+                return false;
+            }
+
+            h2_frame_header(&session->out, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+            return true;
+
+        case H2_PING:
+            if (id) {
+                return h2_fail(session, H2_PROTOCOL_ERROR);
+            }
+            if (len != 8) {
+                return h2_fail(session, H2_FRAME_SIZE_ERROR);
+            }
+            if (!(flags & H2_FLAG_ACK)) {
+                h2_frame_header(&session->out, len, H2_PING, H2_FLAG_ACK, 0);
+                sb_push_n(&session->out, (const char*)payload, len);
+            }
+            return true;
+
+        case H2_GOAWAY:
+            if (id) {
+                return h2_fail(session, H2_PROTOCOL_ERROR);
+            }
+            session->draining = true;
+            return true;
+
+        case H2_WINDOW_UPDATE:
+            return h2_window_update(session, id, payload, len);
+
+        case H2_PUSH_PROMISE:
+            // only servers push
+            return h2_fail(session, H2_PROTOCOL_ERROR);
+    }
+
+    // NOTE: frames of unknown types have to be ignored
+    return true;
+}
+
+char* h2_session_input(H2Session* session, size_t* cap) {
+    *cap = sizeof(session->in) - session->in_len;
+    return session->in + session->in_len;
+}
+
+bool h2_session_recv(H2Session* session, size_t nread, Arena* arena, H2RequestProc proc,
+                     H2DataProc data, void* ctx) {
+    session->in_len += nread;
+    if (session->closing) {
+        session->in_len = 0;
+        return false;
+    }
+
+    const uint8_t* in = (const uint8_t*)session->in;
+    size_t off = 0;
+    if (!session->preface_received) {
+        size_t len = session->in_len < H2_PREFACE_LEN ? session->in_len : H2_PREFACE_LEN;
+        if (memcmp(in, H2_PREFACE, len) != 0) {
+            return h2_fail(session, H2_PROTOCOL_ERROR);
+        }
+        if (len < H2_PREFACE_LEN) {
+            return true;
+        }
+
+        off = H2_PREFACE_LEN;
+        session->preface_received = true;
+    }
+
+    while (session->in_len - off >= H2_FRAME_HEADER_SIZE) {
+        const uint8_t* header = in + off;
+        size_t len = (size_t)header[0] << 16 | header[1] << 8 | header[2];
+        if (len > H2_MAX_FRAME_SIZE) {
+            return h2_fail(session, H2_FRAME_SIZE_ERROR);
+        }
+        if (session->in_len - off < H2_FRAME_HEADER_SIZE + len) {
+            break;
+        }
+
+        uint32_t id = h2_u32(header + 5) & H2_MAX_WINDOW;
+        off += H2_FRAME_HEADER_SIZE + len;
+        if (!h2_frame(session, header[3], header[4], id, header + H2_FRAME_HEADER_SIZE, len, arena,
+                      proc, data, ctx)) {
+            return false;
+        }
+    }
+
+    session->in_len -= off;
+    memmove(session->in, session->in + off, session->in_len);
+    return true;
+}
+
+void h2_defer(H2Session* session, uint32_t id) {
+    H2Stream* stream = h2_stream_find(session, id);
+    if (stream) {
+        stream->deferred = true;
+    }
+}
+
+bool h2_deferred(H2Session* session, uint32_t id) {
+    H2Stream* stream = h2_stream_find(session, id);
+    return stream && stream->deferred;
+}
+
+bool h2_responded(H2Session* session, uint32_t id) {
+    H2Stream* stream = h2_stream_find(session, id);
+    return !stream || stream->responded;
+}
+
+void h2_stream_consumed(H2Session* session, uint32_t id, size_t n) {
+    H2Stream* stream = h2_stream_find(session, id);
+    if (stream) {
+        h2_stream_ack(session, stream, n);
+    }
+}
+
+/// Whether a response header does not belong in HTTP/2
+static bool h2_connection_header(string_view name) {
+    return sv_eq_cstr(name, "connection") || sv_eq_cstr(name, "keep-alive") ||
+           sv_eq_cstr(name, "transfer-encoding") || sv_eq_cstr(name, "upgrade");
+}
+
+static void h2_encode_field(H2Session* session, string_builder* block, const char* name,
+                            size_t name_len, const char* value, size_t value_len) {
+    sb_clear(&session->name);
+    for (size_t i = 0; i < name_len; i++) {
+        char c = name[i];
+        sb_push(&session->name, c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+    }
+
+    string_view lower = sv_make(session->name.items, session->name.len);
+    if (h2_connection_header(lower)) {
+        return;
+    }
+
+    // NOTE: values that belong to a single file are not worth a place in the table
+    bool indexed = !sv_eq_cstr(lower, "etag") && !sv_eq_cstr(lower, "last-modified") &&
+                   !sv_eq_cstr(lower, "content-length");
+    hpack_encode(&session->encoder, block, lower, sv_make(value, value_len), indexed);
+}
+
+/// Encodes the head of a response the way `http_res_encode` does for HTTP/1.1. The size of the
+/// body is sent as its length if `length` is set, unless the raw headers have one
+static void h2_encode_head(H2Session* session, HttpResponse const* res, bool length,
+                           string_builder* block) {
+    char status[4];
+    snprintf(status, sizeof(status), "%03u", res->status_code);
+    hpack_encode(&session->encoder, block, sv_make(":status", 7), sv_make(status, 3), true);
+
+    h2_encode_field(session, block, "date", 4, http_date_now(), HTTP_DATE_LEN);
+
+    for (size_t i = 0; i < res->headers.len; i++) {
+        HttpHeader const* header = &res->headers.items[i];
+        h2_encode_field(session, block, header->key, strlen(header->key), header->value,
+                        strlen(header->value));
+    }
+
+    // the raw headers are lines of "Name: value\r\n"
+    bool has_length = false;
+    string_view raw = res->raw_headers;
+    while (raw.size) {
+        ssize_t line_end = sv_find_sub_cstr(raw, "\r\n");
+        size_t line_len = line_end == -1 ? raw.size : (size_t)line_end;
+        ssize_t colon = sv_find(sv_slice(raw, 0, line_len), ':');
+        if (colon != -1) {
+            has_length |= http_header_is(sv_make(raw.ptr, colon), "content-length");
+            size_t value_start = colon + 1;
+            while (value_start < line_len && raw.ptr[value_start] == ' ') {
+                value_start++;
+            }
+            h2_encode_field(session, block, raw.ptr, colon, raw.ptr + value_start,
+                            line_len - value_start);
+        }
+        raw = sv_slice_end(raw, line_end == -1 ? raw.size : line_len + 2);
+    }
+
+    // NOTE: a length among the raw headers is the one of a relayed body, or of one that is not
+    // sent at all as in the answer to a HEAD request
+    if (length && !has_length && res->status_code != 204) {
+        char size[24];
+        int size_len = snprintf(size, sizeof(size), "%zu", res->body.size);
+        h2_encode_field(session, block, "content-length", 14, size, size_len);
+    }
+}
+
+/// Queues the HEADERS of a response, in CONTINUATION frames as well if the block is too big
+static void h2_queue_head(H2Session* session, H2Stream* stream, HttpResponse const* res,
+                          bool length, bool end_stream) {
+    stream->responded = true;
+
+    // the block is framed right behind the frames already queued, split at the frame size
+    string_builder* out = &session->out;
+    size_t header_off = out->len;
+    h2_frame_header(out, 0, H2_HEADERS, 0, stream->id);
+    size_t block_off = out->len;
+    h2_encode_head(session, res, length, out);
+
+    size_t block_len = out->len - block_off;
+    if (block_len <= session->peer_max_frame) {
+        uint8_t flags = H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0);
+        out->items[header_off] = block_len >> 16;
+        out->items[header_off + 1] = block_len >> 8;
+        out->items[header_off + 2] = block_len;
+        out->items[header_off + 4] = flags;
+        return;
+    }
+
+    // NOTE: rare enough to be done with a copy, the frame headers go in between the pieces
+    string_builder block = sb_new(block_len);
+    sb_push_n(&block, out->items + block_off, block_len);
+    out->len = header_off;
+
+    for (size_t off = 0; off < block_len;) {
+        size_t len = block_len - off < session->peer_max_frame ? block_len - off
+                                                               : session->peer_max_frame;
+        bool first = off == 0;
+        bool last = off + len == block_len;
+        uint8_t flags =
+            (last ? H2_FLAG_END_HEADERS : 0) | (first && end_stream ? H2_FLAG_END_STREAM : 0);
+        h2_frame_header(out, len, first ? H2_HEADERS : H2_CONTINUATION, flags, stream->id);
+        sb_push_n(out, block.items + off, len);
+        off += len;
+    }
+    sb_destroy(&block);
+}
+
+void h2_respond(H2Session* session, uint32_t id, HttpResponse const* res, bool copy,
+                void (*release)(void* owner), void* owner) {
+    H2Stream* stream = h2_stream_find(session, id);
+    if (!stream || stream->responded) {
+        if (release) {
+            release(owner);
+        }
+        return;
+    }
+
+    h2_queue_head(session, stream, res, true, !res->body.size);
+    if (!res->body.size) {
+        if (release) {
+            release(owner);
+        }
+        h2_stream_done(session, stream);
+        return;
+    }
+
+    stream->body = res->body.ptr;
+    stream->body_len = res->body.size;
+    stream->body_off = 0;
+    if (copy) {
+        stream->body_copy = malloc(res->body.size);
+        if (!stream->body_copy) {
+            die("could not allocate a response body");
+        }
+        memcpy(stream->body_copy, res->body.ptr, res->body.size);
+        stream->body = stream->body_copy;
+        if (release) {
+            release(owner);
+        }
+    } else {
+        stream->body_release = release;
+        stream->body_owner = owner;
+    }
+}
+
+void h2_respond_start(H2Session* session, uint32_t id, HttpResponse const* res) {
+    H2Stream* stream = h2_stream_find(session, id);
+    if (!stream || stream->responded) {
+        return;
+    }
+
+    h2_queue_head(session, stream, res, false, false);
+    stream->streamed = true;
+    stream->feed = sb_new(H2_MAX_FRAME_SIZE);
+    stream->body = stream->feed.items;
+    stream->body_len = 0;
+    stream->body_off = 0;
+}
+
+void h2_stream_append(H2Session* session, uint32_t id, const char* data, size_t len) {
+    H2Stream* stream = h2_stream_find(session, id);
+    if (!stream || !stream->streamed) {
+        return;
+    }
+
+    // what was framed already is dropped before the buffer grows
+    if (stream->body_off == stream->body_len) {
+        sb_clear(&stream->feed);
+        stream->body_off = 0;
+    }
+    sb_push_n(&stream->feed, data, len);
+    stream->body = stream->feed.items;
+    stream->body_len = stream->feed.len;
+}
+
+void h2_stream_end(H2Session* session, uint32_t id) {
+    H2Stream* stream = h2_stream_find(session, id);
+    if (stream && stream->streamed) {
+        stream->body_ended = true;
+    }
+}
+
+void h2_stream_cancel(H2Session* session, uint32_t id) {
+    H2Stream* stream = h2_stream_find(session, id);
+    if (stream) {
+        h2_frame_u32(session, H2_RST_STREAM, id, H2_INTERNAL_ERROR);
+        h2_stream_close(session, stream);
+    }
+}
+
+ssize_t h2_stream_pending(H2Session* session, uint32_t id) {
+    H2Stream* stream = h2_stream_find(session, id);
+    return stream ? (ssize_t)(stream->body_len - stream->body_off) : -1;
+}
+
+/// Frames DATA of the streams in turn, one frame each per round, while the windows allow it
+static void h2_frame_data(H2Session* session) {
+    string_builder* out = &session->out;
+    bool progress = true;
+    while (progress && out->len < H2_OUTPUT_BATCH) {
+        progress = false;
+        for (size_t n = 0; n < H2_MAX_STREAMS; n++) {
+            size_t i = (session->next_stream + n) % H2_MAX_STREAMS;
+            H2Stream* stream = &session->streams[i];
+            if (!stream->id || !stream->body) {
+                continue;
+            }
+            // a streamed body that ran dry waits for more, only its end goes out without any
+            size_t len = stream->body_len - stream->body_off;
+            bool ended = !stream->streamed || stream->body_ended;
+            if (len ? stream->send_window <= 0 || session->send_window <= 0 : !ended) {
+                continue;
+            }
+
+            if (len > session->peer_max_frame) {
+                len = session->peer_max_frame;
+            }
+            if (len && (int64_t)len > stream->send_window) {
+                len = stream->send_window;
+            }
+            if (len && (int64_t)len > session->send_window) {
+                len = session->send_window;
+            }
+
+            bool last = ended && stream->body_off + len == stream->body_len;
+            h2_frame_header(out, len, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id);
+            sb_push_n(out, stream->body + stream->body_off, len);
+            stream->body_off += len;
+            stream->send_window -= len;
+            session->send_window -= len;
+            progress = true;
+
+            if (last) {
+                h2_stream_done(session, stream);
+            }
+            if (out->len >= H2_OUTPUT_BATCH) {
+                session->next_stream = (i + 1) % H2_MAX_STREAMS;
+                return;
+            }
+        }
+    }
+}
+
+const char* h2_session_output(H2Session* session, size_t* len) {
+    if (session->out_off == session->out.len) {
+        sb_clear(&session->out);
+        session->out_off = 0;
+        // NOTE: the body of an upgraded request waits for the client's preface, clients only
+        // buffer so much behind the 101 response
+        if (!session->closing && session->preface_received) {
+            h2_frame_data(session);
+        }
+    }
+
+    *len = session->out.len - session->out_off;
+    return session->out.items + session->out_off;
+}
+
+void h2_session_sent(H2Session* session, size_t n) {
+    session->out_off += n;
+}
+
+bool h2_session_idle(H2Session const* session) {
+    return session->stream_count == 0 && session->out_off == session->out.len;
+}
+
+bool h2_session_done(H2Session const* session) {
+    return session->closing || (session->draining && session->stream_count == 0);
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "base.h"
+#include "hpack.h"
+#include "protocol.h"
+
+// HTTP/2 over cleartext TCP (h2c), entered with the connection preface or by upgrading an
+// HTTP/1.1 request. A session only turns received bytes into requests and queued responses into
+// frames, the connection that owns it does the I/O. Many streams share the connection, their DATA
+// frames take turns within the flow control windows the client grants
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_SIZE 9
+// the largest frame accepted, SETTINGS_MAX_FRAME_SIZE is left at its default
+#define H2_MAX_FRAME_SIZE 16384
+// SETTINGS_MAX_CONCURRENT_STREAMS, more streams at once are refused
+#define H2_MAX_STREAMS 256
+// the initial flow control window of both ends
+#define H2_DEFAULT_WINDOW 65535
+// a request whose header block grows beyond this over CONTINUATION frames ends the connection
+#define H2_MAX_HEADER_BLOCK (64 * 1024)
+
+/// A stream from its request to the end of its response
+typedef struct {
+    /// 0 while the slot is free
+    uint32_t id;
+    /// the client sent END_STREAM
+    bool remote_closed;
+    /// the HEADERS of the response are queued
+    bool responded;
+    /// the response comes after the request handler returned, see `h2_defer`
+    bool deferred;
+    /// what the client still takes on this stream
+    int64_t send_window;
+    /// DATA received on the stream that the client was not given back yet
+    uint32_t recv_unacked;
+
+    const char* body;
+    size_t body_len;
+    size_t body_off;
+    /// a copy of a body that would not outlive the request, freed with the stream
+    char* body_copy;
+    /// the body is handed over as it comes, see `h2_respond_start`. It is queued in `feed`, which
+    /// `body` points into
+    bool streamed;
+    /// the last bytes of a streamed body are in `feed`
+    bool body_ended;
+    string_builder feed;
+    void (*body_release)(void* owner);
+    void* body_owner;
+} H2Stream;
+
+/// Handles the request of a stream, it has to queue a response with `h2_respond` before returning
+/// unless it calls `h2_defer`
+typedef void (*H2RequestProc)(void* ctx, uint32_t stream, HttpRequest* req);
+/// Takes the request body of a deferred stream as it arrives, `end` is set along with its last
+/// bytes
+typedef void (*H2DataProc)(void* ctx, uint32_t stream, const char* data, size_t len, bool end);
+
+typedef struct {
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    H2Stream streams[H2_MAX_STREAMS];
+    size_t stream_count;
+    /// where the next round of DATA frames starts, so that every stream gets its turn
+    size_t next_stream;
+    uint32_t last_stream_id;
+
+    /// what the client still takes on the whole connection
+    int64_t send_window;
+    uint32_t recv_unacked;
+    /// the client's SETTINGS_INITIAL_WINDOW_SIZE and SETTINGS_MAX_FRAME_SIZE
+    uint32_t peer_initial_window;
+    uint32_t peer_max_frame;
+
+    bool preface_received;
+    /// a GOAWAY is queued, the connection is closed once it is sent
+    bool closing;
+    /// the client sent a GOAWAY, the connection is closed once its streams are done
+    bool draining;
+
+    /// the stream whose header block goes on in CONTINUATION frames, 0 if there is none
+    uint32_t continuation_stream;
+    bool continuation_end_stream;
+    string_builder header_block;
+
+    /// frames waiting to be sent from `out_off` on
+    string_builder out;
+    size_t out_off;
+    /// the lowercase names of response headers are built here
+    string_builder name;
+
+    size_t in_len;
+    char in[H2_FRAME_HEADER_SIZE + H2_MAX_FRAME_SIZE];
+} H2Session;
+
+/// The HTTP2-Settings of a request that asks to upgrade to h2c, NULL if it does not
+const char* h2_upgrade_settings(HttpRequest const* req);
+/// Creates a session and queues the server preface. For an upgrade, `upgrade_settings` are the
+/// client's HTTP2-Settings, the 101 response is queued ahead of the preface and stream 1 is opened
+/// for the request that asked for it. Returns NULL if the settings are malformed
+H2Session* h2_session_new(const char* upgrade_settings);
+/// Frees the session, releasing the bodies of the streams that are left
+void h2_session_free(H2Session* session);
+
+/// Where received bytes go, at most `cap` of them
+char* h2_session_input(H2Session* session, size_t* cap);
+/// Handles the complete frames among the received bytes, passing every complete request to
+/// `proc` and the bodies of deferred streams to `data`. Header blocks are decoded into the arena,
+/// which `proc` is free to reset. Returns false on a connection error, a GOAWAY is queued then
+bool h2_session_recv(H2Session* session, size_t nread, Arena* arena, H2RequestProc proc,
+                     H2DataProc data, void* ctx);
+
+/// Lets the request handler of a stream return before its response is queued. The body of the
+/// request goes to the data proc from then on, and the client's window only opens up again as
+/// `h2_stream_consumed` is called
+void h2_defer(H2Session* session, uint32_t stream);
+bool h2_deferred(H2Session* session, uint32_t stream);
+/// Whether the response of the stream is queued, or the stream is gone
+bool h2_responded(H2Session* session, uint32_t stream);
+/// Gives bytes of a deferred stream's body back to the client's window once they are used
+void h2_stream_consumed(H2Session* session, uint32_t stream, size_t n);
+
+/// Queues the response of a stream. A body that is `copy`ed is released right away, any other is
+/// released once it is sent or its stream is reset. NULL for `release` if it outlives both
+void h2_respond(H2Session* session, uint32_t stream, HttpResponse const* res, bool copy,
+                void (*release)(void* owner), void* owner);
+
+/// Queues the head of a response whose body is handed over as it comes, with `h2_stream_append`
+/// up to `h2_stream_end`. The length of the body goes among the raw headers if it is known
+void h2_respond_start(H2Session* session, uint32_t stream, HttpResponse const* res);
+/// Queues a copy of the next bytes of a streamed body
+void h2_stream_append(H2Session* session, uint32_t stream, const char* data, size_t len);
+/// Ends a streamed body after the bytes appended so far
+void h2_stream_end(H2Session* session, uint32_t stream);
+/// Cuts the response of a stream short with a RST_STREAM
+void h2_stream_cancel(H2Session* session, uint32_t stream);
+/// How much of a streamed body waits for the flow control windows, -1 once the stream is gone
+ssize_t h2_stream_pending(H2Session* session, uint32_t stream);
+
+/// The bytes waiting to be sent. Once all of them are, the next call frames more DATA
+const char* h2_session_output(H2Session* session, size_t* len);
+void h2_session_sent(H2Session* session, size_t n);
+/// No stream is open and nothing waits to be sent
+bool h2_session_idle(H2Session const* session);
+/// The connection is to be closed once the output is sent
+bool h2_session_done(H2Session const* session);
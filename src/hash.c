@@ -13,6 +13,59 @@ uint64_t hash_djb2(void const* ptr) {
     return hash;
 }
 
+uint64_t hash_bytes(void const* ptr, size_t size) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    const unsigned char* data = (const unsigned char*)ptr;
+
+    uint64_t hash = 0x9747b28cull ^ (size * m);
+
+    const unsigned char* end = data + (size & ~(size_t)7);
+    for (; data != end; data += 8) {
+        uint64_t k;
+        memcpy(&k, data, 8);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        hash ^= k;
+        hash *= m;
+    }
+
+    uint64_t tail = 0;
+    switch (size & 7) {
+        case 7:
+            tail ^= (uint64_t)data[6] << 48;
+            // fall through
+        case 6:
+            tail ^= (uint64_t)data[5] << 40;
+            // fall through
+        case 5:
+            tail ^= (uint64_t)data[4] << 32;
+            // fall through
+        case 4:
+            tail ^= (uint64_t)data[3] << 24;
+            // fall through
+        case 3:
+            tail ^= (uint64_t)data[2] << 16;
+            // fall through
+        case 2:
+            tail ^= (uint64_t)data[1] << 8;
+            // fall through
+        case 1:
+            tail ^= (uint64_t)data[0];
+            hash ^= tail;
+            hash *= m;
+    }
+
+    hash ^= hash >> r;
+    hash *= m;
+    hash ^= hash >> r;
+
+    return hash;
+}
+
 bool hash_str_eq(void const* lhs, void const* rhs) {
     return strcmp((const char*)lhs, (const char*)rhs) == 0;
 }
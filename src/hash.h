@@ -1,8 +1,11 @@
 #pragma once
 
-#include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 uint64_t hash_djb2(void const* str);
+/// MurmurHash64A of a buffer, eight bytes at a time. Good enough to key contents by, not to trust
+uint64_t hash_bytes(void const* data, size_t size);
 
 bool hash_str_eq(void const* lhs, void const* rhs);
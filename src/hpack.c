@@ -0,0 +1,575 @@
+#include "hpack.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+// the longest Huffman code, only EOS and a few control characters are that long
+#define HPACK_HUFFMAN_MAX_BITS 30
+// integers bigger than this are refused, no header block gets anywhere near it
+#define HPACK_INT_MAX (1u << 24)
+
+typedef struct {
+    const char* name;
+    const char* value;
+} HpackStaticEntry;
+
+/// RFC 7541 Appendix A, index 1 comes first
+static const HpackStaticEntry hpack_static_table[HPACK_STATIC_ENTRIES] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+typedef struct {
+    uint32_t code;
+    uint8_t bits;
+} HpackHuffmanCode;
+
+/// RFC 7541 Appendix B, indexed by symbol with EOS last. The code is canonical: codes of the same
+/// length are consecutive and ordered by symbol, which is what the decoder relies on
+static const HpackHuffmanCode hpack_huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28},
+    {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24},
+    {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28},
+    {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28}, {0xffffff4, 28},
+    {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8},
+    {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7},
+    {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7},
+    {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7},
+    {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15},
+    {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5},
+    {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7},
+    {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20},
+    {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22},
+    {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22},
+    {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23},
+    {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22},
+    {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23},
+    {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20},
+    {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26},
+    {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26},
+    {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20},
+    {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24},
+    {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26},
+    {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+/// The decoding side of the code, derived from `hpack_huffman_codes` once
+static struct {
+    /// the symbols ordered by code, so ordered by length and then by symbol
+    uint16_t symbols[257];
+    /// for every length, the first code of that length and where its symbols start
+    uint32_t first_code[HPACK_HUFFMAN_MAX_BITS + 1];
+    uint16_t first_symbol[HPACK_HUFFMAN_MAX_BITS + 1];
+    uint16_t count[HPACK_HUFFMAN_MAX_BITS + 1];
+    /// for every byte that starts with a code of at most 8 bits, its symbol and length. The
+    /// length is 0 for the others. The common characters all take 5 to 8 bits
+    uint8_t fast_symbol[256];
+    uint8_t fast_bits[256];
+} hpack_huffman;
+
+static pthread_once_t hpack_huffman_once = PTHREAD_ONCE_INIT;
+
+static void hpack_huffman_init(void) {
+    size_t n = 0;
+    for (size_t bits = 1; bits <= HPACK_HUFFMAN_MAX_BITS; bits++) {
+        hpack_huffman.first_symbol[bits] = n;
+        for (size_t sym = 0; sym < 257; sym++) {
+            if (hpack_huffman_codes[sym].bits == bits) {
+                hpack_huffman.symbols[n++] = sym;
+            }
+        }
+
+        hpack_huffman.count[bits] = n - hpack_huffman.first_symbol[bits];
+        if (hpack_huffman.count[bits]) {
+            uint16_t first = hpack_huffman.symbols[hpack_huffman.first_symbol[bits]];
+            hpack_huffman.first_code[bits] = hpack_huffman_codes[first].code;
+        }
+    }
+
+    for (size_t sym = 0; sym < 256; sym++) {
+        HpackHuffmanCode code = hpack_huffman_codes[sym];
+        if (code.bits > 8) {
+            continue;
+        }
+
+        size_t prefix = code.code << (8 - code.bits);
+        for (size_t rest = 0; rest < (1u << (8 - code.bits)); rest++) {
+            hpack_huffman.fast_symbol[prefix | rest] = sym;
+            hpack_huffman.fast_bits[prefix | rest] = code.bits;
+        }
+    }
+}
+
+size_t hpack_huffman_len(const char* str, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        bits += hpack_huffman_codes[(uint8_t)str[i]].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+void hpack_huffman_encode(string_builder* sb, const char* str, size_t len) {
+    uint64_t acc = 0;
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        HpackHuffmanCode code = hpack_huffman_codes[(uint8_t)str[i]];
+        acc = acc << code.bits | code.code;
+        bits += code.bits;
+        while (bits >= 8) {
+            bits -= 8;
+            sb_push(sb, (char)(acc >> bits));
+        }
+    }
+
+    // NOTE: the padding is the most significant bits of EOS, all ones
+    if (bits) {
+        sb_push(sb, (char)(acc << (8 - bits) | ((1u << (8 - bits)) - 1)));
+    }
+}
+
+ssize_t hpack_huffman_decode(const uint8_t* data, size_t len, char* out) {
+    pthread_once(&hpack_huffman_once, hpack_huffman_init);
+
+    uint64_t acc = 0;
+    size_t bits = 0;
+    size_t i = 0;
+    size_t out_len = 0;
+    while (true) {
+        while (bits <= 56 && i < len) {
+            acc = acc << 8 | data[i++];
+            bits += 8;
+        }
+        if (bits == 0) {
+            break;
+        }
+
+        if (bits >= 8) {
+            uint8_t top = acc >> (bits - 8);
+            if (hpack_huffman.fast_bits[top]) {
+                out[out_len++] = hpack_huffman.fast_symbol[top];
+                bits -= hpack_huffman.fast_bits[top];
+                continue;
+            }
+        }
+
+        // the byte table covers the short codes, unless less than a byte is left
+        size_t sym = 257;
+        size_t code_bits = bits >= 8 ? 9 : 5;
+        for (; code_bits <= HPACK_HUFFMAN_MAX_BITS && code_bits <= bits; code_bits++) {
+            uint32_t code = (acc >> (bits - code_bits)) & ((1u << code_bits) - 1);
+            if (code - hpack_huffman.first_code[code_bits] < hpack_huffman.count[code_bits]) {
+                size_t at = hpack_huffman.first_symbol[code_bits] + code -
+                            hpack_huffman.first_code[code_bits];
+                sym = hpack_huffman.symbols[at];
+                break;
+            }
+        }
+
+        if (sym == 257) {
+            // what is left has to be padding, less than a byte of ones
+            uint32_t mask = (1u << bits) - 1;
+            if (i == len && bits < 8 && (acc & mask) == mask) {
+                break;
+            }
+            return -1;
+        }
+
+        // EOS must not appear in a string
+        if (sym == 256) {
+            return -1;
+        }
+        out[out_len++] = sym;
+        bits -= code_bits;
+    }
+
+    return out_len;
+}
+
+static void hpack_table_init(HpackTable* table) {
+    table->first = 0;
+    table->count = 0;
+    table->size = 0;
+    table->max_size = HPACK_TABLE_SIZE;
+}
+
+void hpack_decoder_init(HpackDecoder* decoder) {
+    hpack_table_init(&decoder->table);
+}
+
+void hpack_encoder_init(HpackEncoder* encoder) {
+    hpack_table_init(&encoder->table);
+    encoder->pending_max_size = HPACK_TABLE_SIZE;
+    encoder->size_changed = false;
+}
+
+/// Evicts the oldest entries until `room` more bytes fit
+static void hpack_table_evict(HpackTable* table, size_t room) {
+    while (table->count && table->size + room > table->max_size) {
+        HpackEntry* oldest = &table->entries[table->first];
+        table->size -= oldest->name_len + oldest->value_len + HPACK_ENTRY_OVERHEAD;
+        free(oldest->name);
+        table->first = (table->first + 1) % HPACK_MAX_ENTRIES;
+        table->count--;
+    }
+}
+
+void hpack_table_free(HpackTable* table) {
+    table->max_size = 0;
+    hpack_table_evict(table, 0);
+}
+
+static void hpack_table_resize(HpackTable* table, size_t max_size) {
+    table->max_size = max_size;
+    hpack_table_evict(table, 0);
+}
+
+static void hpack_table_add(HpackTable* table, const char* name, size_t name_len,
+                            const char* value, size_t value_len) {
+    size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    // NOTE: an entry bigger than the whole table empties it and is not added
+    hpack_table_evict(table, size);
+    if (size > table->max_size) {
+        return;
+    }
+
+    char* data = malloc(name_len + value_len + 2);
+    if (!data) {
+        die("could not allocate an HPACK table entry");
+    }
+    memcpy(data, name, name_len);
+    data[name_len] = '\0';
+    memcpy(data + name_len + 1, value, value_len);
+    data[name_len + 1 + value_len] = '\0';
+
+    HpackEntry* entry = &table->entries[(table->first + table->count) % HPACK_MAX_ENTRIES];
+    *entry = (HpackEntry){
+        .name = data,
+        .value = data + name_len + 1,
+        .name_len = name_len,
+        .value_len = value_len,
+    };
+    table->count++;
+    table->size += size;
+}
+
+/// Looks an index up in the static and then the dynamic table, the newest entry comes right after
+/// the static ones
+static bool hpack_lookup(HpackTable const* table, uint32_t index, string_view* name,
+                         string_view* value) {
+    if (index == 0) {
+        return false;
+    }
+
+    if (index <= HPACK_STATIC_ENTRIES) {
+        HpackStaticEntry const* entry = &hpack_static_table[index - 1];
+        *name = sv_make(entry->name, strlen(entry->name));
+        *value = sv_make(entry->value, strlen(entry->value));
+        return true;
+    }
+
+    index -= HPACK_STATIC_ENTRIES;
+    if (index > table->count) {
+        return false;
+    }
+
+    HpackEntry const* entry =
+        &table->entries[(table->first + table->count - index) % HPACK_MAX_ENTRIES];
+    *name = sv_make(entry->name, entry->name_len);
+    *value = sv_make(entry->value, entry->value_len);
+    return true;
+}
+
+static bool hpack_get_int(const uint8_t** p, const uint8_t* end, unsigned prefix_bits,
+                          uint32_t* value) {
+    uint32_t max = (1u << prefix_bits) - 1;
+    uint32_t n = *(*p)++ & max;
+    if (n < max) {
+        *value = n;
+        return true;
+    }
+
+    for (unsigned shift = 0; *p < end; shift += 7) {
+        // NOTE: a byte shifted by 28 could only carry bits past `HPACK_INT_MAX`, or past the width
+        // of the value
+        if (shift > 21) {
+            return false;
+        }
+        uint8_t b = *(*p)++;
+        n += (uint32_t)(b & 0x7f) << shift;
+        if (n > HPACK_INT_MAX) {
+            return false;
+        }
+        if (!(b & 0x80)) {
+            *value = n;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static const char* hpack_arena_dup(Arena* arena, string_view sv) {
+    char* ptr = arena_alloc(arena, sv.size + 1);
+    memcpy(ptr, sv.ptr, sv.size);
+    ptr[sv.size] = '\0';
+    return ptr;
+}
+
+static bool hpack_get_string(const uint8_t** p, const uint8_t* end, Arena* arena,
+                             string_view* str) {
+    if (*p == end) {
+        return false;
+    }
+
+    bool huffman = **p & 0x80;
+    uint32_t len;
+    if (!hpack_get_int(p, end, 7, &len) || len > (size_t)(end - *p)) {
+        return false;
+    }
+
+    if (!huffman) {
+        *str = sv_make(hpack_arena_dup(arena, sv_make((const char*)*p, len)), len);
+        *p += len;
+        return true;
+    }
+
+    char* out = arena_alloc(arena, len * 8 / 5 + 1);
+    ssize_t out_len = hpack_huffman_decode(*p, len, out);
+    if (out_len < 0) {
+        return false;
+    }
+    out[out_len] = '\0';
+    *str = sv_make(out, out_len);
+    *p += len;
+    return true;
+}
+
+bool hpack_decode(HpackDecoder* decoder, const uint8_t* block, size_t len, Arena* arena,
+                  HttpHeaders* headers) {
+    const uint8_t* p = block;
+    const uint8_t* end = block + len;
+    bool fields_seen = false;
+
+    while (p < end) {
+        uint8_t first = *p;
+        uint32_t index;
+        string_view name;
+        string_view value;
+
+        // a dynamic table size update, only allowed ahead of the fields
+        if ((first & 0xe0) == 0x20) {
+            if (fields_seen || !hpack_get_int(&p, end, 5, &index) || index > HPACK_TABLE_SIZE) {
+                return false;
+            }
+            hpack_table_resize(&decoder->table, index);
+            continue;
+        }
+        fields_seen = true;
+
+        if (first & 0x80) {
+            if (!hpack_get_int(&p, end, 7, &index) ||
+                !hpack_lookup(&decoder->table, index, &name, &value)) {
+                return false;
+            }
+
+            // NOTE: entries of the dynamic table can be evicted by a later field of the block
+            const char* key =
+                index <= HPACK_STATIC_ENTRIES ? name.ptr : hpack_arena_dup(arena, name);
+            http_headers_add(headers, arena, key, hpack_arena_dup(arena, value));
+            continue;
+        }
+
+        // a literal, with incremental indexing or without, as a 6 or a 4 bit index of its name
+        bool indexed = first & 0x40;
+        if (!hpack_get_int(&p, end, indexed ? 6 : 4, &index)) {
+            return false;
+        }
+
+        if (index) {
+            string_view unused;
+            if (!hpack_lookup(&decoder->table, index, &name, &unused)) {
+                return false;
+            }
+            name = sv_make(hpack_arena_dup(arena, name), name.size);
+        } else if (!hpack_get_string(&p, end, arena, &name)) {
+            return false;
+        }
+
+        if (!hpack_get_string(&p, end, arena, &value)) {
+            return false;
+        }
+
+        if (indexed) {
+            hpack_table_add(&decoder->table, name.ptr, name.size, value.ptr, value.size);
+        }
+        http_headers_add(headers, arena, name.ptr, value.ptr);
+    }
+
+    return true;
+}
+
+static void hpack_put_int(string_builder* sb, uint8_t flags, unsigned prefix_bits, size_t value) {
+    size_t max = (1u << prefix_bits) - 1;
+    if (value < max) {
+        sb_push(sb, (char)(flags | value));
+        return;
+    }
+
+    sb_push(sb, (char)(flags | max));
+    value -= max;
+    while (value >= 0x80) {
+        sb_push(sb, (char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    sb_push(sb, (char)value);
+}
+
+static void hpack_put_string(string_builder* sb, string_view str) {
+    size_t huffman_len = hpack_huffman_len(str.ptr, str.size);
+    if (huffman_len < str.size) {
+        hpack_put_int(sb, 0x80, 7, huffman_len);
+        hpack_huffman_encode(sb, str.ptr, str.size);
+    } else {
+        hpack_put_int(sb, 0x00, 7, str.size);
+        sb_push_n(sb, str.ptr, str.size);
+    }
+}
+
+void hpack_encoder_set_max_size(HpackEncoder* encoder, size_t size) {
+    encoder->pending_max_size = size < HPACK_TABLE_SIZE ? size : HPACK_TABLE_SIZE;
+    // the table never grows past what a decoder starts with, so most clients change nothing
+    encoder->size_changed = encoder->pending_max_size != encoder->table.max_size;
+}
+
+void hpack_encode(HpackEncoder* encoder, string_builder* sb, string_view name, string_view value,
+                  bool indexed) {
+    HpackTable* table = &encoder->table;
+    if (encoder->size_changed) {
+        // NOTE: the update goes ahead of the first field of the next block, that is this one
+        encoder->size_changed = false;
+        hpack_table_resize(table, encoder->pending_max_size);
+        hpack_put_int(sb, 0x20, 5, encoder->pending_max_size);
+    }
+
+    size_t name_index = 0;
+    for (size_t i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        HpackStaticEntry const* entry = &hpack_static_table[i];
+        if (!sv_eq_cstr(name, entry->name)) {
+            continue;
+        }
+
+        if (sv_eq_cstr(value, entry->value)) {
+            hpack_put_int(sb, 0x80, 7, i + 1);
+            return;
+        }
+        if (!name_index) {
+            name_index = i + 1;
+        }
+    }
+
+    for (size_t i = 1; i <= table->count; i++) {
+        HpackEntry const* entry =
+            &table->entries[(table->first + table->count - i) % HPACK_MAX_ENTRIES];
+        if (!sv_eq(name, sv_make(entry->name, entry->name_len))) {
+            continue;
+        }
+
+        if (sv_eq(value, sv_make(entry->value, entry->value_len))) {
+            hpack_put_int(sb, 0x80, 7, HPACK_STATIC_ENTRIES + i);
+            return;
+        }
+        if (!name_index) {
+            name_index = HPACK_STATIC_ENTRIES + i;
+        }
+    }
+
+    hpack_put_int(sb, indexed ? 0x40 : 0x00, indexed ? 6 : 4, name_index);
+    if (!name_index) {
+        hpack_put_string(sb, name);
+    }
+    hpack_put_string(sb, value);
+
+    if (indexed) {
+        hpack_table_add(table, name.ptr, name.size, value.ptr, value.size);
+    }
+}
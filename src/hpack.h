@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "base.h"
+#include "protocol.h"
+
+// HPACK (RFC 7541), the header compression of HTTP/2. Both ends keep a dynamic table of recently
+// sent headers on top of the static one, so a decoder has to see every header block of its
+// connection in order and an encoder has to mirror what the peer's decoder holds
+
+#define HPACK_STATIC_ENTRIES 61
+// the dynamic table size of a new connection, and the most a decoder here accepts
+#define HPACK_TABLE_SIZE 4096
+// every entry is charged this much on top of its name and value
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+typedef struct {
+    /// the name and the value share one allocation, both NUL terminated
+    char* name;
+    char* value;
+    size_t name_len;
+    size_t value_len;
+} HpackEntry;
+
+/// A dynamic table, a ring of entries from the oldest at `first` to the newest
+typedef struct {
+    HpackEntry entries[HPACK_MAX_ENTRIES];
+    size_t first;
+    size_t count;
+    /// the sum of the entry sizes as the RFC counts them
+    size_t size;
+    size_t max_size;
+} HpackTable;
+
+typedef struct {
+    HpackTable table;
+} HpackDecoder;
+
+typedef struct {
+    HpackTable table;
+    /// the size the peer allows, announced at the start of the next block when it changed
+    size_t pending_max_size;
+    bool size_changed;
+} HpackEncoder;
+
+void hpack_decoder_init(HpackDecoder* decoder);
+void hpack_encoder_init(HpackEncoder* encoder);
+void hpack_table_free(HpackTable* table);
+
+/// Decodes a whole header block, appending every field to `headers` in order, pseudo-headers
+/// included. Names and values are allocated from the arena. Returns false on a compression error,
+/// which leaves the table out of step with the peer's, so the connection can't go on
+bool hpack_decode(HpackDecoder* decoder, const uint8_t* block, size_t len, Arena* arena,
+                  HttpHeaders* headers);
+
+/// Makes the encoder use at most `size` bytes of table, the peer's SETTINGS_HEADER_TABLE_SIZE
+void hpack_encoder_set_max_size(HpackEncoder* encoder, size_t size);
+/// Appends a field to a header block. The name has to be lowercase. Fields that are not `indexed`
+/// are never put into the table, for values that are unlikely to repeat on the connection
+void hpack_encode(HpackEncoder* encoder, string_builder* sb, string_view name, string_view value,
+                  bool indexed);
+
+/// The size of a string once Huffman coded
+size_t hpack_huffman_len(const char* str, size_t len);
+/// Appends the Huffman coding of a string, padded to a whole byte
+void hpack_huffman_encode(string_builder* sb, const char* str, size_t len);
+/// Decodes into `out`, which has room for `len * 8 / 5` bytes. Returns the decoded length or -1
+/// for invalid codes and padding
+ssize_t hpack_huffman_decode(const uint8_t* data, size_t len, char* out);
@@ -0,0 +1,102 @@
+#include "http_date.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <threads.h>
+
+#include "util.h"
+
+// NOTE: the clock thread cycles through the slots, a reader would have to hold on to a date for
+// several seconds before it gets overwritten under its feet
+#define HTTP_DATE_SLOTS 4
+
+static char dates[HTTP_DATE_SLOTS][HTTP_DATE_LEN + 1];
+static _Atomic(const char*) current_date;
+
+static inline char* http_date_put2(char* buf, int n) {
+    buf[0] = (char)('0' + n / 10);
+    buf[1] = (char)('0' + n % 10);
+    return buf + 2;
+}
+
+void http_date_format(time_t t, char* buf) {
+    static const char days[7][3] = {
+        {'S', 'u', 'n'}, {'M', 'o', 'n'}, {'T', 'u', 'e'}, {'W', 'e', 'd'},
+        {'T', 'h', 'u'}, {'F', 'r', 'i'}, {'S', 'a', 't'},
+    };
+    static const char months[12][3] = {
+        {'J', 'a', 'n'}, {'F', 'e', 'b'}, {'M', 'a', 'r'}, {'A', 'p', 'r'},
+        {'M', 'a', 'y'}, {'J', 'u', 'n'}, {'J', 'u', 'l'}, {'A', 'u', 'g'},
+        {'S', 'e', 'p'}, {'O', 'c', 't'}, {'N', 'o', 'v'}, {'D', 'e', 'c'},
+    };
+
+    struct tm tm;
+    gmtime_r(&t, &tm);
+
+    // NOTE: strftime would do, but it looks at the locale and the names have to stay English
+    memcpy(buf, days[tm.tm_wday], 3);
+    buf[3] = ',';
+    buf[4] = ' ';
+    char* p = http_date_put2(buf + 5, tm.tm_mday);
+    *p++ = ' ';
+    memcpy(p, months[tm.tm_mon], 3);
+    p += 3;
+    *p++ = ' ';
+    int year = tm.tm_year + 1900;
+    p = http_date_put2(p, year / 100);
+    p = http_date_put2(p, year % 100);
+    *p++ = ' ';
+    p = http_date_put2(p, tm.tm_hour);
+    *p++ = ':';
+    p = http_date_put2(p, tm.tm_min);
+    *p++ = ':';
+    p = http_date_put2(p, tm.tm_sec);
+    memcpy(p, " GMT", 5);
+}
+
+static void http_date_publish(size_t slot, time_t now) {
+    http_date_format(now, dates[slot]);
+    atomic_store_explicit(&current_date, dates[slot], memory_order_release);
+}
+
+static void* http_date_clock(void* arg) {
+    size_t slot = 0;
+
+    while (true) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        slot = (slot + 1) % HTTP_DATE_SLOTS;
+        http_date_publish(slot, now.tv_sec);
+
+        // wake up right at the start of the next second
+        struct timespec next = {.tv_sec = now.tv_sec + 1, .tv_nsec = 0};
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL) != 0) {
+        }
+    }
+
+    return NULL;
+}
+
+void http_date_start(void) {
+    http_date_publish(0, time(NULL));
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, http_date_clock, NULL) != 0) {
+        die("could not start the clock thread");
+    }
+    pthread_detach(thread);
+}
+
+const char* http_date_now(void) {
+    const char* date = atomic_load_explicit(&current_date, memory_order_acquire);
+    if (date) {
+        return date;
+    }
+
+    // the clock is not running, this is the case in the benchmarks
+    static thread_local char fallback[HTTP_DATE_LEN + 1];
+    http_date_format(time(NULL), fallback);
+    return fallback;
+}
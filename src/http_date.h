@@ -0,0 +1,14 @@
+#pragma once
+
+#include <time.h>
+
+// "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_LEN 29
+
+/// Formats an RFC 7231 IMF-fixdate into `buf`, which has room for `HTTP_DATE_LEN` + 1 bytes
+void http_date_format(time_t t, char* buf);
+/// Starts the thread that refreshes the shared Date string once a second
+void http_date_start(void);
+/// The current date, `HTTP_DATE_LEN` bytes long and null terminated. It comes from the clock
+/// thread once it runs, so calling this costs a single atomic load
+const char* http_date_now(void);
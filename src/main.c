@@ -1,11 +1,17 @@
 #include <assert.h>
 #include <errno.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -16,10 +22,20 @@
 
 #define ARENA_H_IMPLEMENTATION
 #include "arena.h"
+#include "access_log.h"
+#include "bundle.h"
+#include "capture.h"
 #include "config.h"
+#include "connection.h"
 #include "files.h"
+#include "http_date.h"
+#include "metrics.h"
 #include "protocol.h"
+#include "microcache.h"
+#include "proxy.h"
 #include "thread_pool.h"
+#include "tls.h"
+#include "trace.h"
 #include "util.h"
 
 #define HTML_INDEX_FILE "index.html"
@@ -27,68 +43,154 @@
 
 #define TCP_BACKLOG_SIZE 256
 
-// shared state
-static HttppoFiles files;
+// how long a scrape may take as a whole, from its request to the end of the response
+#define HTTPPO_METRICS_TIMEOUT_MS 2000
 
-// thread-local state
-static thread_local Arena arena;
-static thread_local string_builder sb;
-static thread_local bool is_state_init = false;
+// seconds an overloaded client is asked to wait before retrying
+#define HTTPPO_RETRY_AFTER "1"
 
-void* server_worker(void* socket) {
-    if (!is_state_init) {
-        sb = sb_new(1024);
-        is_state_init = true;
+// shared state
+static HttppoFiles files;
+static HttppoBundle bundle = {.fd = -1};
+
+// precomputed so that shedding load costs next to nothing
+static const char overloaded_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: " HTTPPO_RETRY_AFTER "\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+/// Answers with the 503 response and closes the socket without ever blocking the caller
+static void server_reject(int sock) {
+    // NOTE: drain what the client already sent, closing with unread data resets the connection
+    // and the client would never see the response
+    char drain[1024];
+    while (recv(sock, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
     }
 
-    int sock = (int)(uintptr_t)socket;
+    // a TLS client would take the plain response for a broken handshake, it is only closed
+    if (!tls_enabled()) {
+        send(sock, overloaded_response, sizeof(overloaded_response) - 1,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(sock);
+}
 
-    char msg_buf[1024];
+/// Called by the thread pool instead of `conn_open` when the connection waited too long
+void* server_shed(void* socket) {
+    server_reject((int)(uintptr_t)socket);
+    atomic_fetch_sub(&conn_active_count, 1);
+    return NULL;
+}
 
-    int nread = recv(sock, msg_buf, sizeof(msg_buf), 0);
-    if (nread == -1) {
-        fprintf(stderr, "ERROR: could not read from socket %d: %s\n", sock, strerror(errno));
-        exit(1);
-    }
+/// Serves a hit from the bundle, its headers are rendered already and large bodies are sent with
+/// sendfile straight from the bundle
+static void server_respond_bundle(Connection* conn, HttpRequest const* req,
+                                  HttppoBundleEntry const* entry) {
+    size_t representation = httppo_bundle_pick(entry, http_req_header(req, "Accept-Encoding"));
+    HttppoBundleSpan body = entry->body[representation];
+    HttppoBundleSpan headers = entry->headers[representation];
+
+    HttpResponse res = http_res_new(STATUS_OK, sv_make(httppo_bundle_at(&bundle, body), body.size));
+    res.raw_headers = sv_make(httppo_bundle_at(&bundle, headers), headers.size);
+    conn_respond_body(conn, &res, &(ConnBody){.fd = bundle.fd, .offset = body.offset});
+}
 
-    assert(nread != 1024);
-    msg_buf[nread] = '\0';
+static void server_release_blob(void* blob) {
+    httppo_files_release(&files, blob);
+}
 
-    HttpRequest* req = http_req_parse(sv_make(msg_buf, nread), &arena);
-    assert(req);
+void server_handle_request(Connection* conn, HttpRequest const* req) {
+    const char* name = http_path_normalize(req->headers.path, req->arena);
+    if (!name) {
+        HttpResponse res = http_res_new(STATUS_BAD_REQUEST, sv_make(NULL, 0));
+        conn_respond(conn, &res);
+        return;
+    }
 
-    http_req_print(req);
+    // directories are served by their index file
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name[name_len - 1] == '/') {
+        char* index = arena_alloc(req->arena, name_len + sizeof(HTML_INDEX_FILE));
+        memcpy(index, name, name_len);
+        memcpy(index + name_len, HTML_INDEX_FILE, sizeof(HTML_INDEX_FILE));
+        name = index;
+    }
 
-    HttppoFile* file = NULL;
-    if (strcmp(req->headers.path, "/") == 0) {
-        file = httppo_files_get(&files, HTML_INDEX_FILE);
-    } else {
-        file = httppo_files_get(&files, req->headers.path + 1);
+    TRACE_MARK(TRACE_LOOKUP_START, lookup__start, name);
+    uint64_t lookup_start = metrics_now();
+    HttppoBundleEntry const* entry = bundle.data ? httppo_bundle_find(&bundle, name) : NULL;
+    if (entry) {
+        metrics_record_since(METRIC_CACHE_LOOKUP, lookup_start);
+        TRACE_MARK(TRACE_LOOKUP_END, lookup__end, name);
+        metrics_count(METRIC_BUNDLE_HITS, 1);
+        server_respond_bundle(conn, req, entry);
+        return;
     }
 
-    const char* res_body = file ? file->contents : NULL;
-    HttpStatusCode status_code = file ? STATUS_OK : STATUS_NOT_FOUND;
-    HttpResponse res = http_res_new(status_code, res_body, ht_make(NULL, NULL, 0));
-    http_res_encode_sb(&res, &sb);
-    const char* res_str = sb_to_cstr(&sb);
-    assert(send(sock, res_str, strlen(res_str), 0) != -1);
+    HttppoFileRef file;
+    bool found = httppo_files_get(&files, name, &file);
+    metrics_record_since(METRIC_CACHE_LOOKUP, lookup_start);
+    TRACE_MARK(TRACE_LOOKUP_END, lookup__end, name);
+    if (!found && proxy_enabled()) {
+        struct MicrocacheFill* fill = NULL;
+        if (!microcache_serve(conn, req, &fill)) {
+            proxy_forward(conn, req, fill);
+        }
+        return;
+    }
+    if (!found) {
+        HttpResponse res = http_res_new(STATUS_NOT_FOUND, sv_make(NULL, 0));
+        conn_respond(conn, &res);
+        return;
+    }
 
-    if (close(sock) == -1) {
-        fprintf(stderr, "ERROR: could not close socket %d: %s\n", sock, strerror(errno));
-        exit(1);
+    HttppoBlob* blob = file.blob;
+    string_view body = sv_make(blob->contents, blob->size);
+    CompressEncoding encoding;
+    HttppoFileVariant const* variant =
+        httppo_blob_pick_variant(blob, http_req_header(req, "Accept-Encoding"), &encoding);
+    if (variant) {
+        body = sv_make(variant->contents, variant->size);
     }
 
-    arena_free(&arena);
-    sb_clear(&sb);
-    http_res_free(&res);
-    http_req_free(req);
+    HttpResponse res = http_res_new(STATUS_OK, body);
+    http_headers_add(&res.headers, req->arena, "Content-Type", file.content_type);
+    http_headers_add(&res.headers, req->arena, "Last-Modified", file.last_modified);
+    if (file.compressible) {
+        http_headers_add(&res.headers, req->arena, "Vary", "Accept-Encoding");
+    }
+    if (variant) {
+        http_headers_add(&res.headers, req->arena, "Content-Encoding",
+                         compress_encoding_name(encoding));
+
+        // every representation needs a tag of its own, the coding goes inside the quotes
+        const char* coding = compress_encoding_name(encoding);
+        size_t etag_len = strlen(blob->etag);
+        size_t coding_len = strlen(coding);
+        char* etag = arena_alloc(req->arena, etag_len + coding_len + 2);
+        memcpy(etag, blob->etag, etag_len - 1);
+        etag[etag_len - 1] = '-';
+        memcpy(etag + etag_len, coding, coding_len);
+        etag[etag_len + coding_len] = '"';
+        etag[etag_len + coding_len + 1] = '\0';
+        http_headers_add(&res.headers, req->arena, "ETag", etag);
+    } else {
+        http_headers_add(&res.headers, req->arena, "ETag", blob->etag);
+    }
 
-    return NULL;
+    // NOTE: the blob stays referenced until the body is sent, a reload can't free it underneath
+    conn_respond_body(conn, &res,
+                      &(ConnBody){.fd = -1, .release = server_release_blob, .owner = blob});
 }
 
 static int server_sock = -1;
 
-void server(ThreadPool* thread_pool, const char* port) {
+void server(ThreadPool* thread_pool, HttppoConfig const* config) {
+    char port[6];
+    sprintf(port, "%d", config->port);
+
     struct addrinfo hints = {0};
     struct addrinfo* server_addr;
 
@@ -128,8 +230,18 @@ void server(ThreadPool* thread_pool, const char* port) {
         if (client_sock == -1) {
             goto fail;
         }
+        TRACE_PROBE(accept, client_sock);
 
-        threadpool_schedule(thread_pool, server_worker, (void*)(uintptr_t)client_sock);
+        if (atomic_load(&conn_active_count) >= config->max_conns) {
+            server_reject(client_sock);
+            continue;
+        }
+
+        atomic_fetch_add(&conn_active_count, 1);
+        if (!threadpool_schedule(thread_pool, conn_open, (void*)(uintptr_t)client_sock)) {
+            server_reject(client_sock);
+            atomic_fetch_sub(&conn_active_count, 1);
+        }
     }
 
 fail:
@@ -137,21 +249,229 @@ fail:
     die("could not accept the connection");
 }
 
-static void init_state(void) {
-    files = httppo_files_new(HTTPPO_FILES_CAP);
+/// Renders every metric of the server, including the ones that are only sampled when scraped
+static void server_render_metrics(string_builder* sb) {
+    metrics_render(sb);
+
+    const char* const pools[] = {"connections", "io_buffers", "jobs", "upstream_connections"};
+    SlabStats slabs[] = {conn_slab_stats(), conn_buffer_slab_stats(), threadpool_job_stats(),
+                         proxy_enabled() ? proxy_slab_stats() : (SlabStats){0}};
+    size_t pool_count = sizeof(slabs) / sizeof(slabs[0]) - !proxy_enabled();
+    metrics_render_slabs(sb, pools, slabs, pool_count);
+
+    HttppoFilesStats stats = httppo_files_stats(&files);
+    metrics_render_gauge(sb, "httppo_cache_files", "Paths in the file cache", stats.files);
+    metrics_render_gauge(sb, "httppo_cache_blobs", "Distinct contents in the file cache",
+                         stats.blobs);
+    metrics_render_gauge(sb, "httppo_cache_negative_entries", "Paths in the negative cache",
+                         stats.missing);
+    metrics_render_gauge(sb, "httppo_compress_pending", "Files waiting for the compressor",
+                         stats.compress_pending);
+    metrics_render_gauge(sb, "httppo_active_connections", "Connections being served",
+                         atomic_load(&conn_active_count));
+
+    if (microcache_enabled()) {
+        MicrocacheStats cache = microcache_stats();
+        metrics_render_gauge(sb, "httppo_microcache_entries", "Responses in the micro-cache",
+                             cache.entries);
+        metrics_render_gauge(sb, "httppo_microcache_bytes", "Bytes held by the micro-cache",
+                             cache.bytes);
+        metrics_render_gauge(sb, "httppo_microcache_fills",
+                             "Paths being fetched for the micro-cache", cache.fills);
+    }
+}
+
+/// Waits until the scraper's socket is ready for `events`, returns false once the deadline passed
+static bool server_metrics_wait(int client, short events, uint64_t deadline) {
+    while (true) {
+        uint64_t now = metrics_now();
+        if (now >= deadline) {
+            return false;
+        }
+        struct pollfd pfd = {.fd = client, .events = events};
+        int ready = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+        if (ready > 0) {
+            return true;
+        }
+        if (ready == -1 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+// NOTE: scrapes are rare and served one at a time on a thread of their own, so that a slow
+// scraper can never take a worker away from the clients. Each one gets a deadline, so a scraper
+// that stalls can't take the endpoint away from the others either
+static void* server_metrics(void* arg) {
+    static const char metrics_content_type[] = "Content-Type: text/plain; version=0.0.4\r\n";
+    static const char trace_content_type[] = "Content-Type: application/json\r\n";
+    int sock = (int)(uintptr_t)arg;
+    string_builder body = sb_new(64 * 1024);
+    string_builder out = sb_new(64 * 1024);
+
+    while (true) {
+        int client = accept(sock, NULL, NULL);
+        if (client == -1) {
+            continue;
+        }
+
+        // the request is read up to the end of its head, or as much of it as fits
+        uint64_t deadline = metrics_now() + (uint64_t)HTTPPO_METRICS_TIMEOUT_MS * 1000 * 1000;
+        char request[1024];
+        size_t request_len = 0;
+        bool complete = false;
+        while (!complete && request_len < sizeof(request) &&
+               server_metrics_wait(client, POLLIN, deadline)) {
+            ssize_t nread = recv(client, request + request_len, sizeof(request) - request_len,
+                                 MSG_DONTWAIT);
+            if (nread == -1 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (nread <= 0) {
+                break;
+            }
+            request_len += nread;
+            complete = sv_find_sub_cstr(sv_make(request, request_len), "\r\n\r\n") != -1;
+        }
+        if (!complete && request_len < sizeof(request)) {
+            close(client);
+            continue;
+        }
+
+        // `/trace` is the dump of the traced requests, anything else gets the metrics
+        bool trace = request_len >= 10 && memcmp(request, "GET /trace", 10) == 0;
+
+        sb_clear(&body);
+        HttpResponse res = http_res_new(STATUS_OK, sv_make(NULL, 0));
+        if (!trace) {
+            server_render_metrics(&body);
+            res.raw_headers = sv_make(metrics_content_type, sizeof(metrics_content_type) - 1);
+        } else if (trace_enabled()) {
+            trace_render(&body);
+            res.raw_headers = sv_make(trace_content_type, sizeof(trace_content_type) - 1);
+        } else {
+            res.status_code = STATUS_NOT_FOUND;
+        }
+        res.body = sv_make(body.items, body.len);
+        res.keep_alive = false;
+        sb_clear(&out);
+        http_res_encode_sb(&res, &out);
+
+        for (size_t off = 0; off < out.len && server_metrics_wait(client, POLLOUT, deadline);) {
+            ssize_t nsent =
+                send(client, out.items + off, out.len - off, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (nsent == -1 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (nsent <= 0) {
+                break;
+            }
+            off += nsent;
+        }
+        close(client);
+    }
+
+    return NULL;
+}
+
+static void server_start_metrics(HttppoConfig const* config) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        die("could not create the metrics socket");
+    }
+
+    int opt_value = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt_value, sizeof(opt_value));
+
+    // only reachable from the machine itself, the numbers say a lot about the server
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(config->metrics_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(sock, 16) == -1) {
+        die("could not listen on the metrics port");
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_metrics, (void*)(uintptr_t)sock) != 0) {
+        die("could not start the metrics thread");
+    }
+    pthread_detach(thread);
+}
+
+static void init_state(HttppoConfig const* config) {
+    http_date_start();
+    if (config->access_log) {
+        access_log_start(config->access_log, config->access_log_text);
+    }
+    if (config->capture) {
+        capture_start(config->capture, config->capture_sample);
+    }
+    if (config->trace_sample) {
+        trace_start(config->trace_sample);
+    }
+    if (config->tls_cert) {
+        tls_start(config->tls_cert, config->tls_key, config->ktls);
+    }
+    if (config->upstreams) {
+        proxy_start(config->upstreams);
+    }
+    files = httppo_files_new(HTTPPO_FILES_CAP, config->root);
+    httppo_files_start_compressor(&files);
+    httppo_files_start_watcher(&files);
+    if (config->microcache) {
+        microcache_start(&files);
+    }
+    if (config->bundle) {
+        if (!httppo_bundle_open(&bundle, config->bundle)) {
+            die("could not open the bundle");
+        }
+        printf("serving %zu files from the bundle %s\n", bundle.count, config->bundle);
+        fflush(stdout);
+    }
+    conn_init(server_handle_request, config->huge_pages ? ARENA_HUGE_PAGES : 0);
+}
+
+/// Loads the docroot into the file cache on the worker threads and reports what it cost
+static void server_preload(ThreadPool* thread_pool, HttppoConfig const* config) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    HttppoPreloadStats stats = httppo_files_preload(&files, thread_pool, config->preload_max);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("preloaded %zu files from %zu directories in %.1f ms: %.2f MiB of contents (%.2f MiB "
+           "unique), %.2f MiB of compressed variants, peak RSS %.2f MiB\n",
+           stats.files, stats.directories, elapsed_ms, stats.bytes / (1024.0 * 1024.0),
+           stats.unique_bytes / (1024.0 * 1024.0), stats.variant_bytes / (1024.0 * 1024.0),
+           usage.ru_maxrss / 1024.0);
+    fflush(stdout);
 }
 
 int main(int argc, char* argv[]) {
     HttppoConfig config = httppo_config_parse(argc, argv);
 
-    ThreadPool thread_pool = threadpool_init(config.threads);
+    ThreadPool thread_pool = threadpool_init(config.threads, config.queue_cap, server_shed);
 
-    char port[6];
-    sprintf(port, "%d", config.port);
-
-    init_state();
+    init_state(&config);
+    if (config.preload) {
+        server_preload(&thread_pool, &config);
+    }
+    // NOTE: started after the preload, whose files would all look cold to the first snapshot
+    if (config.snapshot) {
+        httppo_files_start_snapshots(&files, config.snapshot);
+    }
+    if (config.metrics_port) {
+        server_start_metrics(&config);
+    }
 
-    server(&thread_pool, port);
+    server(&thread_pool, &config);
     threadpool_free(&thread_pool);
 
     return 0;
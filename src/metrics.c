@@ -0,0 +1,238 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the histogram buckets handed to Prometheus, powers of two from ~1us to ~34s
+#define METRICS_EXPORT_MIN_EXPONENT 10
+#define METRICS_EXPORT_MAX_EXPONENT 35
+
+typedef struct {
+    const char* name;
+    const char* help;
+} MetricInfo;
+
+static const MetricInfo metrics_counter_info[METRIC_COUNTER_COUNT] = {
+    [METRIC_CONNECTIONS] = {"httppo_connections_total", "Connections taken over by a worker"},
+    [METRIC_REQUESTS] = {"httppo_requests_total", "Requests parsed"},
+    [METRIC_BAD_REQUESTS] = {"httppo_bad_requests_total", "Requests answered with 400"},
+    [METRIC_BYTES_OUT] = {"httppo_bytes_out_total", "Bytes written to client sockets"},
+    [METRIC_JOBS_SHED] = {"httppo_jobs_shed_total", "Jobs shed because of their queueing delay"},
+    [METRIC_CACHE_HITS] = {"httppo_cache_hits_total", "Requests served from the file cache"},
+    [METRIC_CACHE_MISSES] = {"httppo_cache_misses_total", "Files read into the file cache"},
+    [METRIC_CACHE_NEGATIVE_HITS] = {"httppo_cache_negative_hits_total",
+                                    "Requests answered from the negative cache"},
+    [METRIC_CACHE_EVICTIONS] = {"httppo_cache_evictions_total",
+                                "Cached contents dropped after their last reference"},
+    [METRIC_BUNDLE_HITS] = {"httppo_bundle_hits_total", "Requests served from the bundle"},
+    [METRIC_ACCESS_LOG_DROPPED] = {"httppo_access_log_dropped_total",
+                                   "Access log records dropped because a ring was full"},
+    [METRIC_CAPTURE_DROPPED] = {"httppo_capture_dropped_total",
+                                "Capture records dropped because the writer fell behind"},
+    [METRIC_TLS_HANDSHAKES] = {"httppo_tls_handshakes_total", "Completed TLS handshakes"},
+    [METRIC_TLS_RESUMED] = {"httppo_tls_resumed_total",
+                            "TLS handshakes that resumed a cached session or a ticket"},
+    [METRIC_TLS_HANDSHAKE_FAILURES] = {"httppo_tls_handshake_failures_total",
+                                       "TLS handshakes that failed"},
+    [METRIC_TLS_KTLS] = {"httppo_tls_ktls_total",
+                         "TLS connections whose sends the kernel encrypts"},
+    [METRIC_PROXY_REQUESTS] = {"httppo_proxy_requests_total", "Requests passed on to an upstream"},
+    [METRIC_PROXY_FAILURES] = {"httppo_proxy_failures_total",
+                               "Proxied requests answered with 502 or 504, or cut off"},
+    [METRIC_PROXY_CONNECTS] = {"httppo_proxy_connects_total", "Connections opened to upstreams"},
+    [METRIC_PROXY_REUSED] = {"httppo_proxy_reused_total",
+                             "Proxied requests sent over a pooled upstream connection"},
+    [METRIC_MICROCACHE_HITS] = {"httppo_microcache_hits_total",
+                                "Requests answered with a fresh cached response"},
+    [METRIC_MICROCACHE_STALE_HITS] =
+        {"httppo_microcache_stale_hits_total",
+         "Requests answered with a stale response that is being fetched again"},
+    [METRIC_MICROCACHE_MISSES] = {"httppo_microcache_misses_total",
+                                  "Cacheable requests forwarded to fetch their response"},
+    [METRIC_MICROCACHE_COALESCED] = {"httppo_microcache_coalesced_total",
+                                     "Requests that waited for the response another one fetched"},
+    [METRIC_MICROCACHE_STORES] = {"httppo_microcache_stores_total", "Responses cached"},
+    [METRIC_MICROCACHE_EVICTIONS] = {"httppo_microcache_evictions_total",
+                                     "Cached responses dropped to make room"},
+};
+
+static const MetricInfo metrics_gauge_info[METRIC_GAUGE_COUNT] = {
+    [METRIC_ARENA_MAPPED_BYTES] = {"httppo_arena_mapped_bytes",
+                                   "Bytes mapped for the request arenas"},
+    [METRIC_ARENA_HIGH_WATER_BYTES] = {"httppo_arena_high_water_bytes",
+                                       "Most bytes a request arena handed out between two resets"},
+};
+
+// the rest are summed over the threads
+static const bool metrics_gauge_max[METRIC_GAUGE_COUNT] = {
+    [METRIC_ARENA_HIGH_WATER_BYTES] = true,
+};
+
+static const MetricInfo metrics_histogram_info[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_FIRST_BYTE] = {"httppo_first_byte_seconds",
+                           "Time from accepting a connection to its first response byte"},
+    [METRIC_PARSE] = {"httppo_parse_seconds", "Time spent parsing a request"},
+    [METRIC_CACHE_LOOKUP] = {"httppo_cache_lookup_seconds",
+                             "Time spent looking a request up in the bundle and the file cache"},
+    [METRIC_SEND] = {"httppo_send_seconds",
+                     "Time from encoding a response to sending its last byte"},
+    [METRIC_QUEUE_WAIT] = {"httppo_queue_wait_seconds",
+                           "Time a new connection waited in a worker queue"},
+};
+
+static const double metrics_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+thread_local MetricsShard* metrics_current_shard = NULL;
+
+static MetricsShard* metrics_shards = NULL;
+static pthread_mutex_t metrics_shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+MetricsShard* metrics_shard_new(void) {
+    size_t size = (sizeof(MetricsShard) + 63) & ~(size_t)63;
+    MetricsShard* shard = aligned_alloc(64, size);
+    if (!shard) {
+        abort();
+    }
+    memset(shard, 0, size);
+
+    pthread_mutex_lock(&metrics_shards_mutex);
+    shard->next = metrics_shards;
+    metrics_shards = shard;
+    pthread_mutex_unlock(&metrics_shards_mutex);
+
+    metrics_current_shard = shard;
+    return shard;
+}
+
+static uint64_t metrics_load(atomic_uint_fast64_t const* value) {
+    return atomic_load_explicit((atomic_uint_fast64_t*)value, memory_order_relaxed);
+}
+
+static void metrics_render_header(string_builder* sb, MetricInfo const* info, const char* type) {
+    sb_sprintf(sb, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, type);
+}
+
+static void metrics_render_histogram(string_builder* sb, MetricInfo const* info,
+                                     uint64_t const* buckets, uint64_t sum) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        total += buckets[i];
+    }
+
+    metrics_render_header(sb, info, "histogram");
+
+    // NOTE: the fine buckets never straddle a power of two, so the exported ones are exact
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (size_t exponent = METRICS_EXPORT_MIN_EXPONENT; exponent <= METRICS_EXPORT_MAX_EXPONENT;
+         exponent++) {
+        uint64_t le = (uint64_t)1 << exponent;
+        while (bucket < METRICS_BUCKETS && metrics_bucket_upper(bucket) < le) {
+            cumulative += buckets[bucket++];
+        }
+        sb_sprintf(sb, "%s_bucket{le=\"%g\"} %lu\n", info->name, le / 1e9, cumulative);
+    }
+    sb_sprintf(sb, "%s_bucket{le=\"+Inf\"} %lu\n", info->name, total);
+    sb_sprintf(sb, "%s_sum %.9f\n%s_count %lu\n", info->name, sum / 1e9, info->name, total);
+
+    // the precise quantiles are what the fine buckets are kept for
+    sb_sprintf(sb, "# HELP %s_quantile %s, quantiles\n# TYPE %s_quantile gauge\n", info->name,
+               info->help, info->name);
+    for (size_t q = 0; q < sizeof(metrics_quantiles) / sizeof(metrics_quantiles[0]); q++) {
+        uint64_t rank = (uint64_t)(metrics_quantiles[q] * total);
+        uint64_t seen = 0;
+        size_t i = 0;
+        for (; i < METRICS_BUCKETS - 1; i++) {
+            seen += buckets[i];
+            if (seen > rank) {
+                break;
+            }
+        }
+
+        double value = total ? metrics_bucket_upper(i) / 1e9 : 0;
+        sb_sprintf(sb, "%s_quantile{quantile=\"%g\"} %.9f\n", info->name, metrics_quantiles[q],
+                   value);
+    }
+}
+
+void metrics_render(string_builder* sb) {
+    uint64_t counters[METRIC_COUNTER_COUNT] = {0};
+    uint64_t gauges[METRIC_GAUGE_COUNT] = {0};
+    static uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRICS_BUCKETS];
+    uint64_t sums[METRIC_HISTOGRAM_COUNT] = {0};
+    memset(buckets, 0, sizeof(buckets));
+
+    // NOTE: shards are never freed, so the list can be walked while threads keep recording. The
+    // totals are a little inconsistent with each other, which scrapes tolerate
+    pthread_mutex_lock(&metrics_shards_mutex);
+    MetricsShard* shards = metrics_shards;
+    pthread_mutex_unlock(&metrics_shards_mutex);
+
+    for (MetricsShard* shard = shards; shard; shard = shard->next) {
+        for (size_t i = 0; i < METRIC_COUNTER_COUNT; i++) {
+            counters[i] += metrics_load(&shard->counters[i]);
+        }
+
+        for (size_t i = 0; i < METRIC_GAUGE_COUNT; i++) {
+            uint64_t value = metrics_load(&shard->gauges[i]);
+            if (!metrics_gauge_max[i]) {
+                gauges[i] += value;
+            } else if (value > gauges[i]) {
+                gauges[i] = value;
+            }
+        }
+
+        for (size_t h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+            for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+                buckets[h][i] += metrics_load(&shard->histograms[h].buckets[i]);
+            }
+            sums[h] += metrics_load(&shard->histograms[h].sum);
+        }
+    }
+
+    for (size_t i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        metrics_render_header(sb, &metrics_counter_info[i], "counter");
+        sb_sprintf(sb, "%s %lu\n", metrics_counter_info[i].name, counters[i]);
+    }
+
+    for (size_t i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        metrics_render_header(sb, &metrics_gauge_info[i], "gauge");
+        sb_sprintf(sb, "%s %lu\n", metrics_gauge_info[i].name, gauges[i]);
+    }
+
+    for (size_t h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        metrics_render_histogram(sb, &metrics_histogram_info[h], buckets[h], sums[h]);
+    }
+}
+
+void metrics_render_gauge(string_builder* sb, const char* name, const char* help, double value) {
+    MetricInfo info = {name, help};
+    metrics_render_header(sb, &info, "gauge");
+    sb_sprintf(sb, "%s %.17g\n", name, value);
+}
+
+void metrics_render_slabs(string_builder* sb, const char* const* pools, SlabStats const* stats,
+                          size_t count) {
+    static const struct {
+        MetricInfo info;
+        size_t offset;
+    } fields[] = {
+        {{"httppo_slab_slabs", "Slabs mapped by the pool"}, offsetof(SlabStats, slabs)},
+        {{"httppo_slab_capacity", "Objects carved out of the slabs"},
+         offsetof(SlabStats, capacity)},
+        {{"httppo_slab_in_use", "Objects currently allocated"}, offsetof(SlabStats, in_use)},
+        {{"httppo_slab_remote_frees_total", "Objects freed by a thread that does not own them"},
+         offsetof(SlabStats, remote_frees)},
+    };
+
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+        bool total = strstr(fields[f].info.name, "_total") != NULL;
+        metrics_render_header(sb, &fields[f].info, total ? "counter" : "gauge");
+        for (size_t i = 0; i < count; i++) {
+            size_t value = *(size_t const*)((char const*)&stats[i] + fields[f].offset);
+            sb_sprintf(sb, "%s{pool=\"%s\"} %zu\n", fields[f].info.name, pools[i], value);
+        }
+    }
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <threads.h>
+#include <time.h>
+
+#include "base.h"
+#include "slab.h"
+
+// Every thread records into a shard of its own, so recording takes no lock and writes no cache
+// line another thread writes. Shards are only summed up when the metrics are scraped
+
+// histograms keep 2^METRICS_SUB_BUCKET_BITS linear buckets per power of two, ~6% precision
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+// values from 2^METRICS_MAX_EXPONENT ns (~18 minutes) on all land in the last bucket
+#define METRICS_MAX_EXPONENT 40
+#define METRICS_BUCKETS \
+    ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+
+typedef enum {
+    METRIC_CONNECTIONS,
+    METRIC_REQUESTS,
+    METRIC_BAD_REQUESTS,
+    METRIC_BYTES_OUT,
+    METRIC_JOBS_SHED,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_CACHE_NEGATIVE_HITS,
+    METRIC_CACHE_EVICTIONS,
+    METRIC_BUNDLE_HITS,
+    METRIC_ACCESS_LOG_DROPPED,
+    METRIC_CAPTURE_DROPPED,
+    METRIC_TLS_HANDSHAKES,
+    METRIC_TLS_RESUMED,
+    METRIC_TLS_HANDSHAKE_FAILURES,
+    METRIC_TLS_KTLS,
+    METRIC_PROXY_REQUESTS,
+    METRIC_PROXY_FAILURES,
+    METRIC_PROXY_CONNECTS,
+    METRIC_PROXY_REUSED,
+    METRIC_MICROCACHE_HITS,
+    METRIC_MICROCACHE_STALE_HITS,
+    METRIC_MICROCACHE_MISSES,
+    METRIC_MICROCACHE_COALESCED,
+    METRIC_MICROCACHE_STORES,
+    METRIC_MICROCACHE_EVICTIONS,
+    METRIC_COUNTER_COUNT,
+} MetricCounter;
+
+/// Gauges are set by the thread they describe and summed over all threads, unless they are marked
+/// as maxima
+typedef enum {
+    METRIC_ARENA_MAPPED_BYTES,
+    METRIC_ARENA_HIGH_WATER_BYTES,
+    METRIC_GAUGE_COUNT,
+} MetricGauge;
+
+/// Latencies in nanoseconds
+typedef enum {
+    METRIC_FIRST_BYTE,
+    METRIC_PARSE,
+    METRIC_CACHE_LOOKUP,
+    METRIC_SEND,
+    METRIC_QUEUE_WAIT,
+    METRIC_HISTOGRAM_COUNT,
+} MetricHistogram;
+
+typedef struct {
+    atomic_uint_fast64_t buckets[METRICS_BUCKETS];
+    atomic_uint_fast64_t sum;
+} MetricsHistogramShard;
+
+/// The metrics of one thread, aligned so that no two shards share a cache line
+typedef struct MetricsShard {
+    _Alignas(64) atomic_uint_fast64_t counters[METRIC_COUNTER_COUNT];
+    atomic_uint_fast64_t gauges[METRIC_GAUGE_COUNT];
+    MetricsHistogramShard histograms[METRIC_HISTOGRAM_COUNT];
+    struct MetricsShard* next;
+} MetricsShard;
+
+extern thread_local MetricsShard* metrics_current_shard;
+
+/// Creates and registers the shard of the calling thread
+MetricsShard* metrics_shard_new(void);
+
+/// The shard of the calling thread, created on its first use
+static inline MetricsShard* metrics_shard(void) {
+    return metrics_current_shard ? metrics_current_shard : metrics_shard_new();
+}
+
+static inline uint64_t metrics_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+// NOTE: a shard is only ever written by its own thread, so a relaxed load and store replace the
+// locked read-modify-write an atomic add would be
+static inline void metrics_add(atomic_uint_fast64_t* value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline void metrics_count(MetricCounter counter, uint64_t n) {
+    MetricsShard* shard = metrics_shard();
+    metrics_add(&shard->counters[counter], n);
+}
+
+static inline void metrics_gauge_set(MetricGauge gauge, uint64_t value) {
+    atomic_store_explicit(&metrics_shard()->gauges[gauge], value, memory_order_relaxed);
+}
+
+static inline size_t metrics_bucket(uint64_t value) {
+    if (value < METRICS_SUB_BUCKETS) {
+        return value;
+    }
+
+    size_t exponent = 63 - __builtin_clzll(value);
+    if (exponent > METRICS_MAX_EXPONENT) {
+        return METRICS_BUCKETS - 1;
+    }
+
+    size_t sub = (value >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+/// The largest value that lands in the bucket
+static inline uint64_t metrics_bucket_upper(size_t bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    size_t exponent = bucket / METRICS_SUB_BUCKETS - 1 + METRICS_SUB_BUCKET_BITS;
+    uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+    uint64_t width = (uint64_t)1 << (exponent - METRICS_SUB_BUCKET_BITS);
+    return (METRICS_SUB_BUCKETS + sub) * width + width - 1;
+}
+
+static inline void metrics_record(MetricHistogram histogram, uint64_t nsec) {
+    MetricsHistogramShard* h = &metrics_shard()->histograms[histogram];
+    metrics_add(&h->buckets[metrics_bucket(nsec)], 1);
+    metrics_add(&h->sum, nsec);
+}
+
+/// Records the time since `start`, which came from `metrics_now`
+static inline void metrics_record_since(MetricHistogram histogram, uint64_t start) {
+    metrics_record(histogram, metrics_now() - start);
+}
+
+/// Appends every counter, gauge and histogram in the Prometheus text format
+void metrics_render(string_builder* sb);
+/// Appends the stats of slab pools as gauges labelled with the name of each pool
+void metrics_render_slabs(string_builder* sb, const char* const* pools, SlabStats const* stats,
+                          size_t count);
+/// Appends a single gauge
+void metrics_render_gauge(string_builder* sb, const char* name, const char* help, double value);
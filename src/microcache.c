@@ -0,0 +1,773 @@
+#include "microcache.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "arena.h"
+#include "hash.h"
+#include "metrics.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#define MICROCACHE_NSEC (1000ull * 1000 * 1000)
+// entries kept, vary and pass markers included
+#define MICROCACHE_CAP 4096
+#define MICROCACHE_MAX_BYTES (64 * 1024 * 1024)
+// larger responses are relayed without being kept
+#define MICROCACHE_MAX_BODY (1024 * 1024)
+// how long a response without max-age is fresh
+#define MICROCACHE_TTL_NS MICROCACHE_NSEC
+#define MICROCACHE_MAX_TTL_NS (60 * MICROCACHE_NSEC)
+// how long a response is served stale unless it asks for something else
+#define MICROCACHE_STALE_NS (10 * MICROCACHE_NSEC)
+// a key whose response could not be cached is forwarded without waiting on a fill for this long
+#define MICROCACHE_PASS_NS (2 * MICROCACHE_NSEC)
+// a request that waited this long on fills that failed goes upstream on its own
+#define MICROCACHE_WAIT_MAX_NS (5 * MICROCACHE_NSEC)
+// a parked request checks this often whether its wake-up job got lost to a full queue
+#define MICROCACHE_WAIT_POLL_MS 1000
+// the longest header name a response can vary on
+#define MICROCACHE_VARY_NAME_CAP 64
+
+typedef enum {
+    MICROCACHE_RESPONSE,
+    /// stands in for the responses of a path that vary, it names the headers to key them on
+    MICROCACHE_VARY,
+    /// the last response of the key could not be cached, requests go straight through
+    MICROCACHE_PASS,
+} MicrocacheKind;
+
+typedef struct {
+    /// NULL once the entry was removed
+    char* key;
+    MicrocacheKind kind;
+    uint16_t status;
+    /// the header lines of the response, each ending in CRLF. The comma separated lowercase
+    /// header names for a vary marker
+    char* headers;
+    size_t headers_len;
+    /// a reference of the entry's own
+    HttppoBlob* body;
+    /// what the entry counts against `MICROCACHE_MAX_BYTES`
+    size_t bytes;
+    uint64_t stored_at;
+    uint64_t fresh_until;
+    /// the entry is dropped once this passes
+    uint64_t stale_until;
+    /// a request is fetching the response again, the others are served the stale one meanwhile
+    bool revalidating;
+} MicrocacheEntry;
+
+typedef enum {
+    MICROCACHE_WAITER_PARKED,
+    /// a job on the waiter's worker will wake it up
+    MICROCACHE_WAITER_WOKEN,
+    /// the job could not be queued, the waiter's timer wakes it up instead
+    MICROCACHE_WAITER_LOST,
+} MicrocacheWaiterState;
+
+/// A request parked on the fill of its key, owned by the worker of its connection
+typedef struct MicrocacheWaiter {
+    Timer timer;
+    /// NULL once the connection of a waiting stream closed
+    Connection* conn;
+    WorkerThread* thread;
+    /// only touched under the cache lock
+    MicrocacheWaiterState state;
+    struct MicrocacheWaiter* next;
+
+    /// the deferred HTTP/2 stream that waits, 0 if the whole connection is parked
+    uint32_t stream;
+    /// a copy of the stream's request, the arena it came from is reset once its handler returns
+    HttpRequest* request;
+    uint64_t parked_at;
+    /// the next waiting stream of the same connection
+    struct MicrocacheWaiter* conn_next;
+} MicrocacheWaiter;
+
+typedef struct MicrocacheFill {
+    /// the key that missed, which the fill is found by in `fills`
+    char* key;
+    /// "<method> <host> <path>", where the vary marker of the path goes
+    char* base;
+    /// a copy of the request's headers, the response may vary on any of them
+    HttpHeaders request_headers;
+    /// a stale entry is being fetched again
+    bool revalidation;
+    /// parked requests, guarded by the cache lock
+    MicrocacheWaiter* waiters;
+
+    uint16_t status;
+    string_builder headers;
+    /// the lowercase header names of the response's Vary, separated by commas
+    string_builder vary;
+    uint64_t ttl_ns;
+    uint64_t stale_ns;
+    string_builder body;
+} MicrocacheFill;
+
+typedef enum {
+    MICROCACHE_FILL_STORE,
+    MICROCACHE_FILL_PASS,
+    MICROCACHE_FILL_FAIL,
+} MicrocacheFillOutcome;
+
+static HttppoFiles* cache_files = NULL;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/// maps keys to their entries in `ring`
+static hash_table entries;
+/// entries in the order they were stored, the oldest one is evicted when the cache is full
+static MicrocacheEntry* ring;
+static size_t ring_head = 0;
+static size_t ring_len = 0;
+static size_t cache_bytes = 0;
+/// maps the keys being fetched to their fills
+static hash_table fills;
+
+// keys are built here before they are looked up
+static thread_local string_builder key;
+
+void microcache_start(HttppoFiles* files) {
+    cache_files = files;
+    entries = ht_make(hash_djb2, hash_str_eq, MICROCACHE_CAP);
+    fills = ht_make(hash_djb2, hash_str_eq, 64);
+    ring = calloc(MICROCACHE_CAP, sizeof(MicrocacheEntry));
+    if (!ring) {
+        die("could not allocate the microcache");
+    }
+}
+
+bool microcache_enabled(void) {
+    return cache_files != NULL;
+}
+
+static string_view microcache_trim(string_view sv) {
+    while (sv.size && (sv.ptr[0] == ' ' || sv.ptr[0] == '\t')) {
+        sv = sv_slice_end(sv, 1);
+    }
+    while (sv.size && (sv.ptr[sv.size - 1] == ' ' || sv.ptr[sv.size - 1] == '\t')) {
+        sv.size--;
+    }
+    return sv;
+}
+
+/// Appends the values of the headers the response varies on to the key and terminates it
+static void microcache_vary_key(string_builder* key, const char* names,
+                                HttpHeaders const* headers) {
+    char name[MICROCACHE_VARY_NAME_CAP];
+    for (const char* p = names; *p;) {
+        size_t len = strcspn(p, ",");
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len + (p[len] == ',');
+
+        const char* value = http_headers_find(headers, name);
+        sb_push(key, '\n');
+        if (value) {
+            sb_push_cstr(key, value);
+        }
+    }
+    sb_push(key, '\0');
+}
+
+/// Frees an entry, the caller removes it from the table
+static void microcache_entry_clear(MicrocacheEntry* entry) {
+    if (entry->body) {
+        httppo_files_release(cache_files, entry->body);
+    }
+    cache_bytes -= entry->bytes;
+    free(entry->headers);
+    free(entry->key);
+    *entry = (MicrocacheEntry){0};
+}
+
+static void microcache_remove(const char* key) {
+    MicrocacheEntry* entry = ht_delete(&entries, key);
+    if (entry) {
+        microcache_entry_clear(entry);
+    }
+}
+
+/// The entry of the key, expired ones are dropped on the way
+static MicrocacheEntry* microcache_find(const char* key, uint64_t now) {
+    MicrocacheEntry* entry = ht_find(&entries, key);
+    if (entry && now >= entry->stale_until) {
+        microcache_remove(key);
+        return NULL;
+    }
+    return entry;
+}
+
+/// Replaces the entry of the key, evicting the oldest entries to make room
+static MicrocacheEntry* microcache_put(const char* key, MicrocacheKind kind, size_t bytes) {
+    microcache_remove(key);
+
+    while (ring_len == MICROCACHE_CAP ||
+           (ring_len && cache_bytes + bytes > MICROCACHE_MAX_BYTES)) {
+        MicrocacheEntry* oldest = &ring[ring_head];
+        if (oldest->key) {
+            microcache_remove(oldest->key);
+            metrics_count(METRIC_MICROCACHE_EVICTIONS, 1);
+        }
+        ring_head = (ring_head + 1) % MICROCACHE_CAP;
+        ring_len--;
+    }
+
+    size_t slot = (ring_head + ring_len) % MICROCACHE_CAP;
+    ring_len++;
+
+    MicrocacheEntry* entry = &ring[slot];
+    entry->key = (char*)sv_dup(sv_make(key, strlen(key)));
+    entry->kind = kind;
+    entry->bytes = bytes;
+    cache_bytes += bytes;
+    ht_add(&entries, entry->key, entry);
+    return entry;
+}
+
+/// Whether the request may be answered from the cache at all
+static bool microcache_request_cacheable(HttpRequest const* req) {
+    if (strcmp(req->headers.method, "GET") != 0 || req->body_len || req->body_streamed ||
+        http_req_header(req, "Authorization")) {
+        return false;
+    }
+
+    // the client asks for a response straight from the origin
+    const char* cache_control = http_req_header(req, "Cache-Control");
+    string_view directives =
+        cache_control ? sv_make(cache_control, strlen(cache_control)) : sv_make(NULL, 0);
+    if (http_header_has(directives, "no-cache") || http_header_has(directives, "no-store")) {
+        return false;
+    }
+    const char* pragma = http_req_header(req, "Pragma");
+    return !pragma || !http_header_has(sv_make(pragma, strlen(pragma)), "no-cache");
+}
+
+/// Whether the upstream's response to the request can be stored. Conditional and range requests
+/// get a 304 or 206 that stands for no full response, they are still answered from the cache
+static bool microcache_request_fills(HttpRequest const* req) {
+    return !http_req_header(req, "If-None-Match") && !http_req_header(req, "If-Modified-Since") &&
+           !http_req_header(req, "If-Match") && !http_req_header(req, "If-Unmodified-Since") &&
+           !http_req_header(req, "If-Range") && !http_req_header(req, "Range");
+}
+
+static void microcache_release_body(void* blob) {
+    httppo_files_release(cache_files, blob);
+}
+
+/// Answers from the entry, the cache lock is held and released here
+static void microcache_respond(Connection* conn, HttpRequest const* req,
+                               MicrocacheEntry const* entry, uint64_t now) {
+    // NOTE: the entry may be replaced as soon as the lock is gone, what the response needs is
+    // copied out first
+    char* headers = arena_alloc(req->arena, entry->headers_len + 32);
+    memcpy(headers, entry->headers, entry->headers_len);
+    size_t headers_len =
+        entry->headers_len + sprintf(headers + entry->headers_len, "Age: %" PRIu64 "\r\n",
+                                     (uint64_t)((now - entry->stored_at) / MICROCACHE_NSEC));
+    HttppoBlob* body = httppo_blob_ref(entry->body);
+    HttpStatusCode status = entry->status;
+    pthread_mutex_unlock(&cache_mutex);
+
+    HttpResponse res = http_res_new(status, sv_make(body->contents, body->size));
+    res.raw_headers = sv_make(headers, headers_len);
+    conn_respond_body(conn, &res,
+                      &(ConnBody){.fd = -1, .release = microcache_release_body, .owner = body});
+}
+
+/// Copies `src` to `*p`, which is moved past it
+static const char* microcache_copy_str(char** p, const char* src) {
+    size_t len = strlen(src) + 1;
+    char* dst = memcpy(*p, src, len);
+    *p += len;
+    return dst;
+}
+
+/// Copies the request of an HTTP/2 stream into a single allocation. It has no body, and its
+/// version is a static string
+static HttpRequest* microcache_request_copy(HttpRequest const* req) {
+    HttpHeaders const* headers = &req->headers.headers;
+    size_t size = sizeof(HttpRequest) + sizeof(HttpHeader) * headers->len;
+    size_t strings = strlen(req->headers.method) + strlen(req->headers.path) + 2;
+    for (size_t i = 0; i < headers->len; i++) {
+        strings += strlen(headers->items[i].key) + strlen(headers->items[i].value) + 2;
+    }
+
+    HttpRequest* copy = malloc(size + strings);
+    if (!copy) {
+        die("could not allocate a microcache waiter");
+    }
+    char* p = (char*)copy + size;
+    *copy = (HttpRequest){
+        .headers = {.http_version = req->headers.http_version},
+        .body = "",
+    };
+    copy->headers.method = microcache_copy_str(&p, req->headers.method);
+    copy->headers.path = microcache_copy_str(&p, req->headers.path);
+    copy->headers.headers.items = (HttpHeader*)(copy + 1);
+    copy->headers.headers.len = headers->len;
+    copy->headers.headers.cap = headers->len;
+    for (size_t i = 0; i < headers->len; i++) {
+        copy->headers.headers.items[i] = (HttpHeader){
+            .key = microcache_copy_str(&p, headers->items[i].key),
+            .value = microcache_copy_str(&p, headers->items[i].value),
+        };
+    }
+    return copy;
+}
+
+static void microcache_waiter_run(MicrocacheWaiter* waiter) {
+    threadpool_timer_cancel(&waiter->timer);
+    Connection* conn = waiter->conn;
+    if (!waiter->request) {
+        free(waiter);
+        // the request is looked up again, the response it waited for is most likely in by now
+        conn_unpark(conn);
+        return;
+    }
+
+    // NOTE: a stream whose connection closed meanwhile only has its waiter to free
+    if (conn) {
+        for (MicrocacheWaiter** link = &conn->h2_waiters; *link; link = &(*link)->conn_next) {
+            if (*link == waiter) {
+                *link = waiter->conn_next;
+                break;
+            }
+        }
+        conn_unpark_stream(conn, waiter->stream, waiter->request, waiter->parked_at);
+    }
+    free(waiter->request);
+    free(waiter);
+}
+
+static void* microcache_wake(void* arg) {
+    microcache_waiter_run(arg);
+    return NULL;
+}
+
+static void microcache_wait_timeout(Timer* timer) {
+    MicrocacheWaiter* waiter = container_of(timer, MicrocacheWaiter, timer);
+
+    pthread_mutex_lock(&cache_mutex);
+    MicrocacheWaiterState state = waiter->state;
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (state == MICROCACHE_WAITER_LOST) {
+        microcache_waiter_run(waiter);
+        return;
+    }
+    threadpool_timer_arm(&waiter->timer, MICROCACHE_WAIT_POLL_MS);
+}
+
+/// Starts a fill for the key that missed, the cache lock is held
+static MicrocacheFill* microcache_fill_new(HttpRequest const* req, size_t base_len,
+                                           bool revalidation) {
+    MicrocacheFill* fill = calloc(1, sizeof(MicrocacheFill));
+    if (!fill) {
+        die("could not allocate a microcache fill");
+    }
+
+    fill->key = (char*)sv_dup(sv_make(key.items, strlen(key.items)));
+    fill->base = (char*)sv_dup(sv_make(key.items, base_len));
+    fill->revalidation = revalidation;
+
+    HttpHeaders const* headers = &req->headers.headers;
+    fill->request_headers.items = malloc(sizeof(HttpHeader) * (headers->len + 1));
+    for (size_t i = 0; i < headers->len; i++) {
+        HttpHeader const* header = &headers->items[i];
+        fill->request_headers.items[i] = (HttpHeader){
+            .key = sv_dup(sv_make(header->key, strlen(header->key))),
+            .value = sv_dup(sv_make(header->value, strlen(header->value))),
+        };
+    }
+    fill->request_headers.len = headers->len;
+    fill->request_headers.cap = headers->len;
+
+    fill->ttl_ns = MICROCACHE_TTL_NS;
+    fill->stale_ns = MICROCACHE_STALE_NS;
+    ht_add(&fills, fill->key, fill);
+    return fill;
+}
+
+bool microcache_serve(Connection* conn, HttpRequest const* req, MicrocacheFill** fill) {
+    *fill = NULL;
+    if (!microcache_enabled() || !microcache_request_cacheable(req)) {
+        return false;
+    }
+
+    if (!key.items) {
+        key = sb_new(256);
+    }
+    sb_clear(&key);
+    // NOTE: the Host goes upstream as it is, a backend serving several hosts answers each its own
+    const char* host = http_req_header(req, "Host");
+    sb_push_cstr(&key, req->headers.method);
+    sb_push(&key, ' ');
+    for (const char* p = host ? host : ""; *p; p++) {
+        sb_push(&key, *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p);
+    }
+    sb_push(&key, ' ');
+    sb_push_cstr(&key, req->headers.path);
+    size_t base_len = key.len;
+    sb_push(&key, '\0');
+
+    uint64_t now = metrics_now();
+    pthread_mutex_lock(&cache_mutex);
+    MicrocacheEntry* entry = microcache_find(key.items, now);
+    if (entry && entry->kind == MICROCACHE_VARY) {
+        key.len = base_len;
+        microcache_vary_key(&key, entry->headers, &req->headers.headers);
+        entry = microcache_find(key.items, now);
+    }
+
+    if (entry && entry->kind == MICROCACHE_PASS) {
+        pthread_mutex_unlock(&cache_mutex);
+        return false;
+    }
+
+    if (entry && entry->kind == MICROCACHE_RESPONSE) {
+        if (now < entry->fresh_until) {
+            metrics_count(METRIC_MICROCACHE_HITS, 1);
+            microcache_respond(conn, req, entry, now);
+            return true;
+        }
+        if (entry->revalidating) {
+            metrics_count(METRIC_MICROCACHE_STALE_HITS, 1);
+            microcache_respond(conn, req, entry, now);
+            return true;
+        }
+
+        if (!microcache_request_fills(req)) {
+            pthread_mutex_unlock(&cache_mutex);
+            return false;
+        }
+
+        // this request fetches the response again, the ones behind it get the stale one
+        entry->revalidating = true;
+        *fill = microcache_fill_new(req, base_len, true);
+        pthread_mutex_unlock(&cache_mutex);
+        metrics_count(METRIC_MICROCACHE_MISSES, 1);
+        return false;
+    }
+
+    MicrocacheFill* flight = ht_find(&fills, key.items);
+    if (!flight && !microcache_request_fills(req)) {
+        pthread_mutex_unlock(&cache_mutex);
+        return false;
+    }
+    if (!flight) {
+        *fill = microcache_fill_new(req, base_len, false);
+        pthread_mutex_unlock(&cache_mutex);
+        metrics_count(METRIC_MICROCACHE_MISSES, 1);
+        return false;
+    }
+    if (conn->parked_at && now - conn->parked_at >= MICROCACHE_WAIT_MAX_NS) {
+        pthread_mutex_unlock(&cache_mutex);
+        return false;
+    }
+
+    // NOTE: the connection is neither watched nor timed while it is parked, only the fill's end
+    // or the waiter's own timer can wake it up. An HTTP/2 stream waits on its own instead, so
+    // that it does not hold up the others of its connection
+    MicrocacheWaiter* waiter = malloc(sizeof(MicrocacheWaiter));
+    if (!waiter) {
+        die("could not allocate a microcache waiter");
+    }
+    timer_init(&waiter->timer, microcache_wait_timeout);
+    waiter->conn = conn;
+    waiter->thread = threadpool_current();
+    waiter->state = MICROCACHE_WAITER_PARKED;
+    waiter->stream = conn->h2 ? conn->h2_stream : 0;
+    waiter->request = conn->h2 ? microcache_request_copy(req) : NULL;
+    waiter->parked_at = conn->parked_at ? conn->parked_at : now;
+    waiter->next = flight->waiters;
+    flight->waiters = waiter;
+    pthread_mutex_unlock(&cache_mutex);
+
+    threadpool_timer_arm(&waiter->timer, MICROCACHE_WAIT_POLL_MS);
+    if (conn->h2) {
+        waiter->conn_next = conn->h2_waiters;
+        conn->h2_waiters = waiter;
+        h2_defer(conn->h2, conn->h2_stream);
+    } else {
+        conn->parked = true;
+        conn->parked_at = waiter->parked_at;
+    }
+    metrics_count(METRIC_MICROCACHE_COALESCED, 1);
+    return true;
+}
+
+void microcache_abandon(Connection* conn) {
+    for (MicrocacheWaiter* waiter = conn->h2_waiters; waiter; waiter = waiter->conn_next) {
+        waiter->conn = NULL;
+    }
+    conn->h2_waiters = NULL;
+}
+
+/// Parses the seconds of a directive, returns false if there are none
+static bool microcache_seconds(string_view arg, uint64_t* ns) {
+    if (arg.size && arg.ptr[0] == '"') {
+        arg = sv_slice(arg, 1, arg.size > 1 ? arg.size - 2 : 0);
+    }
+    if (!arg.size) {
+        return false;
+    }
+
+    uint64_t seconds = 0;
+    for (size_t i = 0; i < arg.size; i++) {
+        if (arg.ptr[i] < '0' || arg.ptr[i] > '9') {
+            return false;
+        }
+        // anything that long is capped anyway
+        if (seconds < MICROCACHE_MAX_TTL_NS) {
+            seconds = seconds * 10 + arg.ptr[i] - '0';
+        }
+    }
+    *ns = seconds < MICROCACHE_MAX_TTL_NS / MICROCACHE_NSEC ? seconds * MICROCACHE_NSEC
+                                                             : MICROCACHE_MAX_TTL_NS;
+    return true;
+}
+
+/// Takes the freshness of the response from its Cache-Control, returns false if it must not be
+/// cached
+static bool microcache_cache_control(MicrocacheFill* fill, string_view value) {
+    bool shared_max_age = false;
+    bool revalidate = false;
+    while (value.size) {
+        ssize_t comma = sv_find(value, ',');
+        size_t len = comma == -1 ? value.size : (size_t)comma;
+        string_view directive = microcache_trim(sv_slice(value, 0, len));
+        value = comma == -1 ? sv_make(NULL, 0) : sv_slice_end(value, len + 1);
+
+        ssize_t eq = sv_find(directive, '=');
+        string_view name = microcache_trim(eq == -1 ? directive : sv_slice(directive, 0, eq));
+        string_view arg =
+            eq == -1 ? sv_make(NULL, 0) : microcache_trim(sv_slice_end(directive, eq + 1));
+
+        if (http_header_is(name, "no-store") || http_header_is(name, "no-cache") ||
+            http_header_is(name, "private")) {
+            return false;
+        }
+        if (http_header_is(name, "must-revalidate") ||
+            http_header_is(name, "proxy-revalidate")) {
+            revalidate = true;
+        } else if (http_header_is(name, "s-maxage")) {
+            shared_max_age = microcache_seconds(arg, &fill->ttl_ns) || shared_max_age;
+        } else if (http_header_is(name, "max-age") && !shared_max_age) {
+            microcache_seconds(arg, &fill->ttl_ns);
+        } else if (http_header_is(name, "stale-while-revalidate")) {
+            microcache_seconds(arg, &fill->stale_ns);
+        }
+    }
+
+    if (revalidate) {
+        fill->stale_ns = 0;
+    }
+    return fill->ttl_ns != 0;
+}
+
+/// Takes the header names of the response's Vary, returns false if it varies on everything
+static bool microcache_vary(MicrocacheFill* fill, string_view value) {
+    while (value.size) {
+        ssize_t comma = sv_find(value, ',');
+        size_t len = comma == -1 ? value.size : (size_t)comma;
+        string_view name = microcache_trim(sv_slice(value, 0, len));
+        value = comma == -1 ? sv_make(NULL, 0) : sv_slice_end(value, len + 1);
+
+        if (!name.size) {
+            continue;
+        }
+        if ((name.size == 1 && name.ptr[0] == '*') || name.size >= MICROCACHE_VARY_NAME_CAP ||
+            memchr(name.ptr, '\n', name.size)) {
+            return false;
+        }
+
+        if (fill->vary.len) {
+            sb_push(&fill->vary, ',');
+        }
+        for (size_t i = 0; i < name.size; i++) {
+            char c = name.ptr[i];
+            sb_push(&fill->vary, c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+        }
+    }
+    return true;
+}
+
+static void microcache_fill_free(MicrocacheFill* fill) {
+    for (size_t i = 0; i < fill->request_headers.len; i++) {
+        free((char*)fill->request_headers.items[i].key);
+        free((char*)fill->request_headers.items[i].value);
+    }
+    free(fill->request_headers.items);
+    sb_destroy(&fill->headers);
+    sb_destroy(&fill->vary);
+    sb_destroy(&fill->body);
+    free(fill->base);
+    free(fill->key);
+    free(fill);
+}
+
+/// Stores what the fill came up with and wakes its waiters
+static void microcache_fill_finish(MicrocacheFill* fill, MicrocacheFillOutcome outcome) {
+    HttppoBlob* body = NULL;
+    if (outcome == MICROCACHE_FILL_STORE) {
+        // NOTE: interning takes the blob lock, which is never held while waiting for the cache's
+        char* contents = fill->body.items ? fill->body.items : malloc(1);
+        body = httppo_blob_intern(cache_files, contents, fill->body.len);
+        fill->body = (string_builder){0};
+    }
+
+    uint64_t now = metrics_now();
+    pthread_mutex_lock(&cache_mutex);
+    ht_delete(&fills, fill->key);
+
+    switch (outcome) {
+        case MICROCACHE_FILL_STORE: {
+            sb_clear(&key);
+            sb_push_cstr(&key, fill->base);
+            if (fill->vary.len) {
+                sb_push(&fill->vary, '\0');
+                MicrocacheEntry* marker =
+                    microcache_put(fill->base, MICROCACHE_VARY, fill->vary.len);
+                marker->headers = (char*)sv_dup(sv_make(fill->vary.items, fill->vary.len - 1));
+                marker->headers_len = fill->vary.len - 1;
+                marker->stored_at = now;
+                marker->fresh_until = now + fill->ttl_ns + fill->stale_ns;
+                marker->stale_until = marker->fresh_until;
+                microcache_vary_key(&key, marker->headers, &fill->request_headers);
+            } else {
+                sb_push(&key, '\0');
+            }
+
+            MicrocacheEntry* entry =
+                microcache_put(key.items, MICROCACHE_RESPONSE, body->size + fill->headers.len);
+            entry->status = fill->status;
+            entry->headers = (char*)sv_dup(sv_make(fill->headers.items, fill->headers.len));
+            entry->headers_len = fill->headers.len;
+            entry->body = body;
+            entry->stored_at = now;
+            entry->fresh_until = now + fill->ttl_ns;
+            entry->stale_until = entry->fresh_until + fill->stale_ns;
+            metrics_count(METRIC_MICROCACHE_STORES, 1);
+            break;
+        }
+        case MICROCACHE_FILL_PASS: {
+            MicrocacheEntry* entry = microcache_put(fill->key, MICROCACHE_PASS, 0);
+            entry->stored_at = now;
+            entry->fresh_until = now + MICROCACHE_PASS_NS;
+            entry->stale_until = entry->fresh_until;
+            break;
+        }
+        case MICROCACHE_FILL_FAIL: {
+            // a stale response is still better than none, it is served until it runs out
+            MicrocacheEntry* entry = ht_find(&entries, fill->key);
+            if (fill->revalidation && entry && entry->kind == MICROCACHE_RESPONSE) {
+                entry->revalidating = false;
+            }
+            // NOTE: nothing is stored, the first waiter to look the key up again fetches it once
+            // more and the others wait for that. A struggling upstream still sees one request
+            break;
+        }
+    }
+
+    MicrocacheWaiter* waiters = fill->waiters;
+    for (MicrocacheWaiter* waiter = waiters; waiter; waiter = waiter->next) {
+        waiter->state = MICROCACHE_WAITER_WOKEN;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    while (waiters) {
+        // NOTE: the job may free the waiter as soon as it is queued
+        MicrocacheWaiter* waiter = waiters;
+        waiters = waiter->next;
+        if (!threadpool_schedule_on(waiter->thread, WORKER_LANE_INTERACTIVE, microcache_wake,
+                                    waiter)) {
+            pthread_mutex_lock(&cache_mutex);
+            waiter->state = MICROCACHE_WAITER_LOST;
+            pthread_mutex_unlock(&cache_mutex);
+        }
+    }
+
+    microcache_fill_free(fill);
+}
+
+bool microcache_fill_head(MicrocacheFill* fill, uint16_t status, string_view headers) {
+    fill->status = status;
+    // an upstream that fails says nothing about the response, the key is not given up on
+    if (status >= 500) {
+        microcache_fill_finish(fill, MICROCACHE_FILL_FAIL);
+        return false;
+    }
+    bool cacheable = status == STATUS_OK || status == STATUS_NOT_FOUND;
+
+    fill->headers = sb_new(512);
+    fill->vary = sb_new(64);
+    while (cacheable && headers.size) {
+        ssize_t line_end = sv_find_sub_cstr(headers, "\r\n");
+        size_t len = line_end == -1 ? headers.size : (size_t)line_end;
+        string_view line = sv_slice(headers, 0, len);
+        headers = line_end == -1 ? sv_make(NULL, 0) : sv_slice_end(headers, len + 2);
+
+        ssize_t colon = sv_find(line, ':');
+        if (colon <= 0) {
+            continue;
+        }
+        string_view name = sv_slice(line, 0, colon);
+        string_view value = microcache_trim(sv_slice_end(line, colon + 1));
+
+        if (http_header_is(name, "cache-control")) {
+            cacheable = microcache_cache_control(fill, value);
+        } else if (http_header_is(name, "vary")) {
+            cacheable = microcache_vary(fill, value);
+        } else if (http_header_is(name, "set-cookie")) {
+            cacheable = false;
+        }
+
+        // the framing and the date are the ones of the response that is served from the entry
+        static const char* const dropped[] = {"connection", "keep-alive",     "proxy-connection",
+                                              "te",         "upgrade",        "transfer-encoding",
+                                              "trailer",    "content-length", "date",
+                                              "age"};
+        bool keep = true;
+        for (size_t i = 0; keep && i < sizeof(dropped) / sizeof(dropped[0]); i++) {
+            keep = !http_header_is(name, dropped[i]);
+        }
+        if (keep) {
+            sb_push_n(&fill->headers, line.ptr, line.size);
+            sb_push_cstr(&fill->headers, "\r\n");
+        }
+    }
+
+    if (!cacheable) {
+        microcache_fill_finish(fill, MICROCACHE_FILL_PASS);
+        return false;
+    }
+    fill->body = sb_new(4096);
+    return true;
+}
+
+bool microcache_fill_body(MicrocacheFill* fill, const char* data, size_t len) {
+    if (fill->body.len + len > MICROCACHE_MAX_BODY) {
+        microcache_fill_finish(fill, MICROCACHE_FILL_PASS);
+        return false;
+    }
+
+    sb_push_n(&fill->body, data, len);
+    return true;
+}
+
+void microcache_fill_end(MicrocacheFill* fill, bool complete) {
+    microcache_fill_finish(fill, complete ? MICROCACHE_FILL_STORE : MICROCACHE_FILL_FAIL);
+}
+
+MicrocacheStats microcache_stats(void) {
+    pthread_mutex_lock(&cache_mutex);
+    MicrocacheStats stats = {.entries = entries.len, .bytes = cache_bytes, .fills = fills.len};
+    pthread_mutex_unlock(&cache_mutex);
+    return stats;
+}
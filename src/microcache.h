@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "base.h"
+#include "connection.h"
+#include "files.h"
+#include "protocol.h"
+
+// A short-lived cache of proxied GET responses, keyed on the Host, the path and the request
+// headers named by the response's Vary. A response is fresh for its s-maxage or max-age, a second
+// without either, and is served stale for a while after that as one request fetches it again.
+// Requests that miss while the key is being fetched wait for that response instead of going to the
+// upstreams as well.
+// Bodies are interned as blobs of the file cache, identical ones are kept once
+
+struct MicrocacheFill;
+
+void microcache_start(HttppoFiles* files);
+bool microcache_enabled(void);
+
+/// Answers the request from the cache, or parks its connection until the response another request
+/// is fetching is in. The stream of an HTTP/2 request is deferred to wait instead, the others of
+/// its connection go on. Returns false if the request has to be forwarded, with `fill` set if its
+/// response is to be cached
+bool microcache_serve(Connection* conn, HttpRequest const* req, struct MicrocacheFill** fill);
+/// Lets go of the waiting HTTP/2 streams of a connection that closes, see `conn_unpark_stream`
+void microcache_abandon(Connection* conn);
+
+/// Takes the status and header lines of the response. Returns false if it can't be cached, the
+/// fill is over then
+bool microcache_fill_head(struct MicrocacheFill* fill, uint16_t status, string_view headers);
+/// Takes decoded body bytes. Returns false once the body is too large to cache, the fill is over
+/// then
+bool microcache_fill_body(struct MicrocacheFill* fill, const char* data, size_t len);
+/// Caches the response if it is `complete` and wakes the requests that wait for it
+void microcache_fill_end(struct MicrocacheFill* fill, bool complete);
+
+typedef struct {
+    /// cached responses, along with the vary and pass markers
+    size_t entries;
+    size_t bytes;
+    /// keys being fetched
+    size_t fills;
+} MicrocacheStats;
+
+MicrocacheStats microcache_stats(void);
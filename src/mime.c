@@ -0,0 +1,86 @@
+#include "mime.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define MIME_TABLE_BITS 6
+#define MIME_TABLE_SIZE (1 << MIME_TABLE_BITS)
+// chosen so that every extension below lands in a slot of its own
+#define MIME_HASH_SEED 0x3eb46u
+
+typedef struct {
+    const char* ext;
+    MimeType mime;
+} MimeEntry;
+
+// NOTE: a perfect hash table, every entry sits at the index `mime_hash` gives its extension. Two
+// extensions in the same slot show up as an overridden initializer warning, pick a new seed when
+// adding one
+static const MimeEntry mime_table[MIME_TABLE_SIZE] = {
+    [0] = {"br", {"application/x-brotli", false}},
+    [2] = {"eot", {"application/vnd.ms-fontobject", true}},
+    [3] = {"zip", {"application/zip", false}},
+    [4] = {"mjs", {"text/javascript; charset=utf-8", true}},
+    [6] = {"woff", {"font/woff", false}},
+    [7] = {"mp3", {"audio/mpeg", false}},
+    [10] = {"gz", {"application/gzip", false}},
+    [12] = {"png", {"image/png", false}},
+    [13] = {"wav", {"audio/wav", false}},
+    [15] = {"map", {"application/json", true}},
+    [16] = {"json", {"application/json", true}},
+    [20] = {"md", {"text/markdown; charset=utf-8", true}},
+    [21] = {"pdf", {"application/pdf", false}},
+    [23] = {"jpeg", {"image/jpeg", false}},
+    [25] = {"mp4", {"video/mp4", false}},
+    [26] = {"ttf", {"font/ttf", true}},
+    [28] = {"webp", {"image/webp", false}},
+    [30] = {"js", {"text/javascript; charset=utf-8", true}},
+    [31] = {"gif", {"image/gif", false}},
+    [32] = {"txt", {"text/plain; charset=utf-8", true}},
+    [33] = {"ico", {"image/x-icon", true}},
+    [34] = {"xml", {"application/xml", true}},
+    [35] = {"bmp", {"image/bmp", true}},
+    [36] = {"wasm", {"application/wasm", true}},
+    [37] = {"webm", {"video/webm", false}},
+    [41] = {"woff2", {"font/woff2", false}},
+    [42] = {"csv", {"text/csv; charset=utf-8", true}},
+    [44] = {"svg", {"image/svg+xml", true}},
+    [47] = {"htm", {"text/html; charset=utf-8", true}},
+    [48] = {"ogg", {"audio/ogg", false}},
+    [51] = {"css", {"text/css; charset=utf-8", true}},
+    [53] = {"jpg", {"image/jpeg", false}},
+    [54] = {"webmanifest", {"application/manifest+json", true}},
+    [55] = {"zst", {"application/zstd", false}},
+    [58] = {"html", {"text/html; charset=utf-8", true}},
+    [61] = {"avif", {"image/avif", false}},
+    [63] = {"otf", {"font/otf", true}},
+};
+
+/// Case-insensitive FNV-1a folded into the table size with a multiplicative hash
+static uint32_t mime_hash(const char* ext) {
+    uint32_t hash = 2166136261u;
+    while (*ext) {
+        hash ^= (uint8_t)*ext++ | 0x20;
+        hash *= 16777619u;
+    }
+
+    return ((hash ^ MIME_HASH_SEED) * 2654435761u) >> (32 - MIME_TABLE_BITS);
+}
+
+MimeType mime_lookup(const char* filename) {
+    static const MimeType unknown = {MIME_DEFAULT_TYPE, false};
+
+    const char* ext = strrchr(filename, '.');
+    if (!ext || strchr(ext, '/')) {
+        return unknown;
+    }
+    ext++;
+
+    MimeEntry const* entry = &mime_table[mime_hash(ext)];
+    if (entry->ext && strcasecmp(entry->ext, ext) == 0) {
+        return entry->mime;
+    }
+
+    return unknown;
+}
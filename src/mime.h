@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+// served for files with an unknown or missing extension
+#define MIME_DEFAULT_TYPE "application/octet-stream"
+
+typedef struct {
+    const char* type;
+    /// whether compressing the content pays off, false for formats that are compressed already
+    bool compressible;
+} MimeType;
+
+/// Looks up the content type of a file by its extension, unknown extensions get the default type
+MimeType mime_lookup(const char* filename);
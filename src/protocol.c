@@ -1,102 +1,481 @@
 #include "protocol.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
+#include <strings.h>
 
 #include "base.h"
-#include "hash.h"
+#include "http_date.h"
 
-static void http_req_headers_print(HttpRequestHeaders const* headers) {
-    printf("method: %s, path: %s, version: %s\n", headers->method, headers->path,
-           headers->http_version);
-    printf("headers:\n");
-    HT_ITER(headers->headers, { printf("%s:%s\n", (const char*)kv.key, (const char*)kv.value); });
+static const char* arena_sv_dup(Arena* arena, string_view sv) {
+    char* ptr = arena_alloc(arena, sv.size + 1);
+    memcpy(ptr, sv.ptr, sv.size);
+    ptr[sv.size] = '\0';
+    return ptr;
 }
 
-void http_req_print(HttpRequest const* req) {
-    http_req_headers_print(&req->headers);
-    printf("body: %s\n", req->body);
+void http_headers_add(HttpHeaders* headers, Arena* arena, const char* key, const char* value) {
+    if (headers->len == headers->cap) {
+        // NOTE: the old items are left behind in the arena, they go away on its next reset
+        size_t cap = headers->cap ? headers->cap * 2 : 8;
+        HttpHeader* items = arena_alloc(arena, cap * sizeof(HttpHeader));
+        if (headers->len) {
+            memcpy(items, headers->items, headers->len * sizeof(HttpHeader));
+        }
+        headers->items = items;
+        headers->cap = cap;
+    }
+
+    headers->items[headers->len++] = (HttpHeader){.key = key, .value = value};
 }
 
-static void http_req_headers_free(HttpRequestHeaders* headers) {
-    free((void*)headers->method);
-    free((void*)headers->path);
-    free((void*)headers->http_version);
+const char* http_headers_find(HttpHeaders const* headers, const char* name) {
+    for (size_t i = 0; i < headers->len; i++) {
+        if (strcasecmp(headers->items[i].key, name) == 0) {
+            return headers->items[i].value;
+        }
+    }
 
-    HT_ITER(headers->headers, {
-        free(kv.key);
-        free(kv.value);
-    });
+    return NULL;
+}
 
-    ht_destroy(&headers->headers);
+bool http_header_is(string_view name, const char* expected) {
+    return name.size == strlen(expected) && strncasecmp(name.ptr, expected, name.size) == 0;
 }
 
-void http_req_free(HttpRequest* req) {
-    http_req_headers_free(&req->headers);
-    free((void*)req->body);
+bool http_header_has(string_view value, const char* token) {
+    while (value.size > 0) {
+        ssize_t sep = sv_find(value, ',');
+        string_view element = sep == -1 ? value : sv_slice(value, 0, sep);
+        value = sep == -1 ? sv_make(NULL, 0) : sv_slice_end(value, sep + 1);
+
+        size_t len = 0;
+        while (len < element.size && element.ptr[len] != ';' && element.ptr[len] != '=') {
+            len++;
+        }
+        element.size = len;
+        while (element.size > 0 && isspace((unsigned char)*element.ptr)) {
+            element = sv_slice_end(element, 1);
+        }
+        while (element.size > 0 && isspace((unsigned char)element.ptr[element.size - 1])) {
+            element.size--;
+        }
+
+        if (http_header_is(element, token)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-HttpResponse http_res_new(HttpStatusCode status_code, const char* body, hash_table headers) {
-    return (HttpResponse){
-        .body = body, .status_code = status_code, .headers = headers, .http_version = "HTTP/1.1"};
+const char* http_req_header(HttpRequest const* req, const char* name) {
+    return http_headers_find(&req->headers.headers, name);
 }
 
-static int http_res_headers_encode(HttpResponse const* res, char* buf) {
-    int written = 0;
-    HT_ITER(res->headers, {
-        written += sprintf(buf + written, "%s: %s\r\n", (const char*)kv.key, (const char*)kv.value);
-    });
+bool http_req_keep_alive(HttpRequest const* req) {
+    const char* connection = http_req_header(req, "Connection");
+
+    string_view tokens = connection ? sv_make(connection, strlen(connection)) : sv_make(NULL, 0);
 
-    written += sprintf(buf + written, "\r\n");
+    if (strcmp(req->headers.http_version, "HTTP/1.0") == 0) {
+        return http_header_has(tokens, "keep-alive");
+    }
 
-    return written;
+    return !http_header_has(tokens, "close");
 }
 
-char* http_res_encode(HttpResponse const* res, Arena* arena) {
-    size_t body_len = res->body ? strlen(res->body) : 0;
-    size_t size = body_len + 30 + res->headers.len * 30;
+ssize_t http_req_content_length(string_view head) {
+    static const char name[] = "content-length:";
+    const size_t name_len = sizeof(name) - 1;
+
+    while (head.size > 0) {
+        ssize_t line_end = sv_find_sub_cstr(head, "\r\n");
+        size_t line_len = line_end == -1 ? head.size : (size_t)line_end;
+        string_view line = sv_slice(head, 0, line_len);
+
+        if (line.size > name_len && strncasecmp(line.ptr, name, name_len) == 0) {
+            string_view value = sv_slice_end(line, name_len);
+            while (value.size > 0 && isspace((unsigned char)*value.ptr)) {
+                value = sv_slice_end(value, 1);
+            }
+
+            if (value.size == 0 || value.size > 18) {
+                return -1;
+            }
+
+            for (size_t i = 0; i < value.size; i++) {
+                if (!isdigit((unsigned char)value.ptr[i])) {
+                    return -1;
+                }
+            }
+
+            return sv_atoi(value);
+        }
+
+        if (line_end == -1) {
+            break;
+        }
+        head = sv_slice_end(head, line_len + 2);
+    }
 
-    char* buf = arena_alloc(arena, size * sizeof(char) + 1);
-    int num_written = sprintf(buf, "%s %d %s\r\n", res->http_version, res->status_code,
-                              status_str(res->status_code));
-    assert(num_written != -1);
-    num_written += http_res_headers_encode(res, buf + num_written);
+    return 0;
+}
+
+bool http_req_chunked(string_view head) {
+    static const char name[] = "transfer-encoding:";
+    const size_t name_len = sizeof(name) - 1;
+
+    while (head.size > 0) {
+        ssize_t line_end = sv_find_sub_cstr(head, "\r\n");
+        size_t line_len = line_end == -1 ? head.size : (size_t)line_end;
+        string_view line = sv_slice(head, 0, line_len);
 
-    if (res->body) {
-        sprintf(buf + num_written, "%s", res->body);
+        if (line.size > name_len && strncasecmp(line.ptr, name, name_len) == 0) {
+            return http_header_has(sv_slice_end(line, name_len), "chunked");
+        }
+
+        if (line_end == -1) {
+            break;
+        }
+        head = sv_slice_end(head, line_len + 2);
     }
 
-    return buf;
+    return false;
+}
+
+static int http_hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+const char* http_path_normalize(const char* target, Arena* arena) {
+    if (*target != '/') {
+        return NULL;
+    }
+
+    // NOTE: decoding and dropping segments only ever shrinks the path
+    char* out = arena_alloc(arena, strlen(target) + 1);
+    size_t len = 0;
+    const char* p = target + 1;
+
+    while (true) {
+        size_t segment = len;
+        while (*p && *p != '/' && *p != '?' && *p != '#') {
+            char c = *p++;
+            if (c == '%') {
+                int hi = http_hex_value(p[0]);
+                int lo = hi == -1 ? -1 : http_hex_value(p[1]);
+                // an encoded slash would start a segment that was not there before decoding
+                if (lo == -1 || (hi == 0 && lo == 0) || (hi == 2 && lo == 0xf)) {
+                    return NULL;
+                }
+                c = (char)(hi << 4 | lo);
+                p += 2;
+            }
+            out[len++] = c;
+        }
+
+        size_t segment_len = len - segment;
+        if (segment_len == 1 && out[segment] == '.') {
+            len = segment;
+        } else if (segment_len == 2 && out[segment] == '.' && out[segment + 1] == '.') {
+            if (segment == 0) {
+                return NULL;
+            }
+            // drop the previous segment along with its slash
+            len = segment - 1;
+            while (len > 0 && out[len - 1] != '/') {
+                len--;
+            }
+        } else if (segment_len > 0 && *p == '/') {
+            out[len++] = '/';
+        }
+
+        if (*p != '/') {
+            break;
+        }
+        p++;
+    }
+
+    out[len] = '\0';
+    return out;
 }
 
-static void http_res_headers_encode_sb(hash_table headers, string_builder* sb) {
-    HT_ITER(headers, { sb_sprintf(sb, "%s: %s\r\n", (const char*)kv.key, (const char*)kv.value); });
+/// Whether the parameters of a list element carry a nonzero q value, a missing q means 1
+static bool http_qvalue_positive(string_view params) {
+    while (params.size > 0) {
+        ssize_t sep = sv_find(params, ';');
+        string_view param = sep == -1 ? params : sv_slice(params, 0, sep);
+        params = sep == -1 ? sv_make(NULL, 0) : sv_slice_end(params, sep + 1);
+
+        while (param.size > 0 && isspace((unsigned char)*param.ptr)) {
+            param = sv_slice_end(param, 1);
+        }
+        if (param.size < 2 || tolower((unsigned char)param.ptr[0]) != 'q' || param.ptr[1] != '=') {
+            continue;
+        }
+
+        // NOTE: a qvalue is at most "1.000", it is positive iff it has a nonzero digit
+        for (size_t i = 2; i < param.size; i++) {
+            if (param.ptr[i] >= '1' && param.ptr[i] <= '9') {
+                return true;
+            }
+        }
+        return false;
+    }
 
-    sb_push_cstr(sb, "\r\n");
+    return true;
 }
 
-void http_res_encode_sb(HttpResponse const* res, string_builder* sb) {
-    sb_sprintf(sb, "%s %d %s\r\n", res->http_version, res->status_code,
-               status_str(res->status_code));
-    http_res_headers_encode_sb(res->headers, sb);
+bool http_accepts_encoding(const char* accept_encoding, const char* coding) {
+    string_view list = sv_make(accept_encoding, strlen(accept_encoding));
+    size_t coding_len = strlen(coding);
+    int wildcard = -1;
+
+    while (list.size > 0) {
+        ssize_t sep = sv_find(list, ',');
+        string_view element = sep == -1 ? list : sv_slice(list, 0, sep);
+        list = sep == -1 ? sv_make(NULL, 0) : sv_slice_end(list, sep + 1);
+
+        ssize_t params_start = sv_find(element, ';');
+        string_view name = params_start == -1 ? element : sv_slice(element, 0, params_start);
+        string_view params =
+            params_start == -1 ? sv_make(NULL, 0) : sv_slice_end(element, params_start + 1);
+
+        while (name.size > 0 && isspace((unsigned char)*name.ptr)) {
+            name = sv_slice_end(name, 1);
+        }
+        while (name.size > 0 && isspace((unsigned char)name.ptr[name.size - 1])) {
+            name.size--;
+        }
+
+        if (name.size == coding_len && strncasecmp(name.ptr, coding, coding_len) == 0) {
+            return http_qvalue_positive(params);
+        }
+        if (name.size == 1 && *name.ptr == '*') {
+            wildcard = http_qvalue_positive(params);
+        }
+    }
+
+    return wildcard == 1;
+}
+
+HttpResponse http_res_new(HttpStatusCode status_code, string_view body) {
+    return (HttpResponse){
+        .body = body,
+        .status_code = status_code,
+        .keep_alive = true,
+        .headers = {0},
+        .raw_headers = {0},
+        .http_version = "HTTP/1.1",
+    };
+}
+
+#define HTTP_STATUS_LINE(code, reason) \
+    { sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1, "HTTP/1.1 " #code " " reason "\r\n" }
+
+// the length of the "HTTP/1.1" prefix of every precomputed status line
+#define HTTP_VERSION_LEN 8
+#define HTTP_DATE "Date: "
+#define HTTP_CONTENT_LENGTH "Content-Length: "
+#define HTTP_CONNECTION_CLOSE "Connection: close\r\n"
+// enough for any 64-bit integer
+#define HTTP_MAX_DIGITS 20
+
+static string_view http_status_line(HttpStatusCode status_code) {
+    static const struct {
+        size_t size;
+        const char* ptr;
+    } lines[] = {
+        HTTP_STATUS_LINE(200, "OK"),
+        HTTP_STATUS_LINE(400, "Bad request"),
+        HTTP_STATUS_LINE(404, "Not found"),
+        HTTP_STATUS_LINE(502, "Bad Gateway"),
+        HTTP_STATUS_LINE(503, "Service Unavailable"),
+        HTTP_STATUS_LINE(504, "Gateway Timeout"),
+    };
+
+    size_t i;
+    switch (status_code) {
+        case STATUS_OK:
+            i = 0;
+            break;
+        case STATUS_BAD_REQUEST:
+            i = 1;
+            break;
+        case STATUS_NOT_FOUND:
+            i = 2;
+            break;
+        case STATUS_BAD_GATEWAY:
+            i = 3;
+            break;
+        case STATUS_SERVICE_UNAVAILABLE:
+            i = 4;
+            break;
+        case STATUS_GATEWAY_TIMEOUT:
+            i = 5;
+            break;
+        default:
+            assert(0 && "unknown status code");
+            return sv_make("", 0);
+    }
+
+    return sv_make(lines[i].ptr, lines[i].size);
+}
+
+static const char http_digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/// Formats `n` right-aligned in front of `end` two digits at a time, returns the first digit
+static char* http_format_u64(uint64_t n, char* end) {
+    while (n >= 100) {
+        uint64_t pair = n % 100;
+        n /= 100;
+        end -= 2;
+        memcpy(end, http_digit_pairs + pair * 2, 2);
+    }
 
-    if (res->body) {
-        sb_push_cstr(sb, res->body);
+    if (n >= 10) {
+        end -= 2;
+        memcpy(end, http_digit_pairs + n * 2, 2);
+    } else {
+        *--end = (char)('0' + n);
     }
+
+    return end;
+}
+
+/// The parts of a response head that are looked up and formatted before anything is written, so
+/// that its size is known up front
+typedef struct {
+    /// empty when the status line already carries the version
+    string_view version;
+    string_view status_line;
+    const char* date;
+    string_view content_length;
+    char digits[HTTP_MAX_DIGITS];
+    size_t size;
+} HttpResponseHead;
+
+static void http_res_head_prepare(HttpResponse const* res, HttpResponseHead* head) {
+    head->status_line = http_status_line(res->status_code);
+    head->version = sv_make("", 0);
+    if (res->http_version && strcmp(res->http_version, "HTTP/1.1") != 0) {
+        head->version = sv_make(res->http_version, strlen(res->http_version));
+        head->status_line = sv_slice_end(head->status_line, HTTP_VERSION_LEN);
+    }
+
+    char* end = head->digits + HTTP_MAX_DIGITS;
+    char* start = http_format_u64(res->body.size, end);
+    head->content_length = sv_make(start, end - start);
+
+    head->date = http_date_now();
+
+    size_t size = head->version.size + head->status_line.size;
+    size += sizeof(HTTP_DATE) - 1 + HTTP_DATE_LEN + 2;
+    size += sizeof(HTTP_CONTENT_LENGTH) - 1 + head->content_length.size + 2;
+    if (!res->keep_alive) {
+        size += sizeof(HTTP_CONNECTION_CLOSE) - 1;
+    }
+    for (size_t i = 0; i < res->headers.len; i++) {
+        size += strlen(res->headers.items[i].key) + strlen(res->headers.items[i].value) + 4;
+    }
+    head->size = size + res->raw_headers.size + 2;
+}
+
+static inline char* http_put(char* dst, const char* src, size_t size) {
+    if (size) {
+        memcpy(dst, src, size);
+    }
+    return dst + size;
+}
+
+/// Writes the head into `dst`, which has room for `head->size` bytes. Returns the end of the head
+static char* http_res_head_write(HttpResponse const* res, HttpResponseHead const* head, char* dst) {
+    dst = http_put(dst, head->version.ptr, head->version.size);
+    dst = http_put(dst, head->status_line.ptr, head->status_line.size);
+
+    dst = http_put(dst, HTTP_DATE, sizeof(HTTP_DATE) - 1);
+    dst = http_put(dst, head->date, HTTP_DATE_LEN);
+    dst = http_put(dst, "\r\n", 2);
+
+    dst = http_put(dst, HTTP_CONTENT_LENGTH, sizeof(HTTP_CONTENT_LENGTH) - 1);
+    dst = http_put(dst, head->content_length.ptr, head->content_length.size);
+    dst = http_put(dst, "\r\n", 2);
+    if (!res->keep_alive) {
+        dst = http_put(dst, HTTP_CONNECTION_CLOSE, sizeof(HTTP_CONNECTION_CLOSE) - 1);
+    }
+
+    for (size_t i = 0; i < res->headers.len; i++) {
+        HttpHeader const* header = &res->headers.items[i];
+        dst = http_put(dst, header->key, strlen(header->key));
+        dst = http_put(dst, ": ", 2);
+        dst = http_put(dst, header->value, strlen(header->value));
+        dst = http_put(dst, "\r\n", 2);
+    }
+    dst = http_put(dst, res->raw_headers.ptr, res->raw_headers.size);
+
+    return http_put(dst, "\r\n", 2);
+}
+
+char* http_res_encode(HttpResponse const* res, Arena* arena) {
+    HttpResponseHead head;
+    http_res_head_prepare(res, &head);
+
+    char* buf = arena_alloc(arena, head.size + res->body.size + 1);
+    char* end = http_res_head_write(res, &head, buf);
+    end = http_put(end, res->body.ptr, res->body.size);
+    *end = '\0';
+
+    return buf;
 }
 
-void http_res_free(HttpResponse* res) {
-    ht_destroy(&res->headers);
+void http_res_encode_head_sb(HttpResponse const* res, string_builder* sb) {
+    HttpResponseHead head;
+    http_res_head_prepare(res, &head);
+
+    sb_reserve(sb, head.size);
+    http_res_head_write(res, &head, sb->items + sb->len);
+    sb->len += head.size;
+}
+
+void http_res_encode_sb(HttpResponse const* res, string_builder* sb) {
+    HttpResponseHead head;
+    http_res_head_prepare(res, &head);
+
+    sb_reserve(sb, head.size + res->body.size);
+    char* end = http_res_head_write(res, &head, sb->items + sb->len);
+    http_put(end, res->body.ptr, res->body.size);
+    sb->len += head.size + res->body.size;
 }
 
 thread_local HttpRequestParseError http_req_parse_error;
 
-static HttpRequestHeaders http_req_headers_parse(string_view string) {
-    HttpRequestHeaders result;
+static HttpRequestHeaders http_req_headers_parse(string_view string, Arena* arena) {
+    HttpRequestHeaders result = {0};
+
+    // size the header list up front, one line per header after the request line
+    size_t nlines = 0;
+    for (size_t j = 0; j + 1 < string.size; j++) {
+        if (string.ptr[j] == '\r' && string.ptr[j + 1] == '\n') {
+            nlines++;
+        }
+    }
+    result.headers.items = arena_alloc(arena, (nlines + 1) * sizeof(HttpHeader));
+    result.headers.cap = nlines + 1;
 
-    result.headers = ht_make(hash_djb2, hash_str_eq, 10);
     ssize_t split_idx = sv_find_sub_cstr(string, "\r\n");
-    if (split_idx == -1) goto fail;
+    if (split_idx == -1) {
+        // a request without any headers
+        split_idx = string.size;
+    }
 
     size_t i = split_idx + 2;
 
@@ -104,18 +483,21 @@ static HttpRequestHeaders http_req_headers_parse(string_view string) {
     split_idx = sv_find(first_line, ' ');
     if (split_idx == -1) goto fail;
 
-    result.method = sv_dup(sv_slice(first_line, 0, split_idx));
+    result.method = arena_sv_dup(arena, sv_slice(first_line, 0, split_idx));
     first_line = sv_slice_end(first_line, split_idx + 1);
 
     split_idx = sv_find(first_line, ' ');
     if (split_idx == -1) goto fail;
 
-    result.path = sv_dup(sv_slice(first_line, 0, split_idx));
+    result.path = arena_sv_dup(arena, sv_slice(first_line, 0, split_idx));
     first_line = sv_slice_end(first_line, split_idx + 1);
 
-    result.http_version = sv_dup(first_line);
+    result.http_version = arena_sv_dup(arena, first_line);
 
     size_t orig_len = string.size;
+    if (i >= orig_len) {
+        return result;
+    }
     string = sv_slice_end(string, i);
 
     while (i < orig_len) {
@@ -128,8 +510,12 @@ static HttpRequestHeaders http_req_headers_parse(string_view string) {
 
         string_view key = sv_slice(line, 0, kv_sep_idx);
         string_view value = sv_slice_end(line, kv_sep_idx + 1);
+        while (value.size > 0 && (*value.ptr == ' ' || *value.ptr == '\t')) {
+            value = sv_slice_end(value, 1);
+        }
 
-        ht_add(&result.headers, (void*)sv_dup(key), (void*)sv_dup(value));
+        http_headers_add(&result.headers, arena, arena_sv_dup(arena, key),
+                         arena_sv_dup(arena, value));
 
         i += line_len + 2;
         string = sv_slice_end(string, line_end + 2);
@@ -143,6 +529,8 @@ fail:
 }
 
 HttpRequest* http_req_parse(string_view string, Arena* arena) {
+    http_req_parse_error = HTTP_ERR_NONE;
+
     ssize_t split_idx = sv_find_sub_cstr(string, "\r\n\r\n");
     if (split_idx == -1) {
         http_req_parse_error = HTTP_ERR_MALFORMED_BODY;
@@ -150,17 +538,20 @@ HttpRequest* http_req_parse(string_view string, Arena* arena) {
     }
 
     string_view header_string = sv_slice(string, 0, split_idx);
-    HttpRequestHeaders headers = http_req_headers_parse(header_string);
+    HttpRequestHeaders headers = http_req_headers_parse(header_string, arena);
     if (http_req_parse_error != HTTP_ERR_NONE) {
         return NULL;
     }
 
     HttpRequest* result = arena_alloc(arena, sizeof(HttpRequest));
     result->headers = headers;
+    result->arena = arena;
 
     string_view body_sv =
         sv_slice_end(string, split_idx + 4);  // NOTE: always add 4 to skip the double \r\n
-    result->body = sv_dup(body_sv);
+    result->body = arena_sv_dup(arena, body_sv);
+    result->body_len = body_sv.size;
+    result->body_streamed = false;
 
     return result;
 }
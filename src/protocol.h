@@ -5,29 +5,56 @@
 #include "arena.h"
 #include "base.h"
 
+typedef struct {
+    const char* key;
+    const char* value;
+} HttpHeader;
+
+/// A list of headers living in a request's arena
+typedef struct {
+    HttpHeader* items;
+    size_t len;
+    size_t cap;
+} HttpHeaders;
+
 typedef struct {
     const char* method;
     const char* path;
     const char* http_version;
-    hash_table headers;
+    HttpHeaders headers;
 } HttpRequestHeaders;
 
 typedef struct {
     HttpRequestHeaders headers;
+    /// NUL terminated, but may contain NUL bytes itself
     const char* body;
+    size_t body_len;
+    /// the body is too big for the input buffer or chunked, it is read after the request is
+    /// handled and only passed on to an upstream. `body` holds none of it then
+    bool body_streamed;
+    /// everything belonging to the request is allocated from here, responses can use it as well
+    Arena* arena;
 } HttpRequest;
 
 typedef enum {
     STATUS_OK = 200,
     STATUS_BAD_REQUEST = 400,
     STATUS_NOT_FOUND = 404,
+    STATUS_BAD_GATEWAY = 502,
+    STATUS_SERVICE_UNAVAILABLE = 503,
+    STATUS_GATEWAY_TIMEOUT = 504,
 } HttpStatusCode;
 
 typedef struct {
     const char* http_version;
-    const char* body;
+    /// may contain NUL bytes, its size is sent as the Content-Length
+    string_view body;
     HttpStatusCode status_code;
-    hash_table headers;
+    /// whether the connection stays open after the response
+    bool keep_alive;
+    HttpHeaders headers;
+    /// header lines rendered ahead of time, each ending in CRLF. They are sent after `headers`
+    string_view raw_headers;
 } HttpResponse;
 
 typedef enum {
@@ -46,16 +73,45 @@ static inline const char* status_str(HttpStatusCode status_code) {
             return "Not found";
         case STATUS_BAD_REQUEST:
             return "Bad request";
+        case STATUS_BAD_GATEWAY:
+            return "Bad Gateway";
+        case STATUS_SERVICE_UNAVAILABLE:
+            return "Service Unavailable";
+        case STATUS_GATEWAY_TIMEOUT:
+            return "Gateway Timeout";
         default:
             return NULL;
     }
 }
 
+void http_headers_add(HttpHeaders* headers, Arena* arena, const char* key, const char* value);
+/// Finds a header by its case-insensitive name
+const char* http_headers_find(HttpHeaders const* headers, const char* name);
+/// Whether a header name is `expected`, ignoring case
+bool http_header_is(string_view name, const char* expected);
+/// Whether a comma separated header value lists `token`, ignoring case. Parameters and arguments
+/// after a `;` or `=` are not part of an element's token, so "no-cache-ext" is not "no-cache"
+bool http_header_has(string_view value, const char* token);
+
+/// Parses a request, allocating it from the arena. It stays valid until the arena is reset
 HttpRequest* http_req_parse(string_view sv, Arena* arena);
-void http_req_print(HttpRequest const* req);
-void http_req_free(HttpRequest* req);
+const char* http_req_header(HttpRequest const* req, const char* name);
+bool http_req_keep_alive(HttpRequest const* req);
+/// Scans the header block of a request for its Content-Length, returns 0 if there is none and -1
+/// if it is malformed
+ssize_t http_req_content_length(string_view head);
+/// Scans the header block of a request for a Transfer-Encoding that ends in chunked
+bool http_req_chunked(string_view head);
+/// Percent-decodes the path of an origin-form request target and resolves its `.` and `..`
+/// segments, dropping the query. The result is relative, "/a/./b/../c?x" becomes "a/c", and keeps
+/// a trailing slash. Returns NULL for malformed targets and for paths that would climb out of the
+/// root
+const char* http_path_normalize(const char* target, Arena* arena);
+/// Whether an Accept-Encoding value allows the content coding, taking `*` and `q=0` into account
+bool http_accepts_encoding(const char* accept_encoding, const char* coding);
 
-HttpResponse http_res_new(HttpStatusCode status_code, const char* body, hash_table headers);
+HttpResponse http_res_new(HttpStatusCode status_code, string_view body);
 char* http_res_encode(HttpResponse const* res, Arena* arena);
+/// Encodes the status line and the headers only, the body is sent separately
+void http_res_encode_head_sb(HttpResponse const* res, string_builder* sb);
 void http_res_encode_sb(HttpResponse const* res, string_builder* sb);
-void http_res_free(HttpResponse* res);
@@ -0,0 +1,1207 @@
+#include "proxy.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "metrics.h"
+#include "microcache.h"
+#include "thread_pool.h"
+#include "util.h"
+
+// the head of a response has to fit, the body only passes through
+#define PROXY_BUF_SIZE (16 * 1024)
+// idle connections a worker keeps to each upstream
+#define PROXY_POOL_IDLE_MAX 32
+#define PROXY_IDLE_TIMEOUT_MS (60 * 1000)
+#define PROXY_CONNECT_TIMEOUT_MS (5 * 1000)
+// the upstream has to send something this often until its response is done
+#define PROXY_READ_TIMEOUT_MS (30 * 1000)
+// an upstream that refused a connection is passed over for this long
+#define PROXY_DOWN_NS (1000ull * 1000 * 1000)
+// chunk sizes beyond this are taken for garbage
+#define PROXY_MAX_CHUNK (1ull << 48)
+// the upstream of an HTTP/2 stream is not read from while this much of its body waits to be sent,
+// and again once half of it is
+#define PROXY_STREAM_BUFFERED (64 * 1024)
+
+typedef struct {
+    struct sockaddr_in addr;
+    /// requests sent to the upstream that are not answered completely yet, over all workers
+    atomic_int outstanding;
+    /// the CLOCK_MONOTONIC time until which the upstream is passed over
+    _Atomic uint64_t down_until;
+} ProxyUpstream;
+
+typedef enum {
+    /// in the pool of its worker
+    PROXY_IDLE,
+    PROXY_CONNECTING,
+    /// sending the request and waiting for the head of the response
+    PROXY_WAITING,
+    /// the head is relayed, the body follows
+    PROXY_RELAYING,
+} ProxyState;
+
+/// How the end of a response body is found
+typedef enum {
+    PROXY_BODY_NONE,
+    PROXY_BODY_LENGTH,
+    PROXY_BODY_CHUNKED,
+    /// the upstream closes the connection after it
+    PROXY_BODY_CLOSE,
+} ProxyBody;
+
+/// Where a chunked body is at. The chunks are relayed as they are, only their ends are looked for
+typedef enum {
+    PROXY_CHUNK_SIZE,
+    /// the extensions and the line end after the size
+    PROXY_CHUNK_SIZE_END,
+    PROXY_CHUNK_DATA,
+    PROXY_CHUNK_DATA_END,
+    PROXY_CHUNK_TRAILER,
+} ProxyChunk;
+
+/// How the body of a streamed request is passed on, see `proxy_upload`
+typedef enum {
+    /// there is none, or all of it is in `out`
+    PROXY_UPLOAD_NONE,
+    PROXY_UPLOAD_LENGTH,
+    /// the chunks are passed on as they are, only their end is looked for
+    PROXY_UPLOAD_CHUNKED,
+    /// the DATA of an HTTP/2 stream, which goes upstream in chunks of its own
+    PROXY_UPLOAD_FRAMED,
+} ProxyUpload;
+
+/// A connection to an upstream, idle in the pool of the worker that opened it or carrying the
+/// exchange of one client request
+// NOTE: only one of the connection and its HTTP/1.1 client is watched or has its timer armed at a
+// time, so neither can be freed while an event or expired timer of the other is still being
+// handled. The streams of an HTTP/2 client go on side by side instead, so neither end ever frees
+// the other: a client that goes away only cuts its exchanges short, see `proxy_abort_streams`, and
+// an exchange only queues its response, see `h2_respond_start`
+typedef struct ProxyConn {
+    IoHandler io;
+    Timer timer;
+    int sock;
+    ProxyState state;
+    ProxyUpstream* upstream;
+    /// the next idle connection in the pool, or the next exchange of the same HTTP/2 client
+    struct ProxyConn* next;
+    /// came out of the pool, so the upstream may have closed it in the meantime
+    bool reused;
+    /// the upstream leaves the connection open after the response
+    bool keep_alive;
+
+    /// the client the response goes to, NULL while idle or once an HTTP/2 client went away
+    Connection* client;
+    /// the HTTP/2 stream of the request, 0 for HTTP/1.1. Its body is queued as it comes
+    uint32_t h2_stream;
+    /// not read from until the session sent enough of the stream's body, see
+    /// `proxy_resume_streams`
+    bool paused;
+    /// the request can be sent again if a pooled connection turns out to be closed
+    bool idempotent;
+    bool head_request;
+    uint64_t start_ns;
+    char method[8];
+    char* path;
+    /// takes a copy of the response if it is to be cached, NULL otherwise
+    struct MicrocacheFill* fill;
+
+    /// the encoded request, it stays around until the response starts in case it is retried
+    string_builder out;
+    size_t out_off;
+    /// what is still to come of a streamed body. The body fields below keep track of it until
+    /// the response starts
+    ProxyUpload upload;
+    /// bytes of a stream's body the client's window did not get back yet, they are given back
+    /// once the upstream took them
+    size_t upload_unacked;
+
+    uint16_t status;
+    ProxyBody body;
+    /// what is left of the Content-Length or of the current chunk
+    uint64_t body_left;
+    ProxyChunk chunk;
+    bool chunk_digits;
+    bool trailer_line_empty;
+    /// body bytes relayed, chunk framing included
+    uint64_t bytes;
+
+    size_t in_len;
+    char in[PROXY_BUF_SIZE];
+} ProxyConn;
+
+static ProxyUpstream upstreams[PROXY_MAX_UPSTREAMS];
+static size_t upstream_count = 0;
+
+static SlabPool proxy_pool;
+
+static thread_local ProxyConn* idle_conns[PROXY_MAX_UPSTREAMS];
+static thread_local unsigned idle_counts[PROXY_MAX_UPSTREAMS];
+// where the search for the least busy upstream starts, so that ties are spread evenly
+static thread_local unsigned pick_start = 0;
+// the heads relayed to clients are rewritten here
+static thread_local string_builder head;
+static thread_local string_builder stream_head;
+
+static void proxy_io(IoHandler* io, uint32_t events);
+static void proxy_timeout(Timer* timer);
+
+void proxy_start(const char* list) {
+    slab_pool_init(&proxy_pool, "upstream_connections", sizeof(ProxyConn));
+
+    for (const char* p = list; *p;) {
+        size_t len = strcspn(p, ",");
+        char spec[256];
+        if (len == 0 || len >= sizeof(spec)) {
+            die("malformed upstream list");
+        }
+        memcpy(spec, p, len);
+        spec[len] = '\0';
+        p += len + (p[len] == ',');
+
+        char* colon = strrchr(spec, ':');
+        if (!colon) {
+            errno = EINVAL;
+            die("an upstream has to be given as host:port");
+        }
+        *colon = '\0';
+
+        if (upstream_count == PROXY_MAX_UPSTREAMS) {
+            errno = E2BIG;
+            die("too many upstreams");
+        }
+
+        struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+        struct addrinfo* addr;
+        if (getaddrinfo(spec, colon + 1, &hints, &addr) != 0) {
+            die("could not resolve an upstream");
+        }
+
+        ProxyUpstream* upstream = &upstreams[upstream_count++];
+        memcpy(&upstream->addr, addr->ai_addr, sizeof(upstream->addr));
+        atomic_init(&upstream->outstanding, 0);
+        atomic_init(&upstream->down_until, 0);
+        freeaddrinfo(addr);
+    }
+}
+
+bool proxy_enabled(void) {
+    return upstream_count != 0;
+}
+
+SlabStats proxy_slab_stats(void) {
+    return slab_pool_stats(&proxy_pool);
+}
+
+/// The upstream with the fewest outstanding requests, preferring the ones that are not down
+static ProxyUpstream* proxy_pick(void) {
+    uint64_t now = metrics_now();
+    unsigned start = pick_start++;
+
+    ProxyUpstream* best = NULL;
+    int best_load = 0;
+    bool best_down = true;
+    for (size_t i = 0; i < upstream_count; i++) {
+        ProxyUpstream* upstream = &upstreams[(start + i) % upstream_count];
+        int load = atomic_load_explicit(&upstream->outstanding, memory_order_relaxed);
+        bool down = atomic_load_explicit(&upstream->down_until, memory_order_relaxed) > now;
+        if (!best || (best_down && !down) || (down == best_down && load < best_load)) {
+            best = upstream;
+            best_load = load;
+            best_down = down;
+        }
+    }
+    return best;
+}
+
+static void proxy_mark_down(ProxyUpstream* upstream) {
+    atomic_store_explicit(&upstream->down_until, metrics_now() + PROXY_DOWN_NS,
+                          memory_order_relaxed);
+}
+
+/// Starts a connection on a fresh socket, returns false if it failed right away
+static bool proxy_connect(ProxyConn* pc) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return false;
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    ProxyUpstream* upstream = pc->upstream;
+    if (connect(sock, (struct sockaddr*)&upstream->addr, sizeof(upstream->addr)) == -1 &&
+        errno != EINPROGRESS) {
+        close(sock);
+        proxy_mark_down(upstream);
+        return false;
+    }
+
+    metrics_count(METRIC_PROXY_CONNECTS, 1);
+    pc->sock = sock;
+    pc->state = PROXY_CONNECTING;
+    pc->reused = false;
+    return true;
+}
+
+static void proxy_close(ProxyConn* pc) {
+    threadpool_timer_cancel(&pc->timer);
+    // NOTE: closing the socket also removes it from the worker's epoll set
+    if (pc->sock != -1) {
+        close(pc->sock);
+    }
+    sb_destroy(&pc->out);
+    free(pc->path);
+    slab_free(pc);
+}
+
+static void proxy_pool_remove(ProxyConn* pc) {
+    size_t index = pc->upstream - upstreams;
+    for (ProxyConn** link = &idle_conns[index]; *link; link = &(*link)->next) {
+        if (*link == pc) {
+            *link = pc->next;
+            idle_counts[index]--;
+            return;
+        }
+    }
+}
+
+/// A pooled connection to the upstream, or a new one
+static ProxyConn* proxy_conn_get(ProxyUpstream* upstream) {
+    size_t index = upstream - upstreams;
+    ProxyConn* pc = idle_conns[index];
+    if (pc) {
+        idle_conns[index] = pc->next;
+        idle_counts[index]--;
+        threadpool_timer_cancel(&pc->timer);
+        metrics_count(METRIC_PROXY_REUSED, 1);
+        pc->reused = true;
+        pc->state = PROXY_WAITING;
+        return pc;
+    }
+
+    pc = slab_alloc(&proxy_pool);
+    if (!pc) {
+        die("could not allocate an upstream connection");
+    }
+    pc->io.proc = proxy_io;
+    timer_init(&pc->timer, proxy_timeout);
+    pc->upstream = upstream;
+    pc->next = NULL;
+    pc->client = NULL;
+    pc->h2_stream = 0;
+    pc->paused = false;
+    pc->path = NULL;
+    pc->fill = NULL;
+    if (!proxy_connect(pc)) {
+        slab_free(pc);
+        return NULL;
+    }
+    pc->out = sb_new(1024);
+    return pc;
+}
+
+/// Detaches the connection from its client and pools it, or closes it if it can't be reused
+static void proxy_release(ProxyConn* pc, bool reusable) {
+    // a response that did not make it to the end is not cached
+    if (pc->fill) {
+        microcache_fill_end(pc->fill, false);
+        pc->fill = NULL;
+    }
+    atomic_fetch_sub_explicit(&pc->upstream->outstanding, 1, memory_order_relaxed);
+    if (pc->h2_stream && pc->client) {
+        for (ProxyConn** link = &pc->client->h2_proxies; *link; link = &(*link)->next) {
+            if (*link == pc) {
+                *link = pc->next;
+                break;
+            }
+        }
+    }
+    pc->client = NULL;
+    pc->h2_stream = 0;
+    pc->paused = false;
+    free(pc->path);
+    pc->path = NULL;
+
+    size_t index = pc->upstream - upstreams;
+    if (!reusable || idle_counts[index] == PROXY_POOL_IDLE_MAX) {
+        proxy_close(pc);
+        return;
+    }
+
+    // NOTE: an idle connection that turns readable was closed by the upstream
+    pc->state = PROXY_IDLE;
+    pc->next = idle_conns[index];
+    idle_conns[index] = pc;
+    idle_counts[index]++;
+    threadpool_watch(pc->sock, EPOLLIN, &pc->io);
+    threadpool_timer_arm(&pc->timer, PROXY_IDLE_TIMEOUT_MS);
+}
+
+/// Answers a request whose response never started with an error
+static void proxy_fail(ProxyConn* pc, HttpStatusCode status) {
+    Connection* conn = pc->client;
+    // the rest of a body that was not read yet can't be told from the next request
+    bool keep_alive = pc->upload == PROXY_UPLOAD_NONE;
+    uint32_t stream = pc->h2_stream;
+    metrics_count(METRIC_PROXY_FAILURES, 1);
+    access_log_request(conn->peer_addr, pc->method, pc->path, status, 0, pc->start_ns);
+    proxy_release(pc, false);
+
+    HttpResponse res = http_res_new(status, sv_make(NULL, 0));
+    if (stream) {
+        conn_respond_stream(conn, stream, &res, &(ConnBody){.fd = -1});
+        return;
+    }
+
+    conn->keep_alive &= keep_alive;
+    conn_respond(conn, &res);
+    conn_relay_end(conn, status, 0, keep_alive);
+}
+
+/// Ends the relayed response, the client is closed after it unless it is `complete`
+static void proxy_finish(ProxyConn* pc, bool complete) {
+    Connection* conn = pc->client;
+    uint16_t status = pc->status;
+    uint64_t bytes = pc->bytes;
+    bool client_keep_alive =
+        complete && pc->body != PROXY_BODY_CLOSE && pc->upload == PROXY_UPLOAD_NONE;
+    if (!complete) {
+        metrics_count(METRIC_PROXY_FAILURES, 1);
+    }
+
+    access_log_request(conn->peer_addr, pc->method, pc->path, status, bytes, pc->start_ns);
+    if (pc->fill) {
+        microcache_fill_end(pc->fill, complete);
+        pc->fill = NULL;
+    }
+    bool reusable = complete && pc->keep_alive && pc->out_off == pc->out.len &&
+                    pc->upload == PROXY_UPLOAD_NONE;
+
+    if (pc->h2_stream) {
+        // only the stream is cut short, its head went out already
+        if (complete) {
+            h2_stream_end(conn->h2, pc->h2_stream);
+        } else {
+            h2_stream_cancel(conn->h2, pc->h2_stream);
+        }
+        conn_send_later(conn);
+        proxy_release(pc, reusable);
+        return;
+    }
+
+    proxy_release(pc, reusable);
+    conn_relay_end(conn, status, bytes, client_keep_alive);
+}
+
+static void proxy_watch(ProxyConn* pc) {
+    uint32_t events = EPOLLIN | (pc->out_off < pc->out.len ? EPOLLOUT : 0);
+    threadpool_watch(pc->sock, events, &pc->io);
+}
+
+/// Sends what is left of the request, returns false on an error
+static bool proxy_send(ProxyConn* pc) {
+    while (pc->out_off < pc->out.len) {
+        ssize_t nsent =
+            send(pc->sock, pc->out.items + pc->out_off, pc->out.len - pc->out_off, MSG_NOSIGNAL);
+        if (nsent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        pc->out_off += nsent;
+    }
+
+    // NOTE: the client is read from again once the upstream took what came of its body so far,
+    // which holds it back as much as the upstream. A stream's window opens up again instead
+    if (pc->out_off == pc->out.len && pc->upload_unacked) {
+        h2_stream_consumed(pc->client->h2, pc->h2_stream, pc->upload_unacked);
+        pc->upload_unacked = 0;
+        conn_send_later(pc->client);
+    }
+    if (pc->out_off == pc->out.len && pc->upload != PROXY_UPLOAD_NONE && !pc->h2_stream &&
+        pc->state != PROXY_RELAYING) {
+        threadpool_unwatch(pc->sock);
+        threadpool_timer_cancel(&pc->timer);
+        conn_read_body(pc->client);
+        return true;
+    }
+
+    proxy_watch(pc);
+    return true;
+}
+
+/// Sends the request again over a new connection to `upstream`, returns false if it failed right
+/// away
+static bool proxy_reconnect(ProxyConn* pc, ProxyUpstream* upstream) {
+    threadpool_timer_cancel(&pc->timer);
+    close(pc->sock);
+    atomic_fetch_sub_explicit(&pc->upstream->outstanding, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&upstream->outstanding, 1, memory_order_relaxed);
+    pc->upstream = upstream;
+
+    if (!proxy_connect(pc)) {
+        // the socket is gone already, a failed connect left nothing to close
+        pc->sock = -1;
+        return false;
+    }
+
+    pc->out_off = 0;
+    threadpool_watch(pc->sock, EPOLLOUT, &pc->io);
+    threadpool_timer_arm(&pc->timer, PROXY_CONNECT_TIMEOUT_MS);
+    return true;
+}
+
+/// The connection broke. A pooled one the upstream closed before answering is replaced by a new
+/// one if the request can be sent twice
+static void proxy_broken(ProxyConn* pc) {
+    if (pc->state == PROXY_RELAYING) {
+        proxy_finish(pc, false);
+        return;
+    }
+
+    if (pc->reused && pc->in_len == 0 && pc->idempotent && proxy_reconnect(pc, pc->upstream)) {
+        return;
+    }
+    proxy_fail(pc, STATUS_BAD_GATEWAY);
+}
+
+/// Gives a client the connection's idea of whether it stays open, any other hop-by-hop header
+/// of the upstream is left out
+static bool proxy_hop_by_hop(string_view name) {
+    static const char* const names[] = {"connection", "keep-alive", "proxy-connection", "te",
+                                        "upgrade",    "http2-settings"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (http_header_is(name, names[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Parses the head of the response and rewrites it for the client into `head`. Returns false if
+/// it is malformed
+static bool proxy_head(ProxyConn* pc, string_view in) {
+    // "HTTP/1.x 200 ..."
+    if (in.size < 12 || memcmp(in.ptr, "HTTP/1.", 7) != 0 || in.ptr[8] != ' ') {
+        return false;
+    }
+    unsigned status = 0;
+    for (size_t i = 9; i < 12; i++) {
+        if (in.ptr[i] < '0' || in.ptr[i] > '9') {
+            return false;
+        }
+        status = status * 10 + in.ptr[i] - '0';
+    }
+    pc->status = status;
+    pc->keep_alive = in.ptr[7] == '1';
+
+    ssize_t line_end = sv_find_sub_cstr(in, "\r\n");
+    size_t status_len = line_end == -1 ? in.size : (size_t)line_end;
+    if (!head.items) {
+        head = sb_new(1024);
+    }
+    sb_clear(&head);
+    sb_push_cstr(&head, "HTTP/1.1");
+    sb_push_n(&head, in.ptr + 8, status_len - 8);
+    sb_push_cstr(&head, "\r\n");
+
+    bool chunked = false;
+    bool has_length = false;
+    uint64_t length = 0;
+    string_view rest = line_end == -1 ? sv_make(NULL, 0) : sv_slice_end(in, line_end + 2);
+    while (rest.size) {
+        line_end = sv_find_sub_cstr(rest, "\r\n");
+        size_t len = line_end == -1 ? rest.size : (size_t)line_end;
+        string_view line = sv_slice(rest, 0, len);
+        rest = line_end == -1 ? sv_make(NULL, 0) : sv_slice_end(rest, len + 2);
+
+        ssize_t colon = sv_find(line, ':');
+        if (colon <= 0) {
+            return false;
+        }
+        string_view name = sv_slice(line, 0, colon);
+        string_view value = sv_slice_end(line, colon + 1);
+        while (value.size && (value.ptr[0] == ' ' || value.ptr[0] == '\t')) {
+            value = sv_slice_end(value, 1);
+        }
+
+        if (http_header_is(name, "connection")) {
+            if (http_header_has(value, "close")) {
+                pc->keep_alive = false;
+            } else if (http_header_has(value, "keep-alive")) {
+                pc->keep_alive = true;
+            }
+        } else if (http_header_is(name, "transfer-encoding")) {
+            chunked = http_header_has(value, "chunked");
+        } else if (http_header_is(name, "content-length")) {
+            if (!value.size || has_length) {
+                return false;
+            }
+            has_length = true;
+            for (size_t i = 0; i < value.size; i++) {
+                if (value.ptr[i] < '0' || value.ptr[i] > '9' || length > PROXY_MAX_CHUNK) {
+                    return false;
+                }
+                length = length * 10 + value.ptr[i] - '0';
+            }
+        }
+
+        if (!proxy_hop_by_hop(name)) {
+            sb_push_n(&head, line.ptr, line.size);
+            sb_push_cstr(&head, "\r\n");
+        }
+    }
+
+    pc->body_left = 0;
+    pc->bytes = 0;
+    if (pc->head_request || status / 100 == 1 || status == 204 || status == 304) {
+        pc->body = PROXY_BODY_NONE;
+    } else if (chunked) {
+        pc->body = PROXY_BODY_CHUNKED;
+        pc->chunk = PROXY_CHUNK_SIZE;
+        pc->chunk_digits = false;
+    } else if (has_length) {
+        pc->body = length ? PROXY_BODY_LENGTH : PROXY_BODY_NONE;
+        pc->body_left = length;
+    } else {
+        pc->body = PROXY_BODY_CLOSE;
+        pc->keep_alive = false;
+    }
+
+    // an answer that comes before the whole body was sent leaves the rest of it unread
+    if (!pc->client->keep_alive || pc->body == PROXY_BODY_CLOSE ||
+        pc->upload != PROXY_UPLOAD_NONE) {
+        sb_push_cstr(&head, "Connection: close\r\n");
+    }
+    sb_push_cstr(&head, "\r\n");
+    return true;
+}
+
+static int proxy_hex(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/// Hands bytes of the response body, without any chunk framing, to the cache and to the response
+/// of a stream
+static void proxy_body(ProxyConn* pc, const char* data, size_t len) {
+    if (pc->fill && !microcache_fill_body(pc->fill, data, len)) {
+        pc->fill = NULL;
+    }
+    if (pc->h2_stream) {
+        h2_stream_append(pc->client->h2, pc->h2_stream, data, len);
+    }
+}
+
+/// Finds the end of a chunked body among `len` bytes. Returns how many of them belong to it, -1
+/// if the chunks are malformed
+static ssize_t proxy_scan_chunks(ProxyConn* pc, const char* data, size_t len, bool* done) {
+    size_t i = 0;
+    while (i < len && !*done) {
+        char c = data[i];
+        switch (pc->chunk) {
+            case PROXY_CHUNK_SIZE: {
+                int digit = proxy_hex(c);
+                if (digit == -1) {
+                    if (!pc->chunk_digits) {
+                        return -1;
+                    }
+                    pc->chunk = PROXY_CHUNK_SIZE_END;
+                    continue;
+                }
+                if (pc->body_left > PROXY_MAX_CHUNK) {
+                    return -1;
+                }
+                pc->body_left = pc->body_left * 16 + digit;
+                pc->chunk_digits = true;
+                i++;
+                break;
+            }
+            case PROXY_CHUNK_SIZE_END:
+                i++;
+                if (c == '\n') {
+                    pc->chunk = pc->body_left ? PROXY_CHUNK_DATA : PROXY_CHUNK_TRAILER;
+                    pc->trailer_line_empty = true;
+                }
+                break;
+            case PROXY_CHUNK_DATA: {
+                size_t n = len - i < pc->body_left ? len - i : pc->body_left;
+                proxy_body(pc, data + i, n);
+                i += n;
+                pc->body_left -= n;
+                if (!pc->body_left) {
+                    pc->chunk = PROXY_CHUNK_DATA_END;
+                }
+                break;
+            }
+            case PROXY_CHUNK_DATA_END:
+                i++;
+                if (c == '\n') {
+                    pc->chunk = PROXY_CHUNK_SIZE;
+                    pc->chunk_digits = false;
+                }
+                break;
+            case PROXY_CHUNK_TRAILER:
+                i++;
+                if (c == '\n') {
+                    *done = pc->trailer_line_empty;
+                    pc->trailer_line_empty = true;
+                } else if (c != '\r') {
+                    pc->trailer_line_empty = false;
+                }
+                break;
+        }
+    }
+    return i;
+}
+
+/// Keeps the header lines of `head` that a stream's response does not get from the session
+static void proxy_stream_head(ProxyConn* pc) {
+    sb_clear(&stream_head);
+    string_view rest = sv_make(head.items, head.len);
+    // the status line goes, the session sends the status on its own
+    ssize_t line_end = sv_find_sub_cstr(rest, "\r\n");
+    rest = sv_slice_end(rest, line_end + 2);
+    while ((line_end = sv_find_sub_cstr(rest, "\r\n")) > 0) {
+        string_view line = sv_slice(rest, 0, line_end);
+        rest = sv_slice_end(rest, line_end + 2);
+
+        // the length is passed on as it is when it is known, even of a body that never comes as
+        // in the answer to HEAD
+        string_view name = sv_slice(line, 0, sv_find(line, ':'));
+        bool length = http_header_is(name, "content-length") && pc->body != PROXY_BODY_NONE &&
+                      pc->body != PROXY_BODY_LENGTH;
+        if (length || http_header_is(name, "date")) {
+            continue;
+        }
+        sb_push_n(&stream_head, line.ptr, line.size);
+        sb_push_cstr(&stream_head, "\r\n");
+    }
+}
+
+/// Queues the head of a stream's response, and its end as well if there is no body
+static void proxy_stream_start(ProxyConn* pc) {
+    proxy_stream_head(pc);
+    HttpResponse res = http_res_new((HttpStatusCode)pc->status, sv_make(NULL, 0));
+    res.raw_headers = sv_make(stream_head.items, stream_head.len);
+    if (pc->body == PROXY_BODY_NONE) {
+        conn_respond_stream(pc->client, pc->h2_stream, &res, &(ConnBody){.fd = -1});
+        return;
+    }
+    h2_respond_start(pc->client->h2, pc->h2_stream, &res);
+    conn_send_later(pc->client);
+}
+
+/// Whether the session takes more of a stream's body. Returns false once the client reset the
+/// stream or too much of the body waits, the connection is paused then
+static bool proxy_stream_sent(ProxyConn* pc) {
+    conn_send_later(pc->client);
+    ssize_t pending = h2_stream_pending(pc->client->h2, pc->h2_stream);
+    if (pending == -1) {
+        return false;
+    }
+    pc->paused = pending >= PROXY_STREAM_BUFFERED;
+    return !pc->paused;
+}
+
+/// Relays what is buffered. Returns false once the exchange is over or the client is blocked,
+/// the connection is not to be touched then
+static bool proxy_relay(ProxyConn* pc) {
+    while (pc->state == PROXY_WAITING) {
+        string_view in = sv_make(pc->in, pc->in_len);
+        ssize_t head_end = sv_find_sub_cstr(in, "\r\n\r\n");
+        if (head_end == -1) {
+            if (pc->in_len == sizeof(pc->in)) {
+                proxy_fail(pc, STATUS_BAD_GATEWAY);
+                return false;
+            }
+            return true;
+        }
+
+        if (!proxy_head(pc, sv_slice(in, 0, head_end + 2))) {
+            pc->keep_alive = false;
+            proxy_fail(pc, STATUS_BAD_GATEWAY);
+            return false;
+        }
+
+        // NOTE: interim responses are dropped, the client never asked for them
+        bool interim = pc->status / 100 == 1;
+        if (!interim && pc->fill) {
+            // the header lines as the upstream sent them, the cache picks its own
+            size_t status_end = sv_find_sub_cstr(in, "\r\n") + 2;
+            string_view headers = sv_slice(in, status_end, head_end + 2 - status_end);
+            if (!microcache_fill_head(pc->fill, pc->status, headers)) {
+                pc->fill = NULL;
+            }
+        }
+        pc->in_len -= head_end + 4;
+        memmove(pc->in, pc->in + head_end + 4, pc->in_len);
+        if (interim) {
+            continue;
+        }
+
+        pc->state = PROXY_RELAYING;
+        bool sent = true;
+        if (pc->h2_stream) {
+            proxy_stream_start(pc);
+        } else {
+            sent = conn_relay(pc->client, pc->status, head.items, head.len);
+        }
+        if (pc->body == PROXY_BODY_NONE) {
+            proxy_finish(pc, true);
+            return false;
+        }
+        if (!sent) {
+            threadpool_unwatch(pc->sock);
+            threadpool_timer_cancel(&pc->timer);
+            return false;
+        }
+    }
+
+    if (!pc->in_len) {
+        return true;
+    }
+
+    size_t len = pc->in_len;
+    bool done = false;
+    switch (pc->body) {
+        case PROXY_BODY_LENGTH:
+            len = len < pc->body_left ? len : pc->body_left;
+            pc->body_left -= len;
+            done = pc->body_left == 0;
+            break;
+        case PROXY_BODY_CHUNKED: {
+            ssize_t scanned = proxy_scan_chunks(pc, pc->in, len, &done);
+            if (scanned == -1) {
+                pc->keep_alive = false;
+                proxy_finish(pc, false);
+                return false;
+            }
+            len = scanned;
+            break;
+        }
+        default:
+            break;
+    }
+
+    // bytes behind the end of the response mean the upstream is out of step
+    if (len < pc->in_len) {
+        pc->keep_alive = false;
+    }
+    pc->in_len = 0;
+    pc->bytes += len;
+    // the chunks are taken apart while they are scanned
+    if (pc->body != PROXY_BODY_CHUNKED) {
+        proxy_body(pc, pc->in, len);
+    }
+
+    bool sent = pc->h2_stream ? proxy_stream_sent(pc)
+                              : conn_relay(pc->client, pc->status, pc->in, len);
+    if (done) {
+        proxy_finish(pc, true);
+        return false;
+    }
+    // a stream the client reset takes nothing more
+    if (!sent && !pc->paused && pc->h2_stream) {
+        pc->keep_alive = false;
+        proxy_finish(pc, false);
+        return false;
+    }
+    if (!sent) {
+        threadpool_unwatch(pc->sock);
+        threadpool_timer_cancel(&pc->timer);
+        return false;
+    }
+    return true;
+}
+
+static void proxy_read(ProxyConn* pc) {
+    while (true) {
+        ssize_t nread = recv(pc->sock, pc->in + pc->in_len, sizeof(pc->in) - pc->in_len, 0);
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+
+            proxy_broken(pc);
+            return;
+        }
+
+        if (nread == 0) {
+            if (pc->state == PROXY_RELAYING && pc->body == PROXY_BODY_CLOSE) {
+                proxy_finish(pc, true);
+            } else {
+                proxy_broken(pc);
+            }
+            return;
+        }
+
+        pc->in_len += nread;
+        threadpool_timer_arm(&pc->timer, PROXY_READ_TIMEOUT_MS);
+        if (!proxy_relay(pc)) {
+            return;
+        }
+    }
+}
+
+static void proxy_io(IoHandler* io, uint32_t events) {
+    ProxyConn* pc = container_of(io, ProxyConn, io);
+    if (pc->state != PROXY_IDLE && !pc->client) {
+        proxy_release(pc, false);
+        return;
+    }
+
+    switch (pc->state) {
+        case PROXY_IDLE:
+            proxy_pool_remove(pc);
+            proxy_close(pc);
+            return;
+
+        case PROXY_CONNECTING: {
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            if (getsockopt(pc->sock, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error) {
+                // nothing was sent, so the request goes to another upstream if one is up
+                proxy_mark_down(pc->upstream);
+                ProxyUpstream* upstream = proxy_pick();
+                if (atomic_load_explicit(&upstream->down_until, memory_order_relaxed) <=
+                        metrics_now() &&
+                    proxy_reconnect(pc, upstream)) {
+                    return;
+                }
+                proxy_fail(pc, STATUS_BAD_GATEWAY);
+                return;
+            }
+
+            pc->state = PROXY_WAITING;
+            threadpool_timer_arm(&pc->timer, PROXY_READ_TIMEOUT_MS);
+            if (!proxy_send(pc)) {
+                proxy_broken(pc);
+            }
+            return;
+        }
+
+        case PROXY_WAITING:
+        case PROXY_RELAYING:
+            if ((events & EPOLLOUT) && !proxy_send(pc)) {
+                proxy_broken(pc);
+                return;
+            }
+            if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                proxy_read(pc);
+            }
+            return;
+    }
+}
+
+static void proxy_timeout(Timer* timer) {
+    ProxyConn* pc = container_of(timer, ProxyConn, timer);
+    if (pc->state != PROXY_IDLE && !pc->client) {
+        proxy_release(pc, false);
+        return;
+    }
+
+    switch (pc->state) {
+        case PROXY_IDLE:
+            proxy_pool_remove(pc);
+            proxy_close(pc);
+            return;
+        case PROXY_CONNECTING:
+            proxy_mark_down(pc->upstream);
+            proxy_fail(pc, STATUS_GATEWAY_TIMEOUT);
+            return;
+        case PROXY_WAITING:
+            proxy_fail(pc, STATUS_GATEWAY_TIMEOUT);
+            return;
+        case PROXY_RELAYING:
+            proxy_finish(pc, false);
+            return;
+    }
+}
+
+/// Encodes the request for the upstream, without the hop-by-hop headers of the client
+static void proxy_encode(ProxyConn* pc, Connection* conn, HttpRequest const* req) {
+    string_builder* out = &pc->out;
+    sb_clear(out);
+    pc->out_off = 0;
+
+    sb_sprintf(out, "%s %s HTTP/1.1\r\n", req->headers.method, req->headers.path);
+    bool has_length = false;
+    bool chunked = false;
+    uint64_t length = 0;
+    HttpHeaders const* headers = &req->headers.headers;
+    for (size_t i = 0; i < headers->len; i++) {
+        const char* value = headers->items[i].value;
+        string_view name = sv_make(headers->items[i].key, strlen(headers->items[i].key));
+        if (http_header_is(name, "content-length")) {
+            has_length = true;
+            length = strtoull(value, NULL, 10);
+            continue;
+        }
+        if (http_header_is(name, "transfer-encoding")) {
+            chunked = http_header_has(sv_make(value, strlen(value)), "chunked");
+            continue;
+        }
+        // the client gets its 100 Continue from here, see `conn_read_body`
+        if (proxy_hop_by_hop(name) || (req->body_streamed && http_header_is(name, "expect"))) {
+            continue;
+        }
+        // NOTE: HTTP/2 clients may split their cookies into fields of their own, HTTP/1.1 has
+        // them in one
+        if (conn->h2 && http_header_is(name, "cookie")) {
+            continue;
+        }
+        sb_sprintf(out, "%s: %s\r\n", headers->items[i].key, value);
+    }
+
+    const char* separator = "cookie: ";
+    for (size_t i = 0; conn->h2 && i < headers->len; i++) {
+        if (strcmp(headers->items[i].key, "cookie") == 0) {
+            sb_sprintf(out, "%s%s", separator, headers->items[i].value);
+            separator = "; ";
+        }
+    }
+    if (*separator == ';') {
+        sb_push_cstr(out, "\r\n");
+    }
+
+    if (conn->peer_addr) {
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &conn->peer_addr, addr, sizeof(addr));
+        sb_sprintf(out, "X-Forwarded-For: %s\r\n", addr);
+    }
+
+    pc->upload = PROXY_UPLOAD_NONE;
+    pc->upload_unacked = 0;
+    if (!req->body_streamed) {
+        if (has_length || req->body_len) {
+            sb_sprintf(out, "Content-Length: %zu\r\n", req->body_len);
+        }
+    } else if (conn->h2) {
+        // the DATA frames are chunked as they come, whatever length they add up to
+        sb_push_cstr(out, "Transfer-Encoding: chunked\r\n");
+        pc->upload = PROXY_UPLOAD_FRAMED;
+    } else if (chunked) {
+        sb_push_cstr(out, "Transfer-Encoding: chunked\r\n");
+        pc->upload = PROXY_UPLOAD_CHUNKED;
+        pc->chunk = PROXY_CHUNK_SIZE;
+        pc->chunk_digits = false;
+        pc->body_left = 0;
+    } else {
+        sb_sprintf(out, "Content-Length: %" PRIu64 "\r\n", length);
+        pc->upload = PROXY_UPLOAD_LENGTH;
+        pc->body_left = length;
+    }
+    sb_push_cstr(out, "\r\n");
+    sb_push_n(out, req->body, req->body_len);
+}
+
+void proxy_forward(Connection* conn, HttpRequest const* req, struct MicrocacheFill* fill) {
+    metrics_count(METRIC_PROXY_REQUESTS, 1);
+
+    // an upstream that refuses the connection is marked down, which passes it over on the next try
+    ProxyConn* pc = NULL;
+    for (size_t i = 0; !pc && i < upstream_count; i++) {
+        pc = proxy_conn_get(proxy_pick());
+    }
+    if (!pc) {
+        if (fill) {
+            microcache_fill_end(fill, false);
+        }
+        metrics_count(METRIC_PROXY_FAILURES, 1);
+        HttpResponse res = http_res_new(STATUS_BAD_GATEWAY, sv_make(NULL, 0));
+        conn_respond(conn, &res);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&pc->upstream->outstanding, 1, memory_order_relaxed);
+    pc->client = conn;
+    if (conn->h2) {
+        // the session goes on with the other streams, this one is answered as its response
+        // comes
+        pc->h2_stream = conn->h2_stream;
+        pc->next = conn->h2_proxies;
+        conn->h2_proxies = pc;
+        h2_defer(conn->h2, conn->h2_stream);
+    } else {
+        conn->proxy = pc;
+    }
+
+    const char* method = req->headers.method;
+    pc->head_request = strcmp(method, "HEAD") == 0;
+    // NOTE: a streamed body is gone once it is sent, so it can't be sent again
+    pc->idempotent = (pc->head_request || strcmp(method, "GET") == 0) && !req->body_streamed;
+    pc->start_ns = metrics_now();
+    size_t method_len = strlen(method);
+    method_len = method_len < sizeof(pc->method) ? method_len : sizeof(pc->method) - 1;
+    memcpy(pc->method, method, method_len);
+    pc->method[method_len] = '\0';
+    pc->path = strdup(req->headers.path);
+    pc->fill = fill;
+    pc->in_len = 0;
+    proxy_encode(pc, conn, req);
+
+    // NOTE: the request is only sent from the event loop, an error right away would otherwise
+    // answer the client in the middle of its request handler
+    if (pc->state == PROXY_CONNECTING) {
+        threadpool_timer_arm(&pc->timer, PROXY_CONNECT_TIMEOUT_MS);
+    } else {
+        threadpool_timer_arm(&pc->timer, PROXY_READ_TIMEOUT_MS);
+    }
+    threadpool_watch(pc->sock, EPOLLOUT, &pc->io);
+}
+
+ssize_t proxy_upload(ProxyConn* pc, const char* data, size_t len) {
+    size_t n = len;
+    switch (pc->upload) {
+        case PROXY_UPLOAD_NONE:
+        case PROXY_UPLOAD_FRAMED:
+            return 0;
+        case PROXY_UPLOAD_LENGTH:
+            n = len < pc->body_left ? len : pc->body_left;
+            pc->body_left -= n;
+            if (!pc->body_left) {
+                pc->upload = PROXY_UPLOAD_NONE;
+            }
+            break;
+        case PROXY_UPLOAD_CHUNKED: {
+            bool done = false;
+            ssize_t scanned = proxy_scan_chunks(pc, data, len, &done);
+            if (scanned == -1) {
+                return -1;
+            }
+            n = scanned;
+            if (done) {
+                pc->upload = PROXY_UPLOAD_NONE;
+            }
+            break;
+        }
+    }
+
+    // what was sent before is not needed any more, a streamed request is never sent again
+    if (pc->out_off == pc->out.len) {
+        sb_clear(&pc->out);
+        pc->out_off = 0;
+    }
+    sb_push_n(&pc->out, data, n);
+
+    // a connection that is not up yet sends everything once it is
+    if (pc->state != PROXY_CONNECTING) {
+        threadpool_timer_arm(&pc->timer, PROXY_READ_TIMEOUT_MS);
+        proxy_watch(pc);
+    }
+    return n;
+}
+
+void proxy_stream_data(Connection* conn, uint32_t stream, const char* data, size_t len,
+                       bool end) {
+    ProxyConn* pc = conn->h2_proxies;
+    while (pc && pc->h2_stream != stream) {
+        pc = pc->next;
+    }
+    // an answer that came before the end leaves the rest of the body behind
+    if (!pc || pc->upload != PROXY_UPLOAD_FRAMED || pc->state == PROXY_RELAYING) {
+        return;
+    }
+
+    if (pc->out_off == pc->out.len) {
+        sb_clear(&pc->out);
+        pc->out_off = 0;
+    }
+    if (len) {
+        sb_sprintf(&pc->out, "%zx\r\n", len);
+        sb_push_n(&pc->out, data, len);
+        sb_push_cstr(&pc->out, "\r\n");
+        pc->upload_unacked += len;
+    }
+    if (end) {
+        sb_push_cstr(&pc->out, "0\r\n\r\n");
+        pc->upload = PROXY_UPLOAD_NONE;
+    }
+
+    if (pc->state != PROXY_CONNECTING) {
+        threadpool_timer_arm(&pc->timer, PROXY_READ_TIMEOUT_MS);
+        proxy_watch(pc);
+    }
+}
+
+void proxy_abort_streams(Connection* conn) {
+    for (ProxyConn* pc = conn->h2_proxies; pc; pc = pc->next) {
+        // NOTE: the exchange may have an event or an expired timer waiting in the batch that is
+        // being handled, so it is only cut short here and released by its own handlers
+        pc->client = NULL;
+        shutdown(pc->sock, SHUT_RDWR);
+        // a paused exchange is woken by the shutdown once it is watched again
+        if (pc->paused) {
+            proxy_watch(pc);
+        }
+    }
+    conn->h2_proxies = NULL;
+}
+
+void proxy_resume_streams(Connection* conn) {
+    for (ProxyConn* pc = conn->h2_proxies; pc; pc = pc->next) {
+        if (!pc->paused) {
+            continue;
+        }
+        ssize_t pending = h2_stream_pending(conn->h2, pc->h2_stream);
+        if (pending != -1 && pending > PROXY_STREAM_BUFFERED / 2) {
+            continue;
+        }
+
+        // NOTE: nothing is relayed from here, the session is in the middle of sending. A stream
+        // that is gone is found out about on the next read
+        pc->paused = false;
+        threadpool_timer_arm(&pc->timer, PROXY_READ_TIMEOUT_MS);
+        proxy_watch(pc);
+    }
+}
+
+void proxy_resume(ProxyConn* pc) {
+    // the client took the 100 Continue it waited for, its body comes next
+    if (pc->state != PROXY_RELAYING) {
+        conn_read_body(pc->client);
+        return;
+    }
+
+    threadpool_timer_arm(&pc->timer, PROXY_READ_TIMEOUT_MS);
+    proxy_watch(pc);
+    if (pc->in_len) {
+        proxy_relay(pc);
+    }
+}
+
+void proxy_abort(ProxyConn* pc) {
+    proxy_release(pc, false);
+}
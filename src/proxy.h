@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "connection.h"
+#include "protocol.h"
+#include "slab.h"
+
+// Requests that match no file can be passed on to upstream HTTP/1.1 servers. Every worker keeps
+// pools of keep-alive connections to them, and each request goes to the upstream with the fewest
+// requests in flight over all workers. The response is relayed to the client as it arrives, a
+// client that does not keep up holds back the reading from the upstream. Request bodies too big
+// for the input buffer and chunked ones go the other way just the same
+
+// the most upstreams that can be given
+#define PROXY_MAX_UPSTREAMS 16
+
+struct ProxyConn;
+struct MicrocacheFill;
+
+/// Resolves a comma separated list of `host:port` upstreams and proxies to them from then on
+void proxy_start(const char* upstreams);
+bool proxy_enabled(void);
+
+/// Sends the request upstream and relays the response through `conn_relay`, handing a copy to
+/// `fill` unless it is NULL. The response of an HTTP/2 stream is queued with `h2_respond_start` and
+/// its body as it comes. A request that can't be sent anywhere is answered with 502 right away
+void proxy_forward(Connection* conn, HttpRequest const* req, struct MicrocacheFill* fill);
+/// Passes on bytes of a streamed request body, see `HttpRequest.body_streamed`. They are sent
+/// from the event loop, which asks the client for more with `conn_read_body` once they are gone.
+/// Returns how many of the bytes belong to the body, -1 if its chunks are malformed
+ssize_t proxy_upload(struct ProxyConn* proxy, const char* data, size_t len);
+/// Passes on the body of an HTTP/2 stream as it arrives, it is an `H2DataProc`
+void proxy_stream_data(Connection* conn, uint32_t stream, const char* data, size_t len,
+                       bool end);
+/// Goes on reading the response once the client took everything relayed so far
+void proxy_resume(struct ProxyConn* proxy);
+/// Drops the exchange of a client that went away, along with its upstream connection
+void proxy_abort(struct ProxyConn* proxy);
+/// Goes on reading the responses of an HTTP/2 client's streams once the session sent enough of
+/// what was queued of them
+void proxy_resume_streams(Connection* conn);
+/// Drops the exchanges of the streams of an HTTP/2 client that went away
+void proxy_abort_streams(Connection* conn);
+
+SlabStats proxy_slab_stats(void);
@@ -0,0 +1,171 @@
+#include "slab.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <threads.h>
+
+#include "util.h"
+
+#define SLAB_MAX_POOLS 16
+
+typedef struct SlabObject {
+    struct SlabObject* next;
+} SlabObject;
+
+/// The per-thread part of a pool
+typedef struct SlabCache {
+    SlabPool* pool;
+    SlabObject* free_list;
+    _Atomic(SlabObject*) remote_free;
+    struct SlabCache* next;
+
+    // NOTE: everything but `remote_frees` is only written by the owner
+    atomic_size_t slabs;
+    atomic_size_t allocs;
+    atomic_size_t frees;
+    atomic_size_t remote_frees;
+} SlabCache;
+
+/// The header at the start of every slab
+typedef struct {
+    SlabCache* owner;
+} Slab;
+
+static atomic_size_t pool_count;
+static thread_local SlabCache* thread_caches[SLAB_MAX_POOLS];
+
+static size_t slab_header_size(void) {
+    return (sizeof(Slab) + 63) & ~(size_t)63;
+}
+
+void slab_pool_init(SlabPool* pool, const char* name, size_t obj_size) {
+    if (obj_size < sizeof(SlabObject)) {
+        obj_size = sizeof(SlabObject);
+    }
+    obj_size = (obj_size + 15) & ~(size_t)15;
+    assert(obj_size <= SLAB_SIZE - slab_header_size());
+
+    pool->name = name;
+    pool->obj_size = obj_size;
+    pool->objs_per_slab = (SLAB_SIZE - slab_header_size()) / obj_size;
+    pool->id = atomic_fetch_add(&pool_count, 1);
+    assert(pool->id < SLAB_MAX_POOLS && "too many slab pools");
+
+    pool->caches = NULL;
+    pthread_mutex_init(&pool->caches_mutex, NULL);
+}
+
+static SlabCache* slab_cache_get(SlabPool* pool) {
+    SlabCache* cache = thread_caches[pool->id];
+    if (cache) {
+        return cache;
+    }
+
+    cache = calloc(1, sizeof(SlabCache));
+    cache->pool = pool;
+    atomic_init(&cache->remote_free, NULL);
+
+    pthread_mutex_lock(&pool->caches_mutex);
+    cache->next = pool->caches;
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->caches_mutex);
+
+    thread_caches[pool->id] = cache;
+    return cache;
+}
+
+/// Maps a new slab aligned to its size and threads its objects onto the free list
+static bool slab_cache_grow(SlabCache* cache) {
+    // map twice the size and trim, mmap has no alignment argument
+    uint8_t* raw = mmap(NULL, SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (raw == MAP_FAILED) {
+        return false;
+    }
+
+    uintptr_t aligned = ((uintptr_t)raw + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1);
+    size_t head = aligned - (uintptr_t)raw;
+    if (head) {
+        munmap(raw, head);
+    }
+    munmap((uint8_t*)aligned + SLAB_SIZE, SLAB_SIZE - head);
+
+    Slab* slab = (Slab*)aligned;
+    slab->owner = cache;
+
+    SlabPool* pool = cache->pool;
+    uint8_t* objects = (uint8_t*)slab + slab_header_size();
+    for (size_t i = pool->objs_per_slab; i > 0; i--) {
+        SlabObject* obj = (SlabObject*)(objects + (i - 1) * pool->obj_size);
+        obj->next = cache->free_list;
+        cache->free_list = obj;
+    }
+
+    atomic_fetch_add_explicit(&cache->slabs, 1, memory_order_relaxed);
+    return true;
+}
+
+void* slab_alloc(SlabPool* pool) {
+    SlabCache* cache = slab_cache_get(pool);
+
+    if (!cache->free_list) {
+        // take back everything other threads freed in one go
+        cache->free_list =
+            atomic_exchange_explicit(&cache->remote_free, NULL, memory_order_acquire);
+    }
+
+    if (!cache->free_list && !slab_cache_grow(cache)) {
+        return NULL;
+    }
+
+    SlabObject* obj = cache->free_list;
+    cache->free_list = obj->next;
+    atomic_fetch_add_explicit(&cache->allocs, 1, memory_order_relaxed);
+    return obj;
+}
+
+void slab_free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    Slab* slab = (Slab*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+    SlabCache* cache = slab->owner;
+    SlabObject* obj = (SlabObject*)ptr;
+
+    if (thread_caches[cache->pool->id] == cache) {
+        obj->next = cache->free_list;
+        cache->free_list = obj;
+        atomic_fetch_add_explicit(&cache->frees, 1, memory_order_relaxed);
+        return;
+    }
+
+    SlabObject* head = atomic_load_explicit(&cache->remote_free, memory_order_relaxed);
+    do {
+        obj->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&cache->remote_free, &head, obj,
+                                                    memory_order_release, memory_order_relaxed));
+    atomic_fetch_add_explicit(&cache->remote_frees, 1, memory_order_relaxed);
+}
+
+SlabStats slab_pool_stats(SlabPool* pool) {
+    SlabStats stats = {0};
+
+    pthread_mutex_lock(&pool->caches_mutex);
+    for (SlabCache* cache = pool->caches; cache; cache = cache->next) {
+        size_t frees = atomic_load_explicit(&cache->frees, memory_order_relaxed);
+        size_t remote_frees = atomic_load_explicit(&cache->remote_frees, memory_order_relaxed);
+
+        stats.slabs += atomic_load_explicit(&cache->slabs, memory_order_relaxed);
+        stats.allocs += atomic_load_explicit(&cache->allocs, memory_order_relaxed);
+        stats.frees += frees + remote_frees;
+        stats.remote_frees += remote_frees;
+    }
+    pthread_mutex_unlock(&pool->caches_mutex);
+
+    stats.capacity = stats.slabs * pool->objs_per_slab;
+    stats.in_use = stats.allocs > stats.frees ? stats.allocs - stats.frees : 0;
+    return stats;
+}
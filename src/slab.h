@@ -0,0 +1,42 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// every slab is aligned to its size, so the owner of an object is found by masking its address
+#define SLAB_SIZE (256 * 1024)
+
+struct SlabCache;
+
+/// A pool of fixed-size objects. Every thread allocates from a cache of its own, objects freed by
+/// another thread are handed back to the owning cache through a lock-free remote-free list
+typedef struct {
+    const char* name;
+    size_t obj_size;
+    size_t objs_per_slab;
+    /// index of the pool's cache in the per-thread cache table
+    size_t id;
+
+    /// all caches of the pool, only walked to collect stats
+    struct SlabCache* caches;
+    pthread_mutex_t caches_mutex;
+} SlabPool;
+
+typedef struct {
+    size_t slabs;
+    /// objects carved out of the slabs
+    size_t capacity;
+    size_t in_use;
+    size_t allocs;
+    size_t frees;
+    /// frees that came from a thread that does not own the object
+    size_t remote_frees;
+} SlabStats;
+
+void slab_pool_init(SlabPool* pool, const char* name, size_t obj_size);
+void* slab_alloc(SlabPool* pool);
+void slab_free(void* ptr);
+/// Sums the stats of every thread's cache, the result is only approximate while the pool is used
+SlabStats slab_pool_stats(SlabPool* pool);
@@ -1,26 +1,67 @@
 #include "thread_pool.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <threads.h>
+#include <time.h>
 #include <unistd.h>
 
-#define HTTPO_WTRQ_CAP 32
+#include "metrics.h"
+#include "slab.h"
+#include "util.h"
+
+// how many interactive jobs can run in a row while a bulk slice is waiting
+#define HTTPPO_BULK_STARVATION_LIMIT 16
+
+// how many jobs are run between two polls of the event loop
+#define HTTPPO_JOB_BATCH 64
+#define HTTPPO_MAX_EVENTS 64
+
+// CoDel parameters, see https://queue.acm.org/detail.cfm?id=2209336
+#define HTTPPO_CODEL_TARGET_NS (5 * 1000 * 1000)
+#define HTTPPO_CODEL_INTERVAL_NS (100 * 1000 * 1000)
+
+static thread_local WorkerThread* current_thread = NULL;
+// when the running job was queued, 0 if it is not timed
+static thread_local uint64_t current_enqueued_at = 0;
+
+// NOTE: jobs are mostly allocated by the accept loop and freed by the workers, so they go back to
+// the accept loop's cache through the remote-free lists
+static SlabPool worker_data_pool;
+
+static uint64_t monotonic_nsec(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+static void wtrq_init(WorkerThreadRequestQueue* queue, size_t cap,
+                      pthread_mutexattr_t const* muattr) {
+    *queue = (WorkerThreadRequestQueue){0};
+    queue->cap = cap;
+    queue->items = malloc(sizeof(WorkerData*) * queue->cap);
+    assert(pthread_mutex_init(&queue->mutex, muattr) == 0);
+}
 
 static bool wtrq_enqueue(WorkerThreadRequestQueue* queue, WorkerData* data) {
-    if (queue->size != 0 && queue->write == queue->read) {
+    if (atomic_load(&queue->size) == queue->cap) {
         return false;
     }
 
     assert(pthread_mutex_lock(&queue->mutex) == 0);
 
     if (queue->size == queue->cap) {
-        queue->cap *= 2;
-        queue->items = realloc(queue->items, sizeof(WorkerData*) * queue->cap);
+        assert(pthread_mutex_unlock(&queue->mutex) == 0);
+        return false;
     }
 
     queue->items[queue->write] = data;
@@ -43,31 +84,188 @@ static WorkerData* wtrq_dequeue(WorkerThreadRequestQueue* queue) {
     return result;
 }
 
+static size_t worker_pending(WorkerThread* thread) {
+    size_t pending = 0;
+    for (size_t i = 0; i < WORKER_LANE_COUNT; i++) {
+        pending += atomic_load(&thread->queues[i].size);
+    }
+    return pending;
+}
+
+static uint64_t isqrt(uint64_t n) {
+    uint64_t x = n, y = (x + 1) / 2;
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+    return x;
+}
+
+static uint64_t codel_control_law(WorkerCodel const* codel, uint64_t t) {
+    return t + HTTPPO_CODEL_INTERVAL_NS / isqrt(codel->drop_count);
+}
+
+/// Runs the CoDel state machine for a job that waited `sojourn` ns and returns whether it
+/// should be shed
+static bool codel_should_drop(WorkerCodel* codel, uint64_t now, uint64_t sojourn) {
+    bool above_target = false;
+    if (sojourn < HTTPPO_CODEL_TARGET_NS) {
+        codel->first_above_time = 0;
+    } else if (codel->first_above_time == 0) {
+        codel->first_above_time = now + HTTPPO_CODEL_INTERVAL_NS;
+    } else if (now >= codel->first_above_time) {
+        above_target = true;
+    }
+
+    if (codel->dropping) {
+        if (!above_target) {
+            codel->dropping = false;
+            return false;
+        }
+
+        if (now >= codel->drop_next) {
+            codel->drop_count++;
+            codel->drop_next = codel_control_law(codel, codel->drop_next);
+            return true;
+        }
+
+        return false;
+    }
+
+    if (above_target) {
+        codel->dropping = true;
+        // start close to the previous drop rate if we were dropping recently
+        bool recent = now - codel->drop_next < 16 * HTTPPO_CODEL_INTERVAL_NS;
+        codel->drop_count = recent && codel->drop_count > 2 ? codel->drop_count - 2 : 1;
+        codel->drop_next = codel_control_law(codel, now);
+        return true;
+    }
+
+    return false;
+}
+
+static WorkerData* worker_next(WorkerThread* thread) {
+    WorkerThreadRequestQueue* interactive = &thread->queues[WORKER_LANE_INTERACTIVE];
+    WorkerThreadRequestQueue* bulk = &thread->queues[WORKER_LANE_BULK];
+
+    bool bulk_waiting = atomic_load(&bulk->size) != 0;
+    if (atomic_load(&interactive->size) != 0 &&
+        (!bulk_waiting || thread->interactive_streak < HTTPPO_BULK_STARVATION_LIMIT)) {
+        thread->interactive_streak++;
+        return wtrq_dequeue(interactive);
+    }
+
+    thread->interactive_streak = 0;
+    return wtrq_dequeue(bulk);
+}
+
+static void worker_wake(WorkerThread* thread) {
+    if (!atomic_load(&thread->idle)) {
+        return;
+    }
+
+    uint64_t one = 1;
+    write(thread->wake_fd, &one, sizeof(one));
+}
+
+static uint64_t worker_tick(void) {
+    return monotonic_nsec() / (HTTPPO_TIMER_TICK_MS * 1000 * 1000);
+}
+
+/// How long the event loop may sleep without missing a timer tick
+static int worker_poll_timeout(WorkerThread const* thread) {
+    if (thread->timers.count == 0) {
+        return -1;
+    }
+
+    uint64_t now_ms = monotonic_nsec() / (1000 * 1000);
+    return HTTPPO_TIMER_TICK_MS - now_ms % HTTPPO_TIMER_TICK_MS;
+}
+
+static void worker_run_jobs(WorkerThread* thread) {
+    for (size_t i = 0; i < HTTPPO_JOB_BATCH && worker_pending(thread) != 0; i++) {
+        WorkerData* data = worker_next(thread);
+
+        // NOTE: only jobs that have not been started yet are shed, bulk slices always run
+        bool shed = false;
+        if (data->enqueued_at != 0) {
+            uint64_t now = monotonic_nsec();
+            shed = codel_should_drop(&thread->codel, now, now - data->enqueued_at);
+            metrics_record(METRIC_QUEUE_WAIT, now - data->enqueued_at);
+            if (shed) {
+                metrics_count(METRIC_JOBS_SHED, 1);
+            }
+        }
+
+        current_enqueued_at = data->enqueued_at;
+        if (shed && thread->shed_proc) {
+            thread->shed_proc(data->arg);
+        } else {
+            data->proc(data->arg);
+        }
+        current_enqueued_at = 0;
+        slab_free(data);
+    }
+}
+
+static void worker_poll(WorkerThread* thread) {
+    int timeout = 0;
+    if (worker_pending(thread) == 0) {
+        // NOTE: the flag has to be raised before checking the queues, so that a concurrent
+        // `threadpool_schedule` either sees it or its job is seen here
+        atomic_store(&thread->idle, true);
+        if (worker_pending(thread) == 0) {
+            timeout = worker_poll_timeout(thread);
+        }
+    }
+
+    struct epoll_event events[HTTPPO_MAX_EVENTS];
+    int nevents = epoll_wait(thread->epoll_fd, events, HTTPPO_MAX_EVENTS, timeout);
+    atomic_store(&thread->idle, false);
+
+    for (int i = 0; i < nevents; i++) {
+        IoHandler* handler = (IoHandler*)events[i].data.ptr;
+        if (!handler) {
+            uint64_t count;
+            read(thread->wake_fd, &count, sizeof(count));
+            continue;
+        }
+
+        handler->proc(handler, events[i].events);
+    }
+
+    // all timers that expired since the last poll are handled as one batch
+    Timer* timer = tw_advance(&thread->timers, worker_tick());
+    while (timer) {
+        Timer* next = timer->next;
+        timer->proc(timer);
+        timer = next;
+    }
+}
+
 typedef struct {
     WorkerThread* thread;
 } WorkerInitData;
 
 static void* threadpool_worker(void* worker_data) {
     WorkerInitData* init_data = (WorkerInitData*)worker_data;
-    WorkerThreadRequestQueue* queue = &init_data->thread->queue;
+    WorkerThread* thread = init_data->thread;
+    free(init_data);
 
-    while (true) {
-        assert(pthread_mutex_lock(&init_data->thread->cond_mu) == 0);
-        pthread_cond_wait(&init_data->thread->cond_var, &init_data->thread->cond_mu);
-
-        while (atomic_load(&queue->size) != 0) {
-            WorkerData* data = wtrq_dequeue(queue);
-            data->proc(data->arg);
-            free(data);
-        }
+    current_thread = thread;
+    tw_init(&thread->timers, worker_tick());
 
-        assert(pthread_mutex_unlock(&init_data->thread->cond_mu) == 0);
+    while (true) {
+        worker_run_jobs(thread);
+        worker_poll(thread);
     }
 
     return NULL;
 }
 
-ThreadPool threadpool_init(size_t count) {
+ThreadPool threadpool_init(size_t count, size_t queue_cap, WorkerProc shed_proc) {
+    slab_pool_init(&worker_data_pool, "jobs", sizeof(WorkerData));
+
     pthread_mutexattr_t muattr;
     pthread_mutexattr_init(&muattr);
     pthread_mutexattr_setrobust(&muattr, PTHREAD_MUTEX_ROBUST);
@@ -76,17 +274,28 @@ ThreadPool threadpool_init(size_t count) {
     WorkerThread* threads = malloc(count * sizeof(WorkerThread));
     for (size_t i = 0; i < count; i++) {
         WorkerThread* thread = &threads[i];
-        assert(pthread_cond_init(&thread->cond_var, NULL) == 0);
-        assert(pthread_mutex_init(&thread->cond_mu, &muattr) == 0);
+        thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        thread->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (thread->epoll_fd == -1 || thread->wake_fd == -1) {
+            die("could not create the worker event loop");
+        }
+
+        struct epoll_event wake_event = {.events = EPOLLIN, .data.ptr = NULL};
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->wake_fd, &wake_event) == -1) {
+            die("could not watch the worker wake fd");
+        }
+
+        thread->interactive_streak = 0;
+        thread->codel = (WorkerCodel){0};
+        thread->shed_proc = shed_proc;
+        atomic_init(&thread->idle, false);
+
+        for (size_t lane = 0; lane < WORKER_LANE_COUNT; lane++) {
+            wtrq_init(&thread->queues[lane], queue_cap, &muattr);
+        }
 
         WorkerInitData* data = malloc(sizeof(WorkerInitData));
         data->thread = thread;
-        WorkerThreadRequestQueue queue = {0};
-        queue.cap = HTTPO_WTRQ_CAP;
-        queue.items = malloc(sizeof(WorkerData*) * queue.cap);
-
-        assert(pthread_mutex_init(&queue.mutex, &muattr) == 0);
-        data->thread->queue = queue;
 
         int status = pthread_create(&threads[i].handle, NULL, threadpool_worker, data);
         assert(status == 0);
@@ -98,33 +307,121 @@ ThreadPool threadpool_init(size_t count) {
     };
 }
 
-void threadpool_schedule(ThreadPool* thread_pool, WorkerProc proc, void* arg) {
-    int thread_idx = 0;
+static WorkerData* worker_data_new(WorkerThread* thread, WorkerProc proc, void* arg,
+                                   uint64_t enqueued_at) {
+    WorkerData* data = slab_alloc(&worker_data_pool);
+    if (!data) {
+        die("could not allocate a job");
+    }
+
+    data->thread = thread;
+    data->proc = proc;
+    data->arg = arg;
+    data->enqueued_at = enqueued_at;
+    return data;
+}
+
+static WorkerThread* worker_least_busy(ThreadPool* thread_pool) {
+    size_t thread_idx = 0;
+    size_t min_pending = SIZE_MAX;
 
     for (size_t i = 0; i < thread_pool->count; i++) {
-        if (thread_pool->threads[i].queue.size < thread_pool->threads[thread_idx].queue.size) {
+        size_t pending = worker_pending(&thread_pool->threads[i]);
+        if (pending < min_pending) {
+            min_pending = pending;
             thread_idx = i;
         }
     }
 
-    WorkerThread* thread = &thread_pool->threads[thread_idx];
-    WorkerData* data = malloc(sizeof(WorkerData));
-    data->thread = thread;
-    data->proc = proc;
-    data->arg = arg;
+    return &thread_pool->threads[thread_idx];
+}
 
-    while (!wtrq_enqueue(&thread->queue, data)) {
-        // wait until the queue has free space
+static bool worker_schedule(WorkerThread* thread, WorkerLane lane, WorkerProc proc, void* arg,
+                            uint64_t enqueued_at) {
+    WorkerData* data = worker_data_new(thread, proc, arg, enqueued_at);
+    if (!wtrq_enqueue(&thread->queues[lane], data)) {
+        slab_free(data);
+        return false;
     }
 
-    // the queue was empty before, need to notify the worker thread
-    if (atomic_load(&thread->queue.size) == 1) {
-        pthread_mutex_lock(&thread->cond_mu);
-        pthread_cond_broadcast(&thread->cond_var);
-        pthread_mutex_unlock(&thread->cond_mu);
+    worker_wake(thread);
+    return true;
+}
+
+bool threadpool_schedule_lane(ThreadPool* thread_pool, WorkerLane lane, WorkerProc proc,
+                              void* arg) {
+    return worker_schedule(worker_least_busy(thread_pool), lane, proc, arg, monotonic_nsec());
+}
+
+bool threadpool_schedule_bulk(ThreadPool* thread_pool, WorkerProc proc, void* arg) {
+    // NOTE: no enqueue time, so CoDel neither sheds the job nor counts its wait
+    return worker_schedule(worker_least_busy(thread_pool), WORKER_LANE_BULK, proc, arg, 0);
+}
+
+bool threadpool_schedule(ThreadPool* thread_pool, WorkerProc proc, void* arg) {
+    return threadpool_schedule_lane(thread_pool, WORKER_LANE_INTERACTIVE, proc, arg);
+}
+
+bool threadpool_schedule_local(WorkerLane lane, WorkerProc proc, void* arg) {
+    assert(current_thread && "threadpool_schedule_local called outside of a worker thread");
+    // continuations are never shed, hence no enqueue time
+    WorkerData* data = worker_data_new(current_thread, proc, arg, 0);
+    if (!wtrq_enqueue(&current_thread->queues[lane], data)) {
+        slab_free(data);
+        return false;
+    }
+
+    // the calling worker is awake by definition, so no need to signal it
+    return true;
+}
+
+WorkerThread* threadpool_current(void) {
+    assert(current_thread && "threadpool_current called outside of a worker thread");
+    return current_thread;
+}
+
+bool threadpool_schedule_on(WorkerThread* thread, WorkerLane lane, WorkerProc proc, void* arg) {
+    return worker_schedule(thread, lane, proc, arg, 0);
+}
+
+void threadpool_watch(int fd, uint32_t events, IoHandler* handler) {
+    assert(current_thread && "threadpool_watch called outside of a worker thread");
+
+    struct epoll_event event = {.events = events, .data.ptr = handler};
+    if (epoll_ctl(current_thread->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0) {
+        return;
+    }
+
+    if (errno != ENOENT || epoll_ctl(current_thread->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        die("could not watch a file descriptor");
     }
 }
 
+void threadpool_unwatch(int fd) {
+    assert(current_thread && "threadpool_unwatch called outside of a worker thread");
+    epoll_ctl(current_thread->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void threadpool_timer_arm(Timer* timer, uint64_t timeout_ms) {
+    assert(current_thread && "threadpool_timer_arm called outside of a worker thread");
+    // round up, a timer must never fire early
+    uint64_t ticks = (timeout_ms + HTTPPO_TIMER_TICK_MS - 1) / HTTPPO_TIMER_TICK_MS;
+    tw_arm(&current_thread->timers, timer, worker_tick() + ticks + 1);
+}
+
+void threadpool_timer_cancel(Timer* timer) {
+    assert(current_thread && "threadpool_timer_cancel called outside of a worker thread");
+    tw_cancel(&current_thread->timers, timer);
+}
+
+uint64_t threadpool_job_enqueued_at(void) {
+    return current_enqueued_at;
+}
+
+SlabStats threadpool_job_stats(void) {
+    return slab_pool_stats(&worker_data_pool);
+}
+
 void threadpool_free(ThreadPool const* thread_pool) {
     free(thread_pool->threads);
 }
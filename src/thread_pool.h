@@ -1,14 +1,39 @@
+#pragma once
+
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "slab.h"
+#include "timer_wheel.h"
+
+// granularity of the worker timers
+#define HTTPPO_TIMER_TICK_MS 100
 
 typedef void* (*WorkerProc)(void*);
 
+/// A file descriptor watched by a worker's event loop, embed it into the object that owns the fd
+typedef struct IoHandler {
+    void (*proc)(struct IoHandler* handler, uint32_t events);
+} IoHandler;
+
 struct WorkerThread;
 
+/// Scheduling lanes of a worker thread. Jobs in the interactive lane (new connections, small
+/// responses) are always preferred, the bulk lane holds time-sliced large transfers
+typedef enum {
+    WORKER_LANE_INTERACTIVE,
+    WORKER_LANE_BULK,
+    WORKER_LANE_COUNT,
+} WorkerLane;
+
 typedef struct {
     struct WorkerThread* thread;
     WorkerProc proc;
     void* arg;
+    /// monotonic time of the enqueue, used to measure the queueing delay
+    uint64_t enqueued_at;
 } WorkerData;
 
 typedef struct {
@@ -21,11 +46,27 @@ typedef struct {
     pthread_mutex_t mutex;
 } WorkerThreadRequestQueue;
 
+/// CoDel state of a worker, applied to the queueing delay of interactive jobs
+typedef struct {
+    uint64_t first_above_time;
+    uint64_t drop_next;
+    uint32_t drop_count;
+    bool dropping;
+} WorkerCodel;
+
 typedef struct WorkerThread {
     pthread_t handle;
-    WorkerThreadRequestQueue queue;
-    pthread_cond_t cond_var;
-    pthread_mutex_t cond_mu;
+    WorkerThreadRequestQueue queues[WORKER_LANE_COUNT];
+    /// number of interactive jobs run since the last bulk slice
+    size_t interactive_streak;
+    atomic_bool idle;
+    WorkerCodel codel;
+    /// called instead of `proc` for jobs that are shed because of queueing delay
+    WorkerProc shed_proc;
+    /// the event loop, sleeping workers are woken up through `wake_fd`
+    int epoll_fd;
+    int wake_fd;
+    TimerWheel timers;
 } WorkerThread;
 
 typedef struct {
@@ -33,6 +74,35 @@ typedef struct {
     size_t count;
 } ThreadPool;
 
-ThreadPool threadpool_init(size_t count);
-void threadpool_schedule(ThreadPool* thread_pool, WorkerProc proc, void* arg);
+/// Creates `count` workers with lanes bounded to `queue_cap` jobs. Interactive jobs that waited
+/// in the queue for too long are passed to `shed_proc` instead of being run
+ThreadPool threadpool_init(size_t count, size_t queue_cap, WorkerProc shed_proc);
+/// Returns false if the job could not be queued because the pool is saturated
+bool threadpool_schedule(ThreadPool* thread_pool, WorkerProc proc, void* arg);
+bool threadpool_schedule_lane(ThreadPool* thread_pool, WorkerLane lane, WorkerProc proc, void* arg);
+/// Schedules a background job on the bulk lane of the least busy worker. Unlike connections it is
+/// never shed, however long it waits
+bool threadpool_schedule_bulk(ThreadPool* thread_pool, WorkerProc proc, void* arg);
+/// Schedules a job on the calling worker thread, used to continue time-sliced work
+bool threadpool_schedule_local(WorkerLane lane, WorkerProc proc, void* arg);
+/// The calling worker, for handing work back to it from other threads
+WorkerThread* threadpool_current(void);
+/// Schedules a job on a given worker, which is never shed. Returns false if the lane is full
+bool threadpool_schedule_on(WorkerThread* thread, WorkerLane lane, WorkerProc proc, void* arg);
+
+/// Watches `fd` for `events` on the calling worker, or changes the watched events if it is
+/// already watched. The handler runs on the worker's event loop
+void threadpool_watch(int fd, uint32_t events, IoHandler* handler);
+void threadpool_unwatch(int fd);
+/// Arms a timer of the calling worker to fire after `timeout_ms`
+void threadpool_timer_arm(Timer* timer, uint64_t timeout_ms);
+void threadpool_timer_cancel(Timer* timer);
+
+/// The CLOCK_MONOTONIC time in nanoseconds at which the running job was queued, 0 for jobs that
+/// are not timed like bulk and local ones
+uint64_t threadpool_job_enqueued_at(void);
+
+/// Allocation stats of the queued jobs
+SlabStats threadpool_job_stats(void);
+
 void threadpool_free(ThreadPool const* thread_pool);
@@ -0,0 +1,132 @@
+#include "timer_wheel.h"
+
+#include <assert.h>
+
+static void slot_init(Timer* head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void slot_push(Timer* head, Timer* timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void timer_unlink(Timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void tw_init(TimerWheel* wheel, uint64_t now) {
+    for (size_t level = 0; level < TW_LEVELS; level++) {
+        for (size_t slot = 0; slot < TW_SLOTS; slot++) {
+            slot_init(&wheel->slots[level][slot]);
+        }
+    }
+
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+void timer_init(Timer* timer, TimerProc proc) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->proc = proc;
+}
+
+bool timer_armed(Timer const* timer) {
+    // NOTE: `next` is reused to chain expired timers, so only `prev` tells if a timer is armed
+    return timer->prev != NULL;
+}
+
+static void tw_place(TimerWheel* wheel, Timer* timer) {
+    // NOTE: timers that are already due go into the slot that is expired on the next tick
+    uint64_t expires = timer->expires > wheel->now ? timer->expires : wheel->now + 1;
+    uint64_t delta = expires - wheel->now;
+
+    size_t level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (uint64_t)1 << ((level + 1) * TW_SLOT_BITS)) {
+        level++;
+    }
+
+    // anything past the last level is clamped to its furthest slot and cascaded again later
+    uint64_t max_delta = ((uint64_t)1 << (TW_LEVELS * TW_SLOT_BITS)) - 1;
+    if (delta > max_delta) {
+        expires = wheel->now + max_delta;
+    }
+
+    size_t slot = (expires >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+    slot_push(&wheel->slots[level][slot], timer);
+}
+
+void tw_arm(TimerWheel* wheel, Timer* timer, uint64_t expires) {
+    if (timer_armed(timer)) {
+        timer_unlink(timer);
+    } else {
+        wheel->count++;
+    }
+
+    timer->expires = expires;
+    tw_place(wheel, timer);
+}
+
+void tw_cancel(TimerWheel* wheel, Timer* timer) {
+    if (!timer_armed(timer)) {
+        return;
+    }
+
+    timer_unlink(timer);
+    wheel->count--;
+}
+
+/// Re-places every timer of a higher level slot into the levels below it
+static void tw_cascade(TimerWheel* wheel, size_t level) {
+    Timer* head = &wheel->slots[level][(wheel->now >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK];
+
+    Timer* timer = head->next;
+    slot_init(head);
+
+    while (timer != head) {
+        Timer* next = timer->next;
+        tw_place(wheel, timer);
+        timer = next;
+    }
+}
+
+Timer* tw_advance(TimerWheel* wheel, uint64_t now) {
+    Timer* expired = NULL;
+
+    if (wheel->count == 0) {
+        wheel->now = now > wheel->now ? now : wheel->now;
+        return NULL;
+    }
+
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // going around a level moves the next slot of the level above it down
+        for (size_t level = 1; level < TW_LEVELS; level++) {
+            if ((wheel->now & (((uint64_t)1 << (level * TW_SLOT_BITS)) - 1)) != 0) {
+                break;
+            }
+            tw_cascade(wheel, level);
+        }
+
+        Timer* head = &wheel->slots[0][wheel->now & TW_SLOT_MASK];
+        while (head->next != head) {
+            Timer* timer = head->next;
+            timer_unlink(timer);
+            wheel->count--;
+
+            timer->next = expired;
+            expired = timer;
+        }
+    }
+
+    return expired;
+}
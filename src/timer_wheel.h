@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+struct Timer;
+
+typedef void (*TimerProc)(struct Timer*);
+
+/// An intrusive timer, embed it into the object that needs a timeout
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer* prev;
+    uint64_t expires;
+    TimerProc proc;
+} Timer;
+
+/// A hierarchical timing wheel. Every level has `TW_SLOTS` slots and each slot of a level spans
+/// a whole turn of the level below it, so arming and cancelling are O(1) regardless of the
+/// timeout, and timers are only moved down a level when their slot comes up
+typedef struct {
+    /// list heads, a slot is empty when its head points to itself
+    Timer slots[TW_LEVELS][TW_SLOTS];
+    /// the current time in ticks
+    uint64_t now;
+    size_t count;
+} TimerWheel;
+
+void tw_init(TimerWheel* wheel, uint64_t now);
+void timer_init(Timer* timer, TimerProc proc);
+bool timer_armed(Timer const* timer);
+/// (Re)arms the timer to fire at tick `expires`
+void tw_arm(TimerWheel* wheel, Timer* timer, uint64_t expires);
+void tw_cancel(TimerWheel* wheel, Timer* timer);
+/// Moves the wheel forward to tick `now` and returns the expired timers as a list linked through
+/// `next`. The returned timers are disarmed
+Timer* tw_advance(TimerWheel* wheel, uint64_t now);
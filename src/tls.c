@@ -0,0 +1,322 @@
+#include "tls.h"
+
+#include <errno.h>
+#include <limits.h>
+
+#include "util.h"
+
+#ifdef HTTPPO_HAVE_TLS
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// sessions kept for clients that resume by session id instead of with a ticket
+#define TLS_SESSION_CACHE_SIZE (20 * 1024)
+#define TLS_SESSION_TIMEOUT_SEC 300
+// a new ticket key is made this often, tickets of the previous one are still taken and renewed
+#define TLS_TICKET_ROTATE_SEC 3600
+
+typedef struct {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    time_t created;
+} TlsTicketKey;
+
+static SSL_CTX* tls_ctx = NULL;
+
+// NOTE: only touched by handshakes that issue or take a ticket, a mutex is plenty
+static pthread_mutex_t tls_ticket_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TlsTicketKey tls_ticket_current;
+static TlsTicketKey tls_ticket_previous;
+
+static void tls_ticket_key_new(TlsTicketKey* key) {
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1 ||
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1) {
+        die("could not generate a session ticket key");
+    }
+    key->created = time(NULL);
+}
+
+/// Picks the key for a ticket to issue, or the one a ticket was issued with. Returns 0 if the
+/// ticket's key is gone and 2 if the ticket should be renewed
+static int tls_ticket_key(unsigned char name[16], bool issue, TlsTicketKey* out) {
+    pthread_mutex_lock(&tls_ticket_mutex);
+    if (time(NULL) - tls_ticket_current.created >= TLS_TICKET_ROTATE_SEC) {
+        tls_ticket_previous = tls_ticket_current;
+        tls_ticket_key_new(&tls_ticket_current);
+    }
+
+    int status = 1;
+    if (issue || memcmp(name, tls_ticket_current.name, sizeof(tls_ticket_current.name)) == 0) {
+        *out = tls_ticket_current;
+    } else if (memcmp(name, tls_ticket_previous.name, sizeof(tls_ticket_previous.name)) == 0) {
+        *out = tls_ticket_previous;
+        status = 2;
+    } else {
+        status = 0;
+    }
+    pthread_mutex_unlock(&tls_ticket_mutex);
+
+    return status;
+}
+
+static int tls_ticket_callback(SSL* ssl, unsigned char name[16], unsigned char* iv,
+                               EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt) {
+    TlsTicketKey key;
+    int status = tls_ticket_key(name, encrypt, &key);
+    if (status == 0) {
+        return 0;
+    }
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+
+    if (encrypt) {
+        memcpy(name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+            !EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv)) {
+            return -1;
+        }
+    } else if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv)) {
+        return -1;
+    }
+
+    if (!EVP_MAC_CTX_set_params(mac, params)) {
+        return -1;
+    }
+    return status;
+}
+
+/// Prefers HTTP/2 for clients that offer it
+static int tls_alpn_callback(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+                             const unsigned char* in, unsigned int in_len, void* arg) {
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_len, protocols, sizeof(protocols) - 1, in, in_len) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+void tls_start(const char* cert, const char* key, bool ktls) {
+    // NOTE: OpenSSL writes to the socket without MSG_NOSIGNAL, a client that went away would
+    // kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls_ctx) {
+        die("could not create the TLS context");
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1) {
+        die("could not load the TLS certificate");
+    }
+    if (SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1) {
+        die("could not load the TLS key");
+    }
+
+    // a response can be retried from the buffer it was copied to, one record at a time
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                  SSL_MODE_RELEASE_BUFFERS);
+    uint64_t options = SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_CIPHER_SERVER_PREFERENCE;
+    if (ktls) {
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+    SSL_CTX_set_options(tls_ctx, options);
+
+    SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char*)"httppo", 6);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(tls_ctx, TLS_SESSION_TIMEOUT_SEC);
+    tls_ticket_key_new(&tls_ticket_current);
+    tls_ticket_key_new(&tls_ticket_previous);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(tls_ctx, tls_ticket_callback);
+    // one ticket per full handshake, a client resumes one connection at a time
+    SSL_CTX_set_num_tickets(tls_ctx, 1);
+
+    SSL_CTX_set_alpn_select_cb(tls_ctx, tls_alpn_callback, NULL);
+}
+
+bool tls_enabled(void) {
+    return tls_ctx != NULL;
+}
+
+SSL* tls_new(int sock) {
+    SSL* ssl = SSL_new(tls_ctx);
+    if (!ssl || SSL_set_fd(ssl, sock) != 1) {
+        die("could not create a TLS connection");
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+void tls_free(SSL* ssl) {
+    if (SSL_is_init_finished(ssl)) {
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    // NOTE: the errors are kept per thread and would confuse the next connection's calls
+    ERR_clear_error();
+}
+
+TlsStatus tls_handshake(SSL* ssl) {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if (ret == 1) {
+        metrics_count(METRIC_TLS_HANDSHAKES, 1);
+        if (SSL_session_reused(ssl)) {
+            metrics_count(METRIC_TLS_RESUMED, 1);
+        }
+        if (tls_ktls_send(ssl)) {
+            metrics_count(METRIC_TLS_KTLS, 1);
+        }
+        return TLS_DONE;
+    }
+
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            metrics_count(METRIC_TLS_HANDSHAKE_FAILURES, 1);
+            return TLS_ERROR;
+    }
+}
+
+/// Maps a failed call onto the errno of the plain socket call
+static ssize_t tls_fail(SSL* ssl, int ret) {
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        default:
+            errno = ECONNRESET;
+            return -1;
+    }
+}
+
+ssize_t tls_recv(SSL* ssl, char* buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read(ssl, buf, len < INT_MAX ? len : INT_MAX);
+    return ret > 0 ? ret : tls_fail(ssl, ret);
+}
+
+ssize_t tls_send(SSL* ssl, const char* buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_write(ssl, buf, len < INT_MAX ? len : INT_MAX);
+    if (ret > 0) {
+        return ret;
+    }
+
+    // the client closed its side, which is a broken pipe for a send
+    ssize_t status = tls_fail(ssl, ret);
+    if (status == 0) {
+        errno = EPIPE;
+        return -1;
+    }
+    return status;
+}
+
+bool tls_ktls_send(SSL* ssl) {
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
+ssize_t tls_sendfile(SSL* ssl, int fd, off_t offset, size_t len) {
+#ifndef OPENSSL_NO_KTLS
+    ERR_clear_error();
+    errno = 0;
+    ossl_ssize_t ret = SSL_sendfile(ssl, fd, offset, len, 0);
+    if (ret >= 0) {
+        return ret;
+    }
+    return tls_fail(ssl, ret);
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+bool tls_pending(SSL* ssl) {
+    return SSL_pending(ssl) > 0;
+}
+
+#else
+
+void tls_start(const char* cert, const char* key, bool ktls) {
+    die("httppo was built without TLS support");
+}
+
+bool tls_enabled(void) {
+    return false;
+}
+
+// NOTE: the rest is never called, no connection gets TLS without `tls_start`
+
+struct ssl_st* tls_new(int sock) {
+    return NULL;
+}
+
+void tls_free(struct ssl_st* tls) {
+}
+
+TlsStatus tls_handshake(struct ssl_st* tls) {
+    return TLS_ERROR;
+}
+
+ssize_t tls_recv(struct ssl_st* tls, char* buf, size_t len) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+ssize_t tls_send(struct ssl_st* tls, const char* buf, size_t len) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+bool tls_ktls_send(struct ssl_st* tls) {
+    return false;
+}
+
+ssize_t tls_sendfile(struct ssl_st* tls, int fd, off_t offset, size_t len) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+bool tls_pending(struct ssl_st* tls) {
+    return false;
+}
+
+#endif
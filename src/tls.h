@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// TLS termination with OpenSSL, when the server is built with it. All workers share one context,
+// so a session cached or a ticket issued by one worker resumes on any other. With kTLS the kernel
+// encrypts what is sent once the handshake is done, which keeps sendfile working for large bodies
+
+// a TLS connection, opaque outside of tls.c
+struct ssl_st;
+
+typedef enum {
+    TLS_DONE,
+    TLS_WANT_READ,
+    TLS_WANT_WRITE,
+    TLS_ERROR,
+} TlsStatus;
+
+/// Loads the certificate chain and its key and serves every connection over TLS from then on.
+/// `ktls` asks OpenSSL to hand the encryption to the kernel where it can
+void tls_start(const char* cert, const char* key, bool ktls);
+bool tls_enabled(void);
+
+struct ssl_st* tls_new(int sock);
+/// Sends a close_notify if the connection got that far, without waiting for the client's
+void tls_free(struct ssl_st* tls);
+/// Goes on with the handshake, telling what it waits for
+TlsStatus tls_handshake(struct ssl_st* tls);
+
+/// `recv` and `send` through TLS, with the same return values. A connection that waits for the
+/// other direction fails with EAGAIN as well
+ssize_t tls_recv(struct ssl_st* tls, char* buf, size_t len);
+ssize_t tls_send(struct ssl_st* tls, const char* buf, size_t len);
+/// Whether the kernel encrypts what is sent, only then can `tls_sendfile` be used
+bool tls_ktls_send(struct ssl_st* tls);
+ssize_t tls_sendfile(struct ssl_st* tls, int fd, off_t offset, size_t len);
+/// Whether received bytes were decrypted but not read yet, which the socket won't signal again
+bool tls_pending(struct ssl_st* tls);
@@ -0,0 +1,243 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "util.h"
+
+// how long the TSC is measured against the monotonic clock on startup
+#define TRACE_CALIBRATE_NSEC (20 * 1000 * 1000)
+
+/// A finished request
+typedef struct {
+    uint64_t at[TRACE_STAGE_COUNT];
+    uint32_t conn;
+    uint16_t status;
+    uint16_t path_len;
+    char path[TRACE_PATH_CAP];
+} TraceRecord;
+
+/// The finished requests of one thread. Its lock is only ever contended by a dump
+typedef struct TraceRing {
+    pthread_mutex_t mutex;
+    /// the number of requests ever kept, only the last `TRACE_RING_CAP` of them are left
+    size_t count;
+    unsigned index;
+    struct TraceRing* next;
+    TraceRecord records[TRACE_RING_CAP];
+} TraceRing;
+
+/// The spans drawn for each request, a span is left out if the request skipped either end. The
+/// first one is the whole request and carries its details
+static const struct {
+    const char* name;
+    TraceStage begin;
+    TraceStage end;
+} trace_spans[] = {
+    {"request", TRACE_PARSE_START, TRACE_SENT},
+    {"queue", TRACE_ACCEPT, TRACE_DEQUEUE},
+    {"parse", TRACE_PARSE_START, TRACE_PARSE_END},
+    {"lookup", TRACE_LOOKUP_START, TRACE_LOOKUP_END},
+    {"files lock", TRACE_FILES_LOCK, TRACE_FILES_LOCKED},
+    {"disk read", TRACE_DISK_READ_START, TRACE_DISK_READ_END},
+    {"send", TRACE_RESPOND, TRACE_SENT},
+};
+
+thread_local TraceRequest* trace_current = NULL;
+
+static unsigned trace_every = 0;
+static uint64_t trace_epoch_tsc;
+static uint64_t trace_epoch_ns;
+static double trace_ticks_per_ns = 1;
+
+static thread_local TraceRing* current_ring = NULL;
+static thread_local uint32_t current_conns = 0;
+static thread_local unsigned current_requests = 0;
+
+static TraceRing* trace_rings = NULL;
+static unsigned trace_ring_count = 0;
+static pthread_mutex_t trace_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void trace_start(unsigned sample) {
+    trace_epoch_ns = metrics_now();
+    trace_epoch_tsc = trace_tsc();
+    nanosleep(&(struct timespec){.tv_nsec = TRACE_CALIBRATE_NSEC}, NULL);
+    trace_ticks_per_ns = (double)(trace_tsc() - trace_epoch_tsc) / (metrics_now() - trace_epoch_ns);
+    trace_every = sample;
+}
+
+bool trace_enabled(void) {
+    return trace_every != 0;
+}
+
+void trace_open(TraceRequest* trace, uint64_t accepted_at) {
+    trace->sampled = false;
+    if (!trace_every) {
+        return;
+    }
+
+    trace->conn = current_conns++;
+    trace->fresh = true;
+    trace->at[TRACE_DEQUEUE] = trace_tsc();
+    // NOTE: the accept loop stamped the job with the monotonic clock, the calibration maps it
+    trace->at[TRACE_ACCEPT] =
+        accepted_at > trace_epoch_ns
+            ? trace_epoch_tsc + (uint64_t)((accepted_at - trace_epoch_ns) * trace_ticks_per_ns)
+            : 0;
+}
+
+void trace_begin(TraceRequest* trace) {
+    if (!trace_every) {
+        return;
+    }
+
+    bool fresh = trace->fresh;
+    trace->fresh = false;
+    trace->sampled = ++current_requests % trace_every == 0;
+    if (!trace->sampled) {
+        return;
+    }
+
+    uint64_t accept = fresh ? trace->at[TRACE_ACCEPT] : 0;
+    uint64_t dequeue = fresh ? trace->at[TRACE_DEQUEUE] : 0;
+    memset(trace->at, 0, sizeof(trace->at));
+    trace->at[TRACE_ACCEPT] = accept;
+    trace->at[TRACE_DEQUEUE] = dequeue;
+    trace->path_len = 0;
+    trace->at[TRACE_PARSE_START] = trace_tsc();
+}
+
+void trace_parsed(TraceRequest* trace, const char* path) {
+    if (!trace->sampled) {
+        return;
+    }
+
+    trace->at[TRACE_PARSE_END] = trace_tsc();
+    size_t path_len = strlen(path);
+    trace->path_len = path_len < TRACE_PATH_CAP ? path_len : TRACE_PATH_CAP;
+    memcpy(trace->path, path, trace->path_len);
+}
+
+void trace_enter(TraceRequest* trace) {
+    trace_current = trace->sampled ? trace : NULL;
+}
+
+void trace_leave(void) {
+    trace_current = NULL;
+}
+
+static TraceRing* trace_ring_new(void) {
+    TraceRing* ring = malloc(sizeof(TraceRing));
+    if (!ring) {
+        die("could not allocate a trace ring");
+    }
+    pthread_mutex_init(&ring->mutex, NULL);
+    ring->count = 0;
+
+    pthread_mutex_lock(&trace_rings_mutex);
+    ring->index = trace_ring_count++;
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_rings_mutex);
+
+    current_ring = ring;
+    return ring;
+}
+
+void trace_finish(TraceRequest* trace, uint16_t status) {
+    if (!trace->sampled) {
+        return;
+    }
+    trace->sampled = false;
+    trace->at[TRACE_SENT] = trace_tsc();
+
+    TraceRing* ring = current_ring ? current_ring : trace_ring_new();
+    pthread_mutex_lock(&ring->mutex);
+    TraceRecord* record = &ring->records[ring->count++ & (TRACE_RING_CAP - 1)];
+    memcpy(record->at, trace->at, sizeof(record->at));
+    record->conn = trace->conn;
+    record->status = status;
+    record->path_len = trace->path_len;
+    memcpy(record->path, trace->path, trace->path_len);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+/// Microseconds since the trace started, the unit of Chrome traces
+static double trace_us(uint64_t tsc) {
+    return (double)(tsc - trace_epoch_tsc) / trace_ticks_per_ns / 1000;
+}
+
+static void trace_render_string(string_builder* sb, const char* str, size_t len) {
+    sb_push(sb, '"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            sb_push(sb, '\\');
+            sb_push(sb, c);
+        } else if (c < 0x20) {
+            sb_sprintf(sb, "\\u%04x", c);
+        } else {
+            sb_push(sb, c);
+        }
+    }
+    sb_push(sb, '"');
+}
+
+static void trace_render_record(string_builder* sb, unsigned pid, TraceRecord const* record) {
+    for (size_t i = 0; i < sizeof(trace_spans) / sizeof(trace_spans[0]); i++) {
+        uint64_t begin = record->at[trace_spans[i].begin];
+        uint64_t end = record->at[trace_spans[i].end];
+        if (!begin || !end || end < begin) {
+            continue;
+        }
+
+        sb_sprintf(sb, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,"
+                   "\"dur\":%.3f",
+                   trace_spans[i].name, pid, record->conn, trace_us(begin),
+                   trace_us(end) - trace_us(begin));
+        if (i == 0) {
+            sb_sprintf(sb, ",\"args\":{\"status\":%u,\"path\":", record->status);
+            trace_render_string(sb, record->path, record->path_len);
+            sb_push(sb, '}');
+        }
+        sb_push(sb, '}');
+    }
+}
+
+void trace_render(string_builder* sb) {
+    pthread_mutex_lock(&trace_rings_mutex);
+    TraceRing* rings = trace_rings;
+    pthread_mutex_unlock(&trace_rings_mutex);
+
+    // the records are copied out, so that a worker never waits for the formatting
+    TraceRecord* records = malloc(sizeof(TraceRecord) * TRACE_RING_CAP);
+    if (!records) {
+        die("could not allocate the trace records");
+    }
+
+    sb_push_cstr(sb, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    sb_sprintf(sb,
+               "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+               "\"args\":{\"name\":\"httppo, one in %u requests\"}}",
+               trace_every);
+    for (TraceRing* ring = rings; ring; ring = ring->next) {
+        pthread_mutex_lock(&ring->mutex);
+        size_t count = ring->count < TRACE_RING_CAP ? ring->count : TRACE_RING_CAP;
+        memcpy(records, ring->records, count * sizeof(TraceRecord));
+        pthread_mutex_unlock(&ring->mutex);
+
+        unsigned pid = ring->index + 1;
+        sb_sprintf(sb,
+                   ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                   "\"args\":{\"name\":\"worker %u\"}}",
+                   pid, ring->index);
+        for (size_t i = 0; i < count; i++) {
+            trace_render_record(sb, pid, &records[i]);
+        }
+    }
+    sb_push_cstr(sb, "\n]}\n");
+
+    free(records);
+}
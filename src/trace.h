@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+#include <time.h>
+
+#include "base.h"
+
+// Sampled requests get a TSC timestamp at every stage they pass through. A finished one is kept
+// in a ring of the thread that served it, overwriting the oldest, until the rings are dumped as
+// Chrome trace JSON. The stages are USDT probes as well when <sys/sdt.h> is around, so bpftrace
+// can attach to every request without the server sampling anything
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, arg) DTRACE_PROBE1(httppo, name, arg)
+#endif
+#endif
+
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(name, arg) ((void)(arg))
+#endif
+
+// finished requests kept per thread, a power of two
+#define TRACE_RING_CAP 4096
+#define TRACE_PATH_CAP 64
+
+typedef enum {
+    /// the accept loop queued the connection, only for its first request
+    TRACE_ACCEPT,
+    /// a worker took the connection, only for its first request
+    TRACE_DEQUEUE,
+    TRACE_PARSE_START,
+    TRACE_PARSE_END,
+    TRACE_LOOKUP_START,
+    /// about to take the file cache lock
+    TRACE_FILES_LOCK,
+    TRACE_FILES_LOCKED,
+    /// the file was not cached and is read from the disk
+    TRACE_DISK_READ_START,
+    TRACE_DISK_READ_END,
+    TRACE_LOOKUP_END,
+    /// the response is about to be encoded and sent
+    TRACE_RESPOND,
+    /// the whole response is sent
+    TRACE_SENT,
+    TRACE_STAGE_COUNT,
+} TraceStage;
+
+/// The trace of the current request of a connection
+typedef struct {
+    /// TSC values, 0 for the stages the request did not pass through
+    uint64_t at[TRACE_STAGE_COUNT];
+    /// numbers the connections of a thread, the rows of the trace
+    uint32_t conn;
+    bool sampled;
+    /// no request of the connection was started yet
+    bool fresh;
+    uint16_t path_len;
+    char path[TRACE_PATH_CAP];
+} TraceRequest;
+
+/// the request the calling thread is handling, NULL if it is not sampled
+extern thread_local TraceRequest* trace_current;
+
+static inline uint64_t trace_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+#endif
+}
+
+static inline void trace_stamp(TraceRequest* trace, TraceStage stage) {
+    if (trace && trace->sampled) {
+        trace->at[stage] = trace_tsc();
+    }
+}
+
+/// Stamps a stage of a request and fires the USDT probe `probe` with `arg`
+#define TRACE_POINT(trace, stage, probe, arg) \
+    do {                                      \
+        TRACE_PROBE(probe, arg);              \
+        trace_stamp((trace), (stage));        \
+    } while (0)
+
+/// Same for the request the calling thread is handling
+#define TRACE_MARK(stage, probe, arg) TRACE_POINT(trace_current, stage, probe, arg)
+
+/// Calibrates the TSC and samples one in `sample` requests from then on
+void trace_start(unsigned sample);
+bool trace_enabled(void);
+/// Sets up the trace of a new connection, `accepted_at` is the CLOCK_MONOTONIC time it was
+/// accepted at
+void trace_open(TraceRequest* trace, uint64_t accepted_at);
+/// Decides whether the next request of the connection is sampled and stamps the start of its
+/// parsing
+void trace_begin(TraceRequest* trace);
+/// Stamps the end of the parsing and keeps the path
+void trace_parsed(TraceRequest* trace, const char* path);
+/// Makes the request the one `TRACE_MARK` stamps until `trace_leave`
+void trace_enter(TraceRequest* trace);
+void trace_leave(void);
+/// Stamps the end of the response and keeps the request in the ring of the calling thread
+void trace_finish(TraceRequest* trace, uint16_t status);
+/// Appends the requests in the rings as a Chrome trace, one process per thread and one row per
+/// connection
+void trace_render(string_builder* sb);
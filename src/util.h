@@ -1,10 +1,14 @@
 #ifndef HTTPPO_UTIL_H_
 #define HTTPPO_UTIL_H_
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
+#define container_of(ptr, type, member) ((type*)((char*)(ptr)-offsetof(type, member)))
+
 static inline void die(const char* msg) {
     fprintf(stderr, "ERROR: %s: %s\n", msg, strerror(errno));
     exit(1);
@@ -0,0 +1,49 @@
+// httppo-log turns a binary access log written by `httppo --access-log` into text lines.
+//
+//   httppo-log [<log>]
+//
+// The log is read from stdin without an argument, so `tail -c +1 -f` can be piped into it. The
+// lines are the ones `--access-log-text` writes
+
+#include <stdio.h>
+#include <string.h>
+
+#define BASE_IMPLEMENTATION
+#include "../src/base.h"
+
+#include "../src/access_log.h"
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [<log>]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* in = argc == 2 ? fopen(argv[1], "rb") : stdin;
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    AccessLogHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, ACCESS_LOG_MAGIC, ACCESS_LOG_MAGIC_LEN) != 0) {
+        fprintf(stderr, "ERROR: not a binary access log\n");
+        return 1;
+    }
+
+    if (header.record_size != sizeof(AccessLogRecord)) {
+        fprintf(stderr, "ERROR: records of %u bytes are not supported\n", header.record_size);
+        return 1;
+    }
+
+    string_builder line = sb_new(256);
+    AccessLogRecord record;
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        sb_clear(&line);
+        access_log_format(&record, &line);
+        fwrite(line.items, 1, line.len, stdout);
+    }
+
+    return 0;
+}
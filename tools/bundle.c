@@ -0,0 +1,314 @@
+// httppo-bundle packs a docroot into a bundle that `httppo --bundle` serves from a single mmap.
+//
+//   httppo-bundle <docroot> <output>
+//
+// Every regular file gets its MIME type, Last-Modified, ETag and compressed variants computed
+// here, so the server does no per-file work at all. Symlinks are left out, like the preload does
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BASE_IMPLEMENTATION
+#include "../src/base.h"
+
+#include "../src/bundle.h"
+#include "../src/compress.h"
+#include "../src/hash.h"
+#include "../src/http_date.h"
+#include "../src/mime.h"
+
+// the same limits the file cache compresses within
+#define BUNDLE_COMPRESS_MIN_SIZE 256
+#define BUNDLE_COMPRESS_MAX_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+    char* name;
+    HttppoBundleEntry entry;
+} BundlerFile;
+
+typedef struct {
+    BundlerFile* items;
+    size_t len;
+    size_t cap;
+} BundlerFiles;
+
+typedef struct {
+    const char* root;
+    FILE* out;
+    uint64_t off;
+    BundlerFiles files;
+    /// paths and header lines, their spans are relative to the start of this until it is written
+    string_builder strings;
+    uint64_t bytes;
+    uint64_t variant_bytes;
+} Bundler;
+
+static void bundler_die(const char* what, const char* path) {
+    fprintf(stderr, "ERROR: %s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+static void bundler_write(Bundler* bundler, const void* data, size_t size) {
+    if (size && fwrite(data, 1, size, bundler->out) != size) {
+        bundler_die("could not write", "the bundle");
+    }
+    bundler->off += size;
+}
+
+static void bundler_pad(Bundler* bundler, size_t align) {
+    static const char zeroes[HTTPPO_BUNDLE_ALIGN];
+    size_t pad = (align - bundler->off % align) % align;
+    bundler_write(bundler, zeroes, pad);
+}
+
+static HttppoBundleSpan bundler_write_body(Bundler* bundler, const char* data, size_t size) {
+    bundler_pad(bundler, HTTPPO_BUNDLE_ALIGN);
+    HttppoBundleSpan span = {.offset = bundler->off, .size = size};
+    bundler_write(bundler, data, size);
+    return span;
+}
+
+static HttppoBundleSpan bundler_push_string(Bundler* bundler, const char* str, size_t size) {
+    HttppoBundleSpan span = {.offset = bundler->strings.len, .size = size};
+    sb_push_n(&bundler->strings, str, size);
+    sb_push(&bundler->strings, '\0');
+    return span;
+}
+
+static char* bundler_read(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+
+    struct stat s;
+    char* contents = NULL;
+    if (fstat(fileno(f), &s) == 0 && S_ISREG(s.st_mode)) {
+        contents = malloc(s.st_size ? s.st_size : 1);
+        if (fread(contents, 1, s.st_size, f) != (size_t)s.st_size) {
+            free(contents);
+            contents = NULL;
+        }
+        *size = s.st_size;
+    }
+
+    fclose(f);
+    return contents;
+}
+
+static char* bundler_join(const char* dir, const char* name) {
+    string_builder path = sb_new(strlen(dir) + strlen(name) + 2);
+    if (*dir) {
+        sb_push_cstr(&path, dir);
+        sb_push(&path, '/');
+    }
+    sb_push_cstr(&path, name);
+    return sb_to_cstr(&path);
+}
+
+/// Whether the file is a precompressed sibling of another one, it becomes a variant of that one
+static bool bundler_is_sibling(const char* path) {
+    size_t path_len = strlen(path);
+    for (CompressEncoding encoding = 0; encoding < COMPRESS_ENCODING_COUNT; encoding++) {
+        const char* suffix = compress_encoding_suffix(encoding);
+        size_t suffix_len = strlen(suffix);
+        if (path_len <= suffix_len || strcmp(path + path_len - suffix_len, suffix) != 0) {
+            continue;
+        }
+
+        char* base = (char*)sv_dup(sv_make(path, path_len - suffix_len));
+        struct stat s;
+        bool exists = stat(base, &s) == 0 && S_ISREG(s.st_mode);
+        free(base);
+        if (exists) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Renders the header lines of one representation, in the order the server sends them
+static HttppoBundleSpan bundler_push_headers(Bundler* bundler, MimeType mime,
+                                             const char* last_modified, const char* etag,
+                                             size_t representation) {
+    string_builder headers = sb_new(256);
+    sb_sprintf(&headers, "Content-Type: %s\r\nLast-Modified: %s\r\n", mime.type, last_modified);
+    if (mime.compressible) {
+        sb_push_cstr(&headers, "Vary: Accept-Encoding\r\n");
+    }
+
+    if (representation == HTTPPO_BUNDLE_IDENTITY) {
+        sb_sprintf(&headers, "ETag: %s\r\n", etag);
+    } else {
+        // every representation needs a tag of its own, the coding goes inside the quotes
+        const char* coding = compress_encoding_name(representation - 1);
+        sb_sprintf(&headers, "Content-Encoding: %s\r\nETag: %.*s-%s\"\r\n", coding,
+                   (int)strlen(etag) - 1, etag, coding);
+    }
+
+    HttppoBundleSpan span = bundler_push_string(bundler, headers.items, headers.len);
+    sb_destroy(&headers);
+    return span;
+}
+
+static void bundler_add_file(Bundler* bundler, const char* name, const char* path,
+                             struct stat const* s) {
+    size_t size;
+    char* contents = bundler_read(path, &size);
+    if (!contents) {
+        bundler_die("could not read", path);
+    }
+
+    MimeType mime = mime_lookup(name);
+    char last_modified[HTTP_DATE_LEN + 1];
+    http_date_format(s->st_mtim.tv_sec, last_modified);
+    // NOTE: the same tag the file cache derives from the contents, so a client that switches
+    // between a bundle and a docroot of the same site keeps its cached copies
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%016" PRIx64 "-%zx\"", hash_bytes(contents, size), size);
+
+    BundlerFile file = {.name = (char*)sv_dup(sv_make(name, strlen(name)))};
+    HttppoBundleEntry* entry = &file.entry;
+    entry->path = bundler_push_string(bundler, name, strlen(name));
+    entry->body[HTTPPO_BUNDLE_IDENTITY] = bundler_write_body(bundler, contents, size);
+    entry->headers[HTTPPO_BUNDLE_IDENTITY] =
+        bundler_push_headers(bundler, mime, last_modified, etag, HTTPPO_BUNDLE_IDENTITY);
+    bundler->bytes += size;
+
+    bool compress = mime.compressible && size >= BUNDLE_COMPRESS_MIN_SIZE &&
+                    size <= BUNDLE_COMPRESS_MAX_SIZE;
+    for (CompressEncoding encoding = 0; compress && encoding < COMPRESS_ENCODING_COUNT;
+         encoding++) {
+        // NOTE: a precompressed sibling wins unless it is stale, it was most likely made with a
+        // better compressor
+        string_builder sibling = sb_new(strlen(path) + 4);
+        sb_push_cstr(&sibling, path);
+        sb_push_cstr(&sibling, compress_encoding_suffix(encoding));
+
+        struct stat sibling_stat;
+        char* variant = NULL;
+        size_t variant_size;
+        if (stat(sb_to_cstr(&sibling), &sibling_stat) == 0 &&
+            sibling_stat.st_mtim.tv_sec >= s->st_mtim.tv_sec) {
+            variant = bundler_read(sibling.items, &variant_size);
+        }
+        sb_destroy(&sibling);
+
+        if (!variant && !compress_buffer(encoding, contents, size, &variant, &variant_size)) {
+            continue;
+        }
+
+        size_t representation = 1 + encoding;
+        entry->body[representation] = bundler_write_body(bundler, variant, variant_size);
+        entry->headers[representation] =
+            bundler_push_headers(bundler, mime, last_modified, etag, representation);
+        bundler->variant_bytes += variant_size;
+        free(variant);
+    }
+
+    free(contents);
+    DA_ADD(&bundler->files, file);
+}
+
+static void bundler_walk(Bundler* bundler, const char* dir) {
+    char* dir_path = bundler_join(bundler->root, dir);
+    DIR* d = opendir(dir_path);
+    if (!d) {
+        bundler_die("could not open", dir_path);
+    }
+
+    struct dirent* dirent;
+    while ((dirent = readdir(d))) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+
+        char* name = bundler_join(dir, dirent->d_name);
+        char* path = bundler_join(bundler->root, name);
+
+        struct stat s;
+        if (lstat(path, &s) == 0) {
+            if (S_ISDIR(s.st_mode)) {
+                bundler_walk(bundler, name);
+            } else if (S_ISREG(s.st_mode) && !bundler_is_sibling(path)) {
+                bundler_add_file(bundler, name, path, &s);
+            }
+        }
+
+        free(path);
+        free(name);
+    }
+
+    closedir(d);
+    free(dir_path);
+}
+
+static int bundler_compare(const void* a, const void* b) {
+    return strcmp(((BundlerFile const*)a)->name, ((BundlerFile const*)b)->name);
+}
+
+/// Turns a span into the strings into an absolute one, empty spans are left pointing at nothing
+static void bundler_rebase(HttppoBundleSpan* span, uint64_t base) {
+    if (span->size) {
+        span->offset += base;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <docroot> <output>\n", argv[0]);
+        return 1;
+    }
+
+    Bundler bundler = {
+        .root = argv[1],
+        .out = fopen(argv[2], "wb"),
+        .strings = sb_new(4096),
+    };
+    if (!bundler.out) {
+        bundler_die("could not create", argv[2]);
+    }
+    DA_INIT(&bundler.files, 0, 64);
+
+    // the header is written last, once the index is in place
+    HttppoBundleHeader header = {.version = HTTPPO_BUNDLE_VERSION};
+    memcpy(header.magic, HTTPPO_BUNDLE_MAGIC, HTTPPO_BUNDLE_MAGIC_LEN);
+    bundler_write(&bundler, &header, sizeof(header));
+
+    bundler_walk(&bundler, "");
+
+    uint64_t strings_base = bundler.off;
+    bundler_write(&bundler, bundler.strings.items, bundler.strings.len);
+    bundler_pad(&bundler, _Alignof(HttppoBundleEntry));
+
+    qsort(bundler.files.items, bundler.files.len, sizeof(BundlerFile), bundler_compare);
+
+    header.count = bundler.files.len;
+    header.index.offset = bundler.off;
+    header.index.size = bundler.files.len * sizeof(HttppoBundleEntry);
+    for (size_t i = 0; i < bundler.files.len; i++) {
+        HttppoBundleEntry* entry = &bundler.files.items[i].entry;
+        bundler_rebase(&entry->path, strings_base);
+        for (size_t r = 0; r < HTTPPO_BUNDLE_REPRESENTATIONS; r++) {
+            bundler_rebase(&entry->headers[r], strings_base);
+        }
+        bundler_write(&bundler, entry, sizeof(*entry));
+    }
+
+    if (fseek(bundler.out, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, bundler.out) != 1 || fclose(bundler.out) != 0) {
+        bundler_die("could not write", argv[2]);
+    }
+
+    printf("bundled %zu files into %s: %.2f MiB of contents, %.2f MiB of compressed variants\n",
+           bundler.files.len, argv[2], bundler.bytes / (1024.0 * 1024.0),
+           bundler.variant_bytes / (1024.0 * 1024.0));
+    return 0;
+}
@@ -0,0 +1,351 @@
+// httppo-replay plays a capture recorded with `httppo --capture` back against a server.
+//
+//   httppo-replay [-a <host:port>] [-s <speed>] <capture>
+//
+// Every recorded connection gets a connection of its own and its bytes are sent in the chunks
+// and at the times they arrived in, scaled by the speed: 2 plays twice as fast, 0 as fast as
+// possible. The report is one JSON line, with the time from sending a chunk to the first response
+// byte after it as the latency
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BASE_IMPLEMENTATION
+#include "../src/base.h"
+
+#include "../src/capture.h"
+#include "../src/metrics.h"
+
+// how long responses are waited for once everything is sent
+#define REPLAY_DRAIN_NSEC (1000 * 1000 * 1000)
+
+typedef struct {
+    uint64_t time_ns;
+    uint32_t conn;
+    uint32_t len;
+    const char* data;
+    /// the position in the file, ties in time are played in file order
+    size_t index;
+} ReplayRecord;
+
+typedef struct {
+    int fd;
+    /// when the oldest chunk without a response yet was sent, 0 if there is none
+    uint64_t pending_since;
+} ReplayConn;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int epoll_fd;
+    ReplayConn* conns;
+
+    uint64_t connections;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t errors;
+    uint64_t max_lag;
+    uint64_t responses;
+    uint64_t histogram[METRICS_BUCKETS];
+} Replay;
+
+static void replay_die(const char* what) {
+    fprintf(stderr, "ERROR: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static int replay_compare(const void* a, const void* b) {
+    ReplayRecord const* lhs = a;
+    ReplayRecord const* rhs = b;
+    if (lhs->time_ns != rhs->time_ns) {
+        return lhs->time_ns < rhs->time_ns ? -1 : 1;
+    }
+    return lhs->index < rhs->index ? -1 : lhs->index > rhs->index;
+}
+
+static char* replay_read_file(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        replay_die(path);
+    }
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* data = malloc(*size ? *size : 1);
+    if (!data || fread(data, 1, *size, f) != *size) {
+        replay_die("could not read the capture");
+    }
+    fclose(f);
+    return data;
+}
+
+/// Splits the capture into its records and sorts them by time, the writer interleaves the
+/// buffers of the server threads
+static ReplayRecord* replay_parse(char* data, size_t size, size_t* count, uint32_t* max_conn) {
+    if (size < sizeof(CaptureHeader) || memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "ERROR: not a capture\n");
+        exit(1);
+    }
+
+    size_t cap = 1024;
+    ReplayRecord* records = malloc(cap * sizeof(ReplayRecord));
+    *count = 0;
+    *max_conn = 0;
+
+    size_t off = sizeof(CaptureHeader);
+    while (off + sizeof(CaptureRecord) <= size) {
+        CaptureRecord header;
+        memcpy(&header, data + off, sizeof(header));
+        off += sizeof(header);
+
+        size_t len = header.len == CAPTURE_CLOSE ? 0 : header.len;
+        if (len > size - off) {
+            fprintf(stderr, "WARNING: the capture ends in the middle of a record\n");
+            break;
+        }
+
+        if (*count == cap) {
+            cap *= 2;
+            records = realloc(records, cap * sizeof(ReplayRecord));
+        }
+        records[*count] = (ReplayRecord){
+            .time_ns = header.time_ns,
+            .conn = header.conn,
+            .len = header.len,
+            .data = data + off,
+            .index = *count,
+        };
+        (*count)++;
+
+        if (header.conn > *max_conn) {
+            *max_conn = header.conn;
+        }
+        off += len;
+    }
+
+    qsort(records, *count, sizeof(ReplayRecord), replay_compare);
+    return records;
+}
+
+static void replay_close(Replay* replay, ReplayConn* conn) {
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->pending_since = 0;
+}
+
+static bool replay_connect(Replay* replay, ReplayConn* conn) {
+    conn->fd = socket(replay->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1 ||
+        connect(conn->fd, (struct sockaddr const*)&replay->addr, replay->addr_len) == -1) {
+        replay_close(replay, conn);
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(replay->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        replay_die("could not watch a connection");
+    }
+
+    replay->connections++;
+    return true;
+}
+
+static void replay_receive(Replay* replay, ReplayConn* conn) {
+    char buf[64 * 1024];
+    while (conn->fd != -1) {
+        ssize_t nread = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (nread <= 0) {
+            // the server closed it, a later chunk of the connection opens a new one
+            replay_close(replay, conn);
+            return;
+        }
+
+        replay->bytes_received += nread;
+        if (conn->pending_since) {
+            replay->histogram[metrics_bucket(metrics_now() - conn->pending_since)]++;
+            replay->responses++;
+            conn->pending_since = 0;
+        }
+    }
+}
+
+/// Handles responses until `until`, a CLOCK_MONOTONIC time
+static void replay_poll(Replay* replay, uint64_t until) {
+    struct epoll_event events[64];
+    while (true) {
+        uint64_t now = metrics_now();
+        struct timespec timeout = {0};
+        if (until > now) {
+            timeout.tv_sec = (until - now) / (1000 * 1000 * 1000);
+            timeout.tv_nsec = (until - now) % (1000 * 1000 * 1000);
+        }
+
+        int count = epoll_pwait2(replay->epoll_fd, events, 64, &timeout, NULL);
+        for (int i = 0; i < count; i++) {
+            replay_receive(replay, events[i].data.ptr);
+        }
+        if (metrics_now() >= until) {
+            return;
+        }
+    }
+}
+
+static void replay_send(Replay* replay, ReplayConn* conn, ReplayRecord const* record) {
+    if (conn->fd == -1 && !replay_connect(replay, conn)) {
+        replay->errors++;
+        return;
+    }
+
+    // NOTE: sent blocking, the chunks are as big as what a client once sent in one go
+    for (size_t off = 0; off < record->len;) {
+        ssize_t nsent = send(conn->fd, record->data + off, record->len - off, MSG_NOSIGNAL);
+        if (nsent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nsent <= 0) {
+            replay->errors++;
+            replay_close(replay, conn);
+            return;
+        }
+        off += nsent;
+    }
+
+    replay->bytes_sent += record->len;
+    if (!conn->pending_since) {
+        conn->pending_since = metrics_now();
+    }
+}
+
+static double replay_percentile(Replay const* replay, double quantile) {
+    uint64_t rank = quantile * replay->responses;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        seen += replay->histogram[i];
+        if (seen > rank) {
+            return metrics_bucket_upper(i) / 1e3;
+        }
+    }
+    return 0;
+}
+
+static void replay_parse_addr(Replay* replay, const char* addr) {
+    char host[256];
+    const char* colon = strrchr(addr, ':');
+    if (!colon || (size_t)(colon - addr) >= sizeof(host)) {
+        fprintf(stderr, "ERROR: the address has to be host:port\n");
+        exit(1);
+    }
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo* info;
+    int status = getaddrinfo(host, colon + 1, &hints, &info);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: %s: %s\n", addr, gai_strerror(status));
+        exit(1);
+    }
+    memcpy(&replay->addr, info->ai_addr, info->ai_addrlen);
+    replay->addr_len = info->ai_addrlen;
+    freeaddrinfo(info);
+}
+
+int main(int argc, char** argv) {
+    const char* addr = "127.0.0.1:6969";
+    double speed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:s:")) != -1) {
+        switch (opt) {
+            case 'a':
+                addr = optarg;
+                break;
+            case 's':
+                speed = strtod(optarg, NULL);
+                break;
+            default:
+                optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1 || speed < 0) {
+        fprintf(stderr, "usage: %s [-a <host:port>] [-s <speed>] <capture>\n", argv[0]);
+        return 1;
+    }
+
+    Replay replay = {0};
+    replay_parse_addr(&replay, addr);
+
+    size_t size;
+    char* data = replay_read_file(argv[optind], &size);
+    size_t count;
+    uint32_t max_conn;
+    ReplayRecord* records = replay_parse(data, size, &count, &max_conn);
+
+    // NOTE: the connection numbers are handed out in sequence, so they index an array
+    replay.conns = calloc(max_conn + 1, sizeof(ReplayConn));
+    for (size_t i = 0; i <= max_conn; i++) {
+        replay.conns[i].fd = -1;
+    }
+    replay.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!replay.conns || replay.epoll_fd == -1) {
+        replay_die("could not set up the replay");
+    }
+
+    uint64_t start = metrics_now();
+    uint64_t first = count ? records[0].time_ns : 0;
+    for (size_t i = 0; i < count; i++) {
+        ReplayRecord const* record = &records[i];
+        uint64_t due = speed > 0 ? start + (record->time_ns - first) / speed : 0;
+        replay_poll(&replay, due);
+
+        uint64_t now = metrics_now();
+        if (due && now - due > replay.max_lag) {
+            replay.max_lag = now - due;
+        }
+
+        ReplayConn* conn = &replay.conns[record->conn];
+        if (record->len == CAPTURE_CLOSE) {
+            // give the last response a moment, the client that closed had received it
+            replay_poll(&replay, metrics_now());
+            replay_close(&replay, conn);
+        } else {
+            replay_send(&replay, conn, record);
+        }
+    }
+
+    uint64_t sent = metrics_now();
+    replay_poll(&replay, sent + REPLAY_DRAIN_NSEC);
+    double elapsed = (sent - start) / 1e9;
+
+    printf("{\"records\":%zu,\"connections\":%lu,\"speed\":%g,\"duration_s\":%.3f,"
+           "\"bytes_sent\":%lu,\"bytes_received\":%lu,\"errors\":%lu,\"max_lag_ms\":%.3f,"
+           "\"responses\":%lu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+           count, replay.connections, speed, elapsed, replay.bytes_sent, replay.bytes_received,
+           replay.errors, replay.max_lag / 1e6, replay.responses, replay_percentile(&replay, 0.5),
+           replay_percentile(&replay, 0.99), replay_percentile(&replay, 0.999));
+    return 0;
+}